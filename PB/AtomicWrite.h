@@ -0,0 +1,83 @@
+/**
+ * \file AtomicWrite.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Replace a file so that readers (or a restarted run) only ever see the
+ *  old or the new version, never a half written one: write <path>.tmp,
+ *  flush it to disk, then rename over <path>.
+ *
+ *  Flushing to disk is what makes it survive a power cut, and it is the
+ *  slow part. Files rewritten every few scans can skip it with
+ *  atomic_commit(..., 0) and sync only the versions that must survive
+ *  (checkpoints, the end of a run); a crashed process still leaves a
+ *  whole version, a power cut may lose the unsynced ones.
+ */
+
+#ifndef ATOMIC_WRITE_H
+#define ATOMIC_WRITE_H
+
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+/*
+ * Opens <path>.tmp for writing, its name stored in tmp_path (size bytes).
+ * Returns NULL if the name does not fit or the file cannot be opened.
+ * Finish with atomic_close().
+ */
+static inline FILE *atomic_open(const char *path, char *tmp_path, size_t size)
+{
+	int len = snprintf(tmp_path, size, "%s.tmp", path);
+
+	if (len < 0 || (size_t) len >= size) {
+		return NULL;
+	}
+	return fopen(tmp_path, "wb");
+}
+
+/*
+ * Renames the temporary file over path, flushed to disk first if sync.
+ * Returns 0 or -1.
+ */
+static inline int atomic_commit(FILE *fp, const char *tmp_path, const char *path, int sync)
+{
+	if (fflush(fp) != 0) {
+		fclose(fp);
+		return -1;
+	}
+	if (sync) {
+#ifdef _WIN32
+		_commit(_fileno(fp));
+#else
+		fsync(fileno(fp));
+#endif
+	}
+	if (fclose(fp) != 0) {
+		return -1;
+	}
+#ifdef _WIN32
+	if (!MoveFileExA(tmp_path, path,
+	                 MOVEFILE_REPLACE_EXISTING | (sync ? MOVEFILE_WRITE_THROUGH : 0))) {
+		return -1;
+	}
+#else
+	if (rename(tmp_path, path) != 0) {
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+//Flushes to disk and renames the temporary file over path. Returns 0 or -1.
+static inline int atomic_close(FILE *fp, const char *tmp_path, const char *path)
+{
+	return atomic_commit(fp, tmp_path, path, 1);
+}
+
+#endif
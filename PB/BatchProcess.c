@@ -0,0 +1,852 @@
+/**
+ * \file BatchProcess.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Re-runs the analysis over many finished runs at once, e.g. after a
+ *  change of contrast definition, fit model or outlier rule, instead of
+ *  opening them one at a time in ESR Processing.vi / Fit Rabi Pi
+ *  Pulse.vi. No LabVIEW needed.
+ *
+ *  Every input file gets the same recipe and its results are written next
+ *  to it, as <file><suffix> and <file><suffix>.fit in PulsedPipeline's
+ *  formats (x, contrast, error, signal, reference; scans, ok, p0.., chi2),
+ *  so RunCatalog add and the VIs read them as they are.
+ *
+ *  The files are spread over the threads in equal runs; each thread works
+ *  from the end of its own run and, when it has none left, steals from the
+ *  start of another thread's, so a few large files don't leave the other
+ *  threads idle. Raw inputs are memory mapped (MapFile.h) and summed with
+ *  the pipeline's kernel (Contrast.h).
+ *
+ *  Usage:
+ *  BatchProcess <recipe> <suffix> dir <directory> ext=.bin [threads=N]
+ *      every file in <directory> ending in ext; files already ending in
+ *      <suffix> or <suffix>.fit are skipped. ext= is required, as the
+ *      pipeline leaves .done, .meta, .tmp, checkpoint and result files
+ *      next to its spools
+ *  BatchProcess <recipe> <suffix> catalog <catalog> [condition ...]
+ *               [field=file] [threads=N]
+ *      the runs matching a RunCatalog query; field= names the field that
+ *      holds the input file
+ *
+ *  threads defaults to the number of processors. Prints each file that
+ *  failed and why, then files done, failed, seconds and MB/s read, then
+ *  one line per thread: files and how many of them it stole.
+ *
+ *  Recipe, one name=value per line (# starts a comment):
+ *  input=spool|archive|results
+ *              spool    raw U32 counts (PulsedPipeline's spool)
+ *              archive  compressed counts (CountCodec.h)
+ *              results  a result file (only the signal and reference sums
+ *                       are used, from columns 4 and 5)
+ *  points=N slots=M   record layout of a spool (archives have it)
+ *  sig=K ref=K        signal and reference slots (default 0 and 1)
+ *  contrast=diff|ratio|norm (default ratio)
+ *  fit=none|rabi|decay|esr (default none)
+ *  min=X max=X        sweep, for spool and archive (default 0 and 1)
+ *  outlier=K          drop scans whose total counts are more than K robust
+ *                     sigmas (1.4826 MAD) from the median, e.g. where
+ *                     tracking was lost (default 0, keep all)
+ *  select=K,N,J       post-selection on a charge check, as in PulsedPipeline
+ *  seed=N chunk=R     spools burned with seed= (SweepOrder.h), re-burned
+ *                     every R scans with seed + 1, ... as in PulsedPipeline;
+ *                     each scan is put back in sweep order before it is
+ *                     summed. For catalog runs, the run's seed and chunk
+ *                     fields, or the seed= in its burn field, take
+ *                     precedence. Archives are already in sweep order
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Clock.h"
+#include "AtomicWrite.h"
+#include "Contrast.h"
+#include "Fit.h"
+#include "Spreadsheet.h"
+#include "MapFile.h"
+#include "CountCodec.h"
+#include "RunCatalog.h"
+#include "SweepOrder.h"
+
+#define MAX_THREADS 256
+#define MAD_SIGMA 1.4826
+
+enum input_type { INPUT_SPOOL, INPUT_ARCHIVE, INPUT_RESULTS };
+
+struct recipe {
+	enum input_type input;
+	int num_points, num_slots, sig_slot, ref_slot;
+	enum contrast_type contrast;
+	int use_fit;
+	enum fit_model model;
+	double x_min, x_max;
+	double outlier;
+	int select_slot, reselect_slot;
+	unsigned int select_min;
+	unsigned int seed;
+	long chunk_scans;
+};
+
+struct task {
+	char *path;
+	int own_seed;           //seed and chunk_scans from the catalog
+	unsigned int seed;
+	long chunk_scans;
+	int failed;
+	char why[128];
+	unsigned long long bytes;
+};
+
+/*
+ * One thread's share of the tasks, [head, tail) packed in one word so the
+ * owner (taking from the tail) and thieves (from the head) agree with a
+ * single compare-and-swap.
+ */
+struct worker {
+	atomic_ullong range;
+	pthread_t thread;
+	int index;
+	long files, stolen;
+	struct batch *b;
+};
+
+struct batch {
+	const struct recipe *rc;
+	const char *suffix;
+	struct task *tasks;
+	int num_threads;
+	struct worker workers[MAX_THREADS];
+};
+
+static unsigned long long pack_range(unsigned int head, unsigned int tail)
+{
+	return (unsigned long long) head << 32 | tail;
+}
+
+//Next task of the worker's own share, or -1
+static long take_own(struct worker *w)
+{
+	unsigned long long r = atomic_load(&w->range);
+	unsigned int head, tail;
+
+	do {
+		head = (unsigned int) (r >> 32);
+		tail = (unsigned int) r;
+		if (head >= tail) {
+			return -1;
+		}
+	} while (!atomic_compare_exchange_weak(&w->range, &r, pack_range(head, tail - 1)));
+	return tail - 1;
+}
+
+//A task from another worker's share, or -1 if all are empty
+static long steal(struct batch *b, int self)
+{
+	struct worker *v;
+	unsigned long long r;
+	unsigned int head, tail;
+	int k;
+
+	for(k=1; k<b->num_threads; k++) {
+		v = &b->workers[(self + k) % b->num_threads];
+		r = atomic_load(&v->range);
+		do {
+			head = (unsigned int) (r >> 32);
+			tail = (unsigned int) r;
+		} while (head < tail
+		         && !atomic_compare_exchange_weak(&v->range, &r, pack_range(head + 1, tail)));
+		if (head < tail) {
+			return head;
+		}
+	}
+	return -1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Range of total counts per scan to keep: median +- outlier robust sigmas.
+ * Sorts totals.
+ */
+static void outlier_limits(double *totals, long n, double k, double *lo, double *hi)
+{
+	double median, mad;
+	long i;
+
+	*lo = -HUGE_VAL;
+	*hi = HUGE_VAL;
+	if (n < 3) {
+		return;
+	}
+	qsort(totals, n, sizeof(double), cmp_double);
+	median = totals[n/2];
+	for(i=0; i<n; i++) {
+		totals[i] = fabs(totals[i] - median);
+	}
+	qsort(totals, n, sizeof(double), cmp_double);
+	mad = totals[n/2];
+	if (mad > 0) {
+		*lo = median - k * MAD_SIGMA * mad;
+		*hi = median + k * MAD_SIGMA * mad;
+	}
+}
+
+static double scan_total(const unsigned int *counts, size_t record)
+{
+	double total = 0;
+	size_t j;
+
+	for(j=0; j<record; j++) {
+		total += counts[j];
+	}
+	return total;
+}
+
+/*
+ * Adds the scans whose totals are within [lo, hi]; counts the rest in
+ * dropped. With su, scans are in burn order and put back in sweep order
+ * (in sweep) first.
+ */
+static void add_scans(const struct recipe *rc, struct count_sums *cs, const unsigned int *counts,
+                      long scans, double lo, double hi, long *dropped,
+                      struct sweep_unshuffle *su, unsigned int *sweep)
+{
+	size_t record = (size_t) cs->num_points * cs->num_slots;
+	const unsigned int *scan;
+	double total;
+	long s;
+
+	for(s=0; s<scans; s++, counts+=record) {
+		if (rc->outlier > 0) {
+			total = scan_total(counts, record);
+			if (total < lo || total > hi) {
+				(*dropped)++;
+				continue;
+			}
+		}
+		scan = counts;
+		if (su != NULL) {
+			sweep_unshuffle_scan(su, s, counts, sweep);
+			scan = sweep;
+		}
+		if (rc->select_slot >= 0) {
+			count_sums_add_selected(cs, scan, 1, rc->select_slot, rc->reselect_slot,
+			                        rc->select_min);
+		}
+		else {
+			count_sums_add(cs, scan, 1);
+		}
+	}
+}
+
+/*
+ * Per-slot sums of a spool or archive, after the outlier rule. Returns 0,
+ * or -1 with the reason in why.
+ */
+static int sum_counts(const struct recipe *rc, struct task *t, struct count_sums *cs,
+                      long *dropped)
+{
+	struct mapped_file mf;
+	struct count_reader cr;
+	struct sweep_unshuffle su;
+	unsigned int seed = t->own_seed ? t->seed : rc->seed, *buf = NULL;
+	size_t capacity = 0, record;
+	double *totals = NULL, lo = -HUGE_VAL, hi = HUGE_VAL;
+	long scans = 0, frame, s, n = 0;
+	int pass, r = 0;
+
+	*dropped = 0;
+	if (rc->input == INPUT_SPOOL) {
+		if (map_file(t->path, &mf) != 0) {
+			strcpy(t->why, "could not open");
+			return -1;
+		}
+		record = (size_t) rc->num_points * rc->num_slots;
+		scans = (long) (mf.size / (record * sizeof(unsigned int)));
+		t->bytes = mf.size;
+		if (count_sums_init(cs, rc->num_points, rc->num_slots) != 0) {
+			unmap_file(&mf);
+			strcpy(t->why, "out of memory");
+			return -1;
+		}
+		if (seed != 0) {
+			buf = malloc(record * sizeof(unsigned int));
+			if (buf == NULL || sweep_unshuffle_init(&su, seed, t->own_seed ? t->chunk_scans
+			                                        : rc->chunk_scans, rc->num_points,
+			                                        rc->num_slots) != 0) {
+				free(buf);
+				count_sums_free(cs);
+				unmap_file(&mf);
+				strcpy(t->why, "out of memory");
+				return -1;
+			}
+		}
+		if (rc->outlier > 0) {
+			totals = malloc((scans + 1) * sizeof(double));
+			for(s=0; s<scans; s++) {
+				totals[s] = scan_total((const unsigned int *) mf.data + s * record, record);
+			}
+			outlier_limits(totals, scans, rc->outlier, &lo, &hi);
+			free(totals);
+		}
+		add_scans(rc, cs, (const unsigned int *) mf.data, scans, lo, hi, dropped,
+		          seed != 0 ? &su : NULL, buf);
+		if (seed != 0) {
+			sweep_unshuffle_free(&su);
+			free(buf);
+		}
+		unmap_file(&mf);
+		return 0;
+	}
+
+	//archives: a pass for the totals if needed, then one for the sums
+	for(pass=rc->outlier > 0 ? 0 : 1; pass<2; pass++) {
+		if (count_reader_open(t->path, &cr) != 0) {
+			printf("\n");   //ends the line count_reader_open printed
+			strcpy(t->why, "not a count archive");
+			free(totals);
+			return -1;
+		}
+		record = (size_t) cr.h.num_points * cr.h.num_slots;
+		if ((rc->num_points > 0 && (unsigned int) rc->num_points != cr.h.num_points)
+		    || (rc->num_slots > 0 && (unsigned int) rc->num_slots != cr.h.num_slots)
+		    || (int) cr.h.num_slots <= rc->sig_slot || (int) cr.h.num_slots <= rc->ref_slot) {
+			count_reader_close(&cr);
+			strcpy(t->why, "points or slots differ from the recipe");
+			free(totals);
+			return -1;
+		}
+		if (pass == 1 && count_sums_init(cs, cr.h.num_points, cr.h.num_slots) != 0) {
+			count_reader_close(&cr);
+			strcpy(t->why, "out of memory");
+			free(totals);
+			return -1;
+		}
+		t->bytes = cr.map.size;
+		while ((r = count_reader_next(&cr, &buf, &capacity, &frame)) == 1) {
+			if (pass == 1) {
+				add_scans(rc, cs, buf, frame, lo, hi, dropped, NULL, NULL);
+				continue;
+			}
+			totals = realloc(totals, (n + frame) * sizeof(double));
+			for(s=0; s<frame; s++) {
+				totals[n++] = scan_total(buf + s * record, record);
+			}
+		}
+		count_reader_close(&cr);
+		if (r < 0) {
+			strcpy(t->why, "corrupt archive");
+			if (pass == 1) {
+				count_sums_free(cs);
+			}
+			free(totals);
+			free(buf);
+			return -1;
+		}
+		if (pass == 0) {
+			outlier_limits(totals, n, rc->outlier, &lo, &hi);
+		}
+	}
+	free(totals);
+	free(buf);
+	return 0;
+}
+
+static int write_output(const struct recipe *rc, struct task *t, const char *suffix,
+                        const double *x, const double *sig, const double *ref,
+                        const double *c, const double *err, int n, long scans, long dropped,
+                        const struct fit_result *fit, int fit_ok)
+{
+	char path[1100], tmp[1200];
+	FILE *fp;
+	int i;
+
+	snprintf(path, sizeof(path), "%s%s", t->path, suffix);
+	fp = atomic_open(path, tmp, sizeof(tmp));
+	if (fp == NULL) {
+		strcpy(t->why, "could not write the result");
+		return -1;
+	}
+	for(i=0; i<n; i++) {
+		fprintf(fp, "%.10g\t%.10g\t%.10g\t%.0f\t%.0f\n", x[i], c[i], err[i], sig[i], ref[i]);
+	}
+	if (atomic_close(fp, tmp, path) != 0) {
+		strcpy(t->why, "could not write the result");
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s%s.fit", t->path, suffix);
+	fp = atomic_open(path, tmp, sizeof(tmp));
+	if (fp == NULL) {
+		strcpy(t->why, "could not write the fit");
+		return -1;
+	}
+	fprintf(fp, "scans\t%ld\n", scans);
+	if (rc->outlier > 0) {
+		fprintf(fp, "dropped\t%ld\n", dropped);
+	}
+	fprintf(fp, "ok\t%d\n", fit_ok);
+	for(i=0; fit_ok && i<fit->num_params; i++) {
+		fprintf(fp, "p%d\t%.10g\t%g\n", i, fit->p[i], fit->err[i]);
+	}
+	if (fit_ok) {
+		fprintf(fp, "chi2\t%g\n", fit->chi2);
+	}
+	if (atomic_close(fp, tmp, path) != 0) {
+		strcpy(t->why, "could not write the fit");
+		return -1;
+	}
+	return 0;
+}
+
+//Runs the recipe on one file. Returns 0, or -1 with the reason in why
+static int process(const struct recipe *rc, const char *suffix, struct task *t)
+{
+	struct count_sums cs;
+	struct fit_result fit;
+	double *x, *sig, *ref, *c, *err, *table = NULL;
+	long dropped = 0, scans = 0;
+	int i, n, rows = 0, cols = 0, fit_ok = 0, error;
+
+	memset(&fit, 0, sizeof(fit));
+
+	if (rc->input == INPUT_RESULTS) {
+		table = read_spreadsheet(t->path, &rows, &cols);
+		if (table == NULL || cols < 5 || rows < 2) {
+			free(table);
+			strcpy(t->why, "not a result file");
+			return -1;
+		}
+		n = rows;
+	}
+	else {
+		if (sum_counts(rc, t, &cs, &dropped) != 0) {
+			return -1;
+		}
+		n = cs.num_points;
+		scans = cs.scans;
+	}
+
+	x = malloc(n * sizeof(double));
+	sig = malloc(n * sizeof(double));
+	ref = malloc(n * sizeof(double));
+	c = malloc(n * sizeof(double));
+	err = malloc(n * sizeof(double));
+	for(i=0; i<n; i++) {
+		if (table != NULL) {
+			x[i] = table[i*cols];
+			sig[i] = table[i*cols + 3];
+			ref[i] = table[i*cols + 4];
+		}
+		else {
+			x[i] = (rc->x_max - rc->x_min) / (n - 1) * i + rc->x_min;
+			sig[i] = (double) count_sums_slot(&cs, rc->sig_slot)[i];
+			ref[i] = (double) count_sums_slot(&cs, rc->ref_slot)[i];
+		}
+	}
+	contrast_arrays(rc->contrast, sig, ref, n, c, err);
+	//as in PulsedPipeline: per shot, diff contrast scaled to all scans
+	for(i=0; table == NULL && rc->select_slot >= 0 && i<n; i++) {
+		contrast_point_shots(rc->contrast, sig[i], count_sums_shots(&cs, rc->sig_slot)[i],
+		                     ref[i], count_sums_shots(&cs, rc->ref_slot)[i], cs.scans,
+		                     &c[i], &err[i]);
+	}
+	if (rc->use_fit) {
+		fit_ok = fit_curve(rc->model, x, c, err, n, NULL, &fit) == 0;
+	}
+	error = write_output(rc, t, suffix, x, sig, ref, c, err, n, scans, dropped, &fit, fit_ok);
+
+	if (table == NULL) {
+		count_sums_free(&cs);
+	}
+	free(table);
+	free(x);
+	free(sig);
+	free(ref);
+	free(c);
+	free(err);
+	return error;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct batch *b = w->b;
+	long i;
+
+	while (1) {
+		i = take_own(w);
+		if (i < 0) {
+			i = steal(b, w->index);
+			if (i < 0) {
+				break;
+			}
+			w->stolen++;
+		}
+		b->tasks[i].failed = process(b->rc, b->suffix, &b->tasks[i]) != 0;
+		w->files++;
+	}
+	return NULL;
+}
+
+static int read_recipe(const char *path, struct recipe *rc)
+{
+	char line[256], name[64], value[128];
+	FILE *fp = fopen(path, "r");
+
+	memset(rc, 0, sizeof(*rc));
+	rc->sig_slot = 0;
+	rc->ref_slot = 1;
+	rc->contrast = CONTRAST_RATIO;
+	rc->x_max = 1;
+	rc->select_slot = -1;
+	rc->reselect_slot = -1;
+	if (fp == NULL) {
+		printf("Could not open %s", path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#' || sscanf(line, " %63[^= ] = %127s", name, value) != 2) {
+			continue;
+		}
+		if (strcmp(name, "input") == 0) {
+			rc->input = strcmp(value, "archive") == 0 ? INPUT_ARCHIVE
+			          : strcmp(value, "results") == 0 ? INPUT_RESULTS : INPUT_SPOOL;
+			if (rc->input == INPUT_SPOOL && strcmp(value, "spool") != 0) {
+				printf("Unknown input %s", value);
+				fclose(fp);
+				return -1;
+			}
+		}
+		else if (strcmp(name, "points") == 0) {
+			rc->num_points = atoi(value);
+		}
+		else if (strcmp(name, "slots") == 0) {
+			rc->num_slots = atoi(value);
+		}
+		else if (strcmp(name, "sig") == 0) {
+			rc->sig_slot = atoi(value);
+		}
+		else if (strcmp(name, "ref") == 0) {
+			rc->ref_slot = atoi(value);
+		}
+		else if (strcmp(name, "contrast") == 0) {
+			if (contrast_parse(value, &rc->contrast) != 0) {
+				printf("Unknown contrast %s", value);
+				fclose(fp);
+				return -1;
+			}
+		}
+		else if (strcmp(name, "fit") == 0) {
+			rc->use_fit = strcmp(value, "none") != 0;
+			if (strcmp(value, "rabi") == 0) {
+				rc->model = FIT_RABI;
+			}
+			else if (strcmp(value, "decay") == 0) {
+				rc->model = FIT_DECAY;
+			}
+			else if (strcmp(value, "esr") == 0) {
+				rc->model = FIT_ESR;
+			}
+			else if (rc->use_fit) {
+				printf("Unknown fit %s", value);
+				fclose(fp);
+				return -1;
+			}
+		}
+		else if (strcmp(name, "min") == 0) {
+			rc->x_min = atof(value);
+		}
+		else if (strcmp(name, "max") == 0) {
+			rc->x_max = atof(value);
+		}
+		else if (strcmp(name, "outlier") == 0) {
+			rc->outlier = atof(value);
+		}
+		else if (strcmp(name, "select") == 0) {
+			if (sscanf(value, "%d,%u,%d", &rc->select_slot, &rc->select_min,
+			           &rc->reselect_slot) != 3
+			    || rc->select_slot < 0 || rc->reselect_slot < 0) {
+				printf("Bad select %s", value);
+				fclose(fp);
+				return -1;
+			}
+		}
+		else if (strcmp(name, "seed") == 0) {
+			rc->seed = (unsigned int) strtoul(value, NULL, 0);
+		}
+		else if (strcmp(name, "chunk") == 0) {
+			rc->chunk_scans = atol(value);
+		}
+		else {
+			printf("Unknown recipe field %s", name);
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+	if (rc->input == INPUT_SPOOL && (rc->num_points < 2 || rc->num_slots < 1)) {
+		printf("A spool recipe needs points= and slots=");
+		return -1;
+	}
+	if (rc->sig_slot < 0 || rc->ref_slot < 0
+	    || (rc->num_slots > 0 && (rc->sig_slot >= rc->num_slots || rc->ref_slot >= rc->num_slots))
+	    || (rc->select_slot >= 0
+	        && !(rc->select_slot < rc->sig_slot && rc->sig_slot < rc->reselect_slot
+	             && rc->reselect_slot < rc->ref_slot))) {
+		printf("Bad sig/ref/select slots");
+		return -1;
+	}
+	return 0;
+}
+
+static int ends_with(const char *s, const char *end)
+{
+	size_t n = strlen(s), m = strlen(end);
+
+	return n >= m && strcmp(s + n - m, end) == 0;
+}
+
+static void add_task(struct task **tasks, int *n, int *size, const char *path)
+{
+	if (*n == *size) {
+		*size = *size ? 2 * *size : 256;
+		*tasks = realloc(*tasks, *size * sizeof(struct task));
+	}
+	memset(&(*tasks)[*n], 0, sizeof(struct task));
+	(*tasks)[*n].path = malloc(strlen(path) + 1);
+	strcpy((*tasks)[*n].path, path);
+	(*n)++;
+}
+
+//Files in dir ending in ext, but not in suffix or suffix.fit
+static int list_directory(const char *dir, const char *ext, const char *suffix,
+                          struct task **tasks, int *n)
+{
+	char path[1100], fit_suffix[1100];
+	const char *name;
+	int size = 0;
+#ifdef _WIN32
+	WIN32_FIND_DATAA fd;
+	HANDLE h;
+#else
+	DIR *d;
+	struct dirent *e;
+	struct stat st;
+#endif
+
+	snprintf(fit_suffix, sizeof(fit_suffix), "%s.fit", suffix);
+#ifdef _WIN32
+	snprintf(path, sizeof(path), "%s\\*", dir);
+	h = FindFirstFileA(path, &fd);
+	if (h == INVALID_HANDLE_VALUE) {
+		printf("Could not open %s", dir);
+		return -1;
+	}
+	do {
+		name = fd.cFileName;
+		if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+#else
+	d = opendir(dir);
+	if (d == NULL) {
+		printf("Could not open %s", dir);
+		return -1;
+	}
+	while ((e = readdir(d)) != NULL) {
+		name = e->d_name;
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)
+#endif
+		    || !ends_with(name, ext)
+		    || ends_with(name, suffix) || ends_with(name, fit_suffix)) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		add_task(tasks, n, &size, path);
+#ifdef _WIN32
+	} while (FindNextFileA(h, &fd));
+	FindClose(h);
+#else
+	}
+	closedir(d);
+#endif
+	return 0;
+}
+
+//Input files of the catalog runs matching the conditions
+static int query_catalog(const char *path, char **conditions, int num_conditions,
+                         const char *field, struct task **tasks, int *n)
+{
+	struct catalog cat;
+	struct catalog_condition *c = malloc((num_conditions + 1) * sizeof(*c));
+	unsigned int *found, k, m;
+	char file[1100], text[4096];
+	struct task *t;
+	int i, size = 0;
+
+	if (catalog_open(path, &cat) != 0) {
+		return -1;
+	}
+	for(i=0; i<num_conditions; i++) {
+		if (catalog_condition(&cat, conditions[i], &c[i]) != 0) {
+			catalog_close(&cat);
+			return -1;
+		}
+	}
+	found = malloc((cat.h->num_runs + 1) * sizeof(unsigned int));
+	m = catalog_find(&cat, c, num_conditions, found);
+	for(k=0; k<m; k++) {
+		if (catalog_text(&cat, found[k], field, file, sizeof(file)) != 0) {
+			continue;
+		}
+		add_task(tasks, n, &size, file);
+		//the seed the run was burned with
+		t = &(*tasks)[*n - 1];
+		if (catalog_text(&cat, found[k], "seed", text, sizeof(text)) == 0) {
+			t->seed = (unsigned int) strtoul(text, NULL, 0);
+			t->own_seed = 1;
+		}
+		else if (catalog_text(&cat, found[k], "burn", text, sizeof(text)) == 0) {
+			t->seed = sweep_burn_seed(text);
+			t->own_seed = 1;
+		}
+		if (t->own_seed && catalog_text(&cat, found[k], "chunk", text, sizeof(text)) == 0) {
+			t->chunk_scans = atol(text);
+		}
+	}
+	free(found);
+	free(c);
+	catalog_close(&cat);
+	return 0;
+}
+
+static int num_processors(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return (int) si.dwNumberOfProcessors;
+#else
+	return (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+	static struct batch b;
+	struct recipe rc;
+	struct task *tasks = NULL;
+	char **conditions;
+	const char *ext = NULL, *field = "file";
+	int i, n = 0, m = 0, threads, failed = 0;
+	unsigned long long bytes = 0;
+	double t;
+
+	if (argc < 5) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	if (read_recipe(argv[1], &rc) != 0) {
+		return -1;
+	}
+	threads = num_processors();
+	conditions = malloc(argc * sizeof(char *));
+	for(i=5; i<argc; i++) {
+		if (strncmp(argv[i], "threads=", 8) == 0) {
+			threads = atoi(argv[i] + 8);
+		}
+		else if (strncmp(argv[i], "ext=", 4) == 0) {
+			ext = argv[i] + 4;
+		}
+		else if (strncmp(argv[i], "field=", 6) == 0) {
+			field = argv[i] + 6;
+		}
+		else {
+			conditions[m++] = argv[i];
+		}
+	}
+	if (threads < 1 || threads > MAX_THREADS) {
+		threads = threads < 1 ? 1 : MAX_THREADS;
+	}
+
+	if (strcmp(argv[3], "dir") == 0) {
+		if (m > 0) {
+			printf("Unknown option %s", conditions[0]);
+			return -1;
+		}
+		if (ext == NULL || ext[0] == 0) {
+			printf("dir needs ext= (e.g. ext=.bin)");
+			return -1;
+		}
+		if (list_directory(argv[4], ext, argv[2], &tasks, &n) != 0) {
+			return -1;
+		}
+	}
+	else if (strcmp(argv[3], "catalog") == 0) {
+		if (query_catalog(argv[4], conditions, m, field, &tasks, &n) != 0) {
+			return -1;
+		}
+	}
+	else {
+		printf("Unknown source %s", argv[3]);
+		return -1;
+	}
+
+	b.rc = &rc;
+	b.suffix = argv[2];
+	b.tasks = tasks;
+	b.num_threads = threads;
+	for(i=0; i<threads; i++) {
+		b.workers[i].index = i;
+		b.workers[i].b = &b;
+		atomic_init(&b.workers[i].range, pack_range((unsigned int) ((long long) n * i / threads),
+		                                            (unsigned int) ((long long) n * (i + 1) / threads)));
+	}
+	t = clock_seconds();
+	for(i=0; i<threads; i++) {
+		if (pthread_create(&b.workers[i].thread, NULL, worker_thread, &b.workers[i]) != 0) {
+			printf("Could not start thread %d", i);
+			return -1;
+		}
+	}
+	for(i=0; i<threads; i++) {
+		pthread_join(b.workers[i].thread, NULL);
+	}
+	t = clock_seconds() - t;
+
+	for(i=0; i<n; i++) {
+		if (tasks[i].failed) {
+			printf("%s\t%s\n", tasks[i].path, tasks[i].why);
+			failed++;
+		}
+		bytes += tasks[i].bytes;
+		free(tasks[i].path);
+	}
+	printf("%d\t%d\t%.3f\t%.1f\n", n - failed, failed, t, t > 0 ? bytes / t / 1e6 : 0);
+	for(i=0; i<threads; i++) {
+		printf("%d\t%ld\t%ld\n", i, b.workers[i].files, b.workers[i].stolen);
+	}
+	free(tasks);
+	free(conditions);
+	return failed > 0;
+}
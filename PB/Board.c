@@ -0,0 +1,263 @@
+/**
+ * \file Board.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Called from LabVIEW, keeps track of which program is on the board so
+ *  the experiment and tracking VIs stop re-burning it for nothing.
+ *
+ *  The old way, Optimizer-PB.vi burns HoldChannel over the pulsed program
+ *  and the pulsed VI has to burn it again after every tracking step. With
+ *  the burner option hold=<laser channel> (BurnOptions.h) the hold state is
+ *  part of the pulsed program: the board sits in it (laser on) between
+ *  runs, so tracking just happens while it waits and "Board trigger" starts
+ *  the next run. Burning goes through "Board burn", which skips the burner
+ *  if that exact program is already loaded.
+ *
+ *  The state file is keyed on the whole command line, so any change to it
+ *  re-burns. That includes the seed: a VI that re-burns every chunk with
+ *  seed + 1, seed + 2, ... (seed=, SweepOrder.h) burns every chunk, as it
+ *  has to, and only the repeats of one chunk's program are skipped.
+ *
+ *  Usage:
+ *  Board burn <state file> <burner command line>
+ *      Runs the burner unless the state file says the same command line
+ *      was the last one burned. Prints 1 if it burned, 0 if it skipped.
+ *      A program burned with hold= is started right away, so the board
+ *      is in the hold state before the first trigger.
+ *  Board loaded <state file>
+ *      Prints the command line of the loaded program (empty if unknown).
+ *  Board forget <state file>
+ *      Call after burning anything without "Board burn" (HoldChannel,
+ *      PB_blast, ...), so the next "Board burn" doesn't skip.
+ *  Board trigger [<state file>]
+ *      Starts the program, or releases it from the WAIT of its hold state.
+ *      With the state file, a hold= program that is not in its hold state
+ *      (e.g. after Board stop) is first run up to it, so one trigger is
+ *      always one run; without it such a program only gets to the WAIT.
+ *  Board stop
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PBESRPRO
+#define CLOCK 500.0
+#include "spinapi.h"
+#include "AtomicWrite.h"
+#include "Hash.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#define board_sleep_ms(t) Sleep(t)
+#else
+#include <unistd.h>
+#define board_sleep_ms(t) usleep((t) * 1000)
+#endif
+
+#define COMMAND_LENGTH 4096
+#define STATUS_WAITING 0x8      //pb_read_status: waiting for a trigger
+#define HOLD_TIMEOUT_MS 100
+
+int detect_boards();
+int select_board(int numBoards);
+
+//Hash and command line of the loaded program; -1 if not known
+static int read_state(const char *path, unsigned long long *hash, char *command)
+{
+	char line[COMMAND_LENGTH + 32], *tab;
+	FILE *fp = fopen(path, "r");
+
+	command[0] = 0;
+	if (fp == NULL) {
+		return -1;
+	}
+	if (fgets(line, sizeof(line), fp) == NULL || (tab = strchr(line, '\t')) == NULL) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	line[strcspn(line, "\r\n")] = 0;
+	*hash = strtoull(line, NULL, 0);
+	strncpy(command, tab + 1, COMMAND_LENGTH - 1);
+	command[COMMAND_LENGTH - 1] = 0;
+	return 0;
+}
+
+static int write_state(const char *path, const char *command)
+{
+	char tmp[1100];
+	FILE *fp = atomic_open(path, tmp, sizeof(tmp));
+
+	if (fp == NULL) {
+		return -1;
+	}
+	fprintf(fp, "0x%016llX\t%s\n", fnv1a_string(command), command);
+	return atomic_close(fp, tmp, path);
+}
+
+//Whether a burner command line has the hold= option
+static int command_has_hold(const char *command)
+{
+	const char *p = command;
+
+	while ((p = strstr(p, "hold=")) != NULL) {
+		if (p == command || p[-1] == ' ' || p[-1] == '"') {
+			return 1;
+		}
+		p += 5;
+	}
+	return 0;
+}
+
+/*
+ * Runs a hold= program up to the WAIT of its hold state, unless it is
+ * already there. Returns -1 if it doesn't get there.
+ */
+static int park(void)
+{
+	int i;
+
+	if (pb_read_status() & STATUS_WAITING) {
+		return 0;
+	}
+	pb_start();
+	for(i=0; i<HOLD_TIMEOUT_MS && !(pb_read_status() & STATUS_WAITING); i++) {
+		board_sleep_ms(1);
+	}
+	if (!(pb_read_status() & STATUS_WAITING)) {
+		printf("Board did not reach the hold state: %s\n", pb_status_message());
+		return -1;
+	}
+	return 0;
+}
+
+//trigger, stop or park; hold if the loaded program has a hold state
+static int board_command(const char *command, int hold)
+{
+	int numBoards, status = 0;
+
+	/*If there is more than one board in the system, have the user specify. */
+	if ((numBoards = detect_boards()) > 1) {
+		select_board(numBoards);
+	}
+
+	if (pb_init() != 0) {
+		printf("Error initializing board: %s\n", pb_get_error());
+		return -1;
+	}
+	if (strcmp(command, "stop") == 0) {
+		pb_stop();
+	}
+	else {
+		if (hold) {
+			status = park();
+		}
+		if (status == 0 && strcmp(command, "trigger") == 0) {
+			pb_start();
+		}
+	}
+	pb_close();
+	return status;
+}
+
+int main(int argc, char *argv[])
+{
+	char loaded[COMMAND_LENGTH];
+	unsigned long long hash;
+	int status;
+
+	if (argc < 2) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+
+	if (strcmp(argv[1], "trigger") == 0 || strcmp(argv[1], "stop") == 0) {
+		return board_command(argv[1], argc >= 3 && read_state(argv[2], &hash, loaded) == 0
+		                              && command_has_hold(loaded));
+	}
+
+	if (strcmp(argv[1], "burn") == 0) {
+		if (argc != 4) {
+			printf("Wrong number of arguments");
+			return -1;
+		}
+		if (read_state(argv[2], &hash, loaded) == 0 && hash == fnv1a_string(argv[3])
+		    && strcmp(loaded, argv[3]) == 0) {
+			printf("0\n");
+			return 0;
+		}
+		//whatever is on the board now is about to be overwritten
+		remove(argv[2]);
+		status = system(argv[3]);
+		if (status != 0) {
+			printf("Burner failed (%d)", status);
+			return -1;
+		}
+		if (write_state(argv[2], argv[3]) != 0) {
+			printf("Could not write %s", argv[2]);
+			return -1;
+		}
+		if (command_has_hold(argv[3]) && board_command("park", 1) != 0) {
+			return -1;
+		}
+		printf("1\n");
+		return 0;
+	}
+
+	if (argc != 3) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	if (strcmp(argv[1], "loaded") == 0) {
+		read_state(argv[2], &hash, loaded);
+		printf("%s\n", loaded);
+		return 0;
+	}
+	if (strcmp(argv[1], "forget") == 0) {
+		remove(argv[2]);
+		return 0;
+	}
+
+	printf("Unknown command %s", argv[1]);
+	return -1;
+}
+
+int detect_boards()
+{
+	int numBoards;
+
+	numBoards = pb_count_boards();	/*Count the number of boards */
+
+	if (numBoards <= 0) {
+		printf
+		    ("No Boards were detected in your system. Verify that the board "
+		     "is firmly secured in the PCI slot.\n\n");
+		exit(-1);
+	}
+
+	return numBoards;
+}
+
+int select_board(int numBoards)
+{
+	int choice;
+
+	do {
+		printf
+		    ("Found %d boards in your system. Which board should be used? "
+		     "(0-%d): ", numBoards, numBoards - 1);
+		fflush(stdin);
+		scanf("%d", &choice);
+
+		if (choice < 0 || choice >= numBoards) {
+			printf("Invalid Board Number (%d).\n", choice);
+		}
+	} while (choice < 0 || choice >= numBoards);
+
+	pb_select_board(choice);
+	printf("Board %d selected.\n", choice);
+
+	return choice;
+}
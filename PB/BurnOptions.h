@@ -0,0 +1,195 @@
+/**
+ * \file BurnOptions.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Optional arguments for the burners. They come after the fixed args as
+ *  name=value pairs, so the argument positions LabVIEW already uses stay
+ *  the same and old VIs keep working.
+ *
+ *  Options:
+ *  seed=N      burn the sweep points of each scan in a pseudo-random order
+ *              generated from N (0, the default, keeps them in order).
+ *              Pass seed + c for chunk c to get a different permutation
+ *              per chunk. PulsedPipeline (seed=, chunk=, or the seed= in
+ *              its burn=), BatchProcess, Demux, SNRCheck and Unshuffle.exe
+ *              put the counts back in sweep order.
+ *  aoclock=M   also raise channels M at the start of every repetition, to
+ *              clock the next sample of a buffered analog output
+ *              (see LaserWaveform.c)
+ *  hold=M      put a hold state in front of the experiment: channels M
+ *              (e.g. the green laser for tracking) stay on while the board
+ *              waits for a trigger, and the end of the experiment branches
+ *              back there instead of stopping. The board then alternates
+ *              between tracking and experiment on "Board trigger"
+ *              (Board.c) with no re-burn in between.
+ *  charge=M    charge state check in every sweep point: channels M
+ *              (the orange/resonant probe laser and the counter gate) for
+ *              probe= ns, right after window 1 (the green polarization,
+ *              which also repumps the charge state) and before the MW.
+ *              The probe gate becomes slot 0 of every point and the other
+ *              slots move up by one. Any laser window after the probe
+ *              changes the charge state again, so keep the lasers off
+ *              between window 1 and the signal readout.
+ *  reprobe=W   probe again right before window W, the reference readout.
+ *              The green light of the signal readout re-draws the charge
+ *              state, so the reference needs its own probe: its gate
+ *              becomes a slot in front of the reference slot.
+ *              PulsedPipeline's select= then keeps the signal and the
+ *              reference of only the shots their own probe saw in NV-.
+ *              Needs charge=
+ *  probe=T     probe window length in ns (default 1000)
+ *  herald=1    WAIT after each probe, for a discriminator on the probe
+ *              counts that repumps and re-probes until the NV is NV- and
+ *              only then triggers the board
+ *
+ *  burn_head() and burn_end() use pb_inst, so include this after spinapi.h.
+ */
+
+#ifndef BURN_OPTIONS_H
+#define BURN_OPTIONS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct burn_options {
+	unsigned int seed;
+	int ao_clock;
+	int hold;       //-1 = no hold state
+	int charge;     //0 = no charge check
+	int reprobe;    //window probed again, 0 = none
+	double probe_ns;
+	int herald;
+};
+
+/*
+ * Parses argv[first..argc-1] into opt. Unknown options are an error so a
+ * typo in the VI does not silently burn the wrong sequence.
+ */
+static inline int parse_burn_options(int argc, char *argv[], int first,
+                                     struct burn_options *opt)
+{
+	int i;
+	char *value;
+
+	opt->seed = 0;
+	opt->ao_clock = 0;
+	opt->hold = -1;
+	opt->charge = 0;
+	opt->reprobe = 0;
+	opt->probe_ns = 1000;
+	opt->herald = 0;
+
+	for(i=first; i<argc; i++) {
+		value = strchr(argv[i], '=');
+		if (value == NULL) {
+			printf("Bad option %s (expected name=value)", argv[i]);
+			return -1;
+		}
+		value++;
+
+		if (strncmp(argv[i], "seed=", 5) == 0) {
+			opt->seed = (unsigned int) strtoul(value, NULL, 0);
+		}
+		else if (strncmp(argv[i], "aoclock=", 8) == 0) {
+			opt->ao_clock = (int) strtol(value, NULL, 0);
+		}
+		else if (strncmp(argv[i], "hold=", 5) == 0) {
+			opt->hold = (int) strtol(value, NULL, 0);
+		}
+		else if (strncmp(argv[i], "charge=", 7) == 0) {
+			opt->charge = (int) strtol(value, NULL, 0);
+		}
+		else if (strncmp(argv[i], "reprobe=", 8) == 0) {
+			opt->reprobe = atoi(value);
+		}
+		else if (strncmp(argv[i], "probe=", 6) == 0) {
+			opt->probe_ns = atof(value);
+		}
+		else if (strncmp(argv[i], "herald=", 7) == 0) {
+			opt->herald = atoi(value);
+		}
+		else {
+			printf("Unknown option %s", argv[i]);
+			return -1;
+		}
+	}
+	if (opt->reprobe != 0 && opt->charge == 0) {
+		printf("reprobe= needs charge=");
+		return -1;
+	}
+
+	return 0;
+}
+
+//-1 (with a message) if reprobe= is not one of windows first..last
+static inline int check_reprobe(const struct burn_options *opt, int first, int last)
+{
+	if (opt->reprobe != 0 && (opt->reprobe < first || opt->reprobe > last)) {
+		printf("reprobe= must be one of windows %d-%d", first, last);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * First instructions of the program. With hold=, the hold state and the
+ * WAIT for the trigger (WAIT can't be the first instruction). Returns -1 if
+ * pb_inst failed.
+ */
+static inline int burn_head(const struct burn_options *opt)
+{
+	if (opt->hold < 0) {
+		return 0;
+	}
+	if (pb_inst(ON | opt->hold, CONTINUE, 0, 1000 * ns) < 0
+	    || pb_inst(ON | opt->hold, WAIT, 0, 1000 * ns) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Charge probe, then the WAIT for the herald or a short gap, so the counter
+ * gate drops before a readout gate right after it (reprobe=). Returns -1
+ * if pb_inst failed.
+ */
+static inline int burn_charge_check(const struct burn_options *opt)
+{
+	if (opt->charge == 0) {
+		return 0;
+	}
+	if (pb_inst(ON | opt->charge, CONTINUE, 0, opt->probe_ns * ns) < 0) {
+		return -1;
+	}
+	if (opt->herald) {
+		return pb_inst(0x0, WAIT, 0, 100 * ns) < 0 ? -1 : 0;
+	}
+	return pb_inst(0x0, CONTINUE, 0, 50 * ns) < 0 ? -1 : 0;
+}
+
+//Charge probe again if <window> is the reprobe= window, before burning it
+static inline int burn_reprobe(const struct burn_options *opt, int window)
+{
+	if (window != opt->reprobe) {
+		return 0;
+	}
+	return burn_charge_check(opt);
+}
+
+//Last instruction: STOP, or with hold= back to the hold state. -1 if pb_inst failed
+static inline int burn_end(const struct burn_options *opt)
+{
+	int r;
+
+	if (opt->hold < 0) {
+		r = pb_inst(0x0, STOP, 0, 10 * ns);
+	}
+	else {
+		r = pb_inst(ON | opt->hold, BRANCH, 0, 10 * ns);
+	}
+	return r < 0 ? -1 : 0;
+}
+
+#endif
@@ -0,0 +1,336 @@
+/**
+ * \file CalCache.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Keeps the pi pulse and resonance calibration of each NV (Fit Rabi Pi
+ *  Pulse.vi, ESR scans) between runs, so SpinEcho/CPMG/XY4 only
+ *  recalibrate when the numbers have actually drifted.
+ *
+ *  A calibration is stored for an NV position and MW frequency and power.
+ *  It is looked up by the nearest position within postol= um and the same
+ *  MW settings within freqtol= MHz and powertol= dB. Once it is older than
+ *  <max age> it is checked with a cheap probe instead of recalibrating:
+ *  RabiBurn with min time 0, max time the stored pi time and 2 time points,
+ *  i.e. no pi and pi, for a few seconds. The probe's contrast
+ *
+ *      c = 1 - (s_pi / r_pi) / (s_0 / r_0)     (s signal, r reference)
+ *
+ *  is compared with the stored one. A pi time off by a fraction e (or a
+ *  detuning comparable to the Rabi frequency) loses about (pi e / 2)^2 of
+ *  the contrast, so the default tolerance of 5% catches a 14% pi error.
+ *
+ *  The store is a text file, one calibration per line, rewritten
+ *  atomically (AtomicWrite.h).
+ *
+ *  Usage:
+ *  CalCache get <store> <x> <y> <z> <MW MHz> <MW dBm> <max age h> [options]
+ *      Prints what to do, then pi time (ns), detuning (MHz), contrast and
+ *      hours since it was last confirmed:
+ *      ok         use the stored values
+ *      probe      run the probe with the stored pi time, then "probe"
+ *      calibrate  no (usable) calibration, run the full one, then "put"
+ *  CalCache put <store> <x> <y> <z> <MW MHz> <MW dBm> <pi ns> <detuning MHz>
+ *               <contrast> [options]
+ *      After a full calibration; replaces the NV's entry.
+ *  CalCache probe <store> <x> <y> <z> <MW MHz> <MW dBm> <s 0> <s pi> <r 0>
+ *                 <r pi> [options]
+ *      Probe counts (summed over its scans). Prints 1 (calibration
+ *      confirmed), 0 (drifted, run the full calibration) or -1 (too few
+ *      counts to tell, keep probing), then the probe's contrast, its
+ *      error and the stored contrast. The position is updated to the one
+ *      given, so the entry follows the NV through tracking.
+ *  CalCache list <store>
+ *  Options: postol=D (um, default 1), freqtol=F (MHz, default 0.5),
+ *  powertol=P (dB, default 0.5), tol=T (contrast loss that means drifted,
+ *  default 0.05), now=S (time, seconds since 1970, default the clock)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "AtomicWrite.h"
+#include "Contrast.h"
+
+#define PROBE_SIGMAS 2.0
+
+struct calibration {
+	double x, y, z;
+	double freq_mhz, power_dbm;
+	double pi_ns, detuning_mhz, contrast;
+	double calibrated, confirmed;   //seconds since 1970
+	int stale;
+};
+
+struct cal_store {
+	struct calibration *cal;
+	int n, size;
+};
+
+struct cal_options {
+	double pos_tol, freq_tol, power_tol, tol, now;
+};
+
+static int read_store(const char *path, struct cal_store *cs)
+{
+	char line[512];
+	struct calibration c;
+	FILE *fp = fopen(path, "r");
+
+	cs->cal = NULL;
+	cs->n = cs->size = 0;
+	if (fp == NULL) {
+		return 0;   //empty store
+	}
+	if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, "PBCALCACHE 1", 12) != 0) {
+		fclose(fp);
+		printf("%s is not a calibration store", path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %d", &c.x, &c.y, &c.z,
+		           &c.freq_mhz, &c.power_dbm, &c.pi_ns, &c.detuning_mhz, &c.contrast,
+		           &c.calibrated, &c.confirmed, &c.stale) != 11) {
+			continue;
+		}
+		if (cs->n == cs->size) {
+			cs->size = cs->size ? 2 * cs->size : 64;
+			cs->cal = realloc(cs->cal, cs->size * sizeof(c));
+		}
+		cs->cal[cs->n++] = c;
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int write_store(const char *path, const struct cal_store *cs)
+{
+	char tmp[1100];
+	int i;
+	const struct calibration *c;
+	FILE *fp = atomic_open(path, tmp, sizeof(tmp));
+
+	if (fp == NULL) {
+		printf("Could not write %s", path);
+		return -1;
+	}
+	fprintf(fp, "PBCALCACHE 1\n");
+	for(i=0; i<cs->n; i++) {
+		c = &cs->cal[i];
+		fprintf(fp, "%.6f\t%.6f\t%.6f\t%.6f\t%.3f\t%.4f\t%.6f\t%.6f\t%.0f\t%.0f\t%d\n",
+		        c->x, c->y, c->z, c->freq_mhz, c->power_dbm, c->pi_ns, c->detuning_mhz,
+		        c->contrast, c->calibrated, c->confirmed, c->stale);
+	}
+	return atomic_close(fp, tmp, path);
+}
+
+//Index of the entry for this NV and MW setting, or -1
+static int find(const struct cal_store *cs, const struct calibration *key,
+                const struct cal_options *opt)
+{
+	int i, best = -1;
+	double d, best_d = HUGE_VAL;
+	const struct calibration *c;
+
+	for(i=0; i<cs->n; i++) {
+		c = &cs->cal[i];
+		if (fabs(c->freq_mhz - key->freq_mhz) > opt->freq_tol
+		    || fabs(c->power_dbm - key->power_dbm) > opt->power_tol) {
+			continue;
+		}
+		d = sqrt((c->x - key->x) * (c->x - key->x) + (c->y - key->y) * (c->y - key->y)
+		         + (c->z - key->z) * (c->z - key->z));
+		if (d <= opt->pos_tol && d < best_d) {
+			best_d = d;
+			best = i;
+		}
+	}
+	return best;
+}
+
+static int parse_options(int argc, char *argv[], int first, struct cal_options *opt)
+{
+	int i;
+
+	opt->pos_tol = 1;
+	opt->freq_tol = 0.5;
+	opt->power_tol = 0.5;
+	opt->tol = 0.05;
+	opt->now = (double) time(NULL);
+	for(i=first; i<argc; i++) {
+		if (strncmp(argv[i], "postol=", 7) == 0) {
+			opt->pos_tol = atof(argv[i] + 7);
+		}
+		else if (strncmp(argv[i], "freqtol=", 8) == 0) {
+			opt->freq_tol = atof(argv[i] + 8);
+		}
+		else if (strncmp(argv[i], "powertol=", 9) == 0) {
+			opt->power_tol = atof(argv[i] + 9);
+		}
+		else if (strncmp(argv[i], "tol=", 4) == 0) {
+			opt->tol = atof(argv[i] + 4);
+		}
+		else if (strncmp(argv[i], "now=", 4) == 0) {
+			opt->now = atof(argv[i] + 4);
+		}
+		else {
+			printf("Unknown option %s", argv[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Contrast of a pi / no-pi probe and its error: the ratio of the
+ * normalized signals, each from Contrast.h's ratio contrast.
+ */
+static void probe_contrast(double s0, double s_pi, double r0, double r_pi,
+                           double *c, double *err)
+{
+	double n0, e0, n_pi, e_pi;
+
+	contrast_point(CONTRAST_RATIO, s0, r0, &n0, &e0);
+	contrast_point(CONTRAST_RATIO, s_pi, r_pi, &n_pi, &e_pi);
+	if (n0 <= 0 || n_pi <= 0) {
+		*c = 0;
+		*err = HUGE_VAL;
+		return;
+	}
+	*c = 1 - n_pi / n0;
+	*err = (n_pi / n0) * sqrt((e0 / n0) * (e0 / n0) + (e_pi / n_pi) * (e_pi / n_pi));
+}
+
+int main(int argc, char *argv[])
+{
+	struct cal_store cs;
+	struct cal_options opt;
+	struct calibration key, *c;
+	double max_age, contrast, err, expected;
+	int i, verdict, status = 0;
+
+	if (argc < 3) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	if (read_store(argv[2], &cs) != 0) {
+		return -1;
+	}
+
+	if (strcmp(argv[1], "list") == 0) {
+		for(i=0; i<cs.n; i++) {
+			c = &cs.cal[i];
+			printf("%g\t%g\t%g\t%g\t%g\t%g\t%g\t%g\t%.0f\t%.0f\t%d\n", c->x, c->y, c->z,
+			       c->freq_mhz, c->power_dbm, c->pi_ns, c->detuning_mhz, c->contrast,
+			       c->calibrated, c->confirmed, c->stale);
+		}
+		free(cs.cal);
+		return 0;
+	}
+
+	if (argc < 8) {
+		printf("Wrong number of arguments");
+		free(cs.cal);
+		return -1;
+	}
+	memset(&key, 0, sizeof(key));
+	key.x = atof(argv[3]);
+	key.y = atof(argv[4]);
+	key.z = atof(argv[5]);
+	key.freq_mhz = atof(argv[6]);
+	key.power_dbm = atof(argv[7]);
+
+	if (strcmp(argv[1], "get") == 0 && argc >= 9) {
+		max_age = atof(argv[8]) * 3600;
+		if (parse_options(argc, argv, 9, &opt) != 0) {
+			free(cs.cal);
+			return -1;
+		}
+		i = find(&cs, &key, &opt);
+		if (i < 0 || cs.cal[i].stale) {
+			printf("calibrate\n");
+		}
+		else {
+			c = &cs.cal[i];
+			printf("%s\t%g\t%g\t%g\t%.2f\n",
+			       opt.now - c->confirmed <= max_age ? "ok" : "probe",
+			       c->pi_ns, c->detuning_mhz, c->contrast, (opt.now - c->confirmed) / 3600);
+		}
+		free(cs.cal);
+		return 0;
+	}
+
+	if (strcmp(argv[1], "put") == 0 && argc >= 11) {
+		if (parse_options(argc, argv, 11, &opt) != 0) {
+			free(cs.cal);
+			return -1;
+		}
+		key.pi_ns = atof(argv[8]);
+		key.detuning_mhz = atof(argv[9]);
+		key.contrast = atof(argv[10]);
+		key.calibrated = key.confirmed = opt.now;
+		if (key.pi_ns <= 0 || key.contrast <= 0 || key.contrast >= 1) {
+			printf("Bad calibration");
+			free(cs.cal);
+			return -1;
+		}
+		i = find(&cs, &key, &opt);
+		if (i < 0) {
+			if (cs.n == cs.size) {
+				cs.size = cs.size ? 2 * cs.size : 64;
+				cs.cal = realloc(cs.cal, cs.size * sizeof(key));
+			}
+			i = cs.n++;
+		}
+		cs.cal[i] = key;
+		status = write_store(argv[2], &cs);
+		free(cs.cal);
+		return status;
+	}
+
+	if (strcmp(argv[1], "probe") == 0 && argc >= 12) {
+		if (parse_options(argc, argv, 12, &opt) != 0) {
+			free(cs.cal);
+			return -1;
+		}
+		i = find(&cs, &key, &opt);
+		if (i < 0) {
+			printf("No calibration to probe");
+			free(cs.cal);
+			return -1;
+		}
+		c = &cs.cal[i];
+		probe_contrast(atof(argv[8]), atof(argv[9]), atof(argv[10]), atof(argv[11]),
+		               &contrast, &err);
+		expected = c->contrast;
+		if (err > opt.tol * expected / PROBE_SIGMAS) {
+			verdict = -1;   //can't resolve the tolerance yet
+			if ((1 - opt.tol) * expected - contrast > PROBE_SIGMAS * err) {
+				verdict = 0;    //clearly off even so
+			}
+		}
+		else {
+			verdict = (1 - opt.tol) * expected - contrast > PROBE_SIGMAS * err ? 0 : 1;
+		}
+		if (verdict == 1) {
+			c->confirmed = opt.now;
+			c->x = key.x;
+			c->y = key.y;
+			c->z = key.z;
+		}
+		else if (verdict == 0) {
+			c->stale = 1;
+		}
+		printf("%d\t%g\t%g\t%g\n", verdict, contrast, err, expected);
+		status = verdict >= 0 ? write_store(argv[2], &cs) : 0;
+		free(cs.cal);
+		return status;
+	}
+
+	printf("Unknown command or wrong number of arguments");
+	free(cs.cal);
+	return -1;
+}
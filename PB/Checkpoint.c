@@ -0,0 +1,97 @@
+/**
+ * \file Checkpoint.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Called from LabVIEW when a pulsed run starts, to decide whether it is
+ *  a restart of one that died, and when it finishes. The checkpoint itself
+ *  is written by PulsedPipeline (checkpoint=, see Checkpoint.h).
+ *
+ *  Usage:
+ *  Checkpoint status <checkpoint> <total scans> [<burn command> | program=<file>]
+ *      Prints: resume (1/0), scans done, scans still to run, tracking
+ *      state, tab separated. resume is 0 if there is no usable checkpoint
+ *      or, when the burn command (or, for runs with PulsedPipeline's
+ *      program=, the program file) is given, it was made with another
+ *      program. The VI then burns (or re-burns) and runs the remaining
+ *      scans with the same checkpoint= and spool for PulsedPipeline; on
+ *      resume 0 it starts PulsedPipeline with fresh=1, which refuses to
+ *      overwrite a checkpoint otherwise.
+ *  Checkpoint burn <checkpoint>
+ *      Re-runs the burner command stored in the checkpoint, so the board
+ *      gets exactly the program the sums were taken with.
+ *  Checkpoint hash <file>
+ *      Prints the program hash of a file (e.g. an emulator image), as
+ *      PulsedPipeline's program= option computes it.
+ *  Checkpoint clear <checkpoint>
+ *      Deletes it once the run's results are saved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Checkpoint.h"
+
+int main(int argc, char *argv[])
+{
+	struct checkpoint ck;
+	unsigned long long hash = 0;
+	long total, remaining;
+	int status;
+
+	if (argc < 3) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+
+	if (strcmp(argv[1], "status") == 0) {
+		if (argc != 4 && argc != 5) {
+			printf("Wrong number of arguments");
+			return -1;
+		}
+		total = atol(argv[3]);
+		if (argc == 5) {
+			hash = strncmp(argv[4], "program=", 8) == 0 ? fnv1a_file(argv[4] + 8)
+			                                            : fnv1a_string(argv[4]);
+		}
+		if (checkpoint_read(argv[2], &ck) != 0 || (argc == 5 && ck.program_hash != hash)) {
+			printf("0\t0\t%ld\t\n", total);
+			checkpoint_free(&ck);
+			return 0;
+		}
+		remaining = total - ck.scans;
+		printf("1\t%ld\t%ld\t%s\n", ck.scans, remaining > 0 ? remaining : 0, ck.track);
+		checkpoint_free(&ck);
+		return 0;
+	}
+
+	if (strcmp(argv[1], "burn") == 0) {
+		if (checkpoint_read(argv[2], &ck) != 0 || ck.burn[0] == 0) {
+			printf("No burn command in %s", argv[2]);
+			checkpoint_free(&ck);
+			return -1;
+		}
+		status = system(ck.burn);
+		checkpoint_free(&ck);
+		return status;
+	}
+
+	if (strcmp(argv[1], "hash") == 0) {
+		hash = fnv1a_file(argv[2]);
+		if (hash == 0) {
+			printf("Could not read %s", argv[2]);
+			return -1;
+		}
+		printf("0x%016llX\n", hash);
+		return 0;
+	}
+
+	if (strcmp(argv[1], "clear") == 0) {
+		remove(argv[2]);
+		return 0;
+	}
+
+	printf("Unknown command %s", argv[1]);
+	return -1;
+}
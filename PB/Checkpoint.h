@@ -0,0 +1,218 @@
+/**
+ * \file Checkpoint.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Checkpoint of a pulsed averaging run, so a crash of LabVIEW or the PC
+ *  costs the scans since the last checkpoint instead of the whole night.
+ *  Written by PulsedPipeline (checkpoint=), read back by it on restart and
+ *  by Checkpoint.exe.
+ *
+ *  The file is text, rewritten atomically (AtomicWrite.h):
+ *
+ *  PBCHECKPOINT 1
+ *  program_hash  FNV-1a of the program image or burner command line
+ *  burn          burner command line, to re-burn the same program
+ *  points, slots, x_min, x_max   sweep definition
+ *  scans         scans in the sums
+ *  spool, spool_offset           where in which spool file they end
+ *  spool_id      FNV-1a of the spool's first scan, to tell a new spool of
+ *                the same name from the one the sums came from
+ *  track         the VI's tracking state (one line, passed through)
+ *  sums          then one line per slot of num_points U64 sums
+ *  shots         (optional) then one line per slot of the shots summed per
+ *                point, when they differ from scans (post-selection,
+ *                select=)
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "AtomicWrite.h"
+#include "Hash.h"
+
+#define CHECKPOINT_TEXT 4096
+
+struct checkpoint {
+	unsigned long long program_hash;
+	char burn[CHECKPOINT_TEXT];
+	int num_points, num_slots;
+	double x_min, x_max;
+	long scans;
+	char spool[1024];
+	long long spool_offset;
+	unsigned long long spool_id;    //0 = not known (older checkpoints)
+	char track[CHECKPOINT_TEXT];
+	unsigned long long *sums;   //slot-major, as in struct count_sums
+	long *shots;                //like sums; NULL = scans for every slot and point
+};
+
+//Copies a string value, dropping anything that would break the line format
+static inline void checkpoint_text(char *dst, const char *src)
+{
+	int i;
+
+	for(i=0; src[i] != 0 && i<CHECKPOINT_TEXT-1; i++) {
+		dst[i] = src[i] == '\n' || src[i] == '\r' ? ' ' : src[i];
+	}
+	dst[i] = 0;
+}
+
+static inline void checkpoint_free(struct checkpoint *ck)
+{
+	free(ck->sums);
+	free(ck->shots);
+	ck->sums = NULL;
+	ck->shots = NULL;
+}
+
+static inline int checkpoint_write(const char *path, const struct checkpoint *ck)
+{
+	char tmp[1100];
+	int k, i;
+	FILE *fp = atomic_open(path, tmp, sizeof(tmp));
+
+	if (fp == NULL) {
+		return -1;
+	}
+	fprintf(fp, "PBCHECKPOINT 1\n");
+	fprintf(fp, "program_hash\t0x%016llX\n", ck->program_hash);
+	fprintf(fp, "burn\t%s\n", ck->burn);
+	fprintf(fp, "points\t%d\n", ck->num_points);
+	fprintf(fp, "slots\t%d\n", ck->num_slots);
+	fprintf(fp, "x_min\t%.17g\n", ck->x_min);
+	fprintf(fp, "x_max\t%.17g\n", ck->x_max);
+	fprintf(fp, "scans\t%ld\n", ck->scans);
+	fprintf(fp, "spool\t%s\n", ck->spool);
+	fprintf(fp, "spool_offset\t%lld\n", ck->spool_offset);
+	fprintf(fp, "spool_id\t0x%016llX\n", ck->spool_id);
+	fprintf(fp, "track\t%s\n", ck->track);
+	fprintf(fp, "sums\n");
+	for(k=0; k<ck->num_slots; k++) {
+		for(i=0; i<ck->num_points; i++) {
+			fprintf(fp, i ? "\t%llu" : "%llu", ck->sums[(size_t) k * ck->num_points + i]);
+		}
+		fprintf(fp, "\n");
+	}
+	if (ck->shots != NULL) {
+		fprintf(fp, "shots\n");
+		for(k=0; k<ck->num_slots; k++) {
+			for(i=0; i<ck->num_points; i++) {
+				fprintf(fp, i ? "\t%ld" : "%ld", ck->shots[(size_t) k * ck->num_points + i]);
+			}
+			fprintf(fp, "\n");
+		}
+	}
+	return atomic_close(fp, tmp, path);
+}
+
+//Value of a "name\tvalue" line, or NULL if the line is not that name
+static inline char *checkpoint_value(char *line, const char *name)
+{
+	size_t n = strlen(name);
+
+	if (strncmp(line, name, n) != 0 || line[n] != '\t') {
+		return NULL;
+	}
+	line[strcspn(line, "\r\n")] = 0;
+	return line + n + 1;
+}
+
+/*
+ * Reads a checkpoint; allocates ck->sums and ck->shots if saved (free with
+ * checkpoint_free).
+ * Returns -1 if there is none or it is damaged, so the run starts fresh.
+ */
+static inline int checkpoint_read(const char *path, struct checkpoint *ck)
+{
+	static char line[2 * CHECKPOINT_TEXT];
+	char *v, word[8];
+	size_t i, n;
+	FILE *fp = fopen(path, "r");
+
+	memset(ck, 0, sizeof(*ck));
+	if (fp == NULL) {
+		return -1;
+	}
+	if (fgets(line, sizeof(line), fp) == NULL
+	    || strncmp(line, "PBCHECKPOINT 1", 14) != 0) {
+		fclose(fp);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "sums", 4) == 0) {
+			break;
+		}
+		if ((v = checkpoint_value(line, "program_hash")) != NULL) {
+			ck->program_hash = strtoull(v, NULL, 0);
+		}
+		else if ((v = checkpoint_value(line, "burn")) != NULL) {
+			checkpoint_text(ck->burn, v);
+		}
+		else if ((v = checkpoint_value(line, "points")) != NULL) {
+			ck->num_points = atoi(v);
+		}
+		else if ((v = checkpoint_value(line, "slots")) != NULL) {
+			ck->num_slots = atoi(v);
+		}
+		else if ((v = checkpoint_value(line, "x_min")) != NULL) {
+			ck->x_min = atof(v);
+		}
+		else if ((v = checkpoint_value(line, "x_max")) != NULL) {
+			ck->x_max = atof(v);
+		}
+		else if ((v = checkpoint_value(line, "scans")) != NULL) {
+			ck->scans = atol(v);
+		}
+		else if ((v = checkpoint_value(line, "spool")) != NULL) {
+			strncpy(ck->spool, v, sizeof(ck->spool) - 1);
+		}
+		else if ((v = checkpoint_value(line, "spool_offset")) != NULL) {
+			ck->spool_offset = strtoll(v, NULL, 10);
+		}
+		else if ((v = checkpoint_value(line, "spool_id")) != NULL) {
+			ck->spool_id = strtoull(v, NULL, 0);
+		}
+		else if ((v = checkpoint_value(line, "track")) != NULL) {
+			checkpoint_text(ck->track, v);
+		}
+	}
+
+	if (ck->num_points < 1 || ck->num_slots < 1 || ck->scans < 0) {
+		fclose(fp);
+		return -1;
+	}
+	n = (size_t) ck->num_points * ck->num_slots;
+	ck->sums = malloc(n * sizeof(unsigned long long));
+	for(i=0; ck->sums != NULL && i<n; i++) {
+		if (fscanf(fp, "%llu", &ck->sums[i]) != 1) {
+			break;
+		}
+	}
+	if (ck->sums == NULL || i < n) {
+		fclose(fp);
+		checkpoint_free(ck);
+		return -1;
+	}
+	if (fscanf(fp, "%7s", word) == 1 && strcmp(word, "shots") == 0) {
+		ck->shots = malloc(n * sizeof(long));
+		for(i=0; ck->shots != NULL && i<n; i++) {
+			if (fscanf(fp, "%ld", &ck->shots[i]) != 1) {
+				break;
+			}
+		}
+		if (ck->shots == NULL || i < n) {
+			fclose(fp);
+			checkpoint_free(ck);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,38 @@
+/**
+ * \file Clock.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Monotonic time in seconds, for latency and rate measurements.
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#ifdef _WIN32
+#include <windows.h>
+
+static inline double clock_seconds(void)
+{
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&now);
+	return (double) now.QuadPart / freq.QuadPart;
+}
+#else
+#include <time.h>
+
+static inline double clock_seconds(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+#endif
+
+#endif
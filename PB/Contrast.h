@@ -0,0 +1,308 @@
+/**
+ * \file Contrast.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Signal/reference contrast with shot-noise error bars, the same
+ *  definitions as SaveContrastOptions.ctl:
+ *
+ *  CONTRAST_DIFF   s - r
+ *  CONTRAST_RATIO  s / r
+ *  CONTRAST_NORM   (s - r) / (s + r)
+ *
+ *  s and r are total counts, so their variance is the count itself (Poisson).
+ *
+ *  Also the per-scan reduction that Split Array Even-Odd.vi did: raw
+ *  counts come in sweep order with the slots (counter gates) of each point
+ *  interleaved, and are summed per slot into separate arrays, so the
+ *  contrast can then run straight down the signal and reference arrays.
+ *  The common 2 (even/odd) and 4 slot layouts are de-interleaved with SSE2
+ *  where available.
+ *
+ *  With a charge check in the sequence (charge= and reprobe= in
+ *  BurnOptions.h) the readouts can instead be post-selected on the probe
+ *  slot in front of them, so only shots read out in NV- are summed; the
+ *  number of shots kept per slot and point is then no longer the number of
+ *  scans, and the contrast is taken from the counts per shot.
+ */
+
+#ifndef CONTRAST_H
+#define CONTRAST_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CONTRAST_SSE2
+#endif
+
+enum contrast_type { CONTRAST_DIFF, CONTRAST_RATIO, CONTRAST_NORM };
+
+//Returns -1 if name is not one of diff/ratio/norm
+static inline int contrast_parse(const char *name, enum contrast_type *type)
+{
+	if (strcmp(name, "diff") == 0) {
+		*type = CONTRAST_DIFF;
+	}
+	else if (strcmp(name, "ratio") == 0) {
+		*type = CONTRAST_RATIO;
+	}
+	else if (strcmp(name, "norm") == 0) {
+		*type = CONTRAST_NORM;
+	}
+	else {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Contrast of one point and its 1-sigma error. Points without counts get
+ * contrast 0 and an infinite error so they never look "converged".
+ */
+static inline void contrast_point(enum contrast_type type, double s, double r,
+                                  double *c, double *err)
+{
+	double sum = s + r;
+
+	switch (type) {
+	case CONTRAST_DIFF:
+		*c = s - r;
+		*err = sum > 0 ? sqrt(sum) : HUGE_VAL;
+		break;
+	case CONTRAST_RATIO:
+		if (s <= 0 || r <= 0) {
+			*c = 0;
+			*err = HUGE_VAL;
+			return;
+		}
+		*c = s / r;
+		*err = *c * sqrt(1/s + 1/r);
+		break;
+	case CONTRAST_NORM:
+		if (sum <= 0) {
+			*c = 0;
+			*err = HUGE_VAL;
+			return;
+		}
+		*c = (s - r) / sum;
+		*err = 2 * sqrt(s * r / sum) / sum;
+		break;
+	}
+}
+
+/*
+ * contrast_point for sums over different numbers of shots (post-selection):
+ * s over s_shots and r over r_shots, compared per shot. Diff is scaled to
+ * <scans> shots, so it lines up with the points that kept every shot.
+ */
+static inline void contrast_point_shots(enum contrast_type type, double s, long s_shots,
+                                        double r, long r_shots, long scans,
+                                        double *c, double *err)
+{
+	double a, b, va, vb;
+
+	*c = 0;
+	*err = HUGE_VAL;
+	if (s_shots <= 0 || r_shots <= 0) {
+		return;
+	}
+	a = s / s_shots;
+	b = r / r_shots;
+	va = s / ((double) s_shots * s_shots);
+	vb = r / ((double) r_shots * r_shots);
+
+	switch (type) {
+	case CONTRAST_DIFF:
+		*c = (a - b) * scans;
+		if (va + vb > 0) {
+			*err = sqrt(va + vb) * scans;
+		}
+		break;
+	case CONTRAST_RATIO:
+		if (s <= 0 || r <= 0) {
+			return;
+		}
+		*c = a / b;
+		*err = *c * sqrt(1/s + 1/r);
+		break;
+	case CONTRAST_NORM:
+		if (a + b <= 0) {
+			return;
+		}
+		*c = (a - b) / (a + b);
+		*err = 2 * sqrt(b*b * va + a*a * vb) / ((a + b) * (a + b));
+		break;
+	}
+}
+
+//Contrast and error of n points from separate signal and reference sums
+static inline void contrast_arrays(enum contrast_type type, const double *s,
+                                   const double *r, int n, double *c, double *err)
+{
+	int i;
+
+	for(i=0; i<n; i++) {
+		contrast_point(type, s[i], r[i], &c[i], &err[i]);
+	}
+}
+
+/*
+ * Running per-slot sums, sums[slot * num_points + point]. 64 bit so long
+ * runs with bright gates can't wrap. shots, laid out the same way, is how
+ * many scans were summed into each slot of each point.
+ */
+struct count_sums {
+	int num_points, num_slots;
+	long scans;
+	unsigned long long *sums;
+	long *shots;
+};
+
+static inline int count_sums_init(struct count_sums *cs, int num_points, int num_slots)
+{
+	cs->num_points = num_points;
+	cs->num_slots = num_slots;
+	cs->scans = 0;
+	cs->sums = calloc((size_t) num_points * num_slots, sizeof(unsigned long long));
+	cs->shots = calloc((size_t) num_points * num_slots, sizeof(long));
+	if (cs->sums == NULL || cs->shots == NULL) {
+		free(cs->sums);
+		free(cs->shots);
+		cs->sums = NULL;
+		cs->shots = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static inline void count_sums_free(struct count_sums *cs)
+{
+	free(cs->sums);
+	free(cs->shots);
+	cs->sums = NULL;
+	cs->shots = NULL;
+}
+
+static inline const unsigned long long *count_sums_slot(const struct count_sums *cs, int slot)
+{
+	return cs->sums + (size_t) slot * cs->num_points;
+}
+
+static inline const long *count_sums_shots(const struct count_sums *cs, int slot)
+{
+	return cs->shots + (size_t) slot * cs->num_points;
+}
+
+#ifdef CONTRAST_SSE2
+//sums[0..1] += the two low U32s of v, sums[2..3] += the two high ones
+static inline void count_sums_widen(unsigned long long *sums, __m128i v)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i *lo = (__m128i *) sums, *hi = (__m128i *) (sums + 2);
+
+	_mm_storeu_si128(lo, _mm_add_epi64(_mm_loadu_si128(lo), _mm_unpacklo_epi32(v, zero)));
+	_mm_storeu_si128(hi, _mm_add_epi64(_mm_loadu_si128(hi), _mm_unpackhi_epi32(v, zero)));
+}
+
+//Returns the number of points done, the rest is left to the scalar loop
+static inline int count_sums_add_sse2(struct count_sums *cs, const unsigned int *counts)
+{
+	int p = 0, n = cs->num_points;
+	unsigned long long *s0 = cs->sums, *s1 = s0 + n, *s2 = s1 + n, *s3 = s2 + n;
+	__m128i a, b, c, d, ab_lo, ab_hi, cd_lo, cd_hi;
+
+	if (cs->num_slots == 2) {
+		//4 points: [s0 r0 s1 r1] [s2 r2 s3 r3] -> [s0 s1 s2 s3] [r0 r1 r2 r3]
+		for(; p+4<=n; p+=4) {
+			a = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (counts + 2*p)),
+			                      _MM_SHUFFLE(3, 1, 2, 0));
+			b = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (counts + 2*p + 4)),
+			                      _MM_SHUFFLE(3, 1, 2, 0));
+			count_sums_widen(s0 + p, _mm_unpacklo_epi64(a, b));
+			count_sums_widen(s1 + p, _mm_unpackhi_epi64(a, b));
+		}
+	}
+	else if (cs->num_slots == 4) {
+		//4x4 transpose: one register per point in, one per slot out
+		for(; p+4<=n; p+=4) {
+			a = _mm_loadu_si128((const __m128i *) (counts + 4*p));
+			b = _mm_loadu_si128((const __m128i *) (counts + 4*p + 4));
+			c = _mm_loadu_si128((const __m128i *) (counts + 4*p + 8));
+			d = _mm_loadu_si128((const __m128i *) (counts + 4*p + 12));
+			ab_lo = _mm_unpacklo_epi32(a, b);
+			ab_hi = _mm_unpackhi_epi32(a, b);
+			cd_lo = _mm_unpacklo_epi32(c, d);
+			cd_hi = _mm_unpackhi_epi32(c, d);
+			count_sums_widen(s0 + p, _mm_unpacklo_epi64(ab_lo, cd_lo));
+			count_sums_widen(s1 + p, _mm_unpackhi_epi64(ab_lo, cd_lo));
+			count_sums_widen(s2 + p, _mm_unpacklo_epi64(ab_hi, cd_hi));
+			count_sums_widen(s3 + p, _mm_unpackhi_epi64(ab_hi, cd_hi));
+		}
+	}
+	return p;
+}
+#endif
+
+/*
+ * Adds <scans> raw records (num_points * num_slots U32 counts each, the
+ * slots of a point next to each other) to the sums.
+ */
+static inline void count_sums_add(struct count_sums *cs, const unsigned int *counts,
+                                  long scans)
+{
+	int p, k, n = cs->num_points, m = cs->num_slots;
+	long scan;
+	size_t i;
+
+	for(scan=0; scan<scans; scan++, counts += (size_t) n * m) {
+		p = 0;
+#ifdef CONTRAST_SSE2
+		p = count_sums_add_sse2(cs, counts);
+#endif
+		for(; p<n; p++) {
+			for(k=0; k<m; k++) {
+				cs->sums[(size_t) k * n + p] += counts[p*m + k];
+			}
+		}
+		cs->scans++;
+	}
+	for(i=0; i<(size_t) n * m; i++) {
+		cs->shots[i] += scans;
+	}
+}
+
+/*
+ * Like count_sums_add, but every slot of a point is gated by a charge probe
+ * gate: the slots before <reselect> by the <select> slot (the probe after
+ * the repump), the rest by the <reselect> slot (the probe again in front of
+ * the reference readout). A slot of a scan is only summed if its probe has
+ * at least <min> counts.
+ */
+static inline void count_sums_add_selected(struct count_sums *cs, const unsigned int *counts,
+                                           long scans, int select, int reselect,
+                                           unsigned int min)
+{
+	int p, k, n = cs->num_points, m = cs->num_slots, keep, keep_ref;
+	long scan;
+	size_t i;
+
+	for(scan=0; scan<scans; scan++, counts += (size_t) n * m) {
+		for(p=0; p<n; p++) {
+			keep = counts[p*m + select] >= min;
+			keep_ref = counts[p*m + reselect] >= min;
+			for(k=0; k<m; k++) {
+				if (k < reselect ? keep : keep_ref) {
+					i = (size_t) k * n + p;
+					cs->sums[i] += counts[p*m + k];
+					cs->shots[i]++;
+				}
+			}
+		}
+		cs->scans++;
+	}
+}
+
+#endif
@@ -0,0 +1,322 @@
+/**
+ * \file CountCodec.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Converts raw counts to and from the compressed archive of CountCodec.h
+ *  (which PulsedPipeline writes with archive=), so old spools and
+ *  spreadsheets can be packed and archives read back by anything that
+ *  takes the raw files.
+ *
+ *  Usage:
+ *  CountCodec encode <input> <archive> <num_points> <slots per point>
+ *                    [text=1] [scans=N] [rice=0] [seed=S chunk=R]
+ *      input is a spool (U32, little endian, one record of num_points *
+ *      slots counts per scan) or, with text=1, a spreadsheet with one row
+ *      per scan (as Unshuffle takes). N scans per frame (default 256);
+ *      rice=0 only bit-packs. Archives hold the scans in sweep order, as
+ *      PulsedPipeline writes them: seed= and chunk= (as in PulsedPipeline)
+ *      put input burned in a seeded order back first
+ *  CountCodec decode <archive> <output> [text=1]
+ *      writes the counts back as a spool, identical to the original, or
+ *      as a spreadsheet
+ *  CountCodec sums <archive> <output>
+ *      spreadsheet with one row per point: point, sum of each slot, as
+ *      Demux.exe writes before the contrast columns
+ *  CountCodec info <archive>
+ *      prints points, slots, scans, frames, bytes and the size relative
+ *      to the spool
+ *
+ *  encode, decode and sums also print the scans and the codec throughput
+ *  (MB/s of U32 counts).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CountCodec.h"
+#include "Contrast.h"
+#include "Spreadsheet.h"
+#include "Clock.h"
+#include "SweepOrder.h"
+
+#define FRAME_SCANS 256
+
+static void print_rate(unsigned long long scans, size_t record, double seconds)
+{
+	printf("%llu\t%g\n", scans, seconds > 0
+	       ? scans * record * sizeof(unsigned int) / seconds / 1e6 : 0);
+}
+
+static int encode_file(int argc, char *argv[])
+{
+	struct count_archive ca;
+	struct sweep_unshuffle su;
+	int num_points, num_slots, text = 0, rice = 1, rows, cols, i, r;
+	long frame_scans = FRAME_SCANS, got, chunk_scans = 0, scan = 0, s;
+	unsigned int *block, *sweep, seed = 0;
+	double *data, t, codec_s = 0;
+	size_t record, j;
+	FILE *fp;
+
+	num_points = atoi(argv[4]);
+	num_slots = atoi(argv[5]);
+	for(i=6; i<argc; i++) {
+		if (strncmp(argv[i], "text=", 5) == 0) {
+			text = atoi(argv[i] + 5);
+		}
+		else if (strncmp(argv[i], "scans=", 6) == 0) {
+			frame_scans = atol(argv[i] + 6);
+		}
+		else if (strncmp(argv[i], "rice=", 5) == 0) {
+			rice = atoi(argv[i] + 5);
+		}
+		else if (strncmp(argv[i], "seed=", 5) == 0) {
+			seed = (unsigned int) strtoul(argv[i] + 5, NULL, 0);
+		}
+		else if (strncmp(argv[i], "chunk=", 6) == 0) {
+			chunk_scans = atol(argv[i] + 6);
+		}
+		else {
+			printf("Unknown option %s", argv[i]);
+			return -1;
+		}
+	}
+	if (num_points < 1 || num_slots < 1 || frame_scans < 1) {
+		printf("Bad point/slot arguments");
+		return -1;
+	}
+	record = (size_t) num_points * num_slots;
+	if (count_archive_open(&ca, argv[3], num_points, num_slots, frame_scans, rice, -1) != 0) {
+		return -1;
+	}
+	block = malloc(record * frame_scans * sizeof(unsigned int));
+	sweep = seed != 0 ? malloc(record * frame_scans * sizeof(unsigned int)) : block;
+	if (block == NULL || sweep == NULL
+	    || sweep_unshuffle_init(&su, seed, chunk_scans, num_points, num_slots) != 0) {
+		printf("Out of memory");
+		return -1;
+	}
+
+	if (text) {
+		data = read_spreadsheet(argv[2], &rows, &cols);
+		if (data == NULL) {
+			return -1;
+		}
+		if ((size_t) cols != record) {
+			printf("%s has %d columns, not %d points * %d slots", argv[2], cols,
+			       num_points, num_slots);
+			return -1;
+		}
+		for(r=0; r<rows; r++) {
+			for(j=0; j<record; j++) {
+				//only counts survive the trip, not arbitrary doubles
+				if (data[r*record + j] < 0 || data[r*record + j] > 4294967295.0
+				    || data[r*record + j] != (double) (unsigned int) data[r*record + j]) {
+					printf("%s row %d holds %g, not a count", argv[2], r,
+					       data[r*record + j]);
+					return -1;
+				}
+				block[j] = (unsigned int) data[r*record + j];
+			}
+			if (seed != 0) {
+				sweep_unshuffle_scan(&su, scan++, block, sweep);
+			}
+			t = clock_seconds();
+			if (count_archive_add(&ca, sweep, 1) != 0) {
+				printf("Error writing %s", argv[3]);
+				return -1;
+			}
+			codec_s += clock_seconds() - t;
+		}
+		free(data);
+	}
+	else {
+		fp = fopen(argv[2], "rb");
+		if (fp == NULL) {
+			printf("Could not open %s", argv[2]);
+			return -1;
+		}
+		while ((got = (long) fread(block, record * sizeof(unsigned int), frame_scans, fp)) > 0) {
+			for(s=0; seed != 0 && s<got; s++) {
+				sweep_unshuffle_scan(&su, scan++, block + s * record, sweep + s * record);
+			}
+			t = clock_seconds();
+			if (count_archive_add(&ca, sweep, got) != 0) {
+				printf("Error writing %s", argv[3]);
+				fclose(fp);
+				return -1;
+			}
+			codec_s += clock_seconds() - t;
+		}
+		fclose(fp);
+	}
+
+	t = clock_seconds();
+	if (count_archive_close(&ca) != 0) {
+		printf("Error writing %s", argv[3]);
+		return -1;
+	}
+	codec_s += clock_seconds() - t;
+	print_rate(ca.scans, record, codec_s);
+	if (sweep != block) {
+		free(sweep);
+	}
+	free(block);
+	sweep_unshuffle_free(&su);
+	return 0;
+}
+
+/*
+ * Reads every frame of an archive; mode 0 writes a spool, 1 a spreadsheet,
+ * 2 the slot sums.
+ */
+static int read_archive(const char *path, const char *out_path, int mode)
+{
+	struct count_reader cr;
+	struct count_sums cs;
+	unsigned int *buf = NULL;
+	unsigned long long scans = 0;
+	size_t capacity = 0, record, j;
+	long s, frame;
+	double t, codec_s = 0, *table;
+	int r, p, k, error = 0;
+	FILE *fp = NULL;
+
+	memset(&cs, 0, sizeof(cs));
+	if (count_reader_open(path, &cr) != 0) {
+		return -1;
+	}
+	record = (size_t) cr.h.num_points * cr.h.num_slots;
+	if (mode == 2) {
+		if (count_sums_init(&cs, cr.h.num_points, cr.h.num_slots) != 0) {
+			printf("Out of memory");
+			return -1;
+		}
+	}
+	else {
+		fp = fopen(out_path, mode == 0 ? "wb" : "w");
+		if (fp == NULL) {
+			printf("Could not open %s for writing", out_path);
+			return -1;
+		}
+	}
+
+	while (1) {
+		t = clock_seconds();
+		r = count_reader_next(&cr, &buf, &capacity, &frame);
+		codec_s += clock_seconds() - t;
+		if (r <= 0) {
+			break;
+		}
+		scans += frame;
+		if (mode == 0) {
+			if (fwrite(buf, record * sizeof(unsigned int), frame, fp) != (size_t) frame) {
+				error = -1;
+			}
+		}
+		else if (mode == 1) {
+			for(s=0; s<frame; s++) {
+				for(j=0; j<record; j++) {
+					fprintf(fp, j == 0 ? "%u" : "\t%u", buf[s*record + j]);
+				}
+				fprintf(fp, "\n");
+			}
+		}
+		else {
+			count_sums_add(&cs, buf, frame);
+		}
+	}
+	if (r < 0) {
+		printf("%s is corrupt after %llu scans\n", path, scans);
+		error = -1;
+	}
+	else if (cr.truncated) {
+		printf("%s ends inside a frame, read %llu scans\n", path, scans);
+	}
+
+	if (mode == 2) {
+		table = malloc((size_t) cr.h.num_points * (cr.h.num_slots + 1) * sizeof(double));
+		for(p=0; p<(int) cr.h.num_points; p++) {
+			table[p * (cr.h.num_slots + 1)] = p;
+			for(k=0; k<(int) cr.h.num_slots; k++) {
+				table[p * (cr.h.num_slots + 1) + 1 + k] = (double) count_sums_slot(&cs, k)[p];
+			}
+		}
+		if (write_spreadsheet(out_path, table, cr.h.num_points, cr.h.num_slots + 1) != 0) {
+			error = -1;
+		}
+		free(table);
+		count_sums_free(&cs);
+	}
+	else if (fclose(fp) != 0) {
+		error = -1;
+	}
+	if (error == 0) {
+		print_rate(scans, record, codec_s);
+	}
+	else if (r >= 0) {
+		printf("Error writing %s", out_path);
+	}
+
+	free(buf);
+	count_reader_close(&cr);
+	return error;
+}
+
+static int archive_info(const char *path)
+{
+	struct count_reader cr;
+	struct count_frame fr;
+	unsigned long long scans = 0, frames = 0;
+
+	if (count_reader_open(path, &cr) != 0) {
+		return -1;
+	}
+	//walks the frame headers without decoding
+	while (cr.pos + sizeof(fr) <= cr.map.size) {
+		memcpy(&fr, cr.map.data + cr.pos, sizeof(fr));
+		if (cr.pos + sizeof(fr) + fr.bytes > cr.map.size) {
+			break;
+		}
+		cr.pos += sizeof(fr) + fr.bytes;
+		scans += fr.scans;
+		frames++;
+	}
+	printf("%u\t%u\t%llu\t%llu\t%llu\t%g\n", cr.h.num_points, cr.h.num_slots, scans, frames,
+	       cr.map.size, scans > 0 ? (double) cr.map.size
+	       / (scans * cr.h.num_points * cr.h.num_slots * sizeof(unsigned int)) : 0);
+	if (cr.pos != cr.map.size) {
+		printf("%s ends inside a frame\n", path);
+	}
+	count_reader_close(&cr);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int text = 0;
+
+	if (argc >= 6 && strcmp(argv[1], "encode") == 0) {
+		return encode_file(argc, argv);
+	}
+	if ((argc == 4 || argc == 5) && strcmp(argv[1], "decode") == 0) {
+		if (argc == 5) {
+			if (strncmp(argv[4], "text=", 5) != 0) {
+				printf("Unknown option %s", argv[4]);
+				return -1;
+			}
+			text = atoi(argv[4] + 5);
+		}
+		return read_archive(argv[2], argv[3], text ? 1 : 0);
+	}
+	if (argc == 4 && strcmp(argv[1], "sums") == 0) {
+		return read_archive(argv[2], argv[3], 2);
+	}
+	if (argc == 3 && strcmp(argv[1], "info") == 0) {
+		return archive_info(argv[2]);
+	}
+	printf("Wrong number of arguments");
+	return -1;
+}
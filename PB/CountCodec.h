@@ -0,0 +1,619 @@
+/**
+ * \file CountCodec.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Compact storage for raw photon counts. The counts of a scan are small
+ *  numbers that change little from one sweep point to the next, but the
+ *  spool keeps 4 bytes for each of them and the spreadsheets about 10, so
+ *  a month of raw data mostly stores noise-free high bits.
+ *
+ *  Each count is replaced by its difference to the count <stride> values
+ *  back (the same slot of the previous point), zigzag coded so small
+ *  negative differences stay small (0, -1, 1, -2 -> 0, 1, 2, 3). Blocks of
+ *  COUNT_BLOCK of these are then stored either bit-packed at the width of
+ *  the largest one or Rice coded, whichever is shorter; Rice coding is what
+ *  wins for Poisson noise with the odd outlier. Delta and zigzag are SSE2
+ *  where available.
+ *
+ *  Block, byte aligned:
+ *  byte     COUNT_RICE | k for Rice coding with parameter k, else the
+ *           packed width in bits (0-32)
+ *  bits     LSB first. Rice: q ones, a zero and the low k bits for
+ *           value = q << k | low; q >= COUNT_ESCAPE is stored as
+ *           COUNT_ESCAPE ones and the value in 32 bits
+ *
+ *  Archive (.pbc), little endian: struct count_archive_header, then frames
+ *  of a whole number of scans, each struct count_frame and the encoded
+ *  counts (stride = slots). Frames only ever get appended, so a reader can
+ *  follow a file that is still being written up to the last whole frame.
+ *  A hash of each frame catches a damaged file instead of handing back
+ *  wrong counts.
+ */
+
+#ifndef COUNT_CODEC_H
+#define COUNT_CODEC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MapFile.h"
+#include "Hash.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define count_truncate(fp, size) _chsize_s(_fileno(fp), (__int64) (size))
+#define count_seek(fp, offset) _fseeki64(fp, (__int64) (offset), SEEK_SET)
+#else
+#include <unistd.h>
+#define count_truncate(fp, size) ftruncate(fileno(fp), (off_t) (size))
+#define count_seek(fp, offset) fseeko(fp, (off_t) (offset), SEEK_SET)
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define COUNT_SSE2
+#endif
+
+#define COUNT_BLOCK 128
+#define COUNT_RICE 0x80
+#define COUNT_ESCAPE 32
+
+#define COUNT_MAGIC "PBCOUNT1"
+
+struct count_archive_header {
+	char magic[8];
+	unsigned int num_points, num_slots;
+};
+
+struct count_frame {
+	unsigned int scans;
+	unsigned int bytes;     //encoded counts that follow
+	unsigned int check;     //low 32 bits of the FNV-1a of those bytes
+	unsigned int reserved;
+};
+
+//Most bytes count_encode can write for n counts
+static inline size_t count_encode_bound(size_t n)
+{
+	return 4 * n + n / COUNT_BLOCK + 1;
+}
+
+struct count_bits {
+	unsigned char *out;
+	const unsigned char *in, *end;
+	unsigned long long acc;
+	int bits;
+};
+
+//Appends the low nbits (<= 32) of v, which must have no higher bits set
+static inline void count_put(struct count_bits *bw, unsigned int v, int nbits)
+{
+	bw->acc |= (unsigned long long) v << bw->bits;
+	bw->bits += nbits;
+	while (bw->bits >= 8) {
+		*bw->out++ = (unsigned char) bw->acc;
+		bw->acc >>= 8;
+		bw->bits -= 8;
+	}
+}
+
+//Pads to a whole byte
+static inline void count_put_align(struct count_bits *bw)
+{
+	if (bw->bits > 0) {
+		*bw->out++ = (unsigned char) bw->acc;
+	}
+	bw->acc = 0;
+	bw->bits = 0;
+}
+
+static inline void count_refill(struct count_bits *br)
+{
+	while (br->bits <= 56 && br->in < br->end) {
+		br->acc |= (unsigned long long) *br->in++ << br->bits;
+		br->bits += 8;
+	}
+}
+
+//Next nbits (<= 32) bits; -1 in *error if the input runs out
+static inline unsigned int count_get(struct count_bits *br, int nbits, int *error)
+{
+	unsigned int v;
+
+	if (br->bits < nbits) {
+		count_refill(br);
+		if (br->bits < nbits) {
+			*error = -1;
+			return 0;
+		}
+	}
+	v = nbits == 32 ? (unsigned int) br->acc : (unsigned int) br->acc & ((1u << nbits) - 1);
+	br->acc >>= nbits;
+	br->bits -= nbits;
+	return v;
+}
+
+//Skips to the next whole byte
+static inline void count_get_align(struct count_bits *br)
+{
+	br->acc >>= br->bits % 8;
+	br->bits -= br->bits % 8;
+}
+
+static inline int count_ctz(unsigned long long v)
+{
+#if defined(__GNUC__)
+	return v ? __builtin_ctzll(v) : 64;
+#else
+	int n = 0;
+
+	while (n < 64 && !(v & 1)) {
+		v >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+//Rice coded size in bits of n zigzag values with parameter k
+static inline unsigned long long count_rice_bits(const unsigned int *z, int n, int k)
+{
+	unsigned long long bits = 0;
+	unsigned int q;
+	int i;
+
+	for(i=0; i<n; i++) {
+		q = z[i] >> k;
+		bits += q < COUNT_ESCAPE ? q + 1 + k : 2 * 32;
+	}
+	return bits;
+}
+
+/*
+ * Zigzag deltas of in[i0..i0+n) to z, each against the value stride back
+ * (0 for the first stride values). Returns the OR of all of them.
+ */
+static inline unsigned int count_deltas(const unsigned int *in, size_t i0, int n, int stride,
+                                        unsigned int *z)
+{
+	unsigned int all = 0, d;
+	size_t i = i0, end = i0 + n;
+
+	for(; i<end && i<(size_t) stride; i++) {
+		d = in[i];
+		z[i - i0] = (d << 1) ^ (unsigned int) ((int) d >> 31);
+		all |= z[i - i0];
+	}
+#ifdef COUNT_SSE2
+	{
+		__m128i x, acc = _mm_setzero_si128();
+		unsigned int lanes[4];
+
+		for(; i+4<=end; i+=4) {
+			x = _mm_sub_epi32(_mm_loadu_si128((const __m128i *) (in + i)),
+			                  _mm_loadu_si128((const __m128i *) (in + i - stride)));
+			x = _mm_xor_si128(_mm_slli_epi32(x, 1), _mm_srai_epi32(x, 31));
+			_mm_storeu_si128((__m128i *) (z + (i - i0)), x);
+			acc = _mm_or_si128(acc, x);
+		}
+		_mm_storeu_si128((__m128i *) lanes, acc);
+		all |= lanes[0] | lanes[1] | lanes[2] | lanes[3];
+	}
+#endif
+	for(; i<end; i++) {
+		d = in[i] - in[i - stride];
+		z[i - i0] = (d << 1) ^ (unsigned int) ((int) d >> 31);
+		all |= z[i - i0];
+	}
+	return all;
+}
+
+/*
+ * Encodes n counts, delta coded with the given stride (slots per point),
+ * to out (count_encode_bound(n) bytes). rice = 0 only bit-packs, which
+ * encodes faster but larger. Returns the number of bytes written.
+ */
+static inline size_t count_encode(const unsigned int *in, size_t n, int stride, int rice,
+                                  unsigned char *out)
+{
+	unsigned int z[COUNT_BLOCK], all;
+	unsigned long long sum, packed, best, size;
+	struct count_bits bw;
+	size_t b0;
+	int i, m, width, k, k0, best_k;
+
+	memset(&bw, 0, sizeof(bw));
+	bw.out = out;
+	for(b0=0; b0<n; b0+=COUNT_BLOCK) {
+		m = n - b0 < COUNT_BLOCK ? (int) (n - b0) : COUNT_BLOCK;
+		all = count_deltas(in, b0, m, stride, z);
+		for(width=0; width<32 && (all >> width) != 0; width++) {
+		}
+		packed = (unsigned long long) m * width;
+
+		//the best k is near log2 of the mean, try its neighbours too
+		best_k = -1;
+		best = packed;
+		if (rice && width > 0) {
+			for(sum=0, i=0; i<m; i++) {
+				sum += z[i];
+			}
+			for(k0=0; ((unsigned long long) m << (k0 + 1)) <= sum; k0++) {
+			}
+			for(k=k0>0 ? k0-1 : 0; k<=k0+1 && k<32; k++) {
+				size = count_rice_bits(z, m, k);
+				if (size < best) {
+					best = size;
+					best_k = k;
+				}
+			}
+		}
+
+		if (best_k < 0) {
+			count_put(&bw, width, 8);
+			for(i=0; i<m && width>0; i++) {
+				count_put(&bw, z[i], width);
+			}
+		}
+		else {
+			count_put(&bw, COUNT_RICE | best_k, 8);
+			for(i=0; i<m; i++) {
+				if ((z[i] >> best_k) < COUNT_ESCAPE) {
+					//q ones and the terminating zero
+					count_put(&bw, (1u << (z[i] >> best_k)) - 1, (z[i] >> best_k) + 1);
+					if (best_k > 0) {
+						count_put(&bw, z[i] & ((1u << best_k) - 1), best_k);
+					}
+				}
+				else {
+					count_put(&bw, 0xFFFFFFFFu, COUNT_ESCAPE);
+					count_put(&bw, z[i], 32);
+				}
+			}
+		}
+		count_put_align(&bw);
+	}
+	return bw.out - out;
+}
+
+//Undoes the zigzag and the deltas of count_encode in place
+static inline void count_undelta(unsigned int *v, size_t n, int stride)
+{
+	size_t i = 0;
+
+	for(; i<n && i<(size_t) stride; i++) {
+		v[i] = (v[i] >> 1) ^ (0u - (v[i] & 1));
+	}
+#ifdef COUNT_SSE2
+	{
+		__m128i x, one = _mm_set1_epi32(1), zero = _mm_setzero_si128(), prev;
+
+		//prefix sums of stride 1, 2 and 4 within a register
+		if (stride == 1 || stride == 2 || stride == 4) {
+			for(; i+4<=n; i+=4) {
+				x = _mm_loadu_si128((const __m128i *) (v + i));
+				x = _mm_xor_si128(_mm_srli_epi32(x, 1),
+				                  _mm_sub_epi32(zero, _mm_and_si128(x, one)));
+				if (stride == 1) {
+					x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+					x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+					prev = _mm_set1_epi32((int) v[i-1]);
+				}
+				else if (stride == 2) {
+					x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+					prev = _mm_loadl_epi64((const __m128i *) (v + i - 2));
+					prev = _mm_unpacklo_epi64(prev, prev);
+				}
+				else {
+					prev = _mm_loadu_si128((const __m128i *) (v + i - 4));
+				}
+				_mm_storeu_si128((__m128i *) (v + i), _mm_add_epi32(x, prev));
+			}
+		}
+	}
+#endif
+	for(; i<n; i++) {
+		v[i] = ((v[i] >> 1) ^ (0u - (v[i] & 1))) + v[i - stride];
+	}
+}
+
+/*
+ * Decodes n counts encoded with the same stride from size bytes of in.
+ * Returns the number of bytes used, or -1 if in is short or corrupt.
+ */
+static inline long long count_decode(const unsigned char *in, size_t size, unsigned int *out,
+                                     size_t n, int stride)
+{
+	struct count_bits br;
+	unsigned long long ones;
+	size_t b0;
+	int i, m, mode, k, q, error = 0;
+
+	memset(&br, 0, sizeof(br));
+	br.in = in;
+	br.end = in + size;
+	for(b0=0; b0<n && !error; b0+=COUNT_BLOCK) {
+		m = n - b0 < COUNT_BLOCK ? (int) (n - b0) : COUNT_BLOCK;
+		mode = (int) count_get(&br, 8, &error);
+		if (!(mode & COUNT_RICE)) {
+			if (mode > 32) {
+				return -1;
+			}
+			for(i=0; i<m; i++) {
+				out[b0 + i] = mode > 0 ? count_get(&br, mode, &error) : 0;
+			}
+		}
+		else {
+			k = mode & ~COUNT_RICE;
+			if (k >= 32) {
+				return -1;
+			}
+			for(i=0; i<m && !error; i++) {
+				count_refill(&br);
+				ones = br.bits == 64 ? ~br.acc : ~br.acc & ((1ull << br.bits) - 1);
+				q = count_ctz(ones);
+				if (q >= COUNT_ESCAPE) {
+					count_get(&br, COUNT_ESCAPE, &error);
+					out[b0 + i] = count_get(&br, 32, &error);
+				}
+				else if (q >= br.bits) {
+					error = -1;
+				}
+				else {
+					count_get(&br, q + 1, &error);
+					out[b0 + i] = (unsigned int) q << k;
+					if (k > 0) {
+						out[b0 + i] |= count_get(&br, k, &error);
+					}
+				}
+			}
+		}
+		count_get_align(&br);
+	}
+	if (error) {
+		return -1;
+	}
+	count_undelta(out, n, stride);
+	return (long long) (br.in - in) - br.bits / 8;
+}
+
+/*
+ * Writer of an archive, scan by scan: scans are buffered and written as a
+ * frame every frame_scans scans, and on count_archive_flush.
+ */
+struct count_archive {
+	FILE *fp;
+	int num_points, num_slots, rice;
+	long frame_scans, buffered;
+	unsigned long long scans;       //in the file and the buffer
+	unsigned int *buf;
+	unsigned char *out;
+};
+
+/*
+ * Reader: maps the archive, which may still be growing; frames are taken
+ * from the mapping made at count_reader_open.
+ */
+struct count_reader {
+	struct mapped_file map;
+	struct count_archive_header h;
+	unsigned long long pos;         //next frame
+	int truncated;                  //file ends inside a frame
+};
+
+//Returns 0, or -1 (and prints why)
+static inline int count_reader_open(const char *path, struct count_reader *cr)
+{
+	if (map_file(path, &cr->map) != 0) {
+		printf("Could not open %s", path);
+		return -1;
+	}
+	if (cr->map.size < sizeof(cr->h)) {
+		printf("%s is not a count archive", path);
+		unmap_file(&cr->map);
+		return -1;
+	}
+	memcpy(&cr->h, cr->map.data, sizeof(cr->h));
+	if (memcmp(cr->h.magic, COUNT_MAGIC, 8) != 0
+	    || cr->h.num_points == 0 || cr->h.num_slots == 0) {
+		printf("%s is not a count archive", path);
+		unmap_file(&cr->map);
+		return -1;
+	}
+	cr->pos = sizeof(cr->h);
+	cr->truncated = 0;
+	return 0;
+}
+
+static inline void count_reader_close(struct count_reader *cr)
+{
+	unmap_file(&cr->map);
+}
+
+/*
+ * Decodes the next frame into *buf (grown as needed, *capacity counts) and
+ * sets *scans. Returns 1, 0 at the end, or -1 if the frame is corrupt.
+ */
+static inline int count_reader_next(struct count_reader *cr, unsigned int **buf, size_t *capacity,
+                                    long *scans)
+{
+	struct count_frame fr;
+	size_t n;
+	unsigned int *grown;
+
+	if (cr->pos + sizeof(fr) > cr->map.size) {
+		cr->truncated = cr->pos != cr->map.size;
+		return 0;
+	}
+	memcpy(&fr, cr->map.data + cr->pos, sizeof(fr));
+	if (cr->pos + sizeof(fr) + fr.bytes > cr->map.size) {
+		cr->truncated = 1;
+		return 0;
+	}
+	if ((unsigned int) fnv1a(FNV_OFFSET, cr->map.data + cr->pos + sizeof(fr), fr.bytes)
+	    != fr.check) {
+		return -1;
+	}
+	n = (size_t) fr.scans * cr->h.num_points * cr->h.num_slots;
+	if (n > *capacity) {
+		grown = realloc(*buf, n * sizeof(unsigned int));
+		if (grown == NULL) {
+			return -1;
+		}
+		*buf = grown;
+		*capacity = n;
+	}
+	if (count_decode(cr->map.data + cr->pos + sizeof(fr), fr.bytes, *buf, n,
+	                 cr->h.num_slots) != (long long) fr.bytes) {
+		return -1;
+	}
+	cr->pos += sizeof(fr) + fr.bytes;
+	*scans = fr.scans;
+	return 1;
+}
+
+//Encodes the buffered scans as one frame and flushes the file
+static inline int count_archive_flush(struct count_archive *ca)
+{
+	struct count_frame fr;
+	size_t n = (size_t) ca->buffered * ca->num_points * ca->num_slots;
+
+	if (ca->buffered == 0) {
+		return 0;
+	}
+	fr.scans = (unsigned int) ca->buffered;
+	fr.bytes = (unsigned int) count_encode(ca->buf, n, ca->num_slots, ca->rice, ca->out);
+	fr.check = (unsigned int) fnv1a(FNV_OFFSET, ca->out, fr.bytes);
+	fr.reserved = 0;
+	ca->buffered = 0;
+	if (fwrite(&fr, sizeof(fr), 1, ca->fp) != 1
+	    || fwrite(ca->out, 1, fr.bytes, ca->fp) != fr.bytes || fflush(ca->fp) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static inline int count_archive_add(struct count_archive *ca, const unsigned int *counts, long scans)
+{
+	size_t record = (size_t) ca->num_points * ca->num_slots;
+	long s;
+
+	for(s=0; s<scans; s++) {
+		memcpy(ca->buf + ca->buffered * record, counts + s * record,
+		       record * sizeof(unsigned int));
+		ca->buffered++;
+		ca->scans++;
+		if (ca->buffered == ca->frame_scans && count_archive_flush(ca) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Keeps the first keep scans of an existing archive at path (e.g. those in
+ * a checkpoint being resumed) and drops the rest, leaving the file open
+ * for appending. Fewer scans than that are kept as they are.
+ */
+static inline int count_archive_resume(struct count_archive *ca, const char *path,
+                                       unsigned long long keep)
+{
+	struct count_reader cr;
+	unsigned int *buf = NULL;
+	size_t capacity = 0, record = (size_t) ca->num_points * ca->num_slots;
+	unsigned long long end;
+	long scans;
+	int r;
+
+	if (count_reader_open(path, &cr) != 0) {
+		return -1;
+	}
+	if (cr.h.num_points != (unsigned int) ca->num_points
+	    || cr.h.num_slots != (unsigned int) ca->num_slots) {
+		printf("%s is for a different sweep", path);
+		count_reader_close(&cr);
+		return -1;
+	}
+	end = cr.pos;
+	while (ca->scans < keep && (r = count_reader_next(&cr, &buf, &capacity, &scans)) == 1) {
+		if (ca->scans + scans > keep) {
+			//part of this frame goes back in the buffer
+			scans = (long) (keep - ca->scans);
+			memcpy(ca->buf, buf, scans * record * sizeof(unsigned int));
+			ca->buffered = scans;
+			ca->scans += scans;
+			break;
+		}
+		ca->scans += scans;
+		end = cr.pos;
+	}
+	count_reader_close(&cr);
+	free(buf);
+
+	ca->fp = fopen(path, "r+b");
+	if (ca->fp == NULL || count_truncate(ca->fp, end) != 0 || count_seek(ca->fp, end) != 0) {
+		printf("Could not append to %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Opens an archive for writing, new or (keep >= 0) resumed as in
+ * count_archive_resume. Returns 0, or -1 (and prints why).
+ */
+static inline int count_archive_open(struct count_archive *ca, const char *path, int num_points,
+                                     int num_slots, long frame_scans, int rice, long long keep)
+{
+	struct count_archive_header h;
+	size_t n = (size_t) frame_scans * num_points * num_slots;
+
+	memset(ca, 0, sizeof(*ca));
+	ca->num_points = num_points;
+	ca->num_slots = num_slots;
+	ca->frame_scans = frame_scans;
+	ca->rice = rice;
+	ca->buf = malloc(n * sizeof(unsigned int));
+	ca->out = malloc(count_encode_bound(n));
+	if (ca->buf == NULL || ca->out == NULL) {
+		printf("Out of memory");
+		return -1;
+	}
+	if (keep >= 0) {
+		return count_archive_resume(ca, path, (unsigned long long) keep);
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, COUNT_MAGIC, 8);
+	h.num_points = num_points;
+	h.num_slots = num_slots;
+	ca->fp = fopen(path, "wb");
+	if (ca->fp == NULL || fwrite(&h, sizeof(h), 1, ca->fp) != 1) {
+		printf("Could not write %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+//Writes what is buffered and closes the file. Returns 0 or -1
+static inline int count_archive_close(struct count_archive *ca)
+{
+	int error = 0;
+
+	if (ca->fp != NULL) {
+		error = count_archive_flush(ca);
+		if (fclose(ca->fp) != 0) {
+			error = -1;
+		}
+	}
+	free(ca->buf);
+	free(ca->out);
+	ca->fp = NULL;
+	ca->buf = NULL;
+	ca->out = NULL;
+	return error;
+}
+
+#endif
@@ -0,0 +1,141 @@
+/**
+ * \file Demux.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Native replacement for Split Array Even-Odd.vi + the contrast options
+ *  on a chunk of raw counts: sums every slot of every point over all scans
+ *  in the file and computes the contrast with errors. Same kernel as the
+ *  reduce stage of PulsedPipeline (Contrast.h).
+ *
+ *  Arg Description
+ *  1   Raw counts (U32, little endian, one record of num_points * slots
+ *      counts per scan, as the VI spools them)
+ *  2   Output spreadsheet: point, sum of each slot, contrast, error
+ *  3   Number of sweep points
+ *  4   Slots (counter gates) per point
+ *  5   Signal slot (0-indexed)
+ *  6   Reference slot (0-indexed)
+ *  7   Contrast: diff, ratio or norm
+ *  8+  Optional: seed=N and chunk=R for counts burned in a seeded order,
+ *      as in PulsedPipeline (each scan is put back in sweep order first)
+ *
+ *  Prints the number of scans and the kernel throughput (MB/s).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Contrast.h"
+#include "Spreadsheet.h"
+#include "Clock.h"
+#include "SweepOrder.h"
+
+#define SCANS_PER_READ 256
+
+int main(int argc, char *argv[])
+{
+	int num_points, num_slots, sig_slot, ref_slot, i, k, cols, error;
+	enum contrast_type contrast;
+	struct count_sums cs;
+	struct sweep_unshuffle su;
+	unsigned int *block, *sweep = NULL, seed = 0;
+	double *sig, *ref, *c, *err, *table, kernel_s = 0, t;
+	size_t record, got, s;
+	long chunk_scans = 0, scan = 0;
+	FILE *fp;
+
+	if (argc < 8) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	for(i=8; i<argc; i++) {
+		if (strncmp(argv[i], "seed=", 5) == 0) {
+			seed = (unsigned int) strtoul(argv[i] + 5, NULL, 0);
+		}
+		else if (strncmp(argv[i], "chunk=", 6) == 0) {
+			chunk_scans = atol(argv[i] + 6);
+		}
+		else {
+			printf("Unknown option %s", argv[i]);
+			return -1;
+		}
+	}
+	num_points = atoi(argv[3]);
+	num_slots = atoi(argv[4]);
+	sig_slot = atoi(argv[5]);
+	ref_slot = atoi(argv[6]);
+	if (num_points < 1 || num_slots < 1 || sig_slot < 0 || sig_slot >= num_slots
+	    || ref_slot < 0 || ref_slot >= num_slots) {
+		printf("Bad point/slot arguments");
+		return -1;
+	}
+	if (contrast_parse(argv[7], &contrast) != 0) {
+		printf("Unknown contrast %s", argv[7]);
+		return -1;
+	}
+
+	fp = fopen(argv[1], "rb");
+	if (fp == NULL) {
+		printf("Could not open %s", argv[1]);
+		return -1;
+	}
+	record = (size_t) num_points * num_slots;
+	block = malloc(record * SCANS_PER_READ * sizeof(unsigned int));
+	if (seed != 0) {
+		sweep = malloc(record * SCANS_PER_READ * sizeof(unsigned int));
+	}
+	if (block == NULL || count_sums_init(&cs, num_points, num_slots) != 0
+	    || sweep_unshuffle_init(&su, seed, chunk_scans, num_points, num_slots) != 0
+	    || (seed != 0 && sweep == NULL)) {
+		printf("Out of memory");
+		return -1;
+	}
+
+	while ((got = fread(block, record * sizeof(unsigned int), SCANS_PER_READ, fp)) > 0) {
+		for(s=0; sweep != NULL && s<got; s++) {
+			sweep_unshuffle_scan(&su, scan++, block + s * record, sweep + s * record);
+		}
+		t = clock_seconds();
+		count_sums_add(&cs, sweep != NULL ? sweep : block, (long) got);
+		kernel_s += clock_seconds() - t;
+	}
+	fclose(fp);
+	free(block);
+	free(sweep);
+	sweep_unshuffle_free(&su);
+
+	sig = malloc(num_points * sizeof(double));
+	ref = malloc(num_points * sizeof(double));
+	c = malloc(num_points * sizeof(double));
+	err = malloc(num_points * sizeof(double));
+	for(i=0; i<num_points; i++) {
+		sig[i] = (double) count_sums_slot(&cs, sig_slot)[i];
+		ref[i] = (double) count_sums_slot(&cs, ref_slot)[i];
+	}
+	contrast_arrays(contrast, sig, ref, num_points, c, err);
+
+	cols = num_slots + 3;
+	table = malloc((size_t) num_points * cols * sizeof(double));
+	for(i=0; i<num_points; i++) {
+		table[i*cols] = i;
+		for(k=0; k<num_slots; k++) {
+			table[i*cols + 1 + k] = (double) count_sums_slot(&cs, k)[i];
+		}
+		table[i*cols + num_slots + 1] = c[i];
+		table[i*cols + num_slots + 2] = err[i];
+	}
+	error = write_spreadsheet(argv[2], table, num_points, cols);
+
+	printf("%ld\t%g\n", cs.scans, kernel_s > 0
+	       ? cs.scans * record * sizeof(unsigned int) / kernel_s / 1e6 : 0);
+
+	free(sig);
+	free(ref);
+	free(c);
+	free(err);
+	free(table);
+	count_sums_free(&cs);
+	return error;
+}
@@ -0,0 +1,203 @@
+/**
+ * \file DriftMonitor.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Called from LabVIEW after every chunk of a pulsed run, instead of
+ *  tracking after a fixed num_scans ("samples before track"). Decides from
+ *  the reference window counts whether the NV has drifted out of focus,
+ *  and how long the next chunk can be.
+ *
+ *  After each tracking the first BASELINE_CHUNKS chunks set the baseline
+ *  reference rate. After that every chunk updates a one-sided Poisson CUSUM
+ *  for a drop of <drop> (fraction of the baseline):
+ *
+ *      S = max(0, S + n log(1 - drop) + drop * mu0)
+ *
+ *  (the log likelihood ratio of the dropped against the baseline rate for
+ *  n counts where mu0 are expected), and tracking is called for when S
+ *  passes log(1 / false alarm probability), or on a single chunk more than
+ *  5 sigma low (lost the NV). The rate trend since the last tracking gives
+ *  the drift rate, and the next chunk is sized so a drop of <drop> takes
+ *  about 4 chunks.
+ *
+ *  State is kept in <state file> between calls.
+ *
+ *  Usage:
+ *  DriftMonitor reset <state file>
+ *      After tracking (or at the start of a run).
+ *  DriftMonitor <state file> <reference counts> <scans> <chunk seconds>
+ *               <drop> <false alarm probability> <min scans> <max scans>
+ *      reference counts - summed over the chunk (all points, ref slot)
+ *      Prints: track (1/0), scans for the next chunk, this chunk's rate,
+ *      baseline rate (counts per scan), CUSUM, drift (fraction of the
+ *      baseline per second), tab separated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "AtomicWrite.h"
+
+#define BASELINE_CHUNKS 2
+#define LOST_SIGMA 5
+#define CHUNKS_PER_DROP 4
+
+struct drift_state {
+	int chunks;                 //since the last tracking
+	double base_counts, base_scans;
+	double cusum;
+	double t;                   //seconds since the last tracking
+	double sw, st, sr, stt, str;    //weighted fit of rate against time
+	double drift;               //last estimate, kept across trackings
+	double scans_per_s;
+};
+
+static const char *state_names[] = { "chunks", "base_counts", "base_scans", "cusum",
+                                     "t", "sw", "st", "sr", "stt", "str", "drift",
+                                     "scans_per_s" };
+#define NUM_STATE (sizeof(state_names) / sizeof(state_names[0]))
+
+static double *state_field(struct drift_state *st, int i)
+{
+	double *fields[NUM_STATE] = { NULL, &st->base_counts, &st->base_scans, &st->cusum,
+	                              &st->t, &st->sw, &st->st, &st->sr, &st->stt, &st->str,
+	                              &st->drift, &st->scans_per_s };
+	return fields[i];
+}
+
+static void read_state(const char *path, struct drift_state *st)
+{
+	char line[256], *tab;
+	size_t i;
+	FILE *fp = fopen(path, "r");
+
+	memset(st, 0, sizeof(*st));
+	if (fp == NULL) {
+		return;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if ((tab = strchr(line, '\t')) == NULL) {
+			continue;
+		}
+		*tab = 0;
+		for(i=0; i<NUM_STATE; i++) {
+			if (strcmp(line, state_names[i]) != 0) {
+				continue;
+			}
+			if (i == 0) {
+				st->chunks = atoi(tab + 1);
+			}
+			else {
+				*state_field(st, i) = atof(tab + 1);
+			}
+		}
+	}
+	fclose(fp);
+}
+
+static int write_state(const char *path, struct drift_state *st)
+{
+	char tmp[1100];
+	size_t i;
+	FILE *fp = atomic_open(path, tmp, sizeof(tmp));
+
+	if (fp == NULL) {
+		printf("Could not write %s", path);
+		return -1;
+	}
+	fprintf(fp, "%s\t%d\n", state_names[0], st->chunks);
+	for(i=1; i<NUM_STATE; i++) {
+		fprintf(fp, "%s\t%.17g\n", state_names[i], *state_field(st, i));
+	}
+	return atomic_close(fp, tmp, path);
+}
+
+int main(int argc, char *argv[])
+{
+	struct drift_state st;
+	double counts, scans, seconds, drop, alarm, min_scans, max_scans;
+	double rate, base, mu0, z, slope, denom, next, t_drop;
+	int track = 0;
+
+	if (argc == 3 && strcmp(argv[1], "reset") == 0) {
+		//keep what we learned about the drift rate and scan speed
+		read_state(argv[2], &st);
+		st.chunks = 0;
+		st.base_counts = st.base_scans = st.cusum = st.t = 0;
+		st.sw = st.st = st.sr = st.stt = st.str = 0;
+		return write_state(argv[2], &st);
+	}
+	if (argc != 9) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	counts = atof(argv[2]);
+	scans = atof(argv[3]);
+	seconds = atof(argv[4]);
+	drop = atof(argv[5]);
+	alarm = atof(argv[6]);
+	min_scans = atof(argv[7]);
+	max_scans = atof(argv[8]);
+	if (scans <= 0 || seconds <= 0 || drop <= 0 || drop >= 1 || alarm <= 0
+	    || alarm >= 1 || min_scans < 1 || max_scans < min_scans) {
+		printf("Bad arguments");
+		return -1;
+	}
+
+	read_state(argv[1], &st);
+	rate = counts / scans;
+	st.scans_per_s = scans / seconds;
+	st.t += seconds;
+	st.chunks++;
+
+	if (st.chunks <= BASELINE_CHUNKS) {
+		st.base_counts += counts;
+		st.base_scans += scans;
+	}
+	base = st.base_scans > 0 ? st.base_counts / st.base_scans : 0;
+
+	if (st.chunks > BASELINE_CHUNKS && base > 0) {
+		mu0 = base * scans;
+		st.cusum += counts * log(1 - drop) + drop * mu0;
+		if (st.cusum < 0) {
+			st.cusum = 0;
+		}
+		z = (counts - mu0) / sqrt(mu0);
+		if (st.cusum > log(1 / alarm) || z < -LOST_SIGMA) {
+			track = 1;
+		}
+	}
+
+	//rate against time, weighted by exposure (Poisson)
+	st.sw += scans;
+	st.st += scans * (st.t - seconds / 2);
+	st.sr += scans * rate;
+	st.stt += scans * (st.t - seconds / 2) * (st.t - seconds / 2);
+	st.str += scans * (st.t - seconds / 2) * rate;
+	denom = st.sw * st.stt - st.st * st.st;
+	if (st.chunks >= 3 && denom > 0 && base > 0) {
+		slope = (st.sw * st.str - st.st * st.sr) / denom;
+		st.drift = slope / base;
+	}
+
+	//next chunk: a drop of <drop> should take about CHUNKS_PER_DROP chunks
+	next = scans;
+	if (st.drift < 0) {
+		t_drop = drop / -st.drift;
+		next = t_drop / CHUNKS_PER_DROP * st.scans_per_s;
+	}
+	else if (st.chunks > BASELINE_CHUNKS) {
+		next = scans * 1.5;     //no drift seen, stretch
+	}
+	if (next < min_scans) next = min_scans;
+	if (next > max_scans) next = max_scans;
+
+	if (write_state(argv[1], &st) != 0) {
+		return -1;
+	}
+	printf("%d\t%.0f\t%g\t%g\t%g\t%g\n", track, next, rate, base, st.cusum, st.drift);
+	return 0;
+}
@@ -18,7 +18,7 @@ int select_board(int numBoards);
 
 int main(int argc, char *argv[])
 {
-	int start, scan_loop, freq_loop, status;
+	int scan_loop, freq_loop;
 	int num_scans, num_freqs;
 	int numBoards;
 	double window_time[4];
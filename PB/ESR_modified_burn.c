@@ -19,7 +19,7 @@ int select_board(int numBoards);
 
 int main(int argc, char *argv[])
 {
-	int start, scan_loop, freq_loop, freq_loop_2, status;
+	int scan_loop, freq_loop, freq_loop_2;
 	int num_scans, num_freqs;
 	int numBoards;
 	double window_time[4];
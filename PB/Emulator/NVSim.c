@@ -0,0 +1,331 @@
+/**
+ * \file NVSim.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Stand-in for the NV, laser and APD when testing without the setup.
+ *  Plays back a program image from an emulated burner (see spinapi.h in
+ *  this directory), evolves an NV through it and writes Poisson photon
+ *  counts per counter gate into a spool file, in the format
+ *  PulsedPipeline.exe reads (one U32 record per repetition of the outer
+ *  loop, one count per gate).
+ *
+ *  A gate is one continuous high period of the counter gate channel.
+ *
+ *  Every repetition of the outer (num_scans) loop runs the same sweep, so
+ *  the NV is only evolved through the first two repetitions (the second to
+ *  pick up anything carried over from the previous one) and the expected
+ *  counts of the second are reused. Only the Poisson draws are done per
+ *  repetition, which is what makes 1e5-repetition CPMG runs take well
+ *  under their real board time.
+ *
+ *  Arg Description
+ *  1   Program image
+ *  2   Spool file to write
+ *  3   Laser channel mask (e.g. 0x1)
+ *  4   MW channel mask
+ *  5   MW Y phase channel mask (MW on with this bit = phase 90 deg)
+ *  6   Counter gate channel mask
+ *  7   Rabi frequency (MHz)
+ *  8   Detuning (MHz)
+ *  9   T2 (us, 0 = none)
+ *  10  T2* (us, 0 = none)
+ *  11  Bright count rate (counts/s)
+ *  12  Contrast (0-1)
+ *  13  Readout window / repolarization time (ns)
+ *  14  Background count rate (counts/s)
+ *  15  Random seed
+ *  16  Real time (optional, 1 = write each repetition when the board
+ *      would have finished it, for testing the pipeline live)
+ *
+ *  Options, name=value after the fixed args, for the charge check
+ *  (charge= in BurnOptions.h):
+ *  charge=P     probability that the NV is NV- after a laser window
+ *               (default 1). Every laser window re-draws the charge state
+ *               (green ionizes and recombines it), so a gate sees the state
+ *               the last laser window before it left. In NV0 the NV has no
+ *               spin contrast and nv0= of the bright rate
+ *  probe=M      probe laser channel mask; a gate with it on is a probe gate
+ *  probecps=R   probe count rate in NV- (NV0 gives background only)
+ *  nv0=F        NV0 brightness under the readout laser, fraction of the
+ *               bright count rate (default 0.3)
+ *  attempt=T    ns per repump + probe attempt of the external discriminator
+ *               (default 10000). A probe followed by a WAIT is heralded:
+ *               the discriminator repumps until it sees NV- and then
+ *               triggers the board, so the shot is always NV-, and the
+ *               extra attempts are added to the board time printed at the
+ *               end. The probe gate itself still counts the first attempt.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../PBImage.h"
+#include "../NVModel.h"
+#include "../Random.h"
+#include "../Clock.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#define sim_sleep(s) Sleep((DWORD) ((s) * 1e3))
+#else
+#include <unistd.h>
+#define sim_sleep(s) usleep((useconds_t) ((s) * 1e6))
+#endif
+
+#define NV_ENSEMBLE 32
+
+enum { GATE_READ, GATE_PROBE, GATE_HERALD };
+
+struct sim {
+	const struct pb_image *img;
+	int laser_mask, mw_mask, y_mask, gate_mask, probe_mask;
+	struct nv_params params;
+	struct nv_array nv;
+	double probe_cps, nv0_fraction;
+
+	int keep_iter;        //outer iteration whose gates we keep
+	int gate_open;
+	double gate_lambda, gate_lambda0;
+	int gate_kind;
+	int gate_high;        //gate channel on in the last segment
+	int laser_seen;       //laser window since the last gate opened
+	int gate_redraw;
+	double *gates;        //expected counts per gate in NV-, one repetition
+	double *gates0;       //the same in NV0
+	int *kinds;
+	int *redraws;         //charge state re-drawn before the gate
+	int num_gates, gates_size;
+};
+
+static void close_gate(struct sim *sim)
+{
+	if (!sim->gate_open) {
+		return;
+	}
+	if (sim->num_gates == sim->gates_size) {
+		sim->gates_size = sim->gates_size ? 2 * sim->gates_size : 256;
+		sim->gates = realloc(sim->gates, sim->gates_size * sizeof(double));
+		sim->gates0 = realloc(sim->gates0, sim->gates_size * sizeof(double));
+		sim->kinds = realloc(sim->kinds, sim->gates_size * sizeof(int));
+		sim->redraws = realloc(sim->redraws, sim->gates_size * sizeof(int));
+	}
+	sim->gates[sim->num_gates] = sim->gate_lambda;
+	sim->gates0[sim->num_gates] = sim->gate_lambda0;
+	sim->redraws[sim->num_gates] = sim->gate_redraw;
+	sim->kinds[sim->num_gates++] = sim->gate_kind;
+	sim->gate_open = 0;
+	sim->gate_lambda = 0;
+	sim->gate_lambda0 = 0;
+	sim->gate_kind = GATE_READ;
+}
+
+static int segment(void *ctx, int outputs, double length, int addr, int outer_iter)
+{
+	struct sim *sim = ctx;
+	double photons = 0, photons0 = 0, dark = sim->params.dark_cps * 1e-9 * length;
+	int keep = outer_iter == sim->keep_iter, probe = 0;
+	int gate = (outputs & sim->gate_mask) != 0, opening;
+
+	if (outputs & sim->laser_mask) {
+		photons = nv_laser(&sim->nv, &sim->params, length);
+		photons0 = sim->nv0_fraction * sim->params.bright_cps * 1e-9 * length;
+	}
+	else if (outputs & sim->probe_mask) {
+		//resonant/orange probe: counts in NV-, leaves the spin alone
+		photons = sim->probe_cps * 1e-9 * length;
+		nv_free(&sim->nv, length);
+		probe = GATE_PROBE;
+		if (addr + 1 < sim->img->num_inst && sim->img->inst[addr + 1] == PB_OP_WAIT) {
+			probe = GATE_HERALD;
+		}
+	}
+	else if (outputs & sim->mw_mask) {
+		nv_drive(&sim->nv, (outputs & sim->y_mask) ? M_PI / 2 : 0, length);
+	}
+	else {
+		nv_free(&sim->nv, length);
+	}
+
+	//a probe starts its own gate (and shot)
+	opening = gate && (!sim->gate_high || probe);
+	if (gate && keep) {
+		if (probe && sim->gate_kind == GATE_READ) {
+			close_gate(sim);
+		}
+		if (!sim->gate_open) {
+			sim->gate_redraw = sim->laser_seen;
+		}
+		sim->gate_open = 1;
+		sim->gate_lambda += photons + dark;
+		sim->gate_lambda0 += photons0 + dark;
+		if (probe) {
+			sim->gate_kind = probe;
+		}
+	}
+	else {
+		close_gate(sim);
+	}
+
+	//tracked in every iteration, so the first kept gate sees the laser
+	//windows at the end of the repetition before
+	if (opening) {
+		sim->laser_seen = 0;
+	}
+	if (outputs & sim->laser_mask) {
+		sim->laser_seen = 1;
+	}
+	sim->gate_high = gate;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct pb_image img;
+	struct sim sim;
+	struct pb_walk walk;
+	rand_state rng;
+	unsigned int *record;
+	int rep, reps, g, i, realtime = 0, minus;
+	double t_start, t_sim, p_minus = 1, attempt_ns = 10000, herald_ns = 0;
+	FILE *fp;
+
+	if (argc < 16) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+
+	memset(&sim, 0, sizeof(sim));
+	sim.img = &img;
+	sim.nv0_fraction = 0.3;
+	sim.laser_mask = (int) strtol(argv[3], NULL, 0);
+	sim.mw_mask = (int) strtol(argv[4], NULL, 0);
+	sim.y_mask = (int) strtol(argv[5], NULL, 0);
+	sim.gate_mask = (int) strtol(argv[6], NULL, 0);
+	sim.params.rabi_mhz = atof(argv[7]);
+	sim.params.detuning_mhz = atof(argv[8]);
+	sim.params.t2_us = atof(argv[9]);
+	sim.params.t2star_us = atof(argv[10]);
+	sim.params.bright_cps = atof(argv[11]);
+	sim.params.contrast = atof(argv[12]);
+	sim.params.readout_ns = atof(argv[13]);
+	sim.params.dark_cps = atof(argv[14]);
+	rand_seed(&rng, strtoull(argv[15], NULL, 0));
+	for(i=16; i<argc; i++) {
+		if (strchr(argv[i], '=') == NULL && i == 16) {
+			realtime = atoi(argv[16]);
+		}
+		else if (strncmp(argv[i], "charge=", 7) == 0) {
+			p_minus = atof(argv[i] + 7);
+		}
+		else if (strncmp(argv[i], "probe=", 6) == 0) {
+			sim.probe_mask = (int) strtol(argv[i] + 6, NULL, 0);
+		}
+		else if (strncmp(argv[i], "probecps=", 9) == 0) {
+			sim.probe_cps = atof(argv[i] + 9);
+		}
+		else if (strncmp(argv[i], "nv0=", 4) == 0) {
+			sim.nv0_fraction = atof(argv[i] + 4);
+		}
+		else if (strncmp(argv[i], "attempt=", 8) == 0) {
+			attempt_ns = atof(argv[i] + 8);
+		}
+		else {
+			printf("Unknown option %s", argv[i]);
+			return -1;
+		}
+	}
+	if (p_minus <= 0 || p_minus > 1) {
+		printf("charge= must be in (0, 1]");
+		return -1;
+	}
+
+	if (read_pb_image(argv[1], &img) != 0) {
+		return -1;
+	}
+	if (nv_ensemble(&sim.nv, &sim.params, NV_ENSEMBLE) != 0) {
+		printf("Out of memory");
+		return -1;
+	}
+
+	t_start = clock_seconds();
+
+	//Find out how the program repeats, then evolve through it for real
+	memset(&walk, 0, sizeof(walk));
+	walk.max_outer = 1;
+	sim.keep_iter = -2;
+	if (pb_image_walk(&img, &walk, segment, &sim) != 0) {
+		return -1;
+	}
+	reps = walk.outer_count > 0 ? walk.outer_count : 1;
+	sim.keep_iter = walk.outer_count > 1 ? 1 : (walk.outer_count == 1 ? 0 : -1);
+
+	nv_reset(&sim.nv);
+	sim.laser_seen = 0;
+	sim.gate_high = 0;
+	walk.max_outer = 2;
+	if (pb_image_walk(&img, &walk, segment, &sim) != 0) {
+		return -1;
+	}
+	close_gate(&sim);
+	if (walk.outer_count == 0) {
+		walk.outer_ns = walk.total_ns;
+	}
+
+	if (sim.num_gates == 0) {
+		printf("No counter gates in the program (gate mask 0x%X)", sim.gate_mask);
+		return -1;
+	}
+
+	fp = fopen(argv[2], "wb");
+	if (fp == NULL) {
+		printf("Could not open %s", argv[2]);
+		return -1;
+	}
+	record = malloc(sim.num_gates * sizeof(unsigned int));
+
+	//the charge state carries over between repetitions like the spin does
+	minus = rand_uniform(&rng) < p_minus;
+	for(rep=0; rep<reps; rep++) {
+		for(g=0; g<sim.num_gates; g++) {
+			if (sim.redraws[g]) {
+				minus = rand_uniform(&rng) < p_minus;
+			}
+			record[g] = rand_poisson(&rng, minus ? sim.gates[g] : sim.gates0[g]);
+			if (sim.kinds[g] == GATE_HERALD) {
+				//repump + probe until NV-, geometric in the number of tries
+				if (!minus) {
+					herald_ns += attempt_ns
+					           * (1 + floor(log(1 - rand_uniform(&rng)) / log(1 - p_minus)));
+				}
+				minus = 1;
+			}
+		}
+		if (realtime) {
+			double wait = t_start + ((rep + 1) * walk.outer_ns + herald_ns) * 1e-9
+			            - clock_seconds();
+			if (wait > 0) {
+				sim_sleep(wait);
+			}
+		}
+		fwrite(record, sizeof(unsigned int), sim.num_gates, fp);
+		if (realtime) {
+			fflush(fp);
+		}
+	}
+	fclose(fp);
+
+	t_sim = clock_seconds() - t_start;
+	printf("%d gates x %d repetitions, board time %g s, simulated in %g s\n",
+	       sim.num_gates, reps, (reps * walk.outer_ns + herald_ns) * 1e-9, t_sim);
+
+	free(record);
+	free(sim.gates);
+	free(sim.gates0);
+	free(sim.kinds);
+	free(sim.redraws);
+	nv_release(&sim.nv);
+	return 0;
+}
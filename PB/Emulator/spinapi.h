@@ -0,0 +1,144 @@
+/**
+ * \file Emulator/spinapi.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Stand-in for SpinCore's spinapi.h so the burners can run without a
+ *  PulseBlaster. Build a burner against it by putting this directory first
+ *  on the include path, e.g.
+ *
+ *      gcc -IEmulator RabiBurn.c -o RabiBurn_emu.exe
+ *
+ *  Instead of programming a board, pb_stop_programming() writes the program
+ *  to an image file (PBImage.h format) that NVSim.exe and the design tools
+ *  read. The file is $PB_EMULATOR_IMAGE, or pb_program.pbi in the current
+ *  directory.
+ *
+ *  Only what the burners use is emulated. The constants match spinapi for
+ *  the PBESR-PRO.
+ */
+
+#ifndef SPINAPI_EMULATOR_H
+#define SPINAPI_EMULATOR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ns 1.0
+#define us 1000.0
+#define ms 1000000.0
+
+#define ON 0xE00000
+
+#define CONTINUE 0
+#define STOP 1
+#define LOOP 2
+#define END_LOOP 3
+#define JSR 4
+#define RTS 5
+#define BRANCH 6
+#define LONG_DELAY 7
+#define WAIT 8
+
+#define PULSE_PROGRAM 0
+
+#define PB_EMU_MAX_INST 4096
+
+static struct {
+	double clock;           //MHz
+	int programming;
+	int num_inst;
+	int flags[PB_EMU_MAX_INST];
+	int inst[PB_EMU_MAX_INST];
+	int data[PB_EMU_MAX_INST];
+	double length[PB_EMU_MAX_INST];   //ns
+	const char *error;
+} pb_emu = { 100.0, 0, 0, {0}, {0}, {0}, {0}, "" };
+
+static inline const char *pb_emu_image_path(void)
+{
+	const char *path = getenv("PB_EMULATOR_IMAGE");
+
+	return path != NULL ? path : "pb_program.pbi";
+}
+
+static inline int pb_count_boards(void) { return 1; }
+static inline int pb_select_board(int board) { return board == 0 ? 0 : -1; }
+static inline int pb_init(void) { return 0; }
+static inline int pb_close(void) { return 0; }
+static inline int pb_set_debug(int debug) { (void) debug; return 0; }
+static inline const char *pb_get_error(void) { return pb_emu.error; }
+static inline void pb_core_clock(double clock) { pb_emu.clock = clock; }
+
+static inline int pb_start_programming(int device)
+{
+	if (device != PULSE_PROGRAM) {
+		pb_emu.error = "Only PULSE_PROGRAM is emulated";
+		return -1;
+	}
+	pb_emu.programming = 1;
+	pb_emu.num_inst = 0;
+	return 0;
+}
+
+/*
+ * Same checks as the board: 5 clock cycles minimum per instruction and
+ * room left in instruction memory. Returns the address like the real one.
+ */
+static inline int pb_inst(int flags, int inst, int inst_data, double length)
+{
+	int addr = pb_emu.num_inst;
+
+	if (!pb_emu.programming) {
+		pb_emu.error = "pb_inst called before pb_start_programming";
+		return -1;
+	}
+	if (addr >= PB_EMU_MAX_INST) {
+		pb_emu.error = "Program too long";
+		return -1;
+	}
+	if (length < 5 * 1000.0 / pb_emu.clock - 1e-6) {
+		pb_emu.error = "Instruction shorter than 5 clock cycles";
+		return -1;
+	}
+
+	pb_emu.flags[addr] = flags;
+	pb_emu.inst[addr] = inst;
+	pb_emu.data[addr] = inst_data;
+	pb_emu.length[addr] = length;
+	pb_emu.num_inst++;
+	return addr;
+}
+
+static inline int pb_stop_programming(void)
+{
+	FILE *fp;
+	int i;
+
+	if (!pb_emu.programming) {
+		return -1;
+	}
+	pb_emu.programming = 0;
+
+	fp = fopen(pb_emu_image_path(), "w");
+	if (fp == NULL) {
+		pb_emu.error = "Could not write program image";
+		return -1;
+	}
+	fprintf(fp, "PBIMAGE 1 %g %d\n", pb_emu.clock, pb_emu.num_inst);
+	for(i=0; i<pb_emu.num_inst; i++) {
+		fprintf(fp, "0x%06X\t%d\t%d\t%.6f\n", pb_emu.flags[i], pb_emu.inst[i],
+		        pb_emu.data[i], pb_emu.length[i]);
+	}
+	fclose(fp);
+	return 0;
+}
+
+//Running is NVSim's job, the board side just accepts the calls
+static inline int pb_reset(void) { return 0; }
+static inline int pb_start(void) { return 0; }
+static inline int pb_stop(void) { return 0; }
+static inline int pb_read_status(void) { return 0x8; }   //waiting for a trigger
+static inline const char *pb_status_message(void) { return "Emulated board"; }
+
+#endif
@@ -0,0 +1,76 @@
+/**
+ * \file FFT.h
+ *
+ *  Author: Sam Kim
+ *
+ *  In-place iterative radix-2 FFT on separate real/imaginary arrays.
+ *  Lengths must be powers of 2 (use fft_size to pad).
+ */
+
+#ifndef FFT_H
+#define FFT_H
+
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+//Smallest power of 2 >= n
+static inline int fft_size(int n)
+{
+	int size = 1;
+
+	while (size < n) {
+		size <<= 1;
+	}
+	return size;
+}
+
+/*
+ * Forward transform (sign -1) or unnormalized inverse (sign +1) of
+ * re + i*im, length n.
+ */
+static inline void fft(double *re, double *im, int n, int sign)
+{
+	int i, j, k, len, half;
+	double tr, ti, wr, wi, step_r, step_i, ang, tmp;
+
+	//bit reversal permutation
+	for(i=1, j=0; i<n; i++) {
+		k = n >> 1;
+		while (j & k) {
+			j ^= k;
+			k >>= 1;
+		}
+		j |= k;
+		if (i < j) {
+			tmp = re[i]; re[i] = re[j]; re[j] = tmp;
+			tmp = im[i]; im[i] = im[j]; im[j] = tmp;
+		}
+	}
+
+	for(len=2; len<=n; len<<=1) {
+		half = len >> 1;
+		ang = sign * 2 * M_PI / len;
+		step_r = cos(ang);
+		step_i = sin(ang);
+		for(i=0; i<n; i+=len) {
+			wr = 1;
+			wi = 0;
+			for(k=0; k<half; k++) {
+				tr = wr * re[i+k+half] - wi * im[i+k+half];
+				ti = wr * im[i+k+half] + wi * re[i+k+half];
+				re[i+k+half] = re[i+k] - tr;
+				im[i+k+half] = im[i+k] - ti;
+				re[i+k] += tr;
+				im[i+k] += ti;
+				tmp = wr * step_r - wi * step_i;
+				wi = wr * step_i + wi * step_r;
+				wr = tmp;
+			}
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,238 @@
+/**
+ * \file FilterFunction.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Filter functions of a dynamical decoupling sweep (SpinEchoBurn,
+ *  CPMGBurn, XY4Burn), taken straight from the compiled program so they
+ *  include the real pulse widths (window_time[5]) and timings, and
+ *  optionally the noise spectrum that explains a measured decay.
+ *
+ *  Reads a program image from an emulated burner (Emulator/spinapi.h,
+ *  burned without seed= so the points are in sweep order) and takes every
+ *  block of MW pulses as one sweep point, see FilterFunction.h for how the
+ *  blocks and their switching functions are found.
+ *
+ *  All sweep points are sampled on the same time step and zero padded to
+ *  the same FFT length, so they share one dense frequency grid.
+ *
+ *  Arg Description
+ *  1   Program image
+ *  2   MW channel mask
+ *  3   Time step (ns)
+ *  4   Zero padding factor (frequency grid is this much denser than 1/T)
+ *  5   Max frequency to write (MHz, 0 = Nyquist)
+ *  6   Output prefix: writes <prefix>_filter.txt (frequency, then F for
+ *      each sweep point) and <prefix>_peaks.txt (point, sequence length,
+ *      number of pulses, peak frequency)
+ *  7   Measured coherence file (optional): one value 0-1 per sweep point,
+ *      in sweep order. Writes <prefix>_spectrum.txt (frequency, S) from a
+ *      Tikhonov-regularized inversion of chi = K S with S binned at the
+ *      filter peaks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "PBImage.h"
+#include "FFT.h"
+#include "FilterFunction.h"
+#include "Fit.h"
+#include "Spreadsheet.h"
+
+#define REGULARIZATION 1e-3
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct pb_image img;
+	struct filter_collect col;
+	struct pb_walk walk;
+	double dt, f_max, df, *re, *im, *filter, *peaks, *bins, *edges;
+	double *decay = NULL, *chi, *kernel, *normal, *rhs, trace;
+	int pad, i, j, k, b, n, max_n, fft_n, num_freqs, num_bins;
+	int rows, cols, best;
+	char path[1024];
+	FILE *fp;
+
+	if (argc != 7 && argc != 8) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+
+	dt = atof(argv[3]);
+	pad = atoi(argv[4]);
+	f_max = atof(argv[5]);
+	if (dt <= 0 || pad < 1) {
+		printf("Time step and padding must be positive");
+		return -1;
+	}
+
+	if (read_pb_image(argv[1], &img) != 0) {
+		return -1;
+	}
+	filter_collect_init(&col, &img, (int) strtol(argv[2], NULL, 0));
+	memset(&walk, 0, sizeof(walk));
+	walk.max_outer = 1;
+	if (pb_image_walk(&img, &walk, filter_segment, &col) != 0 || col.failed) {
+		return -1;
+	}
+	if (col.num_seqs == 0) {
+		printf("No pulse sequences found (MW mask 0x%X)", col.mw_mask);
+		return -1;
+	}
+
+	max_n = 0;
+	for(k=0; k<col.num_seqs; k++) {
+		n = filter_samples(&col.seqs[k], dt);
+		if (n > max_n) max_n = n;
+	}
+	fft_n = fft_size(max_n * pad);
+	df = 1e3 / (fft_n * dt);    //MHz
+	num_freqs = fft_n / 2 + 1;
+	if (f_max > 0 && (int) (f_max / df) + 1 < num_freqs) {
+		num_freqs = (int) (f_max / df) + 1;
+	}
+
+	re = malloc(fft_n * sizeof(double));
+	im = malloc(fft_n * sizeof(double));
+	filter = malloc((size_t) num_freqs * col.num_seqs * sizeof(double));
+	peaks = malloc(col.num_seqs * sizeof(double));
+
+	//every sweep point on the same grid, F in us^2
+	for(k=0; k<col.num_seqs; k++) {
+		filter_function(&col.seqs[k], dt, fft_n, re, im);
+		best = 1;
+		for(j=0; j<num_freqs; j++) {
+			filter[(size_t) j * col.num_seqs + k] = re[j];
+			if (j > 0 && filter[(size_t) j * col.num_seqs + k]
+			             > filter[(size_t) best * col.num_seqs + k]) {
+				best = j;
+			}
+		}
+		peaks[k] = best * df;
+	}
+
+	snprintf(path, sizeof(path), "%s_filter.txt", argv[6]);
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		printf("Could not open %s", path);
+		return -1;
+	}
+	for(j=0; j<num_freqs; j++) {
+		fprintf(fp, "%g", j * df);
+		for(k=0; k<col.num_seqs; k++) {
+			fprintf(fp, "\t%.6g", filter[(size_t) j * col.num_seqs + k]);
+		}
+		fprintf(fp, "\n");
+	}
+	fclose(fp);
+
+	snprintf(path, sizeof(path), "%s_peaks.txt", argv[6]);
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		printf("Could not open %s", path);
+		return -1;
+	}
+	for(k=0; k<col.num_seqs; k++) {
+		fprintf(fp, "%d\t%g\t%d\t%g\n", k,
+		        col.seqs[k].end[col.seqs[k].num_pulses - 1] * 1e-3,
+		        col.seqs[k].num_pulses, peaks[k]);
+	}
+	fclose(fp);
+
+	if (argc == 8) {
+		decay = read_spreadsheet(argv[7], &rows, &cols);
+		if (decay == NULL) {
+			return -1;
+		}
+		if (rows * cols != col.num_seqs) {
+			printf("%d coherence values for %d sweep points", rows * cols, col.num_seqs);
+			return -1;
+		}
+
+		//S is binned at the filter peaks, bin edges halfway between them
+		bins = malloc(col.num_seqs * sizeof(double));
+		memcpy(bins, peaks, col.num_seqs * sizeof(double));
+		qsort(bins, col.num_seqs, sizeof(double), compare_double);
+		for(i=0, num_bins=0; i<col.num_seqs; i++) {
+			if (num_bins == 0 || bins[i] > bins[num_bins - 1]) {
+				bins[num_bins++] = bins[i];
+			}
+		}
+		edges = malloc((num_bins + 1) * sizeof(double));
+		edges[0] = 0;
+		for(b=1; b<num_bins; b++) {
+			edges[b] = (bins[b-1] + bins[b]) / 2;
+		}
+		edges[num_bins] = num_freqs * df;
+
+		chi = malloc(col.num_seqs * sizeof(double));
+		kernel = calloc((size_t) col.num_seqs * num_bins, sizeof(double));
+		for(k=0; k<col.num_seqs; k++) {
+			double c = decay[k];
+			if (c > 1) c = 1;
+			if (c < 1e-6) c = 1e-6;
+			chi[k] = -log(c);
+			for(j=1, b=0; j<num_freqs; j++) {
+				while (b < num_bins - 1 && j * df >= edges[b+1]) b++;
+				kernel[k * num_bins + b] += filter[(size_t) j * col.num_seqs + k] * df;
+			}
+		}
+
+		//(K^T K + lambda I) S = K^T chi
+		normal = calloc((size_t) num_bins * num_bins, sizeof(double));
+		rhs = calloc(num_bins, sizeof(double));
+		trace = 0;
+		for(i=0; i<num_bins; i++) {
+			for(k=0; k<col.num_seqs; k++) {
+				rhs[i] += kernel[k * num_bins + i] * chi[k];
+				for(j=0; j<num_bins; j++) {
+					normal[i * num_bins + j] += kernel[k * num_bins + i] * kernel[k * num_bins + j];
+				}
+			}
+			trace += normal[i * num_bins + i];
+		}
+		for(i=0; i<num_bins; i++) {
+			normal[i * num_bins + i] += REGULARIZATION * trace / num_bins;
+		}
+		if (fit_solve_rows(normal, num_bins, rhs, num_bins) != 0) {
+			printf("Could not invert the decay");
+			return -1;
+		}
+
+		snprintf(path, sizeof(path), "%s_spectrum.txt", argv[6]);
+		fp = fopen(path, "w");
+		if (fp == NULL) {
+			printf("Could not open %s", path);
+			return -1;
+		}
+		for(b=0; b<num_bins; b++) {
+			fprintf(fp, "%g\t%.6g\n", bins[b], rhs[b] > 0 ? rhs[b] : 0);
+		}
+		fclose(fp);
+
+		free(bins);
+		free(edges);
+		free(chi);
+		free(kernel);
+		free(normal);
+		free(rhs);
+		free(decay);
+	}
+
+	filter_collect_free(&col);
+	free(re);
+	free(im);
+	free(filter);
+	free(peaks);
+	return 0;
+}
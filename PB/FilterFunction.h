@@ -0,0 +1,271 @@
+/**
+ * \file FilterFunction.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Filter functions of the pulse blocks in a program image (PBImage.h),
+ *  for FilterFunction.exe and SequenceDesign.exe.
+ *
+ *  Walk the image with filter_segment to collect the blocks: every block
+ *  of MW pulses between two laser pulses is one sweep point. Only the MW
+ *  channels make pulses, and a block only ends at a channel that is never
+ *  on together with the MW (laser, counter gate), so a phase channel held
+ *  between pulses (XY4Burn's Y) stays inside the block. A block's switching
+ *  function y(t) starts at the first (pi/2) pulse and ends with the last
+ *  one, and changes sign across every pulse in between, following
+ *  cos(pi * fraction of the pulse) instead of jumping, so finite pi pulses
+ *  are included.
+ *
+ *  F(f) = |Y(f)|^2 with Y the Fourier transform of y (t in us, f in MHz),
+ *  so for noise with spectrum S(f) the decay is C = exp(-chi) with
+ *  chi = integral over f > 0 of S(f) F(f) df.
+ */
+
+#ifndef FILTER_FUNCTION_H
+#define FILTER_FUNCTION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "PBImage.h"
+#include "FFT.h"
+
+#define FILTER_MAX_PULSES 4096
+
+struct filter_sequence {
+	int num_pulses;
+	double *start, *end;     //ns, from the start of the first pulse
+};
+
+struct filter_collect {
+	int mw_mask;
+	int phase_mask;          //channels also on with the MW, e.g. the Y phase
+	double t;                //ns since the first pulse of this block
+	int in_block, in_pulse;
+	double pulse_start[FILTER_MAX_PULSES], pulse_end[FILTER_MAX_PULSES];
+	int num_pulses;
+	int failed;              //a block had too many pulses, or out of memory
+
+	struct filter_sequence *seqs;
+	int num_seqs, seqs_size;
+};
+
+//Every channel that is on together with the MW somewhere in the program
+static inline int filter_phase_channels(const struct pb_image *img, int mw_mask)
+{
+	int i, outputs, mask = 0;
+
+	for(i=0; i<img->num_inst; i++) {
+		outputs = pb_image_outputs(img->flags[i]);
+		if (outputs & mw_mask) {
+			mask |= outputs & ~mw_mask;
+		}
+	}
+	return mask;
+}
+
+//Ready to collect the blocks of img with MW channels mw_mask
+static inline void filter_collect_init(struct filter_collect *c, const struct pb_image *img,
+                                       int mw_mask)
+{
+	memset(c, 0, sizeof(*c));
+	c->mw_mask = mw_mask;
+	c->phase_mask = filter_phase_channels(img, mw_mask);
+}
+
+//Drops the blocks collected so far, to walk the program again
+static inline void filter_collect_clear(struct filter_collect *c)
+{
+	int k;
+
+	for(k=0; k<c->num_seqs; k++) {
+		free(c->seqs[k].start);
+		free(c->seqs[k].end);
+	}
+	c->num_seqs = 0;
+	c->in_block = 0;
+	c->in_pulse = 0;
+	c->num_pulses = 0;
+	c->t = 0;
+}
+
+static inline void filter_collect_free(struct filter_collect *c)
+{
+	filter_collect_clear(c);
+	free(c->seqs);
+	c->seqs = NULL;
+	c->seqs_size = 0;
+}
+
+static inline void filter_end_block(struct filter_collect *c)
+{
+	struct filter_sequence *s, *seqs;
+
+	if (c->num_pulses >= 2) {
+		if (c->num_seqs == c->seqs_size) {
+			c->seqs_size = c->seqs_size ? 2 * c->seqs_size : 64;
+			seqs = realloc(c->seqs, c->seqs_size * sizeof(struct filter_sequence));
+			if (seqs == NULL) {
+				c->failed = 1;
+				return;
+			}
+			c->seqs = seqs;
+		}
+		s = &c->seqs[c->num_seqs];
+		s->num_pulses = c->num_pulses;
+		s->start = malloc(c->num_pulses * sizeof(double));
+		s->end = malloc(c->num_pulses * sizeof(double));
+		if (s->start == NULL || s->end == NULL) {
+			free(s->start);
+			free(s->end);
+			c->failed = 1;
+			return;
+		}
+		memcpy(s->start, c->pulse_start, c->num_pulses * sizeof(double));
+		memcpy(s->end, c->pulse_end, c->num_pulses * sizeof(double));
+		c->num_seqs++;
+	}
+	c->in_block = 0;
+	c->in_pulse = 0;
+	c->num_pulses = 0;
+	c->t = 0;
+}
+
+//pb_segment_fn collecting the blocks of the first outer loop iteration
+static inline int filter_segment(void *ctx, int outputs, double length, int addr, int outer_iter)
+{
+	struct filter_collect *c = ctx;
+	int mw = (outputs & c->mw_mask) != 0;
+
+	(void) addr;
+	if (outer_iter > 0 || c->failed) {
+		return 1;
+	}
+
+	if (mw) {
+		if (!c->in_block) {
+			c->in_block = 1;
+			c->t = 0;
+		}
+		if (!c->in_pulse) {
+			if (c->num_pulses == FILTER_MAX_PULSES) {
+				printf("More than %d pulses in one sweep point", FILTER_MAX_PULSES);
+				c->failed = 1;
+				return 1;
+			}
+			c->pulse_start[c->num_pulses++] = c->t;
+			c->in_pulse = 1;
+		}
+		c->pulse_end[c->num_pulses - 1] = c->t + length;
+	}
+	else if (c->in_block && (outputs & ~c->phase_mask) != 0) {
+		//laser or counter on: this sweep point's pulses are done
+		filter_end_block(c);
+		return c->failed;
+	}
+	else {
+		c->in_pulse = 0;
+	}
+
+	if (c->in_block) {
+		c->t += length;
+	}
+	return 0;
+}
+
+//Samples of one sequence at time step dt ns
+static inline int filter_samples(const struct filter_sequence *s, double dt)
+{
+	return (int) ceil(s->end[s->num_pulses - 1] / dt);
+}
+
+/*
+ * Switching function of one sequence sampled every dt ns (midpoints).
+ * Returns the number of samples written to y.
+ */
+static inline int filter_switching(const struct filter_sequence *s, double dt, double *y)
+{
+	int n, i, p = 0, last = s->num_pulses - 1;
+	double t, frac, sign = 1;
+
+	n = filter_samples(s, dt);
+	for(i=0; i<n; i++) {
+		t = (i + 0.5) * dt;
+		while (p < last && t >= s->end[p]) {
+			if (p > 0) {
+				sign = -sign;    //through a refocusing pulse
+			}
+			p++;
+		}
+		if (t < s->start[p]) {
+			y[i] = sign;         //free evolution
+			continue;
+		}
+		frac = (t - s->start[p]) / (s->end[p] - s->start[p]);
+		if (frac > 1) frac = 1;
+		if (p == 0) {
+			y[i] = sin(M_PI / 2 * frac);         //opening pi/2
+		}
+		else if (p == last) {
+			y[i] = sign * cos(M_PI / 2 * frac);  //closing pi/2
+		}
+		else {
+			y[i] = sign * cos(M_PI * frac);      //pi pulse
+		}
+	}
+	return n;
+}
+
+/*
+ * F of one sequence at j / (fft_n dt) for j = 0 .. fft_n/2, in us^2, into
+ * re (im is scratch, both fft_n long; fft_n a power of 2 at least
+ * filter_samples).
+ */
+static inline void filter_function(const struct filter_sequence *s, double dt, int fft_n,
+                                   double *re, double *im)
+{
+	int j;
+
+	memset(re, 0, fft_n * sizeof(double));
+	memset(im, 0, fft_n * sizeof(double));
+	filter_switching(s, dt, re);
+	fft(re, im, fft_n, -1);
+	for(j=0; j<=fft_n/2; j++) {
+		re[j] = (re[j]*re[j] + im[j]*im[j]) * (dt * 1e-3) * (dt * 1e-3);
+	}
+}
+
+/*
+ * chi of one sequence for a spectrum given as rows of (f in MHz, S), sorted
+ * by f, such as FilterFunction's <prefix>_spectrum.txt: each S holds out to
+ * halfway to its neighbours, the first down to 0 and the last to Nyquist.
+ * F is taken at time step dt ns, zero padded pad times.
+ * Returns -1 if out of memory.
+ */
+static inline double filter_chi(const struct filter_sequence *s, double dt, int pad,
+                                const double *spectrum, int rows)
+{
+	int fft_n = fft_size(filter_samples(s, dt) * pad), j, b = 0;
+	double df = 1e3 / (fft_n * dt), chi = 0;
+	double *re = malloc(fft_n * sizeof(double)), *im = malloc(fft_n * sizeof(double));
+
+	if (re == NULL || im == NULL) {
+		free(re);
+		free(im);
+		return -1;
+	}
+	filter_function(s, dt, fft_n, re, im);
+	for(j=1; j<=fft_n/2; j++) {
+		while (b < rows - 1 && j * df >= (spectrum[2*b] + spectrum[2*b + 2]) / 2) {
+			b++;
+		}
+		chi += spectrum[2*b + 1] * re[j] * df;
+	}
+	free(re);
+	free(im);
+	return chi;
+}
+
+#endif
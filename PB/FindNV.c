@@ -0,0 +1,532 @@
+/**
+ * \file FindNV.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Called from LabVIEW after a confocal scan, finds the NV candidates that
+ *  used to be picked out by eye, and writes their stage coordinates in the
+ *  order they should be measured.
+ *
+ *  Detection is a difference of Gaussians: the image smoothed with the PSF
+ *  (matched filter for a diffraction limited spot) minus the image smoothed
+ *  three times wider (the local background, so uneven illumination or a
+ *  glowing surface doesn't matter). Candidates are local maxima of that
+ *  (non-maximum suppression over +-1 PSF sigma) more than <threshold> times
+ *  its robust noise (median absolute deviation) above its median.
+ *
+ *  For each candidate:
+ *      amplitude   counts per pixel at the peak above the background,
+ *                  from the DoG response of a PSF sized spot
+ *      background  counts per pixel around it
+ *      isolation   distance (um) to the nearest other spot, including ones
+ *                  too dim to be candidates
+ *      width       spot size over the PSF's, from how the response falls
+ *                  off between the PSF and twice its width; clusters and
+ *                  dust come out wider and are dropped above maxwidth=
+ *      score       amplitude * min(1, isolation / minsep), the ranking
+ *  Position is refined to a fraction of a pixel by a parabola through the
+ *  peak and its neighbours.
+ *
+ *  Usage:
+ *  FindNV <image> <output> <z slice> <PSF FWHM um> <threshold> <max NVs>
+ *         [options]
+ *      image    tile store (TileStore.exe) or a spreadsheet of counts
+ *      z slice  -1 = every slice; a spot seen in several slices is kept
+ *               once, at the slice where it is brightest (focus)
+ *      threshold  in noise sigmas, 5 is a good start
+ *  Options, name=value:
+ *      minsep=D    isolation (um) that counts as fully isolated (default
+ *                  2 PSF FWHM)
+ *      maxwidth=F  largest width / PSF width kept (default 1.5)
+ *      level=L     pyramid level to search (default: the coarsest that
+ *                  still has 1.5 pixels per PSF sigma)
+ *      xy=x0,x1,y0,y1  stage coordinates of the first/last pixel, for
+ *                  spreadsheets (tile stores have their own)
+ *
+ *  Output, one NV per row, best first:
+ *  x (um), y (um), z (um), amplitude, background, isolation (um), width,
+ *  score
+ *  Prints the number of rows written, the number of candidates and the
+ *  level searched.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "TileStore.h"
+#include "Spreadsheet.h"
+
+#define BACKGROUND_SCALE 3.0    //background sigma / PSF sigma
+#define MIN_SIGMA_PIXELS 1.5
+#define NOISE_SAMPLES 1000000
+#define DIM_FRACTION 0.3        //spots counted for isolation, of the threshold
+
+struct image {
+	int width, height;
+	float *counts;
+	double x0, dx, y0, dy;      //stage position of pixel 0 and per pixel
+};
+
+struct candidate {
+	double x, y, z;             //um
+	double amplitude, background, isolation, width, score;
+	int slice;
+};
+
+struct candidate_list {
+	struct candidate *c;
+	int n, size;
+};
+
+static void list_push(struct candidate_list *list, const struct candidate *c)
+{
+	if (list->n == list->size) {
+		list->size = list->size ? 2 * list->size : 256;
+		list->c = realloc(list->c, list->size * sizeof(struct candidate));
+	}
+	list->c[list->n++] = *c;
+}
+
+static float *gauss_kernel(double sigma, int *radius)
+{
+	int i, r = (int) ceil(3 * sigma);
+	float *k = malloc((2 * r + 1) * sizeof(float));
+	double sum = 0;
+
+	for(i=-r; i<=r; i++) {
+		k[i + r] = (float) exp(-0.5 * i * i / (sigma * sigma));
+		sum += k[i + r];
+	}
+	for(i=0; i<2*r+1; i++) {
+		k[i] /= (float) sum;
+	}
+	*radius = r;
+	return k;
+}
+
+/*
+ * Separable Gaussian blur, edges replicated. Both passes run along whole
+ * rows (the column pass adds weighted rows), so the inner loops are
+ * contiguous and the compiler vectorizes them.
+ */
+static void gauss_blur(const float *in, float *out, float *tmp, int w, int h, double sigma)
+{
+	int r, x, y, i, yy;
+	float *k = gauss_kernel(sigma, &r), *row = malloc((w + 2 * r) * sizeof(float));
+	const float *src;
+	float *dst, kv;
+
+	//rows: pad the row, then a straight dot product per pixel
+	for(y=0; y<h; y++) {
+		src = in + (size_t) y * w;
+		for(i=0; i<r; i++) {
+			row[i] = src[0];
+			row[w + r + i] = src[w - 1];
+		}
+		memcpy(row + r, src, w * sizeof(float));
+		dst = tmp + (size_t) y * w;
+		memset(dst, 0, w * sizeof(float));
+		for(i=0; i<=2*r; i++) {
+			kv = k[i];
+			for(x=0; x<w; x++) {
+				dst[x] += kv * row[x + i];
+			}
+		}
+	}
+	//columns: out row y = sum of weighted tmp rows
+	for(y=0; y<h; y++) {
+		dst = out + (size_t) y * w;
+		memset(dst, 0, w * sizeof(float));
+		for(i=-r; i<=r; i++) {
+			yy = y + i < 0 ? 0 : (y + i >= h ? h - 1 : y + i);
+			src = tmp + (size_t) yy * w;
+			kv = k[i + r];
+			for(x=0; x<w; x++) {
+				dst[x] += kv * src[x];
+			}
+		}
+	}
+	free(k);
+	free(row);
+}
+
+//Running max over +-r, rows then columns (separable)
+static void max_filter(const float *in, float *out, float *tmp, int w, int h, int r)
+{
+	int x, y, i, lo, hi;
+	float m;
+
+	for(y=0; y<h; y++) {
+		for(x=0; x<w; x++) {
+			lo = x - r < 0 ? 0 : x - r;
+			hi = x + r >= w ? w - 1 : x + r;
+			m = in[(size_t) y * w + lo];
+			for(i=lo+1; i<=hi; i++) {
+				if (in[(size_t) y * w + i] > m) m = in[(size_t) y * w + i];
+			}
+			tmp[(size_t) y * w + x] = m;
+		}
+	}
+	for(y=0; y<h; y++) {
+		lo = y - r < 0 ? 0 : y - r;
+		hi = y + r >= h ? h - 1 : y + r;
+		memcpy(out + (size_t) y * w, tmp + (size_t) lo * w, w * sizeof(float));
+		for(i=lo+1; i<=hi; i++) {
+			for(x=0; x<w; x++) {
+				if (tmp[(size_t) i * w + x] > out[(size_t) y * w + x]) {
+					out[(size_t) y * w + x] = tmp[(size_t) i * w + x];
+				}
+			}
+		}
+	}
+}
+
+static int compare_float(const void *a, const void *b)
+{
+	float fa = *(const float *) a, fb = *(const float *) b;
+
+	return fa < fb ? -1 : (fa > fb ? 1 : 0);
+}
+
+static int compare_score(const void *a, const void *b)
+{
+	double sa = ((const struct candidate *) a)->score;
+	double sb = ((const struct candidate *) b)->score;
+
+	return sa > sb ? -1 : (sa < sb ? 1 : 0);
+}
+
+//Median and MAD (as a Gaussian sigma) of a subsample
+static void robust_noise(const float *v, size_t n, double *median, double *sigma)
+{
+	size_t step = n / NOISE_SAMPLES + 1, m = 0, i;
+	float *s = malloc((n / step + 1) * sizeof(float));
+
+	for(i=0; i<n; i+=step) {
+		s[m++] = v[i];
+	}
+	qsort(s, m, sizeof(float), compare_float);
+	*median = s[m / 2];
+	for(i=0; i<m; i++) {
+		s[i] = (float) fabs(s[i] - *median);
+	}
+	qsort(s, m, sizeof(float), compare_float);
+	*sigma = 1.4826 * s[m / 2];
+	free(s);
+}
+
+/*
+ * Spot width over the PSF width, from the ratio of the responses with the
+ * smoothing at 2 and at 1 PSF sigma (background at BACKGROUND_SCALE). For
+ * a Gaussian spot, smoothing with a multiplies the peak by q / (q + a^2),
+ * q = (spot sigma / PSF sigma)^2, and the ratio grows with q.
+ */
+static double width_from_ratio(double ratio)
+{
+	double lo = 0.01, hi = 100, q = 1, b = BACKGROUND_SCALE * BACKGROUND_SCALE, d1, d2;
+	int i;
+
+	for(i=0; i<50; i++) {
+		q = sqrt(lo * hi);
+		d1 = q / (q + 1) - q / (q + b);
+		d2 = q / (q + 4) - q / (q + b);
+		if (d2 / d1 < ratio) {
+			lo = q;
+		}
+		else {
+			hi = q;
+		}
+	}
+	return sqrt(q);
+}
+
+//Vertex of the parabola through f(-1), f(0), f(1)
+static double parabola_peak(double fm, double f0, double fp)
+{
+	double d = fm - 2 * f0 + fp;
+
+	return d < 0 ? 0.5 * (fm - fp) / d : 0;
+}
+
+/*
+ * Finds the candidates of one image; sigma is the PSF sigma in pixels.
+ * Spots above the dim threshold (for isolation) go to dim.
+ */
+static void find_spots(const struct image *im, double sigma, double threshold, double z,
+                       int slice, struct candidate_list *found, struct candidate_list *dim)
+{
+	int w = im->width, h = im->height, x, y;
+	size_t n = (size_t) w * h, p;
+	float *smooth = malloc(n * sizeof(float)), *back = malloc(n * sizeof(float));
+	float *wide = malloc(n * sizeof(float));
+	float *tmp = malloc(n * sizeof(float)), *peaks = malloc(n * sizeof(float));
+	double median, noise, response, dx, dy;
+	//DoG response of a PSF sized spot of amplitude 1 (s = sigma)
+	double gain = 0.5 - 1 / (1 + BACKGROUND_SCALE * BACKGROUND_SCALE);
+	struct candidate c;
+
+	gauss_blur(im->counts, smooth, tmp, w, h, sigma);
+	gauss_blur(im->counts, wide, tmp, w, h, 2 * sigma);
+	gauss_blur(im->counts, back, tmp, w, h, BACKGROUND_SCALE * sigma);
+	//wide and back become the responses at 2 and 1 PSF sigma
+	for(p=0; p<n; p++) {
+		wide[p] -= back[p];
+		back[p] = smooth[p] - back[p];
+	}
+	robust_noise(back, n, &median, &noise);
+	max_filter(back, peaks, tmp, w, h, (int) ceil(sigma));
+
+	for(y=1; y<h-1; y++) {
+		for(x=1; x<w-1; x++) {
+			p = (size_t) y * w + x;
+			response = back[p] - median;
+			if (back[p] != peaks[p] || response <= DIM_FRACTION * threshold * noise) {
+				continue;
+			}
+			memset(&c, 0, sizeof(c));
+			dx = parabola_peak(back[p - 1], back[p], back[p + 1]);
+			dy = parabola_peak(back[p - w], back[p], back[p + w]);
+			c.x = im->x0 + (x + dx) * im->dx;
+			c.y = im->y0 + (y + dy) * im->dy;
+			c.z = z;
+			c.slice = slice;
+			c.amplitude = response / gain;
+			list_push(dim, &c);
+			if (response <= threshold * noise) {
+				continue;
+			}
+
+			c.background = smooth[p] - c.amplitude / 2;
+			c.width = width_from_ratio(wide[p] / back[p]);
+			list_push(found, &c);
+		}
+	}
+	free(smooth);
+	free(wide);
+	free(back);
+	free(tmp);
+	free(peaks);
+}
+
+//Loads slice z of a level of a tile store
+static int load_slice(const struct tile_store *ts, int level, int z, struct image *im)
+{
+	const struct tile_header *h = ts->h;
+	const struct tile_level *lv = &h->level[level];
+	unsigned int *counts;
+	size_t n = (size_t) lv->width * lv->height, p;
+
+	im->width = lv->width;
+	im->height = lv->height;
+	im->counts = malloc(n * sizeof(float));
+	counts = malloc(n * sizeof(unsigned int));
+	if (im->counts == NULL || counts == NULL) {
+		printf("Out of memory");
+		free(counts);
+		return -1;
+	}
+	tile_store_region(ts, level, z, 0, 0, lv->width, lv->height, counts);
+	for(p=0; p<n; p++) {
+		im->counts[p] = (float) counts[p];
+	}
+	free(counts);
+	//pixel i of level l covers level 0 pixels i*2^l .. i*2^l + 2^l - 1
+	im->dx = h->width > 1 ? (h->x_max - h->x_min) / (h->width - 1) : 0;
+	im->dy = h->height > 1 ? (h->y_max - h->y_min) / (h->height - 1) : 0;
+	im->x0 = h->x_min + im->dx * ((1 << level) - 1) / 2.0;
+	im->y0 = h->y_min + im->dy * ((1 << level) - 1) / 2.0;
+	im->dx *= 1 << level;
+	im->dy *= 1 << level;
+	return 0;
+}
+
+static int is_tile_store(const char *path)
+{
+	char magic[8];
+	FILE *fp = fopen(path, "rb");
+	int yes;
+
+	if (fp == NULL) {
+		return 0;
+	}
+	yes = fread(magic, 1, 8, fp) == 8 && memcmp(magic, TILE_MAGIC, 8) == 0;
+	fclose(fp);
+	return yes;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tile_store ts;
+	struct image im;
+	struct candidate_list found = { NULL, 0, 0 }, dim = { NULL, 0, 0 }, kept = { NULL, 0, 0 };
+	struct candidate *c;
+	double fwhm, threshold, minsep = -1, maxwidth = 1.5, xy[4] = { 0, 0, 0, 0 };
+	double sigma0, sigma, pixel, d, d2, zstep = 0;
+	double *out;
+	int z, z_first, z_last, max_nv, level = -1, depth = 1, store, i, j, rows, cols, status;
+
+	if (argc < 7) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	memset(&im, 0, sizeof(im));
+	z = atoi(argv[3]);
+	fwhm = atof(argv[4]);
+	threshold = atof(argv[5]);
+	max_nv = atoi(argv[6]);
+	for(i=7; i<argc; i++) {
+		if (strncmp(argv[i], "minsep=", 7) == 0) {
+			minsep = atof(argv[i] + 7);
+		}
+		else if (strncmp(argv[i], "maxwidth=", 9) == 0) {
+			maxwidth = atof(argv[i] + 9);
+		}
+		else if (strncmp(argv[i], "level=", 6) == 0) {
+			level = atoi(argv[i] + 6);
+		}
+		else if (strncmp(argv[i], "xy=", 3) == 0) {
+			if (sscanf(argv[i] + 3, "%lf,%lf,%lf,%lf", &xy[0], &xy[1], &xy[2], &xy[3]) != 4) {
+				printf("Bad option %s", argv[i]);
+				return -1;
+			}
+		}
+		else {
+			printf("Unknown option %s", argv[i]);
+			return -1;
+		}
+	}
+	if (fwhm <= 0 || threshold <= 0 || max_nv < 1) {
+		printf("Bad arguments");
+		return -1;
+	}
+	if (minsep <= 0) {
+		minsep = 2 * fwhm;
+	}
+
+	store = is_tile_store(argv[1]);
+	if (store) {
+		if (tile_store_open(argv[1], &ts) != 0) {
+			return -1;
+		}
+		depth = ts.h->depth;
+		pixel = ts.h->width > 1 ? fabs(ts.h->x_max - ts.h->x_min) / (ts.h->width - 1) : 0;
+		zstep = depth > 1 ? (ts.h->z_max - ts.h->z_min) / (depth - 1) : 0;
+	}
+	else {
+		out = read_spreadsheet(argv[1], &rows, &cols);
+		if (out == NULL) {
+			return -1;
+		}
+		im.width = cols;
+		im.height = rows;
+		im.counts = malloc((size_t) rows * cols * sizeof(float));
+		for(i=0; i<rows*cols; i++) {
+			im.counts[i] = (float) out[i];
+		}
+		free(out);
+		im.x0 = xy[0];
+		im.y0 = xy[2];
+		im.dx = cols > 1 ? (xy[1] - xy[0]) / (cols - 1) : 0;
+		im.dy = rows > 1 ? (xy[3] - xy[2]) / (rows - 1) : 0;
+		pixel = fabs(im.dx);
+	}
+	if (pixel <= 0) {
+		printf("No pixel size (xy= for spreadsheets)");
+		return -1;
+	}
+	sigma0 = fwhm / 2.3548 / pixel;
+
+	if (store) {
+		//coarsest level that still resolves the PSF
+		if (level < 0) {
+			for(level=0; level+1<(int) ts.h->levels
+			             && sigma0 / (1 << (level + 1)) >= MIN_SIGMA_PIXELS; level++);
+		}
+		if (level >= (int) ts.h->levels) {
+			printf("No level %d", level);
+			return -1;
+		}
+	}
+	else {
+		level = 0;
+	}
+	sigma = sigma0 / (1 << level);
+
+	z_first = z < 0 ? 0 : z;
+	z_last = z < 0 ? depth - 1 : z;
+	if (z_last >= depth) {
+		printf("No slice %d", z);
+		return -1;
+	}
+	for(z=z_first; z<=z_last; z++) {
+		if (store && load_slice(&ts, level, z, &im) != 0) {
+			return -1;
+		}
+		find_spots(&im, sigma, threshold, store ? ts.h->z_min + zstep * z : 0, z,
+		           &found, &dim);
+		free(im.counts);
+	}
+
+	//the same spot in several slices: keep it where it is brightest
+	for(i=0; i<found.n; i++) {
+		c = &found.c[i];
+		c->score = c->amplitude;
+	}
+	qsort(found.c, found.n, sizeof(struct candidate), compare_score);
+	for(i=0; i<found.n; i++) {
+		c = &found.c[i];
+		for(j=0; j<kept.n; j++) {
+			d = hypot(kept.c[j].x - c->x, kept.c[j].y - c->y);
+			if (d < fwhm && kept.c[j].slice != c->slice) {
+				break;
+			}
+		}
+		if (j == kept.n && c->width <= maxwidth) {
+			list_push(&kept, c);
+		}
+	}
+
+	//isolation from everything above the dim threshold, in any slice
+	for(i=0; i<kept.n; i++) {
+		c = &kept.c[i];
+		d = 1e30;
+		for(j=0; j<dim.n; j++) {
+			d2 = hypot(dim.c[j].x - c->x, dim.c[j].y - c->y);
+			if (d2 > fwhm / 2 && d2 < d) {
+				d = d2;
+			}
+		}
+		c->isolation = d;
+		c->score = c->amplitude * (d < minsep ? d / minsep : 1);
+	}
+	qsort(kept.c, kept.n, sizeof(struct candidate), compare_score);
+
+	rows = kept.n < max_nv ? kept.n : max_nv;
+	out = malloc((rows > 0 ? rows : 1) * 8 * sizeof(double));
+	for(i=0; i<rows; i++) {
+		c = &kept.c[i];
+		out[i*8] = c->x;
+		out[i*8 + 1] = c->y;
+		out[i*8 + 2] = c->z;
+		out[i*8 + 3] = c->amplitude;
+		out[i*8 + 4] = c->background;
+		out[i*8 + 5] = c->isolation < 1e29 ? c->isolation : -1;
+		out[i*8 + 6] = c->width;
+		out[i*8 + 7] = c->score;
+	}
+	status = write_spreadsheet(argv[2], out, rows, 8);
+	if (status == 0) {
+		printf("%d\t%d\t%d\n", rows, kept.n, level);
+	}
+
+	free(out);
+	free(found.c);
+	free(dim.c);
+	free(kept.c);
+	if (store) {
+		tile_store_close(&ts);
+	}
+	return status;
+}
@@ -0,0 +1,288 @@
+/**
+ * \file Fit.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Small weighted Levenberg-Marquardt fitter for the pulsed experiment
+ *  curves, with the parameter covariance so we get error bars on the
+ *  number we actually care about (pi time, T2, resonance frequency).
+ *
+ *  Models (x in the sweep units, y = contrast):
+ *  FIT_RABI   y = a + b*cos(pi*x/t_pi)          params a, b, t_pi
+ *  FIT_DECAY  y = a + b*exp(-x/T2)              params a, b, T2
+ *  FIT_ESR    y = a - b/(1 + (2(x-f0)/w)^2)     params a, b, f0, w
+ */
+
+#ifndef FIT_H
+#define FIT_H
+
+#include <math.h>
+#include <string.h>
+
+#define FIT_MAX_PARAMS 4
+#define FIT_MAX_ITER 100
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+enum fit_model { FIT_RABI, FIT_DECAY, FIT_ESR };
+
+struct fit_result {
+	int num_params;
+	double p[FIT_MAX_PARAMS];
+	double err[FIT_MAX_PARAMS];   //1 sigma, scaled by reduced chi^2 if > 1
+	double chi2;                  //reduced
+	int key;                      //index of t_pi, T2 or f0 in p
+	int ok;
+};
+
+static inline int fit_num_params(enum fit_model model)
+{
+	return model == FIT_ESR ? 4 : 3;
+}
+
+static inline double fit_eval(enum fit_model model, const double *p, double x)
+{
+	double d;
+
+	switch (model) {
+	case FIT_RABI:
+		return p[0] + p[1] * cos(M_PI * x / p[2]);
+	case FIT_DECAY:
+		return p[0] + p[1] * exp(-x / p[2]);
+	case FIT_ESR:
+		d = 2 * (x - p[2]) / p[3];
+		return p[0] - p[1] / (1 + d*d);
+	}
+	return 0;
+}
+
+/*
+ * Starting values from the data itself, so the fit can run unattended
+ * after every chunk.
+ */
+static inline void fit_guess(enum fit_model model, const double *x, const double *y,
+                             int n, double *p)
+{
+	int i, imin = 0, best;
+	double mean = 0, ymin = y[0], ymax = y[0], half, t, re, im, amp, best_amp;
+
+	for(i=0; i<n; i++) {
+		mean += y[i] / n;
+		if (y[i] < ymin) { ymin = y[i]; imin = i; }
+		if (y[i] > ymax) { ymax = y[i]; }
+	}
+
+	memset(p, 0, fit_num_params(model) * sizeof(double));
+	switch (model) {
+	case FIT_RABI:
+		//dominant period from a coarse DFT over the sweep
+		p[0] = mean;
+		p[1] = y[0] > mean ? (ymax - ymin) / 2 : -(ymax - ymin) / 2;
+		best = 1;
+		best_amp = -1;
+		for(i=1; i<n; i++) {
+			int k;
+			t = (x[n-1] - x[0]) / i;   //trial period
+			re = im = 0;
+			for(k=0; k<n; k++) {
+				re += (y[k] - mean) * cos(2 * M_PI * (x[k] - x[0]) / t);
+				im += (y[k] - mean) * sin(2 * M_PI * (x[k] - x[0]) / t);
+			}
+			amp = re*re + im*im;
+			if (amp > best_amp) {
+				best_amp = amp;
+				best = i;
+			}
+		}
+		p[2] = (x[n-1] - x[0]) / best / 2;
+		break;
+	case FIT_DECAY:
+		p[0] = y[n-1];
+		p[1] = y[0] - y[n-1];
+		half = p[0] + p[1] / M_E;
+		p[2] = (x[n-1] - x[0]) / 3;
+		for(i=0; i<n; i++) {
+			if ((p[1] > 0 && y[i] < half) || (p[1] < 0 && y[i] > half)) {
+				p[2] = x[i] - x[0] > 0 ? x[i] - x[0] : p[2];
+				break;
+			}
+		}
+		break;
+	case FIT_ESR:
+		p[0] = ymax;
+		p[1] = ymax - ymin;
+		p[2] = x[imin];
+		p[3] = (x[n-1] - x[0]) / 10;
+		//width from the half-depth crossings around the dip
+		half = ymax - p[1] / 2;
+		for(i=imin; i<n && y[i] < half; i++);
+		for(best=imin; best>0 && y[best] < half; best--);
+		if (i < n && x[i] > x[best]) {
+			p[3] = x[i] - x[best];
+		}
+		break;
+	}
+}
+
+/*
+ * Solves a*x = b in place, a being n x n with rows stride doubles apart.
+ * Returns -1 if singular. Also used for the larger systems outside the
+ * curve fits (FilterFunction).
+ */
+static inline int fit_solve_rows(double *a, int stride, double *b, int n)
+{
+	int i, j, k, piv;
+	double tmp, f;
+
+	for(i=0; i<n; i++) {
+		piv = i;
+		for(j=i+1; j<n; j++) {
+			if (fabs(a[j*stride + i]) > fabs(a[piv*stride + i])) piv = j;
+		}
+		if (fabs(a[piv*stride + i]) < 1e-300) {
+			return -1;
+		}
+		for(k=0; k<n; k++) {
+			tmp = a[i*stride + k]; a[i*stride + k] = a[piv*stride + k]; a[piv*stride + k] = tmp;
+		}
+		tmp = b[i]; b[i] = b[piv]; b[piv] = tmp;
+		for(j=i+1; j<n; j++) {
+			f = a[j*stride + i] / a[i*stride + i];
+			for(k=i; k<n; k++) a[j*stride + k] -= f * a[i*stride + k];
+			b[j] -= f * b[i];
+		}
+	}
+	for(i=n-1; i>=0; i--) {
+		for(k=i+1; k<n; k++) b[i] -= a[i*stride + k] * b[k];
+		b[i] /= a[i*stride + i];
+	}
+	return 0;
+}
+
+//Solves a*x = b in place (n <= FIT_MAX_PARAMS). Returns -1 if singular.
+static inline int fit_solve(double a[FIT_MAX_PARAMS][FIT_MAX_PARAMS], double *b,
+                            int n)
+{
+	return fit_solve_rows(&a[0][0], FIT_MAX_PARAMS, b, n);
+}
+
+static inline double fit_chi2(enum fit_model model, const double *p, const double *x,
+                              const double *y, const double *sigma, int n)
+{
+	int i;
+	double r, chi2 = 0;
+
+	for(i=0; i<n; i++) {
+		r = (y[i] - fit_eval(model, p, x[i])) / sigma[i];
+		chi2 += r*r;
+	}
+	return chi2;
+}
+
+/*
+ * Fits y(x) with 1-sigma errors sigma. If guess is NULL the starting values
+ * come from fit_guess. Returns 0 and fills res, or -1 if the fit failed.
+ */
+static inline int fit_curve(enum fit_model model, const double *x, const double *y,
+                            const double *sigma, int n, const double *guess,
+                            struct fit_result *res)
+{
+	int np = fit_num_params(model);
+	int i, j, k, iter;
+	double p[FIT_MAX_PARAMS], trial[FIT_MAX_PARAMS], step[FIT_MAX_PARAMS];
+	double jac[FIT_MAX_PARAMS];
+	double alpha[FIT_MAX_PARAMS][FIT_MAX_PARAMS], beta[FIT_MAX_PARAMS];
+	double a[FIT_MAX_PARAMS][FIT_MAX_PARAMS];
+	double lambda = 1e-3, chi2, new_chi2, h, r, w;
+
+	memset(res, 0, sizeof(*res));
+	res->num_params = np;
+	res->key = 2;
+	if (n <= np) {
+		return -1;
+	}
+
+	if (guess != NULL) {
+		memcpy(p, guess, np * sizeof(double));
+	}
+	else {
+		fit_guess(model, x, y, n, p);
+	}
+	chi2 = fit_chi2(model, p, x, y, sigma, n);
+
+	for(iter=0; iter<FIT_MAX_ITER; iter++) {
+		//normal equations with a forward-difference Jacobian
+		memset(alpha, 0, sizeof(alpha));
+		memset(beta, 0, sizeof(beta));
+		for(i=0; i<n; i++) {
+			double f0 = fit_eval(model, p, x[i]);
+			for(j=0; j<np; j++) {
+				memcpy(trial, p, sizeof(p));
+				h = 1e-6 * (fabs(p[j]) + 1e-12);
+				trial[j] += h;
+				jac[j] = (fit_eval(model, trial, x[i]) - f0) / h;
+			}
+			w = 1 / (sigma[i] * sigma[i]);
+			r = y[i] - f0;
+			for(j=0; j<np; j++) {
+				beta[j] += w * r * jac[j];
+				for(k=0; k<np; k++) alpha[j][k] += w * jac[j] * jac[k];
+			}
+		}
+
+		do {
+			memcpy(a, alpha, sizeof(a));
+			for(j=0; j<np; j++) {
+				a[j][j] *= 1 + lambda;
+				step[j] = beta[j];
+			}
+			if (fit_solve(a, step, np) != 0) {
+				return -1;
+			}
+			for(j=0; j<np; j++) trial[j] = p[j] + step[j];
+			new_chi2 = fit_chi2(model, trial, x, y, sigma, n);
+			if (new_chi2 >= chi2 || new_chi2 != new_chi2) {
+				lambda *= 10;
+			}
+		} while ((new_chi2 >= chi2 || new_chi2 != new_chi2) && lambda < 1e10);
+
+		if (lambda >= 1e10) {
+			break;  //no downhill step left, converged
+		}
+		memcpy(p, trial, sizeof(p));
+		lambda /= 10;
+		if (chi2 - new_chi2 < 1e-8 * chi2) {
+			chi2 = new_chi2;
+			break;
+		}
+		chi2 = new_chi2;
+	}
+
+	//covariance = alpha^-1, one column at a time
+	for(j=0; j<np; j++) {
+		memcpy(a, alpha, sizeof(a));
+		memset(step, 0, sizeof(step));
+		step[j] = 1;
+		if (fit_solve(a, step, np) != 0) {
+			return -1;
+		}
+		res->err[j] = sqrt(fabs(step[j]));
+	}
+
+	res->chi2 = chi2 / (n - np);
+	for(j=0; j<np; j++) {
+		res->p[j] = p[j];
+		if (res->chi2 > 1) {
+			res->err[j] *= sqrt(res->chi2);
+		}
+	}
+	if (model != FIT_ESR) {
+		res->p[2] = fabs(res->p[2]);
+	}
+	res->ok = 1;
+	return 0;
+}
+
+#endif
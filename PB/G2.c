@@ -0,0 +1,531 @@
+/**
+ * \file G2.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Photon correlations from time tags (TimeTags.h), streaming and in fixed
+ *  memory, to check for a single NV before starting a long Rabi/echo run.
+ *
+ *  - Short lags (g2, antibunching): start-stop histogram of the delay
+ *    between every pair of tags within <range> of each other, A to B for
+ *    two detectors (HBT, no dead time problem), or each detector with
+ *    itself for one. Normalized by the coincidences expected from the
+ *    count rates, so g2 -> 1 at long delays, 0 at zero delay for an ideal
+ *    single emitter and 1 - 1/N for N.
+ *  - Long lags (blinking, shelving): multi-tau correlator on the counts
+ *    binned to <base bin>. Each level holds 16 lags and halves its time
+ *    resolution, so <levels> levels cover base bin * 8 * 2^levels with
+ *    constant work per tag.
+ *
+ *  Results are rewritten about once a second while tags come in, and
+ *  at the end:
+ *  <prefix>_g2.txt      delay (ns), g2, coincidences
+ *  <prefix>_fcs.txt     lag (s), g (negative lags are B before A)
+ *  <prefix>_summary.txt name/value: g2(0), its error, rates, tags/s
+ *  The summary is also printed at the end.
+ *
+ *  Usage:
+ *  G2 <tag file> <prefix> <channels> <bin ns> <range ns> <base bin us> <levels>
+ *      Tags from a file; waits for more at the end until <file>.done exists.
+ *      Channels 1: tags on detector 0 only. 2: detectors 0 (A) and 1 (B).
+ *  G2 synth <prefix> <channels> <bin ns> <range ns> <base bin us> <levels>
+ *           <synthetic source args> <duration s>
+ *      Tags from the synthetic source.
+ *  G2 gen <tag file> <channels> <synthetic source args> <duration s>
+ *      Writes synthetic tags to a file (then <file>.done).
+ *
+ *  Synthetic source args: emitters, excitation rate (MHz), lifetime (ns),
+ *  detection efficiency, background (counts/s per detector), shelving
+ *  probability per emission, dark state lifetime (us), random seed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "TimeTags.h"
+#include "Clock.h"
+#include "AtomicWrite.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#define g2_sleep() Sleep(20)
+#else
+#include <unistd.h>
+#define g2_sleep() usleep(20000)
+#endif
+
+#define READ_BLOCK 65536
+#define RECENT_TAGS 4096        //per detector, within the histogram range
+#define LAGS 16                 //per multi-tau level
+#define MAX_LEVELS 40
+#define SYNTH_ARGS 8
+
+//Start-stop histogram over -range..range
+struct histogram {
+	double bin_ps;
+	long long range_ps;
+	int half;                   //bins per side
+	unsigned long long *counts; //2*half bins, bin half is delay 0..bin
+	unsigned long long recent[2][RECENT_TAGS];
+	int first[2], num[2];       //ring of recent tags per detector
+	unsigned long long overflow;
+};
+
+//Multi-tau correlator of the counts of A (delayed) against B, and B against A
+struct level {
+	double delay[2][LAGS];      //counts of A and B, newest at pos
+	int pos, filled;
+	double corr[2][LAGS];       //sum of A(t-lag) B(t), sum of B(t-lag) A(t)
+	double sum[2];
+	double bins;
+	double carry[2];            //first half of the next level's bin
+	int carried;
+};
+
+struct multitau {
+	double base_ps;
+	int levels;
+	struct level level[MAX_LEVELS];
+	long long bin;              //current base bin
+	double counts[2];
+	int mirror;                 //one detector: B is A
+};
+
+struct g2 {
+	int channels;
+	struct histogram hist;
+	struct multitau tau;
+	unsigned long long tags[2];
+	unsigned long long first_ps, last_ps;
+	int started;
+};
+
+static int hist_init(struct histogram *h, double bin_ns, double range_ns)
+{
+	memset(h, 0, sizeof(*h));
+	h->bin_ps = bin_ns * 1e3;
+	h->half = (int) ceil(range_ns / bin_ns);
+	h->range_ps = (long long) (h->half * h->bin_ps);
+	if (h->half < 1 || h->half > 10000000) {
+		return -1;
+	}
+	h->counts = calloc(2 * h->half, sizeof(unsigned long long));
+	return h->counts == NULL ? -1 : 0;
+}
+
+static void hist_add(struct histogram *h, long long delay)
+{
+	long long bin = (long long) floor(delay / h->bin_ps) + h->half;
+
+	if (bin >= 0 && bin < 2 * h->half) {
+		h->counts[bin]++;
+	}
+}
+
+static void hist_tag(struct histogram *h, int channels, int channel,
+                     unsigned long long t)
+{
+	int other = channels == 2 ? !channel : channel;
+	int i, k;
+	long long delay;
+
+	//forget tags that are out of range of anything still to come
+	for(k=0; k<channels; k++) {
+		while (h->num[k] > 0
+		       && t - h->recent[k][h->first[k]] > (unsigned long long) h->range_ps) {
+			h->first[k] = (h->first[k] + 1) % RECENT_TAGS;
+			h->num[k]--;
+		}
+	}
+
+	for(i=0; i<h->num[other]; i++) {
+		delay = (long long) (t - h->recent[other][(h->first[other] + i) % RECENT_TAGS]);
+		if (channels == 1) {
+			hist_add(h, delay);
+			hist_add(h, -delay);
+		}
+		else {
+			//delay is B - A
+			hist_add(h, channel == 1 ? delay : -delay);
+		}
+	}
+
+	if (h->num[channel] == RECENT_TAGS) {
+		h->first[channel] = (h->first[channel] + 1) % RECENT_TAGS;
+		h->num[channel]--;
+		h->overflow++;
+	}
+	h->recent[channel][(h->first[channel] + h->num[channel]) % RECENT_TAGS] = t;
+	h->num[channel]++;
+}
+
+static void level_push(struct multitau *m, int l, double a, double b)
+{
+	struct level *lv;
+	int j, k;
+
+	while (l < m->levels) {
+		lv = &m->level[l];
+		lv->pos = (lv->pos + 1) % LAGS;
+		lv->delay[0][lv->pos] = a;
+		lv->delay[1][lv->pos] = b;
+		if (lv->filled < LAGS) {
+			lv->filled++;
+		}
+		if (a != 0 || b != 0) {
+			for(j=0; j<lv->filled; j++) {
+				k = (lv->pos - j + LAGS) % LAGS;
+				lv->corr[0][j] += lv->delay[0][k] * b;
+				lv->corr[1][j] += lv->delay[1][k] * a;
+			}
+		}
+		lv->sum[0] += a;
+		lv->sum[1] += b;
+		lv->bins++;
+
+		//every second bin goes on to the next level, summed with the first
+		if (!lv->carried) {
+			lv->carry[0] = a;
+			lv->carry[1] = b;
+			lv->carried = 1;
+			return;
+		}
+		a += lv->carry[0];
+		b += lv->carry[1];
+		lv->carried = 0;
+		l++;
+	}
+}
+
+static void multitau_tag(struct multitau *m, int channel, unsigned long long t)
+{
+	long long bin = (long long) (t / m->base_ps);
+
+	if (bin != m->bin) {
+		level_push(m, 0, m->counts[0], m->counts[1]);
+		m->counts[0] = m->counts[1] = 0;
+		//empty bins in between, cheap since nothing gets multiplied
+		while (++m->bin < bin) {
+			level_push(m, 0, 0, 0);
+		}
+	}
+	m->counts[channel]++;
+	if (m->mirror) {
+		m->counts[1]++;
+	}
+}
+
+static void g2_tag(struct g2 *g, time_tag tag)
+{
+	unsigned long long t = tag_time(tag);
+	int channel = tag_channel(tag);
+
+	if (channel >= g->channels) {
+		return;
+	}
+	if (!g->started) {
+		g->first_ps = t;
+		g->tau.bin = (long long) (t / g->tau.base_ps);
+		g->started = 1;
+	}
+	if (t < g->last_ps) {
+		return;     //out of order, the tagger is supposed to sort
+	}
+	g->last_ps = t;
+	g->tags[channel]++;
+	hist_tag(&g->hist, g->channels, channel, t);
+	multitau_tag(&g->tau, channel, t);
+}
+
+/*
+ * Coincidences expected per histogram bin for uncorrelated light. For one
+ * detector each pair lands on both sides, same as for two.
+ */
+static double g2_expected(const struct g2 *g)
+{
+	double span = (double) (g->last_ps - g->first_ps);
+	int b = g->channels == 2;
+
+	if (span <= 0) {
+		return 0;
+	}
+	return (double) g->tags[0] * g->tags[b] / span * g->hist.bin_ps;
+}
+
+static void g2_zero(const struct g2 *g, double *value, double *err)
+{
+	double expected = g2_expected(g);
+	//the two bins either side of zero delay
+	double counts = (double) g->hist.counts[g->hist.half - 1]
+	              + g->hist.counts[g->hist.half];
+
+	if (expected <= 0) {
+		*value = *err = 0;
+		return;
+	}
+	*value = counts / (2 * expected);
+	*err = sqrt(counts > 0 ? counts : 1) / (2 * expected);
+}
+
+static void write_lag(FILE *fp, const struct level *lv, int dir, int j,
+                      double lag_s)
+{
+	double mean_a = lv->sum[dir] / lv->bins;
+	double mean_b = lv->sum[!dir] / lv->bins;
+	double pairs = lv->bins - j;
+
+	if (pairs > 0 && mean_a > 0 && mean_b > 0) {
+		fprintf(fp, "%.6g\t%.6g\n", lag_s,
+		        lv->corr[dir][j] / pairs / (mean_a * mean_b));
+	}
+}
+
+static int g2_write(const struct g2 *g, const char *prefix, double elapsed_s,
+                    int print)
+{
+	char path[1024], tmp[1100];
+	double expected = g2_expected(g), zero, zero_err, span_s, bin_s;
+	int i, j, l, b = g->channels == 2;
+	const struct level *lv;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s_g2.txt", prefix);
+	fp = atomic_open(path, tmp, sizeof(tmp));
+	if (fp == NULL) {
+		printf("Could not open %s", path);
+		return -1;
+	}
+	for(i=0; i<2*g->hist.half; i++) {
+		fprintf(fp, "%.4f\t%.6g\t%llu\n", ((i - g->hist.half) + 0.5) * g->hist.bin_ps * 1e-3,
+		        expected > 0 ? g->hist.counts[i] / expected : 0, g->hist.counts[i]);
+	}
+	atomic_close(fp, tmp, path);
+
+	//long lags, from -longest to +longest. For one detector the correlation
+	//is symmetric and lag 0 is shot noise, so only the positive side from 1
+	snprintf(path, sizeof(path), "%s_fcs.txt", prefix);
+	fp = atomic_open(path, tmp, sizeof(tmp));
+	if (fp == NULL) {
+		printf("Could not open %s", path);
+		return -1;
+	}
+	if (g->channels == 2) {
+		for(l=g->tau.levels-1; l>=0; l--) {
+			lv = &g->tau.level[l];
+			bin_s = ldexp(g->tau.base_ps * 1e-12, l);
+			for(j=LAGS-1; j>=(l ? LAGS/2 : 1); j--) {
+				write_lag(fp, lv, 1, j, -j * bin_s);
+			}
+		}
+	}
+	for(l=0; l<g->tau.levels; l++) {
+		lv = &g->tau.level[l];
+		bin_s = ldexp(g->tau.base_ps * 1e-12, l);
+		for(j=(l ? LAGS/2 : !b); j<LAGS; j++) {
+			write_lag(fp, lv, 0, j, j * bin_s);
+		}
+	}
+	atomic_close(fp, tmp, path);
+
+	g2_zero(g, &zero, &zero_err);
+	span_s = (g->last_ps - g->first_ps) * 1e-12;
+	snprintf(path, sizeof(path), "%s_summary.txt", prefix);
+	fp = atomic_open(path, tmp, sizeof(tmp));
+	if (fp == NULL) {
+		printf("Could not open %s", path);
+		return -1;
+	}
+	fprintf(fp, "g2_0\t%g\n", zero);
+	fprintf(fp, "g2_0_err\t%g\n", zero_err);
+	fprintf(fp, "single\t%d\n", zero + 2 * zero_err < 0.5);
+	fprintf(fp, "tags\t%llu\n", g->tags[0] + g->tags[1]);
+	fprintf(fp, "span_s\t%g\n", span_s);
+	fprintf(fp, "rate_a_cps\t%g\n", span_s > 0 ? g->tags[0] / span_s : 0);
+	fprintf(fp, "rate_b_cps\t%g\n", span_s > 0 && b ? g->tags[1] / span_s : 0);
+	fprintf(fp, "tags_per_s\t%g\n", elapsed_s > 0 ? (g->tags[0] + g->tags[1]) / elapsed_s : 0);
+	fprintf(fp, "recent_overflow\t%llu\n", g->hist.overflow);
+	atomic_close(fp, tmp, path);
+
+	if (print) {
+		printf("%g\t%g\t%llu\t%g\n", zero, zero_err, g->tags[0] + g->tags[1],
+		       elapsed_s > 0 ? (g->tags[0] + g->tags[1]) / elapsed_s : 0);
+	}
+	return 0;
+}
+
+static int parse_synth(char *argv[], int channels, struct tag_synth *synth)
+{
+	struct tag_synth_params p;
+
+	p.channels = channels;
+	p.emitters = atoi(argv[0]);
+	p.excitation_mhz = atof(argv[1]);
+	p.lifetime_ns = atof(argv[2]);
+	p.efficiency = atof(argv[3]);
+	p.background_cps = atof(argv[4]);
+	p.shelving = atof(argv[5]);
+	p.dark_us = atof(argv[6]);
+	if (tag_synth_init(synth, &p, strtoull(argv[7], NULL, 0)) != 0) {
+		printf("Bad synthetic source parameters");
+		return -1;
+	}
+	return 0;
+}
+
+static int generate(int argc, char *argv[])
+{
+	struct tag_synth synth;
+	static time_tag block[READ_BLOCK];
+	unsigned long long end_ps;
+	char done_path[1024];
+	FILE *fp;
+	int n;
+
+	if (argc != 5 + SYNTH_ARGS) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	if (parse_synth(argv + 4, atoi(argv[3]), &synth) != 0) {
+		return -1;
+	}
+	end_ps = (unsigned long long) (atof(argv[4 + SYNTH_ARGS]) * 1e12);
+
+	fp = fopen(argv[2], "wb");
+	if (fp == NULL) {
+		printf("Could not open %s", argv[2]);
+		return -1;
+	}
+	do {
+		for(n=0; n<READ_BLOCK; n++) {
+			block[n] = tag_synth_next(&synth);
+			if (tag_time(block[n]) >= end_ps) {
+				break;
+			}
+		}
+		fwrite(block, sizeof(time_tag), n, fp);
+	} while (n == READ_BLOCK);
+	fclose(fp);
+
+	snprintf(done_path, sizeof(done_path), "%s.done", argv[2]);
+	fp = fopen(done_path, "w");
+	if (fp != NULL) {
+		fclose(fp);
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct g2 g;
+	static time_tag block[READ_BLOCK];
+	struct tag_synth synth;
+	char done_path[1024];
+	FILE *fp = NULL, *done;
+	int synthetic, finishing = 0, error;
+	size_t got, i, bytes = 0;
+	unsigned long long end_ps = 0;
+	double start, last_write;
+
+	if (argc >= 2 && strcmp(argv[1], "gen") == 0) {
+		return generate(argc, argv);
+	}
+	if (argc < 8) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	synthetic = strcmp(argv[1], "synth") == 0;
+	if (argc != (synthetic ? 9 + SYNTH_ARGS : 8)) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+
+	g.channels = atoi(argv[3]);
+	if (g.channels < 1 || g.channels > 2) {
+		printf("Channels must be 1 or 2");
+		return -1;
+	}
+	if (hist_init(&g.hist, atof(argv[4]), atof(argv[5])) != 0) {
+		printf("Bad histogram bin or range");
+		return -1;
+	}
+	g.tau.base_ps = atof(argv[6]) * 1e6;
+	g.tau.levels = atoi(argv[7]);
+	g.tau.mirror = g.channels == 1;
+	if (g.tau.base_ps < 1 || g.tau.levels < 1 || g.tau.levels > MAX_LEVELS) {
+		printf("Bad base bin or number of levels");
+		return -1;
+	}
+
+	if (synthetic) {
+		if (parse_synth(argv + 8, g.channels, &synth) != 0) {
+			return -1;
+		}
+		end_ps = (unsigned long long) (atof(argv[8 + SYNTH_ARGS]) * 1e12);
+	}
+	snprintf(done_path, sizeof(done_path), "%s.done", argv[1]);
+
+	start = last_write = clock_seconds();
+	while (1) {
+		if (synthetic) {
+			for(got=0; got<READ_BLOCK; got++) {
+				block[got] = tag_synth_next(&synth);
+				if (tag_time(block[got]) >= end_ps) {
+					finishing = 1;
+					break;
+				}
+			}
+		}
+		else {
+			if (fp == NULL && (fp = fopen(argv[1], "rb")) == NULL) {
+				if ((done = fopen(done_path, "rb")) != NULL) {
+					fclose(done);
+					printf("Could not open %s", argv[1]);
+					return -1;
+				}
+				g2_sleep();
+				continue;
+			}
+			//bytes, the tagger may be in the middle of writing a tag
+			bytes += fread((char *) block + bytes, 1, sizeof(block) - bytes, fp);
+			got = bytes / sizeof(time_tag);
+		}
+
+		for(i=0; i<got; i++) {
+			g2_tag(&g, block[i]);
+		}
+		if (!synthetic) {
+			//keep a partly read tag for the next pass
+			memmove(block, block + got, bytes - got * sizeof(time_tag));
+			bytes -= got * sizeof(time_tag);
+		}
+
+		if (clock_seconds() - last_write > 1) {
+			g2_write(&g, argv[2], clock_seconds() - start, 0);
+			last_write = clock_seconds();
+		}
+
+		if (synthetic) {
+			if (finishing) break;
+		}
+		else if (got < READ_BLOCK) {
+			if (finishing) break;
+			clearerr(fp);
+			if ((done = fopen(done_path, "rb")) != NULL) {
+				//.done comes after the last write, read once more
+				fclose(done);
+				finishing = 1;
+				continue;
+			}
+			g2_sleep();
+		}
+	}
+
+	error = g2_write(&g, argv[2], clock_seconds() - start, 1);
+	if (fp != NULL) {
+		fclose(fp);
+	}
+	free(g.hist.counts);
+	return error;
+}
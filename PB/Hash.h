@@ -0,0 +1,57 @@
+/**
+ * \file Hash.h
+ *
+ *  Author: Sam Kim
+ *
+ *  64 bit FNV-1a, to tell programs apart (checkpoints, Board.c) without
+ *  keeping copies of them.
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdio.h>
+
+#define FNV_OFFSET 0xCBF29CE484222325ull
+#define FNV_PRIME 0x100000001B3ull
+
+static inline unsigned long long fnv1a(unsigned long long hash, const void *data, size_t n)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for(i=0; i<n; i++) {
+		hash = (hash ^ p[i]) * FNV_PRIME;
+	}
+	return hash;
+}
+
+//Hash of a file's contents, 0 if it can't be read
+static inline unsigned long long fnv1a_file(const char *path)
+{
+	unsigned long long hash = FNV_OFFSET;
+	char block[65536];
+	size_t got;
+	FILE *fp = fopen(path, "rb");
+
+	if (fp == NULL) {
+		return 0;
+	}
+	while ((got = fread(block, 1, sizeof(block), fp)) > 0) {
+		hash = fnv1a(hash, block, got);
+	}
+	fclose(fp);
+	return hash;
+}
+
+static inline unsigned long long fnv1a_string(const char *s)
+{
+	unsigned long long hash = FNV_OFFSET;
+
+	while (*s) {
+		hash = (hash ^ (unsigned char) *s++) * FNV_PRIME;
+	}
+	return hash;
+}
+
+#endif
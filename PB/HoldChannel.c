@@ -24,7 +24,6 @@ int select_board(int numBoards);
 
 int main(int argc, char *argv[])
 {
-	int status;
 	int numBoards;
 	int window_channel;
 	int loop, error;
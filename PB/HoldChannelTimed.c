@@ -25,11 +25,10 @@ int select_board(int numBoards);
 
 int main(int argc, char *argv[])
 {
-	int status;
 	int numBoards;
 	double window_time;
 	int window_channel;
-	int error, loop, num_runs;
+	int loop, num_runs;
 	int max_delay = 500;
 	int max_runs = 1e6;
 
@@ -0,0 +1,303 @@
+/**
+ * \file LaserWaveform.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Laser tuning voltages for the low-T Spectrum runs, replacing the ramps
+ *  built in gen_laservoltage_sequence_scans.vi / _samples.vi and
+ *  triangular waveform.vi. The table is built once and then clocked out
+ *  by the PulseBlaster: SpectrumBurn with aoclock=<channel> raises that
+ *  channel at the start of every repetition, and each rising edge makes
+ *  the analog output step to the next sample. Voltage steps and count
+ *  gates therefore stay aligned however fast we scan.
+ *
+ *  Usage:
+ *  LaserWaveform build <table> <shape> <V min> <V max> <steps per scan>
+ *                      <number of scans> <repump every> <repump V>
+ *      shape       - triangle (up then down), sawtooth (up, jump back) or
+ *                    up (like sawtooth, kept for the old VI's naming)
+ *      repump every - insert a repump step at <repump V> after every N
+ *                    scan steps (0 = never)
+ *      Writes the table (sample, voltage, kind 0 = scan / 1 = repump, scan
+ *      number) and prints the number of samples, which is the number of
+ *      repetitions to give SpectrumBurn.
+ *
+ *  LaserWaveform run <table> file <output> <program image> <clock mask>
+ *      File-backed stand-in for testing: plays the emulated program
+ *      (Emulator/spinapi.h) and writes the time (ns) of every clock edge
+ *      with the voltage it puts out.
+ *
+ *  LaserWaveform run <table> daqmx <AO channel> <clock terminal>
+ *                    <max rate Hz> <timeout s>
+ *      Buffered AO on e.g. Dev1/ao0, sample clock from the PulseBlaster
+ *      channel wired to e.g. /Dev1/PFI0. Start this (without waiting)
+ *      before starting the board; it returns when the table is done.
+ *      Needs NI-DAQmx: build with -DUSE_DAQMX and link NIDAQmx.lib.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PBImage.h"
+#include "Spreadsheet.h"
+
+#ifdef USE_DAQMX
+#include "NIDAQmx.h"
+#endif
+
+enum { KIND_SCAN = 0, KIND_REPUMP = 1 };
+
+static int build_table(int argc, char *argv[])
+{
+	const char *shape;
+	double v_min, v_max, v_repump, v, *table;
+	int steps, scans, repump_every, per_scan, i, s, k, n, since_repump;
+
+	if (argc != 10) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	shape = argv[3];
+	v_min = atof(argv[4]);
+	v_max = atof(argv[5]);
+	steps = atoi(argv[6]);
+	scans = atoi(argv[7]);
+	repump_every = atoi(argv[8]);
+	v_repump = atof(argv[9]);
+
+	if (steps < 2 || scans < 1 || repump_every < 0) {
+		printf("Need at least 2 steps and 1 scan");
+		return -1;
+	}
+
+	if (strcmp(shape, "triangle") == 0) {
+		per_scan = 2 * steps - 2;   //don't repeat the turning points
+	}
+	else if (strcmp(shape, "sawtooth") == 0 || strcmp(shape, "up") == 0) {
+		per_scan = steps;
+	}
+	else {
+		printf("Unknown shape %s", shape);
+		return -1;
+	}
+
+	n = per_scan * scans;
+	if (repump_every > 0) {
+		n += n / repump_every;
+	}
+	table = malloc((size_t) n * 4 * sizeof(double));
+	if (table == NULL) {
+		printf("Out of memory");
+		return -1;
+	}
+
+	i = 0;
+	since_repump = 0;
+	for(s=0; s<scans; s++) {
+		for(k=0; k<per_scan; k++) {
+			int step = k < steps ? k : 2 * steps - 2 - k;
+			v = v_min + (v_max - v_min) / (steps - 1) * step;
+
+			table[i*4 + 0] = i;
+			table[i*4 + 1] = v;
+			table[i*4 + 2] = KIND_SCAN;
+			table[i*4 + 3] = s;
+			i++;
+
+			if (repump_every > 0 && ++since_repump == repump_every) {
+				table[i*4 + 0] = i;
+				table[i*4 + 1] = v_repump;
+				table[i*4 + 2] = KIND_REPUMP;
+				table[i*4 + 3] = s;
+				i++;
+				since_repump = 0;
+			}
+		}
+	}
+
+	if (write_spreadsheet(argv[2], table, i, 4) != 0) {
+		free(table);
+		return -1;
+	}
+	printf("%d\n", i);
+	free(table);
+	return 0;
+}
+
+struct edge_writer {
+	int clock_mask;
+	int high;
+	double t;
+	const double *table;
+	int num_samples, next;
+	FILE *fp;
+};
+
+static int clock_segment(void *ctx, int outputs, double length, int addr, int outer_iter)
+{
+	struct edge_writer *w = ctx;
+	int high = (outputs & w->clock_mask) != 0;
+
+	(void) addr;
+	(void) outer_iter;
+	if (high && !w->high) {
+		if (w->next < w->num_samples) {
+			fprintf(w->fp, "%.1f\t%.6f\t%.0f\n", w->t,
+			        w->table[w->next*4 + 1], w->table[w->next*4 + 2]);
+		}
+		w->next++;
+	}
+	w->high = high;
+	w->t += length;
+	return 0;
+}
+
+static int run_file(const double *table, int rows, int argc, char *argv[])
+{
+	static struct pb_image img;
+	struct edge_writer w;
+	struct pb_walk walk;
+
+	if (argc != 7) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	if (read_pb_image(argv[5], &img) != 0) {
+		return -1;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.clock_mask = (int) strtol(argv[6], NULL, 0);
+	w.table = table;
+	w.num_samples = rows;
+	w.fp = fopen(argv[4], "w");
+	if (w.fp == NULL) {
+		printf("Could not open %s", argv[4]);
+		return -1;
+	}
+
+	memset(&walk, 0, sizeof(walk));
+	if (pb_image_walk(&img, &walk, clock_segment, &w) != 0) {
+		fclose(w.fp);
+		return -1;
+	}
+	fclose(w.fp);
+
+	//same check the DAQmx side would fail on
+	if (w.next != rows) {
+		printf("Program has %d clock edges for %d samples\n", w.next, rows);
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef USE_DAQMX
+static int daqmx_check(int32 error)
+{
+	char message[2048];
+
+	if (DAQmxFailed(error)) {
+		DAQmxGetExtendedErrorInfo(message, sizeof(message));
+		printf("DAQmx error: %s\n", message);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+static int run_daqmx(const double *table, int rows, int argc, char *argv[])
+{
+#ifdef USE_DAQMX
+	TaskHandle task = 0;
+	float64 *voltages, v_min, v_max;
+	int32 written;
+	int i, error = 0;
+
+	if (argc != 8) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+
+	voltages = malloc(rows * sizeof(float64));
+	v_min = v_max = table[1];
+	for(i=0; i<rows; i++) {
+		voltages[i] = table[i*4 + 1];
+		if (voltages[i] < v_min) v_min = voltages[i];
+		if (voltages[i] > v_max) v_max = voltages[i];
+	}
+	if (v_max == v_min) {
+		v_max = v_min + 1;   //DAQmx wants a nonzero range
+	}
+
+	//finite buffered output, one sample per PulseBlaster clock edge
+	error = daqmx_check(DAQmxCreateTask("", &task))
+	     || daqmx_check(DAQmxCreateAOVoltageChan(task, argv[4], "", v_min, v_max,
+	                                             DAQmx_Val_Volts, NULL))
+	     || daqmx_check(DAQmxCfgSampClkTiming(task, argv[5], atof(argv[6]),
+	                                          DAQmx_Val_Rising, DAQmx_Val_FiniteSamps,
+	                                          rows))
+	     || daqmx_check(DAQmxWriteAnalogF64(task, rows, 0, 10.0,
+	                                        DAQmx_Val_GroupByChannel, voltages,
+	                                        &written, NULL))
+	     || daqmx_check(DAQmxStartTask(task))
+	     || daqmx_check(DAQmxWaitUntilTaskDone(task, atof(argv[7])));
+
+	if (task != 0) {
+		DAQmxStopTask(task);
+		DAQmxClearTask(task);
+	}
+	free(voltages);
+	return error ? -1 : 0;
+#else
+	(void) table;
+	(void) rows;
+	(void) argc;
+	(void) argv;
+	printf("Built without DAQmx support (-DUSE_DAQMX)");
+	return -1;
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+	double *table;
+	int rows, cols, error;
+
+	if (argc < 4) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+
+	if (strcmp(argv[1], "build") == 0) {
+		return build_table(argc, argv);
+	}
+	if (strcmp(argv[1], "run") != 0) {
+		printf("Unknown command %s", argv[1]);
+		return -1;
+	}
+
+	table = read_spreadsheet(argv[2], &rows, &cols);
+	if (table == NULL) {
+		return -1;
+	}
+	if (cols != 4 || rows == 0) {
+		printf("%s is not a waveform table", argv[2]);
+		free(table);
+		return -1;
+	}
+
+	if (strcmp(argv[3], "file") == 0) {
+		error = run_file(table, rows, argc, argv);
+	}
+	else if (strcmp(argv[3], "daqmx") == 0) {
+		error = run_daqmx(table, rows, argc, argv);
+	}
+	else {
+		printf("Unknown output %s", argv[3]);
+		error = -1;
+	}
+
+	free(table);
+	return error;
+}
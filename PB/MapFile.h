@@ -0,0 +1,102 @@
+/**
+ * \file MapFile.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Read-only memory mapping of a whole file, so large data files open
+ *  without reading them: pages come in from disk (or the OS cache) only
+ *  when they are touched.
+ */
+
+#ifndef MAP_FILE_H
+#define MAP_FILE_H
+
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct mapped_file {
+	const unsigned char *data;
+	unsigned long long size;
+#ifdef _WIN32
+	HANDLE file, mapping;
+#endif
+};
+
+//Returns 0, or -1 if the file can't be opened or is empty
+static inline int map_file(const char *path, struct mapped_file *mf)
+{
+#ifdef _WIN32
+	LARGE_INTEGER size;
+
+	mf->data = NULL;
+	mf->mapping = NULL;
+	mf->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+	                       NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (mf->file == INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+	if (!GetFileSizeEx(mf->file, &size) || size.QuadPart == 0) {
+		CloseHandle(mf->file);
+		return -1;
+	}
+	mf->size = (unsigned long long) size.QuadPart;
+	mf->mapping = CreateFileMappingA(mf->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mf->mapping != NULL) {
+		mf->data = MapViewOfFile(mf->mapping, FILE_MAP_READ, 0, 0, 0);
+	}
+	if (mf->data == NULL) {
+		if (mf->mapping != NULL) {
+			CloseHandle(mf->mapping);
+		}
+		CloseHandle(mf->file);
+		return -1;
+	}
+	return 0;
+#else
+	struct stat st;
+	void *p;
+	int fd = open(path, O_RDONLY);
+
+	mf->data = NULL;
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+	mf->size = (unsigned long long) st.st_size;
+	p = mmap(NULL, (size_t) mf->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return -1;
+	}
+	mf->data = p;
+	return 0;
+#endif
+}
+
+static inline void unmap_file(struct mapped_file *mf)
+{
+	if (mf->data == NULL) {
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(mf->data);
+	CloseHandle(mf->mapping);
+	CloseHandle(mf->file);
+#else
+	munmap((void *) mf->data, (size_t) mf->size);
+#endif
+	mf->data = NULL;
+}
+
+#endif
@@ -0,0 +1,332 @@
+/**
+ * \file NVModel.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Two-level (ms=0 / ms=-1) NV model in the rotating frame, as Bloch
+ *  vectors. Every function works on a whole array of NVs at once, each with
+ *  its own detuning and MW amplitude, stored as separate x/y/z arrays so
+ *  the loops vectorize. NVSim uses the array for the quasi-static detuning
+ *  spread (T2*); the design tools use it for batches of cases.
+ *
+ *  Bloch z = +1 is ms=0 (bright). Units: ns and rad/ns internally.
+ */
+
+#ifndef NV_MODEL_H
+#define NV_MODEL_H
+
+#include <stdlib.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+struct nv_params {
+	double rabi_mhz;        //Rabi frequency, pi time = 1/(2*rabi)
+	double detuning_mhz;    //MW minus resonance
+	double t2_us;           //homogeneous decay of coherences (0 = none)
+	double t2star_us;       //Gaussian detuning spread (0 = none)
+	double bright_cps;      //count rate from ms=0 under the laser
+	double contrast;        //fraction of bright counts lost for ms=-1
+	double readout_ns;      //spin-dependent window = repolarization time
+	double dark_cps;        //background while the counter is gated
+};
+
+struct nv_array {
+	int n;
+	double *x, *y, *z;
+	double *delta;          //rad/ns
+	double *omega;          //rad/ns
+	double *weight;         //sums to 1 over the array
+	double decay_rate;      //1/T2 in 1/ns
+};
+
+static inline double nv_inverse_normal(double p)
+{
+	//Acklam's rational approximation, good to ~1e-9
+	static const double a[6] = { -3.969683028665376e+01, 2.209460984245205e+02,
+		-2.759285104469687e+02, 1.383577518672690e+02, -3.066479806614716e+01,
+		2.506628277459239e+00 };
+	static const double b[5] = { -5.447609879822406e+01, 1.615858368580409e+02,
+		-1.556989798598866e+02, 6.680131188771972e+01, -1.328068155288572e+01 };
+	static const double c[6] = { -7.784894002430293e-03, -3.223964580411365e-01,
+		-2.400758277161838e+00, -2.549732539343734e+00, 4.374664141464968e+00,
+		2.938163982698783e+00 };
+	static const double d[4] = { 7.784695709041462e-03, 3.224671290700398e-01,
+		2.445134137142996e+00, 3.754408661907416e+00 };
+	double q, r;
+
+	if (p < 0.02425) {
+		q = sqrt(-2 * log(p));
+		return (((((c[0]*q + c[1])*q + c[2])*q + c[3])*q + c[4])*q + c[5])
+		     / ((((d[0]*q + d[1])*q + d[2])*q + d[3])*q + 1);
+	}
+	if (p > 1 - 0.02425) {
+		return -nv_inverse_normal(1 - p);
+	}
+	q = p - 0.5;
+	r = q*q;
+	return (((((a[0]*r + a[1])*r + a[2])*r + a[3])*r + a[4])*r + a[5])*q
+	     / (((((b[0]*r + b[1])*r + b[2])*r + b[3])*r + b[4])*r + 1);
+}
+
+//Zeroed array of n NVs; fill delta/omega/weight and call nv_reset
+static inline int nv_alloc(struct nv_array *nv, int n)
+{
+	nv->n = n;
+	nv->x = calloc(n, sizeof(double));
+	nv->y = calloc(n, sizeof(double));
+	nv->z = calloc(n, sizeof(double));
+	nv->delta = calloc(n, sizeof(double));
+	nv->omega = calloc(n, sizeof(double));
+	nv->weight = calloc(n, sizeof(double));
+	nv->decay_rate = 0;
+	if (!nv->x || !nv->y || !nv->z || !nv->delta || !nv->omega || !nv->weight) {
+		return -1;
+	}
+	return 0;
+}
+
+static inline void nv_release(struct nv_array *nv)
+{
+	free(nv->x);
+	free(nv->y);
+	free(nv->z);
+	free(nv->delta);
+	free(nv->omega);
+	free(nv->weight);
+}
+
+/*
+ * One NV ensemble: n detuning classes at equal-probability quantiles of
+ * the Gaussian spread set by T2* (coherence exp(-(t/T2*)^2)).
+ */
+static inline int nv_ensemble(struct nv_array *nv, const struct nv_params *p, int n)
+{
+	int k;
+	double sigma = p->t2star_us > 0 ? sqrt(2.0) / (p->t2star_us * 1e3) : 0;
+
+	if (p->t2star_us <= 0) {
+		n = 1;
+	}
+	if (nv_alloc(nv, n) != 0) {
+		return -1;
+	}
+	for(k=0; k<n; k++) {
+		nv->delta[k] = 2 * M_PI * p->detuning_mhz * 1e-3;
+		if (n > 1) {
+			nv->delta[k] += sigma * nv_inverse_normal((k + 0.5) / n);
+		}
+		nv->omega[k] = 2 * M_PI * p->rabi_mhz * 1e-3;
+		nv->weight[k] = 1.0 / n;
+		nv->z[k] = 1;
+	}
+	nv->decay_rate = p->t2_us > 0 ? 1 / (p->t2_us * 1e3) : 0;
+	return 0;
+}
+
+static inline void nv_reset(struct nv_array *nv)
+{
+	int k;
+
+	for(k=0; k<nv->n; k++) {
+		nv->x[k] = 0;
+		nv->y[k] = 0;
+		nv->z[k] = 1;
+	}
+}
+
+//Free precession about z for t ns, with T2 decay of the coherences
+static inline void nv_free(struct nv_array *nv, double t)
+{
+	int k;
+	double decay = exp(-t * nv->decay_rate);
+	double *restrict x = nv->x, *restrict y = nv->y;
+	const double *restrict delta = nv->delta;
+
+	for(k=0; k<nv->n; k++) {
+		double c = cos(delta[k] * t), s = sin(delta[k] * t);
+		double xn = c * x[k] - s * y[k];
+		double yn = s * x[k] + c * y[k];
+		x[k] = xn * decay;
+		y[k] = yn * decay;
+	}
+}
+
+/*
+ * Driven evolution for t ns with MW phase phi (0 = X, pi/2 = Y):
+ * rotation about (omega cos phi, omega sin phi, delta), i.e. the 3x3
+ * Bloch propagator from Rodrigues' formula, then T2 decay.
+ */
+static inline void nv_drive(struct nv_array *nv, double phi, double t)
+{
+	int k;
+	double cp = cos(phi), sp = sin(phi);
+	double decay = exp(-t * nv->decay_rate);
+	double *restrict x = nv->x, *restrict y = nv->y, *restrict z = nv->z;
+	const double *restrict delta = nv->delta, *restrict omega = nv->omega;
+
+	for(k=0; k<nv->n; k++) {
+		double wx = omega[k] * cp, wy = omega[k] * sp, wz = delta[k];
+		double w = sqrt(wx*wx + wy*wy + wz*wz);
+		double nx, ny, nz, c, s, dot, cx, cy, cz;
+
+		if (w == 0) {
+			continue;
+		}
+		nx = wx / w; ny = wy / w; nz = wz / w;
+		c = cos(w * t);
+		s = sin(w * t);
+		dot = (nx*x[k] + ny*y[k] + nz*z[k]) * (1 - c);
+		cx = ny*z[k] - nz*y[k];
+		cy = nz*x[k] - nx*z[k];
+		cz = nx*y[k] - ny*x[k];
+		x[k] = (x[k]*c + cx*s + nx*dot) * decay;
+		y[k] = (y[k]*c + cy*s + ny*dot) * decay;
+		z[k] = z[k]*c + cz*s + nz*dot;
+	}
+}
+
+/*
+ * One pulse or free period as a 3x3 Bloch matrix per NV, T2 decay folded
+ * into the x and y rows, stored m[(3*row + col) * n + k] like the x/y/z
+ * arrays. The sin/cos in nv_free/nv_drive keep their loops scalar;
+ * building a propagator has the same cost, but applying it is a plain
+ * multiply-add loop that vectorizes, which pays off when the same period
+ * repeats (CPMG and XY4 pulses and taus).
+ */
+struct nv_propagator {
+	int n;
+	double *m;
+};
+
+static inline int nv_propagator_alloc(struct nv_propagator *p, int n)
+{
+	p->n = n;
+	p->m = malloc((size_t) 9 * n * sizeof(double));
+	return p->m != NULL ? 0 : -1;
+}
+
+static inline void nv_propagator_release(struct nv_propagator *p)
+{
+	free(p->m);
+	p->m = NULL;
+}
+
+/*
+ * What nv_drive (driven, MW phase phi) or nv_free (not driven) would do
+ * over t ns to each NV of nv, as it is now (delta, omega, decay_rate).
+ */
+static inline void nv_propagator_set(struct nv_propagator *p, const struct nv_array *nv,
+                                     int driven, double phi, double t)
+{
+	int k, n = p->n;
+	double cp = driven ? cos(phi) : 0, sp = driven ? sin(phi) : 0;
+	double decay = exp(-t * nv->decay_rate);
+	double *restrict m = p->m;
+
+	for(k=0; k<n; k++) {
+		double wx = nv->omega[k] * cp, wy = nv->omega[k] * sp, wz = nv->delta[k];
+		double w = sqrt(wx*wx + wy*wy + wz*wz);
+		double nx = 0, ny = 0, nz = 0, c = 1, s = 0, a;
+
+		if (w != 0) {
+			nx = wx / w; ny = wy / w; nz = wz / w;
+			c = cos(w * t);
+			s = sin(w * t);
+		}
+		//Rodrigues: c I + s [n]x + (1 - c) n n^T
+		a = 1 - c;
+		m[0*n + k] = (c + a*nx*nx) * decay;
+		m[1*n + k] = (a*nx*ny - s*nz) * decay;
+		m[2*n + k] = (a*nx*nz + s*ny) * decay;
+		m[3*n + k] = (a*ny*nx + s*nz) * decay;
+		m[4*n + k] = (c + a*ny*ny) * decay;
+		m[5*n + k] = (a*ny*nz - s*nx) * decay;
+		m[6*n + k] = a*nz*nx - s*ny;
+		m[7*n + k] = a*nz*ny + s*nx;
+		m[8*n + k] = c + a*nz*nz;
+	}
+}
+
+//restrict parameters rather than locals, or gcc gives up on the aliasing
+static inline void nv_propagate_loop(int n, double *restrict x, double *restrict y,
+                                     double *restrict z, const double *restrict m)
+{
+	int k;
+
+	for(k=0; k<n; k++) {
+		double xk = x[k], yk = y[k], zk = z[k];
+
+		x[k] = m[0*n + k]*xk + m[1*n + k]*yk + m[2*n + k]*zk;
+		y[k] = m[3*n + k]*xk + m[4*n + k]*yk + m[5*n + k]*zk;
+		z[k] = m[6*n + k]*xk + m[7*n + k]*yk + m[8*n + k]*zk;
+	}
+}
+
+static inline void nv_propagate(struct nv_array *nv, const struct nv_propagator *p)
+{
+	nv_propagate_loop(p->n, nv->x, nv->y, nv->z, p->m);
+}
+
+//Weighted ms=-1 population
+static inline double nv_dark_population(const struct nv_array *nv)
+{
+	int k;
+	double p = 0;
+
+	for(k=0; k<nv->n; k++) {
+		p += nv->weight[k] * (1 - nv->z[k]) / 2;
+	}
+	return p;
+}
+
+/*
+ * Laser on for t ns: returns the expected photons (before gating) and
+ * pumps back toward ms=0. The ms=-1 population decays with the readout
+ * time constant, which is what makes the contrast window:
+ * photons = rate * (t - contrast * P1 * tau * (1 - exp(-t/tau)))
+ */
+static inline double nv_laser(struct nv_array *nv, const struct nv_params *p, double t)
+{
+	int k;
+	double tau = p->readout_ns > 0 ? p->readout_ns : 1;
+	double keep = exp(-t / tau);
+	double p1 = nv_dark_population(nv);
+	double photons;
+
+	photons = p->bright_cps * 1e-9 * (t - p->contrast * p1 * tau * (1 - keep));
+
+	for(k=0; k<nv->n; k++) {
+		//z relaxes to +1, coherences are destroyed at the same rate
+		nv->z[k] = 1 - (1 - nv->z[k]) * keep;
+		nv->x[k] *= keep;
+		nv->y[k] *= keep;
+	}
+	return photons;
+}
+
+/*
+ * Same as nv_laser, but for a batch of independent NVs: adds each NV's
+ * own expected photons (unweighted) to photons[k].
+ */
+static inline void nv_laser_each(struct nv_array *nv, const struct nv_params *p,
+                                 double t, double *restrict photons)
+{
+	int k;
+	double tau = p->readout_ns > 0 ? p->readout_ns : 1;
+	double keep = exp(-t / tau);
+	double rate = p->bright_cps * 1e-9;
+	double window = p->contrast * tau * (1 - keep);
+	double *restrict x = nv->x, *restrict y = nv->y, *restrict z = nv->z;
+
+	for(k=0; k<nv->n; k++) {
+		photons[k] += rate * (t - window * (1 - z[k]) / 2);
+		z[k] = 1 - (1 - z[k]) * keep;
+		x[k] *= keep;
+		y[k] *= keep;
+	}
+}
+
+#endif
@@ -0,0 +1,222 @@
+/**
+ * \file PBImage.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Reads the program images written by the emulated spinapi.h
+ *  (Emulator/spinapi.h) and plays them back as a timeline of
+ *  (flags, duration) segments, the way the board would run them.
+ *
+ *  Image format (text):
+ *      PBIMAGE 1 <clock MHz> <number of instructions>
+ *      <flags> <opcode> <data> <length ns>      one line per instruction
+ *
+ *  Opcodes are spinapi's: CONTINUE 0, STOP 1, LOOP 2, END_LOOP 3, JSR 4,
+ *  RTS 5, BRANCH 6, LONG_DELAY 7, WAIT 8.
+ */
+
+#ifndef PB_IMAGE_H
+#define PB_IMAGE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PB_IMAGE_MAX_INST 4096
+#define PB_IMAGE_MAX_DEPTH 16
+
+#define PB_OP_CONTINUE 0
+#define PB_OP_STOP 1
+#define PB_OP_LOOP 2
+#define PB_OP_END_LOOP 3
+#define PB_OP_JSR 4
+#define PB_OP_RTS 5
+#define PB_OP_BRANCH 6
+#define PB_OP_LONG_DELAY 7
+#define PB_OP_WAIT 8
+
+//Flag bits 21-23 are the PBESR-PRO short pulse bits; all three set = ON
+#define PB_FLAGS_ON 0xE00000
+#define PB_FLAGS_CHANNELS 0x1FFFFF
+
+struct pb_image {
+	double clock;
+	int num_inst;
+	int flags[PB_IMAGE_MAX_INST];
+	int inst[PB_IMAGE_MAX_INST];
+	int data[PB_IMAGE_MAX_INST];
+	double length[PB_IMAGE_MAX_INST];
+};
+
+/*
+ * Channels that are actually high during an instruction. The short pulse
+ * setting the burners use for windows <= 10 ns is treated as off.
+ */
+static inline int pb_image_outputs(int flags)
+{
+	return (flags & PB_FLAGS_ON) == PB_FLAGS_ON ? flags & PB_FLAGS_CHANNELS : 0;
+}
+
+//Returns 0, or -1 (and prints why) if the image can't be read
+static inline int read_pb_image(const char *path, struct pb_image *img)
+{
+	FILE *fp;
+	int version, i;
+	unsigned int flags;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		printf("Could not open %s\n", path);
+		return -1;
+	}
+	if (fscanf(fp, "PBIMAGE %d %lf %d", &version, &img->clock, &img->num_inst) != 3
+	    || version != 1 || img->num_inst < 0 || img->num_inst > PB_IMAGE_MAX_INST) {
+		printf("%s is not a program image\n", path);
+		fclose(fp);
+		return -1;
+	}
+	for(i=0; i<img->num_inst; i++) {
+		if (fscanf(fp, "%x %d %d %lf", &flags, &img->inst[i], &img->data[i],
+		           &img->length[i]) != 4) {
+			printf("%s: bad instruction %d\n", path, i);
+			fclose(fp);
+			return -1;
+		}
+		img->flags[i] = (int) flags;
+	}
+	fclose(fp);
+	return 0;
+}
+
+/*
+ * Called for every executed instruction: outputs (pb_image_outputs),
+ * duration in ns, the address, and which iteration of the outermost loop
+ * we are in (-1 outside it). Return nonzero to stop the walk.
+ */
+typedef int (*pb_segment_fn)(void *ctx, int outputs, double length, int addr,
+                             int outer_iter);
+
+struct pb_walk {
+	int max_outer;      //run at most this many outer loop iterations (0 = all)
+	double max_ns;      //stop after this much board time (0 = no limit)
+	int outer_count;    //set by the walk: real count of the last outer loop
+	double outer_ns;    //set by the walk: board time of one outer iteration
+	double total_ns;    //set by the walk: board time actually walked
+};
+
+/*
+ * Runs the program from address 0 until STOP, a BRANCH back to address 0
+ * (the board starts over, or waits at the head for the next trigger with
+ * hold=, see BurnOptions.h), the end of memory or a limit in walk. WAIT is
+ * taken as triggered at once. Loops nest like on the board: the LOOP
+ * instruction is the first instruction of its body and END_LOOP's data is
+ * the LOOP address.
+ *
+ * The outermost loop is usually num_scans repetitions of the same sweep,
+ * so callers that only need one repetition set max_outer and scale by
+ * outer_count. Returns 0, or -1 on a malformed program.
+ */
+static inline int pb_image_walk(const struct pb_image *img, struct pb_walk *walk,
+                                pb_segment_fn fn, void *ctx)
+{
+	int loop_addr[PB_IMAGE_MAX_DEPTH], loop_left[PB_IMAGE_MAX_DEPTH];
+	int call_stack[PB_IMAGE_MAX_DEPTH];
+	int depth = 0, calls = 0, pc = 0, outer_iter = -1, op, n;
+	double length, t_outer = 0;
+
+	walk->outer_count = 0;
+	walk->outer_ns = 0;
+	walk->total_ns = 0;
+
+	while (pc >= 0 && pc < img->num_inst) {
+		op = img->inst[pc];
+		length = img->length[pc];
+		if (op == PB_OP_LONG_DELAY) {
+			length *= img->data[pc] > 0 ? img->data[pc] : 1;
+		}
+
+		if (op == PB_OP_LOOP && (depth == 0 || loop_addr[depth-1] != pc)) {
+			//entering a new loop (not coming back from its END_LOOP)
+			if (depth == PB_IMAGE_MAX_DEPTH) {
+				printf("Loops nested too deep at %d\n", pc);
+				return -1;
+			}
+			n = img->data[pc] > 0 ? img->data[pc] : 1;
+			if (depth == 0) {
+				walk->outer_count = n;
+				if (walk->max_outer > 0 && n > walk->max_outer) {
+					n = walk->max_outer;
+				}
+				outer_iter = 0;
+				t_outer = walk->total_ns;
+			}
+			loop_addr[depth] = pc;
+			loop_left[depth] = n;
+			depth++;
+		}
+
+		if (fn(ctx, pb_image_outputs(img->flags[pc]), length, pc, outer_iter) != 0) {
+			return 0;
+		}
+		walk->total_ns += length;
+		if (walk->max_ns > 0 && walk->total_ns >= walk->max_ns) {
+			return 0;
+		}
+
+		switch (op) {
+		case PB_OP_STOP:
+			return 0;
+		case PB_OP_END_LOOP:
+			//drop loops that were never closed (e.g. LOOP used as a delay)
+			while (depth > 0 && loop_addr[depth-1] != img->data[pc]) {
+				depth--;
+			}
+			if (depth == 0) {
+				printf("END_LOOP at %d without its LOOP\n", pc);
+				return -1;
+			}
+			if (--loop_left[depth-1] > 0) {
+				pc = img->data[pc];
+				if (depth == 1) {
+					outer_iter++;
+					walk->outer_ns = walk->total_ns - t_outer;
+					t_outer = walk->total_ns;
+				}
+				continue;
+			}
+			depth--;
+			if (depth == 0) {
+				walk->outer_ns = walk->total_ns - t_outer;
+				outer_iter = -1;
+			}
+			break;
+		case PB_OP_BRANCH:
+			if (img->data[pc] == 0) {
+				return 0;
+			}
+			pc = img->data[pc];
+			continue;
+		case PB_OP_JSR:
+			if (calls == PB_IMAGE_MAX_DEPTH) {
+				printf("Subroutines nested too deep at %d\n", pc);
+				return -1;
+			}
+			call_stack[calls++] = pc + 1;
+			pc = img->data[pc];
+			continue;
+		case PB_OP_RTS:
+			if (calls == 0) {
+				printf("RTS at %d without JSR\n", pc);
+				return -1;
+			}
+			pc = call_stack[--calls];
+			continue;
+		default:
+			break;
+		}
+		pc++;
+	}
+	return 0;
+}
+
+#endif
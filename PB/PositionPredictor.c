@@ -0,0 +1,286 @@
+/**
+ * \file PositionPredictor.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Called from LabVIEW around tracking. Instead of only overwriting the
+ *  stored position after each optimize (Update Position to Globals.vi),
+ *  keeps a Kalman filter per axis over the optimize results so the drift
+ *  can be predicted between trackings: the VI moves to the prediction
+ *  before each chunk, and Optimize 1D searches a range around it sized
+ *  from the prediction's uncertainty instead of a fixed one.
+ *
+ *  Model per axis, with dT = temperature - temperature at the first update:
+ *      position = p + k * dT
+ *      p drifts with velocity v, v and k do random walks
+ *  State (p, v, k); each optimize result measures p + k dT.
+ *
+ *  Usage:
+ *  PositionPredictor reset <state file> <q pos> <q vel> <q temp>
+ *      Starts over. Process noise: q pos (um^2/s, jumps), q vel
+ *      (um^2/s^3, how fast the drift rate changes), q temp (um^2/K^2/s,
+ *      how fast the temperature coefficient changes). Start from
+ *      1e-8 1e-15 1e-10; much larger values make the prediction follow
+ *      the measurement noise and do worse than the last position.
+ *  PositionPredictor update <state file> <time s> <temperature> <x> <y> <z>
+ *                           <measurement sigma um>
+ *      After each optimize, with its result.
+ *  PositionPredictor predict <state file> <time s> <temperature> <sigmas>
+ *                            <min range um> <max range um>
+ *      Prints x, y, z, then the search range (+-, um) for x, y, z:
+ *      <sigmas> times the prediction's sigma, clamped to [min, max].
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "AtomicWrite.h"
+
+#define AXES 3
+#define STATES 3
+#define INITIAL_VEL_SIGMA 1.0       //um/s, i.e. unknown
+#define INITIAL_TEMP_SIGMA 10.0     //um/K
+
+struct axis {
+	double x[STATES];           //p, v, k
+	double P[STATES][STATES];
+};
+
+struct predictor {
+	double q_pos, q_vel, q_temp;
+	int updates;
+	double t_last, temp_ref;
+	struct axis axis[AXES];
+};
+
+static int read_state(const char *path, struct predictor *pr)
+{
+	int a, i, j, n = 0;
+	FILE *fp = fopen(path, "r");
+
+	memset(pr, 0, sizeof(*pr));
+	if (fp == NULL) {
+		printf("No predictor state %s (run reset first)", path);
+		return -1;
+	}
+	n += fscanf(fp, "%lf %lf %lf", &pr->q_pos, &pr->q_vel, &pr->q_temp);
+	n += fscanf(fp, "%d %lf %lf", &pr->updates, &pr->t_last, &pr->temp_ref);
+	for(a=0; a<AXES; a++) {
+		for(i=0; i<STATES; i++) {
+			n += fscanf(fp, "%lf", &pr->axis[a].x[i]);
+		}
+		for(i=0; i<STATES; i++) {
+			for(j=0; j<STATES; j++) {
+				n += fscanf(fp, "%lf", &pr->axis[a].P[i][j]);
+			}
+		}
+	}
+	fclose(fp);
+	if (n != 6 + AXES * (STATES + STATES * STATES)) {
+		printf("Damaged predictor state %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int write_state(const char *path, const struct predictor *pr)
+{
+	char tmp[1100];
+	int a, i, j;
+	FILE *fp = atomic_open(path, tmp, sizeof(tmp));
+
+	if (fp == NULL) {
+		printf("Could not write %s", path);
+		return -1;
+	}
+	fprintf(fp, "%.17g\t%.17g\t%.17g\n", pr->q_pos, pr->q_vel, pr->q_temp);
+	fprintf(fp, "%d\t%.17g\t%.17g\n", pr->updates, pr->t_last, pr->temp_ref);
+	for(a=0; a<AXES; a++) {
+		for(i=0; i<STATES; i++) {
+			fprintf(fp, i ? "\t%.17g" : "%.17g", pr->axis[a].x[i]);
+		}
+		fprintf(fp, "\n");
+		for(i=0; i<STATES; i++) {
+			for(j=0; j<STATES; j++) {
+				fprintf(fp, j ? "\t%.17g" : "%.17g", pr->axis[a].P[i][j]);
+			}
+			fprintf(fp, "\n");
+		}
+	}
+	return atomic_close(fp, tmp, path);
+}
+
+//Time update over dt: p += v dt, plus process noise
+static void kalman_predict(const struct predictor *pr, struct axis *ax, double dt)
+{
+	double P[STATES][STATES];
+	int i, j;
+
+	ax->x[0] += ax->x[1] * dt;
+
+	//P = F P F', F = [1 dt 0; 0 1 0; 0 0 1]
+	memcpy(P, ax->P, sizeof(P));
+	for(j=0; j<STATES; j++) {
+		P[0][j] += dt * ax->P[1][j];
+	}
+	memcpy(ax->P, P, sizeof(P));
+	for(i=0; i<STATES; i++) {
+		P[i][0] += dt * ax->P[i][1];
+	}
+	memcpy(ax->P, P, sizeof(P));
+
+	//integrated random walk in v, random walks in p and k
+	ax->P[0][0] += pr->q_pos * dt + pr->q_vel * dt * dt * dt / 3;
+	ax->P[0][1] += pr->q_vel * dt * dt / 2;
+	ax->P[1][0] += pr->q_vel * dt * dt / 2;
+	ax->P[1][1] += pr->q_vel * dt;
+	ax->P[2][2] += pr->q_temp * dt;
+}
+
+//Predicted measurement and its variance, H = [1 0 dT]
+static void kalman_observe(const struct axis *ax, double dT, double *value, double *var)
+{
+	double h[STATES] = { 1, 0, dT };
+	int i, j;
+
+	*value = ax->x[0] + ax->x[2] * dT;
+	*var = 0;
+	for(i=0; i<STATES; i++) {
+		for(j=0; j<STATES; j++) {
+			*var += h[i] * ax->P[i][j] * h[j];
+		}
+	}
+}
+
+static void kalman_update(struct axis *ax, double dT, double z, double r)
+{
+	double h[STATES] = { 1, 0, dT }, ph[STATES], gain[STATES], predicted, s;
+	double P[STATES][STATES];
+	int i, j;
+
+	kalman_observe(ax, dT, &predicted, &s);
+	s += r;
+	for(i=0; i<STATES; i++) {
+		ph[i] = 0;
+		for(j=0; j<STATES; j++) {
+			ph[i] += ax->P[i][j] * h[j];
+		}
+		gain[i] = ph[i] / s;
+	}
+	for(i=0; i<STATES; i++) {
+		ax->x[i] += gain[i] * (z - predicted);
+	}
+	//P = P - K (P h)'
+	for(i=0; i<STATES; i++) {
+		for(j=0; j<STATES; j++) {
+			P[i][j] = ax->P[i][j] - gain[i] * ph[j];
+		}
+	}
+	//keep it symmetric against rounding
+	for(i=0; i<STATES; i++) {
+		for(j=0; j<STATES; j++) {
+			ax->P[i][j] = (P[i][j] + P[j][i]) / 2;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct predictor pr;
+	struct axis ax;
+	double t, temp, sigma, value, var, range[AXES], pos[AXES];
+	double min_range, max_range;
+	int a;
+
+	if (argc < 3) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+
+	if (strcmp(argv[1], "reset") == 0) {
+		if (argc != 6) {
+			printf("Wrong number of arguments");
+			return -1;
+		}
+		memset(&pr, 0, sizeof(pr));
+		pr.q_pos = atof(argv[3]);
+		pr.q_vel = atof(argv[4]);
+		pr.q_temp = atof(argv[5]);
+		return write_state(argv[2], &pr);
+	}
+
+	if (strcmp(argv[1], "update") == 0) {
+		if (argc != 9) {
+			printf("Wrong number of arguments");
+			return -1;
+		}
+		if (read_state(argv[2], &pr) != 0) {
+			return -1;
+		}
+		t = atof(argv[3]);
+		temp = atof(argv[4]);
+		sigma = atof(argv[8]);
+		if (sigma <= 0) {
+			printf("Measurement sigma must be positive");
+			return -1;
+		}
+
+		for(a=0; a<AXES; a++) {
+			if (pr.updates == 0) {
+				//first fix: position known, drift and temperature unknown
+				memset(&pr.axis[a], 0, sizeof(struct axis));
+				pr.axis[a].x[0] = atof(argv[5 + a]);
+				pr.axis[a].P[0][0] = sigma * sigma;
+				pr.axis[a].P[1][1] = INITIAL_VEL_SIGMA * INITIAL_VEL_SIGMA;
+				pr.axis[a].P[2][2] = INITIAL_TEMP_SIGMA * INITIAL_TEMP_SIGMA;
+				continue;
+			}
+			kalman_predict(&pr, &pr.axis[a], t - pr.t_last);
+			kalman_update(&pr.axis[a], temp - pr.temp_ref, atof(argv[5 + a]),
+			              sigma * sigma);
+		}
+		if (pr.updates == 0) {
+			pr.temp_ref = temp;
+		}
+		pr.updates++;
+		pr.t_last = t;
+		return write_state(argv[2], &pr);
+	}
+
+	if (strcmp(argv[1], "predict") == 0) {
+		if (argc != 8) {
+			printf("Wrong number of arguments");
+			return -1;
+		}
+		if (read_state(argv[2], &pr) != 0) {
+			return -1;
+		}
+		if (pr.updates == 0) {
+			printf("No optimize results yet");
+			return -1;
+		}
+		t = atof(argv[3]);
+		temp = atof(argv[4]);
+		sigma = atof(argv[5]);
+		min_range = atof(argv[6]);
+		max_range = atof(argv[7]);
+
+		for(a=0; a<AXES; a++) {
+			ax = pr.axis[a];
+			kalman_predict(&pr, &ax, t - pr.t_last);
+			kalman_observe(&ax, temp - pr.temp_ref, &value, &var);
+			pos[a] = value;
+			range[a] = sigma * sqrt(var);
+			if (range[a] < min_range) range[a] = min_range;
+			if (range[a] > max_range) range[a] = max_range;
+		}
+		printf("%.6f\t%.6f\t%.6f\t%.4f\t%.4f\t%.4f\n", pos[0], pos[1], pos[2],
+		       range[0], range[1], range[2]);
+		return 0;
+	}
+
+	printf("Unknown command %s", argv[1]);
+	return -1;
+}
@@ -0,0 +1,915 @@
+/**
+ * \file PulsedPipeline.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Started from LabVIEW (System Exec, wait until completion = false) at the
+ *  beginning of a pulsed run. Does the averaging, fitting and saving that
+ *  used to happen in the acquisition loop of Pulsed Experiment.vi, in its
+ *  own threads, so a slow fit or disk write no longer delays the next
+ *  counter read:
+ *
+ *  acquire -> reduce -> fit -> store
+ *
+ *  acquire  reads raw scans from the spool file the VI appends to
+ *           (Write to Binary File, U32, little endian, one record of
+ *           num_points * slots per point counts per scan, in the order
+ *           the points were burned)
+ *  reduce   puts each scan back in sweep order (seed=) and adds it to
+ *           the per-point sums
+ *  fit      contrast with errors and (optionally) a fit of the sums
+ *  store    rewrites the result files atomically
+ *
+ *  The stages are connected by bounded lock-free queues (Ring.h). Scans are
+ *  never dropped: if reduce falls behind, acquire stops reading and the
+ *  spool file just grows. If fit falls behind, reduce skips intermediate
+ *  snapshots (the next one contains the same scans anyway).
+ *
+ *  The run ends when <spool file>.done exists and all scans are processed.
+ *
+ *  Arg Description
+ *  1   Spool file
+ *  2   Output file; also writes <output>.fit and <output>.stats
+ *  3   Number of sweep points
+ *  4   Slots (counter gates) per point
+ *  5   Signal slot (0-indexed)
+ *  6   Reference slot (0-indexed)
+ *  7   Contrast: diff, ratio or norm
+ *  8   Fit: none, rabi, decay or esr
+ *  9   Sweep min
+ *  10  Sweep max
+ *  11  Queue depth (optional, power of 2, default 64)
+ *
+ *  Options, name=value after the fixed args (Checkpoint.h):
+ *  checkpoint=F  write a checkpoint to F every <every> seconds and at the
+ *                end. If F already holds one for the same sweep and
+ *                program, the sums continue from it (and, if the spool is
+ *                the same file with the same first scan, reading continues
+ *                after its last scan). If it holds anything else the run
+ *                does not start, unless fresh=1 is given
+ *  fresh=1       start over even if F holds a checkpoint; the old one is
+ *                moved to F.old
+ *  every=S       seconds between checkpoints (default 60)
+ *  burn=CMD      burner command line the VI ran; stored so Checkpoint.exe
+ *                can re-burn the same program, and hashed unless program=
+ *                is given
+ *  program=P     file to hash as the program (e.g. the emulator image)
+ *  track=T       file whose first line (the VI's tracking state) is saved
+ *                with each checkpoint
+ *  select=K,N,J  post-selection on a charge check (charge= and reprobe= in
+ *                the burner): slot K is the probe in front of the signal
+ *                readout, J the probe in front of the reference readout
+ *                (K < signal slot < J < reference slot). A slot of a scan
+ *                is only summed if its probe has at least N counts, so
+ *                signal and reference are both read out in NV-, each over
+ *                its own shots. The output gets a sixth and seventh
+ *                column, the signal and reference shots kept per point,
+ *                the contrast is taken per shot, and diff contrast is
+ *                scaled to all scans so points with fewer shots line up
+ *  share=NAME    also publish every result to shared memory NAME
+ *                (SharedResults.h) for live viewers (SharedView.exe):
+ *                points   x, contrast, error, signal, reference, signal shots
+ *                sums     every slot's sums, one row per slot
+ *                fit      parameter and error, one row per parameter
+ *                status   scans, fit ok, chi2, seconds from reading the
+ *                         newest scan to publishing it
+ *  archive=F     also keep every raw scan in F, compressed (CountCodec.h,
+ *                read back with CountCodec.exe), so the spool need not be
+ *                kept. The scans are stored in sweep order. Written in
+ *                frames of ARCHIVE_SCANS scans and before each checkpoint;
+ *                a resumed run keeps the scans of the checkpoint in F and
+ *                appends the rest
+ *  seed=N        seed the points were burned in (seed= in the burner,
+ *                SweepOrder.h); every scan is put back in sweep order
+ *                before it is summed. Defaults to the seed= in burn=
+ *  chunk=R       scans per chunk, when the VI re-burns every R scans with
+ *                seed + 1, seed + 2, ... (as Unshuffle.exe takes; default
+ *                0, one seed for the whole run)
+ *
+ *  <output>.stats has one row per stage: items, mean and max latency (s),
+ *  current and max depth of the queue feeding it, and dropped items.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "Ring.h"
+#include "Clock.h"
+#include "AtomicWrite.h"
+#include "Contrast.h"
+#include "Fit.h"
+#include "Checkpoint.h"
+#include "SharedResults.h"
+#include "CountCodec.h"
+#include "SweepOrder.h"
+
+#ifdef _WIN32
+#define spool_seek(fp, offset, whence) _fseeki64(fp, (__int64) (offset), whence)
+#define spool_tell(fp) ((long long) _ftelli64(fp))
+#else
+#define spool_seek(fp, offset, whence) fseeko(fp, (off_t) (offset), whence)
+#define spool_tell(fp) ((long long) ftello(fp))
+#endif
+
+#define NUM_STAGES 4
+#define ARCHIVE_SCANS 64
+
+enum { ACQUIRE, REDUCE, FIT, STORE };
+static const char *stage_names[NUM_STAGES] = { "acquire", "reduce", "fit", "store" };
+
+struct stage_stats {
+	atomic_long items;
+	atomic_long dropped;
+	atomic_llong latency_sum_us;
+	atomic_llong latency_max_us;
+};
+
+struct scan {
+	unsigned int *counts;
+	double t_read;
+};
+
+struct snapshot {
+	double *sig, *ref;  //summed signal and reference slot per point
+	long *shots;        //signal shots kept per point, only with select=
+	long *ref_shots;    //the same for the reference
+	long scans;
+	double t_read;      //when the newest scan in it was read
+	double *contrast;   //filled by the fit stage
+	double *err;
+	struct fit_result fit;
+	int fit_ok;
+	unsigned long long *all_sums;   //every slot, with share= or a checkpoint due
+	long *all_shots;                //every slot, with select= and a checkpoint due
+	int checkpoint;                 //store saves all_sums as a checkpoint
+	int final;                      //the sums at the end of the run
+	long long spool_offset;
+};
+
+struct pipeline {
+	const char *spool_path;
+	const char *out_path;
+	int num_points, num_slots, sig_slot, ref_slot;
+	enum contrast_type contrast;
+	int use_fit;
+	enum fit_model model;
+	double x_min, x_max;
+	int select_slot;        //-1 = sum every shot
+	int reselect_slot;      //probe in front of the reference
+	unsigned int select_min;
+
+	struct ring scans;      //acquire -> reduce
+	struct ring snapshots;  //reduce -> fit
+	struct ring results;    //fit -> store
+	struct stage_stats stats[NUM_STAGES];
+
+	const char *checkpoint_path;    //NULL = no checkpoints
+	double checkpoint_every;
+	const char *burn;
+	const char *track_path;
+	unsigned long long program_hash;
+	struct checkpoint resume;       //resume.sums != NULL if continuing
+	long long spool_start;          //where reading starts in the spool
+	unsigned long long spool_id;    //hash of its first scan, set before it is pushed
+
+	const char *share_name;         //NULL = don't publish
+	struct shared_results shared;   //written by the fit stage only
+
+	const char *archive_path;       //NULL = don't archive
+	struct count_archive archive;   //written by the reduce stage only
+
+	struct sweep_unshuffle unshuffle;   //used by the reduce stage only
+};
+
+static void stage_done(struct stage_stats *st, double t_start)
+{
+	long long us = (long long) ((clock_seconds() - t_start) * 1e6);
+
+	atomic_fetch_add(&st->items, 1);
+	atomic_fetch_add(&st->latency_sum_us, us);
+	if (us > atomic_load(&st->latency_max_us)) {
+		atomic_store(&st->latency_max_us, us);
+	}
+}
+
+static int file_exists(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+
+	if (fp == NULL) {
+		return 0;
+	}
+	fclose(fp);
+	return 1;
+}
+
+/*
+ * Whether the spool is still the one the checkpoint's scans came from: at
+ * least as long, and with the same first scan (if the checkpoint says).
+ * Sets pl->spool_id if so.
+ */
+static int spool_continues(struct pipeline *pl, FILE *fp, size_t record)
+{
+	unsigned int *first = malloc(record);
+	unsigned long long id = 0;
+
+	if (first != NULL && spool_seek(fp, 0, SEEK_END) == 0 && spool_tell(fp) >= pl->spool_start
+	    && spool_seek(fp, 0, SEEK_SET) == 0 && fread(first, 1, record, fp) == record) {
+		id = fnv1a(FNV_OFFSET, first, record);
+	}
+	free(first);
+	if (id == 0 || (pl->resume.spool_id != 0 && id != pl->resume.spool_id)) {
+		return 0;
+	}
+	pl->spool_id = id;
+	return 1;
+}
+
+static void *acquire_thread(void *arg)
+{
+	struct pipeline *pl = arg;
+	size_t record = (size_t) pl->num_points * pl->num_slots * sizeof(unsigned int);
+	size_t got = 0;
+	char done_path[1024];
+	struct scan *sc = NULL;
+	FILE *fp = NULL;
+	double t_start = 0;
+	int finishing = 0;
+
+	snprintf(done_path, sizeof(done_path), "%s.done", pl->spool_path);
+
+	while (1) {
+		if (fp == NULL) {
+			fp = fopen(pl->spool_path, "rb");
+			if (fp == NULL) {
+				if (file_exists(done_path)) {
+					break;   //run ended before the first scan
+				}
+				ring_sleep();
+				continue;
+			}
+			//continuing a spool from a checkpoint, unless the VI started it over
+			if (pl->spool_start > 0) {
+				if (!spool_continues(pl, fp, record)) {
+					pl->spool_start = 0;
+				}
+				spool_seek(fp, pl->spool_start, SEEK_SET);
+			}
+		}
+		if (sc == NULL) {
+			sc = malloc(sizeof(*sc));
+			sc->counts = malloc(record);
+			got = 0;
+		}
+
+		got += fread((char *) sc->counts + got, 1, record - got, fp);
+		if (got < record) {
+			//check done before retrying so the last scan isn't missed
+			if (finishing) {
+				break;
+			}
+			finishing = file_exists(done_path);
+			clearerr(fp);
+			if (!finishing) {
+				ring_sleep();
+			}
+			continue;
+		}
+
+		if (t_start == 0) {
+			t_start = clock_seconds();
+		}
+		sc->t_read = clock_seconds();
+		if (pl->spool_id == 0) {
+			pl->spool_id = fnv1a(FNV_OFFSET, sc->counts, record);
+		}
+		ring_push(&pl->scans, sc);
+		stage_done(&pl->stats[ACQUIRE], sc->t_read);
+		sc = NULL;
+		finishing = 0;
+	}
+
+	if (sc != NULL) {
+		free(sc->counts);
+		free(sc);
+	}
+	if (fp != NULL) {
+		fclose(fp);
+	}
+	ring_close(&pl->scans);
+	return NULL;
+}
+
+static struct snapshot *snapshot_new(struct pipeline *pl)
+{
+	struct snapshot *sn = calloc(1, sizeof(*sn));
+
+	sn->sig = malloc(pl->num_points * sizeof(double));
+	sn->ref = malloc(pl->num_points * sizeof(double));
+	sn->contrast = malloc(pl->num_points * sizeof(double));
+	sn->err = malloc(pl->num_points * sizeof(double));
+	if (pl->select_slot >= 0) {
+		sn->shots = malloc(pl->num_points * sizeof(long));
+		sn->ref_shots = malloc(pl->num_points * sizeof(long));
+	}
+	return sn;
+}
+
+static void snapshot_free(struct snapshot *sn)
+{
+	free(sn->sig);
+	free(sn->ref);
+	free(sn->contrast);
+	free(sn->err);
+	free(sn->shots);
+	free(sn->ref_shots);
+	free(sn->all_sums);
+	free(sn->all_shots);
+	free(sn);
+}
+
+//Signal and reference sums so far, for the fit stage
+static struct snapshot *snapshot_take(struct pipeline *pl, const struct count_sums *cs,
+                                      double t_read)
+{
+	struct snapshot *sn = snapshot_new(pl);
+	const unsigned long long *sig = count_sums_slot(cs, pl->sig_slot);
+	const unsigned long long *ref = count_sums_slot(cs, pl->ref_slot);
+	int i;
+
+	for(i=0; i<pl->num_points; i++) {
+		sn->sig[i] = (double) sig[i];
+		sn->ref[i] = (double) ref[i];
+	}
+	if (sn->shots != NULL) {
+		memcpy(sn->shots, count_sums_shots(cs, pl->sig_slot), pl->num_points * sizeof(long));
+		memcpy(sn->ref_shots, count_sums_shots(cs, pl->ref_slot), pl->num_points * sizeof(long));
+	}
+	if (pl->share_name != NULL) {
+		sn->all_sums = malloc((size_t) pl->num_points * pl->num_slots
+		                      * sizeof(unsigned long long));
+		if (sn->all_sums != NULL) {
+			memcpy(sn->all_sums, cs->sums, (size_t) pl->num_points * pl->num_slots
+			                               * sizeof(unsigned long long));
+		}
+	}
+	sn->scans = cs->scans;
+	sn->t_read = t_read;
+	return sn;
+}
+
+//Attaches every slot's sums and the spool position for the store stage to save
+static void snapshot_checkpoint(struct pipeline *pl, struct snapshot *sn,
+                                const struct count_sums *cs, long first_scan)
+{
+	size_t n = (size_t) pl->num_points * pl->num_slots;
+
+	if (sn->all_sums == NULL) {
+		sn->all_sums = malloc(n * sizeof(unsigned long long));
+		if (sn->all_sums != NULL) {
+			memcpy(sn->all_sums, cs->sums, n * sizeof(unsigned long long));
+		}
+	}
+	if (pl->select_slot >= 0) {
+		sn->all_shots = malloc(n * sizeof(long));
+		if (sn->all_shots != NULL) {
+			memcpy(sn->all_shots, cs->shots, n * sizeof(long));
+		}
+	}
+	sn->checkpoint = sn->all_sums != NULL && (pl->select_slot < 0 || sn->all_shots != NULL);
+	sn->spool_offset = pl->spool_start
+	                 + (long long) (cs->scans - first_scan) * n * sizeof(unsigned int);
+}
+
+static void *reduce_thread(void *arg)
+{
+	struct pipeline *pl = arg;
+	struct count_sums cs;
+	double t_start, t_read = 0, t_checkpoint;
+	long first_scan = 0, scan;
+	int i;
+	struct scan *sc;
+	struct snapshot *sn;
+	unsigned int *counts, *sweep = NULL;
+
+	if (pl->unshuffle.seed != 0) {
+		sweep = malloc((size_t) pl->num_points * pl->num_slots * sizeof(unsigned int));
+	}
+	if (count_sums_init(&cs, pl->num_points, pl->num_slots) != 0
+	    || (pl->unshuffle.seed != 0 && sweep == NULL)) {
+		printf("Out of memory");
+		exit(-1);
+	}
+	if (pl->resume.sums != NULL) {
+		memcpy(cs.sums, pl->resume.sums,
+		       (size_t) pl->num_points * pl->num_slots * sizeof(unsigned long long));
+		cs.scans = first_scan = pl->resume.scans;
+		for(i=0; i<pl->num_points * pl->num_slots; i++) {
+			cs.shots[i] = pl->resume.shots != NULL ? pl->resume.shots[i] : cs.scans;
+		}
+	}
+	t_checkpoint = clock_seconds();
+	scan = first_scan;
+
+	while ((sc = ring_pop(&pl->scans)) != NULL) {
+		t_start = clock_seconds();
+		counts = sc->counts;
+		if (sweep != NULL) {
+			sweep_unshuffle_scan(&pl->unshuffle, scan, sc->counts, sweep);
+			counts = sweep;
+		}
+		scan++;
+		if (pl->select_slot >= 0) {
+			count_sums_add_selected(&cs, counts, 1, pl->select_slot, pl->reselect_slot,
+			                        pl->select_min);
+		}
+		else {
+			count_sums_add(&cs, counts, 1);
+		}
+		if (pl->archive_path != NULL && count_archive_add(&pl->archive, counts, 1) != 0) {
+			printf("Error writing %s\n", pl->archive_path);
+		}
+		t_read = sc->t_read;
+		free(sc->counts);
+		free(sc);
+
+		sn = snapshot_take(pl, &cs, t_read);
+		if (pl->checkpoint_path != NULL
+		    && clock_seconds() - t_checkpoint >= pl->checkpoint_every) {
+			//the archive must hold every scan a checkpoint does
+			if (pl->archive_path != NULL && count_archive_flush(&pl->archive) != 0) {
+				printf("Error writing %s\n", pl->archive_path);
+			}
+			snapshot_checkpoint(pl, sn, &cs, first_scan);
+			//never dropped, so the flush above happens once per checkpoint
+			ring_push(&pl->snapshots, sn);
+			t_checkpoint = clock_seconds();
+		}
+		//fit is behind: the next snapshot supersedes this one
+		else if (ring_try_push(&pl->snapshots, sn) != 0) {
+			snapshot_free(sn);
+			atomic_fetch_add(&pl->stats[REDUCE].dropped, 1);
+		}
+		stage_done(&pl->stats[REDUCE], t_start);
+	}
+
+	//always hand on the final sums
+	if (cs.scans > 0) {
+		sn = snapshot_take(pl, &cs, t_read);
+		if (pl->checkpoint_path != NULL) {
+			snapshot_checkpoint(pl, sn, &cs, first_scan);
+		}
+		sn->final = 1;
+		ring_push(&pl->snapshots, sn);
+	}
+
+	if (pl->archive_path != NULL && count_archive_close(&pl->archive) != 0) {
+		printf("Error writing %s\n", pl->archive_path);
+	}
+	count_sums_free(&cs);
+	free(sweep);
+	ring_close(&pl->snapshots);
+	return NULL;
+}
+
+//Blocks of the shared region, see share= above
+enum { SHARE_POINTS, SHARE_SUMS, SHARE_FIT, SHARE_STATUS, SHARE_BLOCKS };
+
+static int share_create(struct pipeline *pl)
+{
+	const char *names[SHARE_BLOCKS] = { "points", "sums", "fit", "status" };
+	unsigned int rows[SHARE_BLOCKS], cols[SHARE_BLOCKS];
+
+	rows[SHARE_POINTS] = pl->num_points;
+	cols[SHARE_POINTS] = 6;
+	rows[SHARE_SUMS] = pl->num_slots;
+	cols[SHARE_SUMS] = pl->num_points;
+	rows[SHARE_FIT] = FIT_MAX_PARAMS;
+	cols[SHARE_FIT] = 2;
+	rows[SHARE_STATUS] = 1;
+	cols[SHARE_STATUS] = 4;
+	return shared_create(&pl->shared, pl->share_name, SHARE_BLOCKS, names, rows, cols);
+}
+
+//Writes a result straight into the shared region
+static void share_publish(struct pipeline *pl, const struct snapshot *sn, const double *x)
+{
+	double *points = shared_data(&pl->shared, SHARE_POINTS);
+	double *sums = shared_data(&pl->shared, SHARE_SUMS);
+	double *fit = shared_data(&pl->shared, SHARE_FIT);
+	double *status = shared_data(&pl->shared, SHARE_STATUS);
+	size_t i, n = (size_t) pl->num_points * pl->num_slots;
+
+	shared_publish_begin(&pl->shared);
+	for(i=0; i<(size_t) pl->num_points; i++) {
+		points[i*6] = x[i];
+		points[i*6 + 1] = sn->contrast[i];
+		points[i*6 + 2] = sn->err[i];
+		points[i*6 + 3] = sn->sig[i];
+		points[i*6 + 4] = sn->ref[i];
+		points[i*6 + 5] = sn->shots != NULL ? sn->shots[i] : sn->scans;
+	}
+	for(i=0; sn->all_sums != NULL && i<n; i++) {
+		sums[i] = (double) sn->all_sums[i];
+	}
+	for(i=0; i<FIT_MAX_PARAMS; i++) {
+		fit[i*2] = sn->fit_ok && (int) i < sn->fit.num_params ? sn->fit.p[i] : 0;
+		fit[i*2 + 1] = sn->fit_ok && (int) i < sn->fit.num_params ? sn->fit.err[i] : 0;
+	}
+	status[0] = sn->scans;
+	status[1] = sn->fit_ok;
+	status[2] = sn->fit_ok ? sn->fit.chi2 : 0;
+	status[3] = sn->t_read > 0 ? clock_seconds() - sn->t_read : 0;
+	shared_publish_end(&pl->shared);
+}
+
+static void *fit_thread(void *arg)
+{
+	struct pipeline *pl = arg;
+	int i;
+	double t_start, *x = malloc(pl->num_points * sizeof(double));
+	struct snapshot *sn;
+
+	for(i=0; i<pl->num_points; i++) {
+		x[i] = (pl->x_max - pl->x_min) / (pl->num_points - 1) * i + pl->x_min;
+	}
+
+	while ((sn = ring_pop(&pl->snapshots)) != NULL) {
+		t_start = clock_seconds();
+		if (sn->shots != NULL) {
+			for(i=0; i<pl->num_points; i++) {
+				contrast_point_shots(pl->contrast, sn->sig[i], sn->shots[i], sn->ref[i],
+				                     sn->ref_shots[i], sn->scans, &sn->contrast[i], &sn->err[i]);
+			}
+		}
+		else {
+			contrast_arrays(pl->contrast, sn->sig, sn->ref, pl->num_points,
+			                sn->contrast, sn->err);
+		}
+		sn->fit_ok = 0;
+		if (pl->use_fit) {
+			sn->fit_ok = fit_curve(pl->model, x, sn->contrast, sn->err,
+			                       pl->num_points, NULL, &sn->fit) == 0;
+		}
+		if (pl->share_name != NULL) {
+			share_publish(pl, sn, x);
+		}
+		ring_push(&pl->results, sn);
+		stage_done(&pl->stats[FIT], t_start);
+	}
+
+	free(x);
+	ring_close(&pl->results);
+	return NULL;
+}
+
+/*
+ * Output and .fit. Only flushed to disk (sync) with a checkpoint or at the
+ * end, not on every snapshot.
+ */
+static int write_results(struct pipeline *pl, struct snapshot *sn, int sync)
+{
+	char tmp[1100], path[1024];
+	FILE *fp;
+	int i;
+	double x;
+
+	fp = atomic_open(pl->out_path, tmp, sizeof(tmp));
+	if (fp == NULL) {
+		return -1;
+	}
+	for(i=0; i<pl->num_points; i++) {
+		x = (pl->x_max - pl->x_min) / (pl->num_points - 1) * i + pl->x_min;
+		fprintf(fp, "%.10g\t%.10g\t%.10g\t%.0f\t%.0f", x,
+		        sn->contrast[i], sn->err[i],
+		        sn->sig[i], sn->ref[i]);
+		if (sn->shots != NULL) {
+			fprintf(fp, "\t%ld\t%ld", sn->shots[i], sn->ref_shots[i]);
+		}
+		fprintf(fp, "\n");
+	}
+	if (atomic_commit(fp, tmp, pl->out_path, sync) != 0) {
+		return -1;
+	}
+
+	if (pl->use_fit) {
+		snprintf(path, sizeof(path), "%s.fit", pl->out_path);
+		fp = atomic_open(path, tmp, sizeof(tmp));
+		if (fp == NULL) {
+			return -1;
+		}
+		fprintf(fp, "scans\t%ld\n", sn->scans);
+		fprintf(fp, "ok\t%d\n", sn->fit_ok);
+		for(i=0; sn->fit_ok && i<sn->fit.num_params; i++) {
+			fprintf(fp, "p%d\t%.10g\t%g\n", i, sn->fit.p[i], sn->fit.err[i]);
+		}
+		if (sn->fit_ok) {
+			fprintf(fp, "chi2\t%g\n", sn->fit.chi2);
+		}
+		if (atomic_commit(fp, tmp, path, sync) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void write_stats(struct pipeline *pl, FILE *fp)
+{
+	struct ring *feeds[NUM_STAGES] = { NULL, &pl->scans, &pl->snapshots, &pl->results };
+	long items;
+	int i;
+
+	for(i=0; i<NUM_STAGES; i++) {
+		items = atomic_load(&pl->stats[i].items);
+		fprintf(fp, "%s\t%ld\t%g\t%g\t%u\t%u\t%ld\n", stage_names[i], items,
+		        items > 0 ? atomic_load(&pl->stats[i].latency_sum_us) * 1e-6 / items : 0,
+		        atomic_load(&pl->stats[i].latency_max_us) * 1e-6,
+		        feeds[i] ? ring_depth(feeds[i]) : 0,
+		        feeds[i] ? atomic_load(&feeds[i]->max_depth) : 0,
+		        atomic_load(&pl->stats[i].dropped));
+	}
+}
+
+static int write_checkpoint(struct pipeline *pl, struct snapshot *sn)
+{
+	struct checkpoint ck;
+	FILE *fp;
+
+	memset(&ck, 0, sizeof(ck));
+	ck.program_hash = pl->program_hash;
+	checkpoint_text(ck.burn, pl->burn);
+	ck.num_points = pl->num_points;
+	ck.num_slots = pl->num_slots;
+	ck.x_min = pl->x_min;
+	ck.x_max = pl->x_max;
+	ck.scans = sn->scans;
+	strncpy(ck.spool, pl->spool_path, sizeof(ck.spool) - 1);
+	ck.spool_offset = sn->spool_offset;
+	ck.spool_id = pl->spool_id;
+	if (pl->track_path != NULL && (fp = fopen(pl->track_path, "r")) != NULL) {
+		if (fgets(ck.track, sizeof(ck.track), fp) != NULL) {
+			ck.track[strcspn(ck.track, "\r\n")] = 0;
+		}
+		fclose(fp);
+	}
+	ck.sums = sn->all_sums;
+	ck.shots = sn->all_shots;
+	return checkpoint_write(pl->checkpoint_path, &ck);
+}
+
+static void *store_thread(void *arg)
+{
+	struct pipeline *pl = arg;
+	char tmp[1100], path[1024];
+	double t_start;
+	struct snapshot *sn;
+	FILE *fp;
+	int sync;
+
+	snprintf(path, sizeof(path), "%s.stats", pl->out_path);
+
+	while ((sn = ring_pop(&pl->results)) != NULL) {
+		t_start = clock_seconds();
+		//fsync only with a checkpoint or at the end, not three files per snapshot
+		sync = sn->checkpoint || sn->final;
+		if (write_results(pl, sn, sync) != 0) {
+			printf("Error writing %s\n", pl->out_path);
+		}
+		if (sn->checkpoint && write_checkpoint(pl, sn) != 0) {
+			printf("Error writing %s\n", pl->checkpoint_path);
+		}
+		snapshot_free(sn);
+		stage_done(&pl->stats[STORE], t_start);
+
+		fp = atomic_open(path, tmp, sizeof(tmp));
+		if (fp != NULL) {
+			write_stats(pl, fp);
+			atomic_commit(fp, tmp, path, sync);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Picks up an existing checkpoint if it is for this sweep and program.
+ * Returns -1 if there is anything else there, so another run's sums are
+ * never overwritten by accident; with fresh=1 it is moved to <path>.old.
+ */
+static int resume_checkpoint(struct pipeline *pl, int fresh)
+{
+	struct checkpoint *ck = &pl->resume;
+	char old[1100];
+
+	if (!file_exists(pl->checkpoint_path)) {
+		return 0;
+	}
+	if (fresh) {
+		snprintf(old, sizeof(old), "%s.old", pl->checkpoint_path);
+		remove(old);
+		if (rename(pl->checkpoint_path, old) != 0) {
+			printf("Could not move %s to %s", pl->checkpoint_path, old);
+			return -1;
+		}
+		return 0;
+	}
+	if (checkpoint_read(pl->checkpoint_path, ck) != 0
+	    || ck->num_points != pl->num_points || ck->num_slots != pl->num_slots
+	    || ck->x_min != pl->x_min || ck->x_max != pl->x_max
+	    || ck->program_hash != pl->program_hash) {
+		printf("Checkpoint %s is for a different sweep or program (fresh=1 to start over)",
+		       pl->checkpoint_path);
+		checkpoint_free(ck);
+		return -1;
+	}
+	if (strcmp(ck->spool, pl->spool_path) == 0) {
+		pl->spool_start = ck->spool_offset;
+	}
+	printf("Resuming from %ld scans\n", ck->scans);
+	return 0;
+}
+
+/*
+ * New archive, or when resuming, the existing one cut back to the scans in
+ * the checkpoint.
+ */
+static int open_archive(struct pipeline *pl)
+{
+	long long keep = -1;
+
+	if (pl->resume.sums != NULL && file_exists(pl->archive_path)) {
+		keep = pl->resume.scans;
+	}
+	if (count_archive_open(&pl->archive, pl->archive_path, pl->num_points, pl->num_slots,
+	                       ARCHIVE_SCANS, 1, keep) != 0) {
+		return -1;
+	}
+	if (pl->resume.sums != NULL && pl->archive.scans < (unsigned long long) pl->resume.scans) {
+		printf("Archive %s has %llu of the %ld scans in the checkpoint\n",
+		       pl->archive_path, pl->archive.scans, pl->resume.scans);
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct pipeline pl;
+	pthread_t threads[NUM_STAGES];
+	void *(*funcs[NUM_STAGES])(void *) = { acquire_thread, reduce_thread, fit_thread, store_thread };
+	unsigned int depth = 64;
+	const char *program = NULL;
+	int i, has_seed = 0, fresh = 0;
+	unsigned int seed = 0;
+	long chunk_scans = 0;
+
+	if (argc < 11) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+
+	memset(&pl, 0, sizeof(pl));
+	pl.spool_path = argv[1];
+	pl.out_path = argv[2];
+	pl.num_points = atoi(argv[3]);
+	pl.num_slots = atoi(argv[4]);
+	pl.sig_slot = atoi(argv[5]);
+	pl.ref_slot = atoi(argv[6]);
+	if (contrast_parse(argv[7], &pl.contrast) != 0) {
+		printf("Unknown contrast %s", argv[7]);
+		return -1;
+	}
+	pl.use_fit = 1;
+	if (strcmp(argv[8], "none") == 0) {
+		pl.use_fit = 0;
+	}
+	else if (strcmp(argv[8], "rabi") == 0) {
+		pl.model = FIT_RABI;
+	}
+	else if (strcmp(argv[8], "decay") == 0) {
+		pl.model = FIT_DECAY;
+	}
+	else if (strcmp(argv[8], "esr") == 0) {
+		pl.model = FIT_ESR;
+	}
+	else {
+		printf("Unknown fit %s", argv[8]);
+		return -1;
+	}
+	pl.x_min = atof(argv[9]);
+	pl.x_max = atof(argv[10]);
+	pl.checkpoint_every = 60;
+	pl.burn = "";
+	pl.select_slot = -1;
+	pl.reselect_slot = -1;
+	for(i=11; i<argc; i++) {
+		if (strchr(argv[i], '=') == NULL && i == 11) {
+			depth = (unsigned int) atoi(argv[11]);
+		}
+		else if (strncmp(argv[i], "checkpoint=", 11) == 0) {
+			pl.checkpoint_path = argv[i] + 11;
+		}
+		else if (strncmp(argv[i], "fresh=", 6) == 0) {
+			fresh = atoi(argv[i] + 6);
+		}
+		else if (strncmp(argv[i], "every=", 6) == 0) {
+			pl.checkpoint_every = atof(argv[i] + 6);
+		}
+		else if (strncmp(argv[i], "burn=", 5) == 0) {
+			pl.burn = argv[i] + 5;
+		}
+		else if (strncmp(argv[i], "program=", 8) == 0) {
+			program = argv[i] + 8;
+		}
+		else if (strncmp(argv[i], "track=", 6) == 0) {
+			pl.track_path = argv[i] + 6;
+		}
+		else if (strncmp(argv[i], "share=", 6) == 0) {
+			pl.share_name = argv[i] + 6;
+		}
+		else if (strncmp(argv[i], "archive=", 8) == 0) {
+			pl.archive_path = argv[i] + 8;
+		}
+		else if (strncmp(argv[i], "select=", 7) == 0) {
+			if (sscanf(argv[i] + 7, "%d,%u,%d", &pl.select_slot, &pl.select_min,
+			           &pl.reselect_slot) != 3
+			    || pl.select_slot < 0 || pl.reselect_slot < 0) {
+				printf("Bad option %s (select=<probe slot>,<min counts>,<reference probe slot>)",
+				       argv[i]);
+				return -1;
+			}
+		}
+		else if (strncmp(argv[i], "seed=", 5) == 0) {
+			seed = (unsigned int) strtoul(argv[i] + 5, NULL, 0);
+			has_seed = 1;
+		}
+		else if (strncmp(argv[i], "chunk=", 6) == 0) {
+			chunk_scans = atol(argv[i] + 6);
+		}
+		else {
+			printf("Unknown option %s", argv[i]);
+			return -1;
+		}
+	}
+
+	if (pl.num_points < 2 || pl.num_slots <= 0
+	    || pl.sig_slot < 0 || pl.sig_slot >= pl.num_slots
+	    || pl.ref_slot < 0 || pl.ref_slot >= pl.num_slots) {
+		printf("Bad sweep/slot arguments");
+		return -1;
+	}
+	if (pl.select_slot >= 0
+	    && !(pl.select_slot < pl.sig_slot && pl.sig_slot < pl.reselect_slot
+	         && pl.reselect_slot < pl.ref_slot)) {
+		printf("select= needs probe slot < signal slot < reference probe slot < reference slot");
+		return -1;
+	}
+	if (!has_seed) {
+		seed = sweep_burn_seed(pl.burn);
+	}
+	if (sweep_unshuffle_init(&pl.unshuffle, seed, chunk_scans, pl.num_points, pl.num_slots) != 0) {
+		printf("Out of memory");
+		return -1;
+	}
+	pl.program_hash = program != NULL ? fnv1a_file(program)
+	                                  : fnv1a_string(pl.burn);
+	if (pl.checkpoint_path != NULL && resume_checkpoint(&pl, fresh) != 0) {
+		return -1;
+	}
+
+	if (ring_init(&pl.scans, depth) != 0 || ring_init(&pl.snapshots, depth) != 0
+	    || ring_init(&pl.results, depth) != 0) {
+		printf("Queue depth must be a power of 2");
+		return -1;
+	}
+	if (pl.archive_path != NULL && open_archive(&pl) != 0) {
+		return -1;
+	}
+	if (pl.share_name != NULL && share_create(&pl) != 0) {
+		printf("Could not create shared memory %s", pl.share_name);
+		return -1;
+	}
+
+	for(i=0; i<NUM_STAGES; i++) {
+		if (pthread_create(&threads[i], NULL, funcs[i], &pl) != 0) {
+			printf("Could not start %s thread", stage_names[i]);
+			return -1;
+		}
+	}
+	for(i=0; i<NUM_STAGES; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	write_stats(&pl, stdout);
+	if (pl.share_name != NULL) {
+		shared_close(&pl.shared);
+	}
+
+	ring_free(&pl.scans);
+	ring_free(&pl.snapshots);
+	ring_free(&pl.results);
+	checkpoint_free(&pl.resume);
+	sweep_unshuffle_free(&pl.unshuffle);
+	return 0;
+}
@@ -13,6 +13,7 @@
  *  window channels 1-8
  *  number of scans (samples before track)
  *  number of times (samples) per scan (time axis points)
+ *  optional name=value args, see BurnOptions.h
  */
 
 #include <stdio.h>
@@ -21,13 +22,15 @@
 #define PBESRPRO
 #define CLOCK 500.0
 #include "spinapi.h"
+#include "BurnOptions.h"
+#include "SweepOrder.h"
 
 int detect_boards();
 int select_board(int numBoards);
 
 int main(int argc, char *argv[])
 {
-	int start, scan_loop, status;
+	int scan_loop;
 	int num_scans, num_times; //num_times - the number of times to pulse the MW
 	                           //num_scans - number of runs for min->max
 	int numBoards;
@@ -37,15 +40,21 @@ int main(int argc, char *argv[])
 	double min_time, max_time, mw_time;
 	int window_channel[8];
 	int window_channel3;
+	int *order;
+	struct burn_options options;
 
 	//Uncommenting the line below will generate a debug log in your current
 	//directory that can help debug any problems that you may be experiencing   
 	//pb_set_debug(1); 
 	
-	if (argc != 20) {
+	if (argc < 20) {
        printf("Wrong number of arguments");
        return -1;
     }
+    if (parse_burn_options(argc, argv, 20, &options) != 0
+        || check_reprobe(&options, 4, 8) != 0) {
+       return -1;
+    }
 
 	/*If there is more than one board in the system, have the user specify. */
 	if ((numBoards = detect_boards()) > 1) {
@@ -58,7 +67,7 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 	
-	int i;
+	int i, j, k;
 	for(i=0; i<8; i++) {
         window_time[i] = atof(argv[i+1]) * 1e9; //convert to ns
         window_channel[i] = atoi(argv[i+10]);
@@ -72,15 +81,28 @@ int main(int argc, char *argv[])
     max_time = window_time[8];  //already in ns
     num_scans = atoi(argv[18]);
     num_times = atoi(argv[19]);
+    
+    order = malloc(num_times * sizeof(int));
+    sweep_order(order, num_times, options.seed);
 	
 	// Tell the driver what clock frequency the board has (in MHz)
 	pb_core_clock(CLOCK);
 
 	pb_start_programming(PULSE_PROGRAM);
+	if (burn_head(&options) != 0) {
+		printf("Error burning the program: %s\n", pb_get_error());
+		return -1;
+	}
 	
 	scan_loop = pb_inst(0x0, LOOP, num_scans, 50 * ns);
-	for(i=0; i<num_times; i++) {
+	for(k=0; k<num_times; k++) {
+        i = order[k];
         pb_inst(window_channel[0], CONTINUE, 0, window_time[0] * ns);
+        //charge check after the window 1 repump, before the MW
+        if (burn_charge_check(&options) != 0) {
+            printf("Error burning the program: %s\n", pb_get_error());
+            return -1;
+        }
         pb_inst(window_channel[1], CONTINUE, 0, window_time[1] * ns);
         
         mw_time = (max_time - min_time)/(num_times-1)*i + min_time;
@@ -92,17 +114,24 @@ int main(int argc, char *argv[])
         }
         pb_inst(window_channel3, CONTINUE, 0, mw_time * ns);
         
-        pb_inst(window_channel[3], CONTINUE, 0, window_time[3] * ns);
-        pb_inst(window_channel[4], CONTINUE, 0, window_time[4] * ns);
-        pb_inst(window_channel[5], CONTINUE, 0, window_time[5] * ns);
-        pb_inst(window_channel[6], CONTINUE, 0, window_time[6] * ns);
-        pb_inst(window_channel[7], CONTINUE, 0, window_time[7] * ns);
+        //windows 4-8, with the reference probe (reprobe=) in front of one
+        for(j=3; j<8; j++) {
+            if (burn_reprobe(&options, j + 1) != 0) {
+                printf("Error burning the program: %s\n", pb_get_error());
+                return -1;
+            }
+            pb_inst(window_channel[j], CONTINUE, 0, window_time[j] * ns);
+        }
     }
     pb_inst(0x0, END_LOOP, scan_loop, 50*ns);
-    pb_inst(0x0, STOP, 0, 10*ns);
+    if (burn_end(&options) != 0) {
+        printf("Error burning the program: %s\n", pb_get_error());
+        return -1;
+    }
 
 	
 	pb_stop_programming();
+	free(order);
 
 	return 0;
 }
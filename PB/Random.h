@@ -0,0 +1,104 @@
+/**
+ * \file Random.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Seeded random numbers for the simulators: xorshift64*, normal and
+ *  Poisson deviates. Each simulator keeps its own state so runs are
+ *  reproducible from the seed.
+ */
+
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+typedef unsigned long long rand_state;
+
+static inline void rand_seed(rand_state *s, unsigned long long seed)
+{
+	//splitmix64 step so nearby seeds give unrelated streams
+	unsigned long long z = seed + 0x9E3779B97F4A7C15ull;
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	*s = (z ^ (z >> 31)) | 1;
+}
+
+static inline unsigned long long rand_u64(rand_state *s)
+{
+	unsigned long long x = *s;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*s = x;
+	return x * 0x2545F4914F6CDD1Dull;
+}
+
+//Uniform in (0, 1), never exactly 0 so it is safe to take the log of
+static inline double rand_uniform(rand_state *s)
+{
+	return ((rand_u64(s) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+static inline double rand_normal(rand_state *s)
+{
+	return sqrt(-2 * log(rand_uniform(s))) * cos(2 * M_PI * rand_uniform(s));
+}
+
+/*
+ * Poisson deviate with mean lambda. Inversion for small means, Hormann's
+ * PTRS transformed rejection above 10 (constant time for any mean).
+ */
+static inline unsigned int rand_poisson(rand_state *s, double lambda)
+{
+	double u, v, us, k, b, a, inv_alpha, vr, log_lambda;
+	double p, sum;
+	unsigned int n;
+
+	if (lambda <= 0) {
+		return 0;
+	}
+	if (lambda < 10) {
+		u = rand_uniform(s);
+		p = exp(-lambda);
+		sum = p;
+		n = 0;
+		while (u > sum && n < 1000) {
+			n++;
+			p *= lambda / n;
+			sum += p;
+		}
+		return n;
+	}
+
+	log_lambda = log(lambda);
+	b = 0.931 + 2.53 * sqrt(lambda);
+	a = -0.059 + 0.02483 * b;
+	inv_alpha = 1.1239 + 1.1328 / (b - 3.4);
+	vr = 0.9277 - 3.6224 / (b - 2);
+
+	while (1) {
+		u = rand_uniform(s) - 0.5;
+		v = rand_uniform(s);
+		us = 0.5 - fabs(u);
+		k = floor((2 * a / us + b) * u + lambda + 0.43);
+		if (us >= 0.07 && v <= vr) {
+			return (unsigned int) k;
+		}
+		if (k < 0 || (us < 0.013 && v > us)) {
+			continue;
+		}
+		if (log(v) + log(inv_alpha) - log(a / (us * us) + b)
+		    <= -lambda + k * log_lambda - lgamma(k + 1)) {
+			return (unsigned int) k;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,367 @@
+/**
+ * \file ReadoutTune.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Picks the readout gate and polarization laser times from a
+ *  ReadoutTuneBurn trace, instead of setting window 1 and the readout
+ *  windows by hand, and optionally writes them into a burner's arguments.
+ *
+ *  The bright - dark difference of the trace is the spin signal; it dies
+ *  out as the laser repolarizes the NV. For a readout gate of n bins and a
+ *  laser of m >= n bins per shot:
+ *
+ *      signal   S(n) = sum of (bright - dark) over the first n bins
+ *      noise    sqrt(V(n)), V(n) = sum of (bright + dark) over the bins
+ *      residual r(m) = difference left after m bins / total difference,
+ *               the ms=-1 population the laser leaves behind
+ *      polarization q(m) = (1 - r) / (1 + r^2), the contrast left when
+ *               pi / no-pi shots alternate with incomplete polarization
+ *
+ *  and the sensitivity per unit time is
+ *
+ *      q(m) S(n) / sqrt(V(n) (overhead + m * bin))
+ *
+ *  which is maximized over n and m. Counts in the gaps between gates are
+ *  interpolated. Longer gates add shot noise faster than signal, shorter
+ *  ones waste the shot; a longer laser buys contrast with repetition rate.
+ *
+ *  Arg Description
+ *  1   Counts (U32 spool, one record of 2 x number of bins per scan,
+ *      bright bins first, as ReadoutTuneBurn counts them)
+ *  2   Output spreadsheet: bin start (ns), bright, dark, difference,
+ *      residual r, best relative sensitivity with the gate ending there
+ *  3   Number of bins
+ *  4   Bin width (ns, as given to ReadoutTuneBurn in s)
+ *  5   Overhead (ns): time per shot with the laser off (waits, MW, tau)
+ *  6+  Optional name=value args to write the result back:
+ *      args=F     file with the burner's arguments (as LabVIEW passes them,
+ *                 whitespace separated), rewritten in place
+ *      burner=B   rabi, spinecho, cpmg or xy4
+ *      laser=M    laser channel mask (default 0x1)
+ *      gate=M     counter gate channel mask (default 0x8)
+ *      In the readout windows (Rabi 4-8, the others 8-12), every window
+ *      with both the laser and the gate becomes the readout gate and window
+ *      1 becomes the rest of the polarization. Laser-only readout windows
+ *      are left alone; the search counts them (and at least 20 ns of
+ *      window 1) in the laser time, and every gated window after the
+ *      first (e.g. the reference) as one more gate of laser.
+ *
+ *  Prints: readout gate (ns), laser after it (window 1 with args=, ns),
+ *  laser per shot (ns), gain in sensitivity per unit time over the current
+ *  args (1 without args=), and the repolarization time (ns, where r = 1/e).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "Contrast.h"
+#include "Spreadsheet.h"
+#include "AtomicWrite.h"
+
+//must match ReadoutTuneBurn.c
+#define TRACE_GATE_GAP 12.0
+#define MIN_WINDOW 20.0
+#define MAX_ARGS 64
+#define SCANS_PER_READ 256
+
+/*
+ * Where a burner keeps window 1 and the readout windows in its arguments
+ * (1-indexed, times in s, channels as integers).
+ */
+struct burner_layout {
+	const char *name;
+	int min_args;
+	int init_time, init_channel;
+	int readout_time, readout_channel;  //first of READOUT_WINDOWS
+};
+
+#define READOUT_WINDOWS 5
+
+static const struct burner_layout layouts[] = {
+	{ "rabi", 19, 1, 10, 4, 13 },
+	{ "spinecho", 25, 1, 13, 6, 19 },
+	{ "cpmg", 24, 1, 12, 7, 17 },
+	{ "xy4", 25, 1, 12, 7, 18 },
+};
+
+struct trace {
+	int bins;
+	double bin_ns, overhead_ns;
+	double *bright, *dark;
+	double *signal, *variance;  //cumulative over the first n bins, n = 0..bins
+	double *residual;           //r after n bins, n = 0..bins
+};
+
+static double polarization(double r)
+{
+	return (1 - r) / (1 + r * r);
+}
+
+//Relative sensitivity per unit time for a gate of n bins and laser_ns of laser
+static double merit(const struct trace *tr, int n, double laser_ns)
+{
+	int m = (int) floor(laser_ns / tr->bin_ns);
+
+	if (n < 1 || tr->variance[n] <= 0 || tr->signal[n] <= 0) {
+		return 0;
+	}
+	m = m > tr->bins ? tr->bins : m;
+	return polarization(tr->residual[m]) * tr->signal[n]
+	       / sqrt(tr->variance[n] * (tr->overhead_ns + laser_ns));
+}
+
+static void trace_prepare(struct trace *tr)
+{
+	int i;
+	double fill = tr->bin_ns / (tr->bin_ns - TRACE_GATE_GAP), total, tail;
+
+	tr->signal[0] = tr->variance[0] = 0;
+	for(i=0; i<tr->bins; i++) {
+		tr->signal[i+1] = tr->signal[i] + (tr->bright[i] - tr->dark[i]) * fill;
+		tr->variance[i+1] = tr->variance[i] + (tr->bright[i] + tr->dark[i]) * fill;
+	}
+
+	//r from the difference still to come, kept non-increasing against noise
+	total = tr->signal[tr->bins];
+	tr->residual[0] = 1;
+	for(i=1; i<=tr->bins; i++) {
+		tail = total > 0 ? (total - tr->signal[i]) / total : 0;
+		tail = tail < 0 ? 0 : tail;
+		tr->residual[i] = tail < tr->residual[i-1] ? tail : tr->residual[i-1];
+	}
+}
+
+static int read_args(const char *path, char args[][64], int *num_args)
+{
+	FILE *fp = fopen(path, "r");
+
+	if (fp == NULL) {
+		printf("Could not open %s", path);
+		return -1;
+	}
+	*num_args = 0;
+	while (*num_args < MAX_ARGS && fscanf(fp, "%63s", args[*num_args]) == 1) {
+		(*num_args)++;
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int write_args(const char *path, char args[][64], int num_args)
+{
+	char tmp[1100];
+	int i;
+	FILE *fp = atomic_open(path, tmp, sizeof(tmp));
+
+	if (fp == NULL) {
+		printf("Could not write %s", path);
+		return -1;
+	}
+	for(i=0; i<num_args; i++) {
+		fprintf(fp, i ? " %s" : "%s", args[i]);
+	}
+	fprintf(fp, "\n");
+	return atomic_close(fp, tmp, path);
+}
+
+int main(int argc, char *argv[])
+{
+	struct trace tr;
+	struct count_sums cs;
+	const struct burner_layout *layout = NULL;
+	const char *args_path = NULL, *burner = NULL;
+	char args[MAX_ARGS][64];
+	int laser = 0x1, gate = 0x8, num_args = 0;
+	int i, n, w, best_n = 0, best_w = 0, cur_n = 1, found, ch, error;
+	int extra_gates = 0;    //gated windows after the first, rewritten to the gate too
+	double best = 0, f, t, gain = 1, tau_ns, gate_ns, init_ns;
+	double fixed_ns = 0;    //laser per shot that isn't the gate or tuned
+	double cur_laser = 0;   //laser per shot with the current args
+	double *table;
+	unsigned int *block;
+	size_t record, got;
+	FILE *fp;
+
+	if (argc < 6) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	tr.bins = atoi(argv[3]);
+	tr.bin_ns = atof(argv[4]);
+	tr.overhead_ns = atof(argv[5]);
+	if (tr.bins < 1 || tr.bin_ns <= TRACE_GATE_GAP || tr.overhead_ns < 0) {
+		printf("Bad bin arguments");
+		return -1;
+	}
+	for(i=6; i<argc; i++) {
+		if (strncmp(argv[i], "args=", 5) == 0) {
+			args_path = argv[i] + 5;
+		}
+		else if (strncmp(argv[i], "burner=", 7) == 0) {
+			burner = argv[i] + 7;
+		}
+		else if (strncmp(argv[i], "laser=", 6) == 0) {
+			laser = (int) strtol(argv[i] + 6, NULL, 0);
+		}
+		else if (strncmp(argv[i], "gate=", 5) == 0) {
+			gate = (int) strtol(argv[i] + 5, NULL, 0);
+		}
+		else {
+			printf("Unknown option %s", argv[i]);
+			return -1;
+		}
+	}
+	if (args_path != NULL) {
+		for(i=0; burner != NULL && i<(int) (sizeof(layouts) / sizeof(layouts[0])); i++) {
+			if (strcmp(burner, layouts[i].name) == 0) {
+				layout = &layouts[i];
+			}
+		}
+		if (layout == NULL) {
+			printf("args= needs burner=rabi, spinecho, cpmg or xy4");
+			return -1;
+		}
+		if (read_args(args_path, args, &num_args) != 0) {
+			return -1;
+		}
+		if (num_args < layout->min_args) {
+			printf("%s has %d args, %s needs %d", args_path, num_args, layout->name,
+			       layout->min_args);
+			return -1;
+		}
+
+		//current settings, and the laser-only time the readout block keeps
+		found = 0;
+		for(i=0; i<READOUT_WINDOWS; i++) {
+			ch = atoi(args[layout->readout_channel - 1 + i]);
+			t = atof(args[layout->readout_time - 1 + i]) * 1e9;
+			if ((ch & laser) && (ch & gate)) {
+				if (!found) {
+					cur_n = (int) floor(t / tr.bin_ns + 0.5);
+				}
+				else {
+					extra_gates++;
+				}
+				cur_laser += t;
+				found = 1;
+			}
+			else if (ch & laser) {
+				fixed_ns += t;
+			}
+		}
+		if (!found) {
+			printf("No readout window (laser and gate) in the %s args", layout->name);
+			return -1;
+		}
+		if (atoi(args[layout->init_channel - 1]) & laser) {
+			cur_laser += atof(args[layout->init_time - 1]) * 1e9;
+		}
+		cur_laser += fixed_ns;
+		cur_n = cur_n < 1 ? 1 : cur_n > tr.bins ? tr.bins : cur_n;
+		//window 1 can't go below MIN_WINDOW
+		fixed_ns += MIN_WINDOW;
+	}
+
+	//sum the trace, bright as point 0 and dark as point 1
+	fp = fopen(argv[1], "rb");
+	if (fp == NULL) {
+		printf("Could not open %s", argv[1]);
+		return -1;
+	}
+	record = (size_t) 2 * tr.bins;
+	block = malloc(record * SCANS_PER_READ * sizeof(unsigned int));
+	if (block == NULL || count_sums_init(&cs, 2, tr.bins) != 0) {
+		printf("Out of memory");
+		return -1;
+	}
+	while ((got = fread(block, record * sizeof(unsigned int), SCANS_PER_READ, fp)) > 0) {
+		count_sums_add(&cs, block, (long) got);
+	}
+	fclose(fp);
+	free(block);
+	if (cs.scans == 0) {
+		printf("No complete scans in %s", argv[1]);
+		count_sums_free(&cs);
+		return -1;
+	}
+
+	tr.bright = malloc(tr.bins * sizeof(double));
+	tr.dark = malloc(tr.bins * sizeof(double));
+	tr.signal = malloc((tr.bins + 1) * sizeof(double));
+	tr.variance = malloc((tr.bins + 1) * sizeof(double));
+	tr.residual = malloc((tr.bins + 1) * sizeof(double));
+	for(i=0; i<tr.bins; i++) {
+		tr.bright[i] = (double) count_sums_slot(&cs, i)[0];
+		tr.dark[i] = (double) count_sums_slot(&cs, i)[1];
+	}
+	count_sums_free(&cs);
+	trace_prepare(&tr);
+
+	table = malloc((size_t) tr.bins * 6 * sizeof(double));
+	for(n=1; n<=tr.bins; n++) {
+		table[(n-1)*6 + 5] = 0;
+		//laser after the gate in whole bins, at least once even past the trace
+		for(w=0; w==0 || n+w<=tr.bins; w++) {
+			f = merit(&tr, n, (n + w + extra_gates * n) * tr.bin_ns + fixed_ns);
+			if (f > table[(n-1)*6 + 5]) {
+				table[(n-1)*6 + 5] = f;
+			}
+			if (f > best) {
+				best = f;
+				best_n = n;
+				best_w = w;
+			}
+		}
+	}
+	if (best <= 0) {
+		printf("No spin signal in the trace (dark is not darker than bright)");
+		return -1;
+	}
+	tau_ns = tr.bins * tr.bin_ns;
+	for(i=0; i<=tr.bins; i++) {
+		if (tr.residual[i] <= exp(-1)) {
+			tau_ns = i * tr.bin_ns;
+			break;
+		}
+	}
+	for(i=0; i<tr.bins; i++) {
+		table[i*6] = i * tr.bin_ns;
+		table[i*6 + 1] = tr.bright[i];
+		table[i*6 + 2] = tr.dark[i];
+		table[i*6 + 3] = tr.bright[i] - tr.dark[i];
+		table[i*6 + 4] = tr.residual[i+1];
+		table[i*6 + 5] /= best;
+	}
+	error = write_spreadsheet(argv[2], table, tr.bins, 6);
+	free(table);
+
+	gate_ns = best_n * tr.bin_ns;
+	init_ns = best_w * tr.bin_ns;
+	if (layout != NULL && error == 0) {
+		f = merit(&tr, cur_n, cur_laser);
+		gain = f > 0 ? best / f : HUGE_VAL;
+
+		init_ns += MIN_WINDOW;
+		for(i=0; i<READOUT_WINDOWS; i++) {
+			ch = atoi(args[layout->readout_channel - 1 + i]);
+			if ((ch & laser) && (ch & gate)) {
+				sprintf(args[layout->readout_time - 1 + i], "%.9g", gate_ns * 1e-9);
+			}
+		}
+		sprintf(args[layout->init_time - 1], "%.9g", init_ns * 1e-9);
+		error = write_args(args_path, args, num_args);
+	}
+
+	printf("%g\t%g\t%g\t%g\t%g\n", gate_ns, init_ns,
+	       (1 + extra_gates) * gate_ns + best_w * tr.bin_ns + fixed_ns, gain, tau_ns);
+
+	free(tr.bright);
+	free(tr.dark);
+	free(tr.signal);
+	free(tr.variance);
+	free(tr.residual);
+	return error;
+}
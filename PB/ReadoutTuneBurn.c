@@ -0,0 +1,171 @@
+/**
+ * \file ReadoutTuneBurn.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Called from LabVIEW, burns the time-resolved fluorescence sequence for
+ *  tuning the polarization and readout windows (see ReadoutTune.c).
+ *
+ *  Every scan has two shots, bright (no MW) then dark (pi pulse). Each is
+ *  a long init laser, a wait, the MW window, a wait, and then the laser on
+ *  for number of bins x bin width with the counter gate sliding along it:
+ *  one gate per bin, high for all but the last TRACE_GATE_GAP ns of the bin
+ *  so consecutive bins are separate gates. One repetition of the scan loop
+ *  is 2 x number of bins counts, bright bins first.
+ *
+ *  Make the trace a few repolarization times long (~3 us) so the bright
+ *  and dark traces have met by the end; the init laser should fully
+ *  polarize on its own (a few us too).
+ *
+ *  Arg Description
+ *  1   Init laser time
+ *  2   Wait after init
+ *  3   Pi pulse time
+ *  4   Wait after the pi pulse
+ *  5   Bin width
+ *  6   Number of bins
+ *  7   Laser channels
+ *  8   MW channels
+ *  9   Counter gate channels
+ *  10  Number of scans
+ *  11+ Optional name=value args, see BurnOptions.h (hold=, aoclock=;
+ *      seed= and charge= would change the count layout ReadoutTune reads)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PBESRPRO
+#define CLOCK 500.0
+#include "spinapi.h"
+#include "BurnOptions.h"
+
+//gate low at the end of each bin: the shortest window that still gets ON
+#define TRACE_GATE_GAP 12.0
+
+int detect_boards();
+int select_board(int numBoards);
+
+int main(int argc, char *argv[])
+{
+	int scan_loop, num_scans, num_bins, numBoards;
+	int laser, mw, gate, shot, bin;
+	double init_time, init_wait, pi_time, pi_wait, bin_time;
+	struct burn_options options;
+
+	//Uncommenting the line below will generate a debug log in your current
+	//directory that can help debug any problems that you may be experiencing
+	//pb_set_debug(1);
+
+	if (argc < 11) {
+       printf("Wrong number of arguments");
+       return -1;
+    }
+    if (parse_burn_options(argc, argv, 11, &options) != 0) {
+       return -1;
+    }
+    if (options.seed != 0 || options.charge != 0) {
+       printf("seed= and charge= are not supported for the readout trace");
+       return -1;
+    }
+
+    init_time = atof(argv[1]) * 1e9;   //convert to ns
+    init_wait = atof(argv[2]) * 1e9;
+    pi_time = atof(argv[3]) * 1e9;
+    pi_wait = atof(argv[4]) * 1e9;
+    bin_time = atof(argv[5]) * 1e9;
+    num_bins = atoi(argv[6]);
+    laser = atoi(argv[7]);
+    mw = atoi(argv[8]);
+    gate = atoi(argv[9]);
+    num_scans = atoi(argv[10]);
+    if (bin_time - TRACE_GATE_GAP <= 5*2 || num_bins < 1 || init_time <= 5*2
+        || init_wait <= 5*2 || pi_time <= 5*2 || pi_wait <= 5*2) {
+       printf("Windows must be longer than 10 ns (bins longer than %g ns)",
+              TRACE_GATE_GAP + 5*2);
+       return -1;
+    }
+
+	/*If there is more than one board in the system, have the user specify. */
+	if ((numBoards = detect_boards()) > 1) {
+		select_board(numBoards);
+	}
+
+	if (pb_init() != 0) {
+		printf("Error initializing board: %s\n", pb_get_error());
+		system("pause");
+		return -1;
+	}
+
+	// Tell the driver what clock frequency the board has (in MHz)
+	pb_core_clock(CLOCK);
+
+	pb_start_programming(PULSE_PROGRAM);
+	if (burn_head(&options) != 0) {
+		printf("Error burning the program: %s\n", pb_get_error());
+		return -1;
+	}
+
+	scan_loop = pb_inst(0x0, LOOP, num_scans, 50 * ns);
+	for(shot=0; shot<2; shot++) {
+        pb_inst(ON | laser, CONTINUE, 0, init_time * ns);
+        pb_inst(ON, CONTINUE, 0, init_wait * ns);
+        //bright: the same time with the MW off
+        pb_inst(shot ? ON | mw : ON, CONTINUE, 0, pi_time * ns);
+        pb_inst(ON, CONTINUE, 0, pi_wait * ns);
+
+        for(bin=0; bin<num_bins; bin++) {
+            pb_inst(ON | laser | gate, CONTINUE, 0, (bin_time - TRACE_GATE_GAP) * ns);
+            pb_inst(ON | laser, CONTINUE, 0, TRACE_GATE_GAP * ns);
+        }
+    }
+    pb_inst(0x0, END_LOOP, scan_loop, 50*ns);
+    if (burn_end(&options) != 0) {
+        printf("Error burning the program: %s\n", pb_get_error());
+        return -1;
+    }
+
+
+	pb_stop_programming();
+
+	return 0;
+}
+
+int detect_boards()
+{
+	int numBoards;
+
+	numBoards = pb_count_boards();	/*Count the number of boards */
+
+	if (numBoards <= 0) {
+		printf
+		    ("No Boards were detected in your system. Verify that the board "
+		     "is firmly secured in the PCI slot.\n\n");
+		system("PAUSE");
+		exit(-1);
+	}
+
+	return numBoards;
+}
+
+int select_board(int numBoards)
+{
+	int choice;
+
+	do {
+		printf
+		    ("Found %d boards in your system. Which board should be used? "
+		     "(0-%d): ", numBoards, numBoards - 1);
+		fflush(stdin);
+		scanf("%d", &choice);
+
+		if (choice < 0 || choice >= numBoards) {
+			printf("Invalid Board Number (%d).\n", choice);
+		}
+	} while (choice < 0 || choice >= numBoards);
+
+	pb_select_board(choice);
+	printf("Board %d selected.\n", choice);
+
+	return choice;
+}
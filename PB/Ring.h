@@ -0,0 +1,130 @@
+/**
+ * \file Ring.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Bounded single-producer/single-consumer queue of pointers between two
+ *  pipeline threads. Lock-free: the producer only writes head, the consumer
+ *  only writes tail. A full queue makes the producer wait (back-pressure)
+ *  instead of growing without limit.
+ *
+ *  Capacity must be a power of 2.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define ring_sleep() Sleep(1)
+#else
+#include <unistd.h>
+#define ring_sleep() usleep(1000)
+#endif
+
+struct ring {
+	void **slots;
+	unsigned int mask;
+	atomic_uint head;        //next slot to write, producer only
+	atomic_uint tail;        //next slot to read, consumer only
+	atomic_int closed;       //producer is done, no more items
+	atomic_uint max_depth;   //high water mark, for the stage statistics
+};
+
+static inline int ring_init(struct ring *q, unsigned int capacity)
+{
+	if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+		return -1;
+	}
+	q->slots = calloc(capacity, sizeof(void *));
+	if (q->slots == NULL) {
+		return -1;
+	}
+	q->mask = capacity - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	atomic_init(&q->closed, 0);
+	atomic_init(&q->max_depth, 0);
+	return 0;
+}
+
+static inline void ring_free(struct ring *q)
+{
+	free(q->slots);
+	q->slots = NULL;
+}
+
+static inline unsigned int ring_depth(struct ring *q)
+{
+	return atomic_load_explicit(&q->head, memory_order_acquire)
+	     - atomic_load_explicit(&q->tail, memory_order_acquire);
+}
+
+//Returns 0, or -1 if the queue is full
+static inline int ring_try_push(struct ring *q, void *item)
+{
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+	if (head - tail > q->mask) {
+		return -1;
+	}
+	q->slots[head & q->mask] = item;
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+	if (head + 1 - tail > atomic_load_explicit(&q->max_depth, memory_order_relaxed)) {
+		atomic_store_explicit(&q->max_depth, head + 1 - tail, memory_order_relaxed);
+	}
+	return 0;
+}
+
+//Returns the item, or NULL if the queue is empty
+static inline void *ring_try_pop(struct ring *q)
+{
+	unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+	void *item;
+
+	if (tail == head) {
+		return NULL;
+	}
+	item = q->slots[tail & q->mask];
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return item;
+}
+
+//Waits while the queue is full
+static inline void ring_push(struct ring *q, void *item)
+{
+	while (ring_try_push(q, item) != 0) {
+		ring_sleep();
+	}
+}
+
+/*
+ * Waits for an item. Returns NULL once the producer has closed the queue
+ * and everything in it has been read.
+ */
+static inline void *ring_pop(struct ring *q)
+{
+	void *item;
+
+	while ((item = ring_try_pop(q)) == NULL) {
+		if (atomic_load_explicit(&q->closed, memory_order_acquire)) {
+			//anything pushed before close is visible now
+			return ring_try_pop(q);
+		}
+		ring_sleep();
+	}
+	return item;
+}
+
+static inline void ring_close(struct ring *q)
+{
+	atomic_store_explicit(&q->closed, 1, memory_order_release);
+}
+
+#endif
@@ -0,0 +1,304 @@
+/**
+ * \file RunCatalog.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Records finished runs in the run catalog (RunCatalog.h) and searches
+ *  it. Called from the end of each experiment VI with what it knows about
+ *  the run; the fit is picked up from <file>.fit (PulsedPipeline) if
+ *  there is one.
+ *
+ *  Usage:
+ *  RunCatalog add <catalog> <type> <file> [name=value ...]
+ *      Adds a run of experiment <type> with result file <file>. Fields as
+ *      in RunCatalog.h, e.g. x= y= z= nv= burn="<burner command line>"
+ *      and calibration or key parameters (pi=, freq=, tau=, ...); date=
+ *      (seconds, or YYYY-MM-DD[ HH:MM:SS] local time) defaults to now.
+ *      From <file>.fit: scans, fit_ok, fit_p0, fit_p0_err, ..., fit_chi2.
+ *      Prints the run number.
+ *  RunCatalog find <catalog> [condition ...] [cols=name,...] [max=N]
+ *      Prints the matching runs by date, one per line: run, date, type,
+ *      nv, x, y, z, file, then the cols= fields; last the number of runs
+ *      found and the milliseconds the query took. Conditions (all must
+ *      hold):
+ *      type=T  nv=N  near=x,y,z,r  from=DATE  to=DATE  days=D
+ *      <field>=V  <field><V  <field><=V  <field>>V  <field>>=V
+ *      DATE is YYYY-MM-DD[ HH:MM[:SS]] (local) or seconds since 1970; to=
+ *      with a bare date includes that day. Quote conditions with < or >.
+ *      E.g. find runs.txt type=cpmg nv=7 "tau>10e-6" from=2026-09-01
+ *  RunCatalog show <catalog> <run>
+ *      Prints every field of a run, one per line.
+ *  RunCatalog index <catalog>
+ *      Rebuilds the index and prints runs, field names and milliseconds
+ *      (done automatically when the catalog has changed).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "RunCatalog.h"
+#include "Clock.h"
+
+#define LINE_LENGTH 16384
+
+//Appends "\t<name>=<value>"; -1 if it doesn't fit or would break the line
+static int append_field(char *line, const char *name, const char *value)
+{
+	size_t n = strlen(line);
+
+	if (strpbrk(name, "=\t\r\n") != NULL || strpbrk(value, "\t\r\n") != NULL
+	    || n + strlen(name) + strlen(value) + 3 > LINE_LENGTH) {
+		return -1;
+	}
+	sprintf(line + n, "%s%s=%s", n > 0 ? "\t" : "", name, value);
+	return 0;
+}
+
+//Fit results from PulsedPipeline's <file>.fit, if there is one
+static void append_fit(char *line, const char *file)
+{
+	char path[1100], text[256], name[64], value[64], err[64];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s.fit", file);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return;
+	}
+	while (fgets(text, sizeof(text), fp) != NULL) {
+		err[0] = 0;
+		if (sscanf(text, "%31s %63s %63s", name, value, err) < 2) {
+			continue;
+		}
+		if (strcmp(name, "scans") == 0) {
+			append_field(line, "scans", value);
+		}
+		else if (strcmp(name, "ok") == 0) {
+			append_field(line, "fit_ok", value);
+		}
+		else if (strcmp(name, "chi2") == 0) {
+			append_field(line, "fit_chi2", value);
+		}
+		else if (name[0] == 'p') {
+			snprintf(path, sizeof(path), "fit_%s", name);
+			append_field(line, path, value);
+			if (err[0] != 0) {
+				snprintf(path, sizeof(path), "fit_%s_err", name);
+				append_field(line, path, err);
+			}
+		}
+	}
+	fclose(fp);
+}
+
+static int add_run(int argc, char *argv[])
+{
+	struct catalog cat;
+	char *line = malloc(LINE_LENGTH + 2), name[CATALOG_NAME], date[32];
+	const char *eq;
+	int i, has_date = 0;
+	double t;
+	FILE *fp;
+
+	line[0] = 0;
+	append_field(line, "type", argv[3]);
+	for(i=5; i<argc; i++) {
+		eq = strchr(argv[i], '=');
+		if (eq == NULL || eq == argv[i] || eq - argv[i] >= CATALOG_NAME) {
+			printf("Bad field %s", argv[i]);
+			return -1;
+		}
+		memcpy(name, argv[i], eq - argv[i]);
+		name[eq - argv[i]] = 0;
+		if (strcmp(name, "type") == 0 || strcmp(name, "file") == 0) {
+			printf("%s is given by the fixed arguments", name);
+			return -1;
+		}
+		if (strcmp(name, "date") == 0) {
+			//stored as seconds, the index only reads a number
+			if (catalog_date(eq + 1, 0, &t) != 0) {
+				printf("Bad date %s", eq + 1);
+				return -1;
+			}
+			sprintf(date, "%.0f", t);
+			has_date = 1;
+			if (append_field(line, name, date) != 0) {
+				printf("Bad field %s", argv[i]);
+				return -1;
+			}
+		}
+		else if (append_field(line, name, eq + 1) != 0) {
+			printf("Bad field %s", argv[i]);
+			return -1;
+		}
+	}
+	if (!has_date) {
+		sprintf(date, "%.0f", (double) time(NULL));
+		append_field(line, "date", date);
+	}
+	append_fit(line, argv[4]);
+	if (append_field(line, "file", argv[4]) != 0) {
+		printf("Bad file %s", argv[4]);
+		return -1;
+	}
+	strcat(line, "\n");
+
+	//one write, so runs added at the same time don't interleave: the buffer
+	//holds the whole line, which only goes out at fclose
+	fp = fopen(argv[2], "ab");
+	if (fp == NULL || setvbuf(fp, NULL, _IOFBF, LINE_LENGTH + 2) != 0
+	    || fwrite(line, 1, strlen(line), fp) != strlen(line) || fclose(fp) != 0) {
+		printf("Could not write %s", argv[2]);
+		return -1;
+	}
+	free(line);
+
+	if (catalog_open(argv[2], &cat) != 0) {
+		return -1;
+	}
+	printf("%u\n", cat.h->num_runs - 1);
+	catalog_close(&cat);
+	return 0;
+}
+
+static void print_run(const struct catalog *cat, unsigned int run, char *cols)
+{
+	const struct catalog_run *r = &cat->runs[run];
+	char date[32], text[1100], *col, *comma;
+	time_t t = (time_t) r->date;
+	double v;
+	int name;
+
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	catalog_text(cat, run, "file", text, sizeof(text));
+	printf("%u\t%s\t%s\t%d\t%g\t%g\t%g\t%s", run, date, cat->types[r->type], r->nv,
+	       r->x, r->y, r->z, text);
+	if (cols != NULL) {
+		for(col=cols; col!=NULL; col=comma!=NULL ? comma+1 : NULL) {
+			comma = strchr(col, ',');
+			if (comma != NULL) {
+				*comma = 0;
+			}
+			//arg1, arg2, ... only exist in the index
+			name = catalog_lookup(cat->names, cat->h->num_names, col);
+			if (catalog_text(cat, run, col, text, sizeof(text)) != 0 && name >= 0
+			    && catalog_param(cat, run, (unsigned int) name, &v)) {
+				sprintf(text, "%.10g", v);
+			}
+			printf("\t%s", text);
+		}
+	}
+	printf("\n");
+}
+
+static int find_runs(int argc, char *argv[])
+{
+	struct catalog cat;
+	struct catalog_condition *c = malloc(argc * sizeof(*c));
+	char *cols = NULL, *copy;
+	unsigned int *found, n, k, max = 0xFFFFFFFFu;
+	double t;
+	int i, m = 0;
+
+	if (catalog_open(argv[2], &cat) != 0) {
+		return -1;
+	}
+	t = clock_seconds();
+	for(i=3; i<argc; i++) {
+		if (strncmp(argv[i], "cols=", 5) == 0) {
+			cols = argv[i] + 5;
+		}
+		else if (strncmp(argv[i], "max=", 4) == 0) {
+			max = (unsigned int) strtoul(argv[i] + 4, NULL, 10);
+		}
+		else if (catalog_condition(&cat, argv[i], &c[m++]) != 0) {
+			return -1;
+		}
+	}
+	found = malloc((cat.h->num_runs + 1) * sizeof(unsigned int));
+	n = catalog_find(&cat, c, m, found);
+	t = clock_seconds() - t;
+
+	copy = cols != NULL ? malloc(strlen(cols) + 1) : NULL;
+	for(k=0; k<n && k<max; k++) {
+		if (copy != NULL) {
+			strcpy(copy, cols);
+		}
+		print_run(&cat, found[k], copy);
+	}
+	printf("%u\t%.3f\n", n, t * 1e3);
+
+	free(copy);
+	free(found);
+	free(c);
+	catalog_close(&cat);
+	return 0;
+}
+
+static int show_run(const char *path, unsigned int run)
+{
+	struct catalog cat;
+	const char *line;
+	unsigned int i, length;
+	int in_value = 0;
+
+	if (catalog_open(path, &cat) != 0) {
+		return -1;
+	}
+	if (run >= cat.h->num_runs || cat.log.data == NULL) {
+		printf("No run %u in %s", run, path);
+		catalog_close(&cat);
+		return -1;
+	}
+	line = (const char *) cat.log.data + cat.runs[run].line;
+	length = cat.runs[run].length;
+	//name<tab>value, one field per line
+	for(i=0; i<length && line[i] != '\r'; i++) {
+		if (line[i] == '\t') {
+			in_value = 0;
+			putchar('\n');
+		}
+		else if (line[i] == '=' && !in_value) {
+			in_value = 1;
+			putchar('\t');
+		}
+		else {
+			putchar(line[i]);
+		}
+	}
+	printf("\n");
+	catalog_close(&cat);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char index_path[1100];
+	double t;
+	struct catalog cat;
+
+	if (argc >= 5 && strcmp(argv[1], "add") == 0) {
+		return add_run(argc, argv);
+	}
+	if (argc >= 3 && strcmp(argv[1], "find") == 0) {
+		return find_runs(argc, argv);
+	}
+	if (argc == 4 && strcmp(argv[1], "show") == 0) {
+		return show_run(argv[2], (unsigned int) strtoul(argv[3], NULL, 10));
+	}
+	if (argc == 3 && strcmp(argv[1], "index") == 0) {
+		t = clock_seconds();
+		snprintf(index_path, sizeof(index_path), "%s.idx", argv[2]);
+		if (catalog_build(argv[2], index_path) != 0 || catalog_open(argv[2], &cat) != 0) {
+			return -1;
+		}
+		printf("%u\t%u\t%.1f\n", cat.h->num_runs, cat.h->num_names,
+		       (clock_seconds() - t) * 1e3);
+		catalog_close(&cat);
+		return 0;
+	}
+	printf("Wrong number of arguments");
+	return -1;
+}
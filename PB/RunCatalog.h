@@ -0,0 +1,886 @@
+/**
+ * \file RunCatalog.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Catalog of finished runs, so "all CPMG runs on NV 7 with tau over
+ *  10 us from last month" is a lookup instead of a search through file
+ *  names and spreadsheets.
+ *
+ *  The catalog itself is a text file with one run per line, tab separated
+ *  name=value fields, appended to by RunCatalog add:
+ *
+ *  type    experiment (rabi, esr, cpmg, ...)
+ *  date    seconds since 1970
+ *  x y z   NV position (um)
+ *  nv      NV number (SurveyPlan), -1 if none
+ *  file    result file
+ *  burn    burner command line; its numbers are also indexed as arg1,
+ *          arg2, ... in order
+ *  other   any other numeric field (calibration, fit output, key
+ *          parameters) is indexed under its name; text fields are kept
+ *          but not indexed
+ *
+ *  Queries go through <catalog>.idx, a binary index next to it that is
+ *  rebuilt whenever the catalog has changed size since it was written. It
+ *  holds the runs' indexed fields and sorted run lists by date, by type
+ *  (then date), by x and by NV number, and every numeric field's values
+ *  sorted. A query takes the condition whose index range is smallest and
+ *  checks only the runs in it against the other conditions, so it costs
+ *  the size of the most selective condition, not the size of the catalog.
+ */
+
+#ifndef RUN_CATALOG_H
+#define RUN_CATALOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "MapFile.h"
+#include "AtomicWrite.h"
+#include "Hash.h"
+
+#define CATALOG_MAGIC "PBRUNIDX"
+#define CATALOG_NAME 32
+#define CATALOG_HASH 4096   //most distinct field names or types, times 2
+
+struct catalog_header {
+	char magic[8];
+	unsigned long long log_size;    //catalog bytes indexed
+	unsigned int num_runs, num_types, num_names, reserved;
+	unsigned long long num_params;
+	//section offsets
+	unsigned long long types, names, name_first, runs, params, values;
+	unsigned long long by_date, by_type, by_x, by_nv;
+};
+
+struct catalog_run {
+	double date, x, y, z;
+	int nv, type;
+	unsigned long long line;        //offset of its line in the catalog
+	unsigned int length;
+	unsigned int param_first, param_count;
+	unsigned int reserved;
+};
+
+//A numeric field of a run; params are by run then name, values by name then value
+struct catalog_param {
+	double value;
+	unsigned int name, run;
+};
+
+struct catalog {
+	struct mapped_file index, log;
+	const struct catalog_header *h;
+	const char (*types)[CATALOG_NAME];
+	const char (*names)[CATALOG_NAME];
+	const unsigned int *name_first;
+	const struct catalog_run *runs;
+	const struct catalog_param *params, *values;
+	const unsigned int *by_date, *by_type, *by_x, *by_nv;
+};
+
+enum catalog_field { CATALOG_TYPE, CATALOG_NV, CATALOG_DATE, CATALOG_NEAR, CATALOG_PARAM,
+                     CATALOG_NONE };
+
+/*
+ * One condition of a query. Numbers must lie between lo and hi (each end
+ * open or closed); CATALOG_NONE matches nothing (an unknown type or name).
+ */
+struct catalog_condition {
+	enum catalog_field field;
+	unsigned int id;                //type or name
+	double lo, hi;
+	int lo_open, hi_open;
+	double x, y, z, r;              //CATALOG_NEAR
+};
+
+/* ---- building the index ---- */
+
+struct catalog_names {
+	char (*name)[CATALOG_NAME];
+	unsigned int n, size;
+	int slot[CATALOG_HASH];         //index + 1, 0 = free
+};
+
+//Index of name, added if new; -1 if too long or the table is full
+static inline int catalog_intern(struct catalog_names *cn, const char *name, size_t length)
+{
+	unsigned int h;
+	int i;
+
+	if (length == 0 || length >= CATALOG_NAME) {
+		return -1;
+	}
+	h = (unsigned int) fnv1a(FNV_OFFSET, name, length) % CATALOG_HASH;
+	while (cn->slot[h] != 0) {
+		i = cn->slot[h] - 1;
+		if (strncmp(cn->name[i], name, length) == 0 && cn->name[i][length] == 0) {
+			return i;
+		}
+		h = (h + 1) % CATALOG_HASH;
+	}
+	if (cn->n >= CATALOG_HASH / 2) {
+		return -1;
+	}
+	if (cn->n == cn->size) {
+		cn->size = cn->size ? 2 * cn->size : 64;
+		cn->name = realloc(cn->name, cn->size * sizeof(*cn->name));
+	}
+	memset(cn->name[cn->n], 0, CATALOG_NAME);
+	memcpy(cn->name[cn->n], name, length);
+	cn->slot[h] = ++cn->n;
+	return cn->n - 1;
+}
+
+//The whole field is a number
+static inline int catalog_number(const char *s, size_t length, double *v)
+{
+	char buf[64], *end;
+
+	if (length == 0 || length >= sizeof(buf)) {
+		return 0;
+	}
+	memcpy(buf, s, length);
+	buf[length] = 0;
+	*v = strtod(buf, &end);
+	return *end == 0 && isfinite(*v);
+}
+
+struct catalog_build {
+	struct catalog_run *runs;
+	struct catalog_param *params;
+	unsigned int num_runs, runs_size;
+	unsigned long long num_params, params_size;
+};
+
+static inline void catalog_add_param(struct catalog_build *cb, int name, double value)
+{
+	if (name < 0) {
+		return;
+	}
+	if (cb->num_params == cb->params_size) {
+		cb->params_size = cb->params_size ? 2 * cb->params_size : 1024;
+		cb->params = realloc(cb->params, cb->params_size * sizeof(*cb->params));
+	}
+	cb->params[cb->num_params].value = value;
+	cb->params[cb->num_params].name = (unsigned int) name;
+	cb->params[cb->num_params].run = cb->num_runs;
+	cb->num_params++;
+}
+
+//Indexes the numbers of a burner command line (after the program) as arg1, arg2, ...
+static inline void catalog_add_args(struct catalog_build *cb, struct catalog_names *names,
+                                    const char *s, size_t length)
+{
+	char name[16];
+	size_t i = 0, start;
+	int k = 0;
+	double v;
+
+	while (i < length) {
+		while (i < length && s[i] == ' ') {
+			i++;
+		}
+		start = i;
+		while (i < length && s[i] != ' ') {
+			i++;
+		}
+		if (i > start && k++ > 0 && catalog_number(s + start, i - start, &v)) {
+			sprintf(name, "arg%d", k - 1);
+			catalog_add_param(cb, catalog_intern(names, name, strlen(name)), v);
+		}
+	}
+}
+
+//Adds the run on the line at offset; lines without a type are skipped
+static inline void catalog_parse_line(struct catalog_build *cb, struct catalog_names *types,
+                                      struct catalog_names *names, const char *line, size_t length,
+                                      unsigned long long offset)
+{
+	struct catalog_run run;
+	struct catalog_param swap;
+	unsigned long long first = cb->num_params, i, j;
+	const char *field, *next, *eq, *end = line + length;
+	size_t name_length, value_length;
+	double v;
+
+	memset(&run, 0, sizeof(run));
+	run.nv = -1;
+	run.type = -1;
+	run.line = offset;
+	run.length = (unsigned int) length;
+	if (length > 0 && line[length-1] == '\r') {
+		end--;
+	}
+	for(field=line; field<end; field=next+1) {
+		next = memchr(field, '\t', end - field);
+		if (next == NULL) {
+			next = end;
+		}
+		eq = memchr(field, '=', next - field);
+		if (eq == NULL) {
+			continue;
+		}
+		name_length = eq - field;
+		value_length = next - eq - 1;
+		if (name_length == 4 && strncmp(field, "type", 4) == 0) {
+			run.type = catalog_intern(types, eq + 1, value_length);
+		}
+		else if (name_length == 4 && strncmp(field, "burn", 4) == 0) {
+			catalog_add_args(cb, names, eq + 1, value_length);
+		}
+		else if (!catalog_number(eq + 1, value_length, &v)) {
+			//text: file and notes
+		}
+		else if (name_length == 4 && strncmp(field, "date", 4) == 0) {
+			run.date = v;
+		}
+		else if (name_length == 1 && (*field == 'x' || *field == 'y' || *field == 'z')) {
+			*(*field == 'x' ? &run.x : *field == 'y' ? &run.y : &run.z) = v;
+		}
+		else if (name_length == 2 && strncmp(field, "nv", 2) == 0) {
+			run.nv = (int) v;
+		}
+		else {
+			catalog_add_param(cb, catalog_intern(names, field, name_length), v);
+		}
+	}
+	if (run.type < 0) {
+		cb->num_params = first;
+		return;
+	}
+
+	//by name, so a run's field is a binary search away
+	for(i=first+1; i<cb->num_params; i++) {
+		swap = cb->params[i];
+		for(j=i; j>first && cb->params[j-1].name > swap.name; j--) {
+			cb->params[j] = cb->params[j-1];
+		}
+		cb->params[j] = swap;
+	}
+	run.param_first = (unsigned int) first;
+	run.param_count = (unsigned int) (cb->num_params - first);
+	if (cb->num_runs == cb->runs_size) {
+		cb->runs_size = cb->runs_size ? 2 * cb->runs_size : 1024;
+		cb->runs = realloc(cb->runs, cb->runs_size * sizeof(*cb->runs));
+	}
+	cb->runs[cb->num_runs++] = run;
+}
+
+static const struct catalog_run *catalog_sort_runs;     //for the comparators
+
+static inline int catalog_cmp_date(const void *a, const void *b)
+{
+	const struct catalog_run *ra = &catalog_sort_runs[*(const unsigned int *) a];
+	const struct catalog_run *rb = &catalog_sort_runs[*(const unsigned int *) b];
+
+	if (ra->date != rb->date) {
+		return ra->date < rb->date ? -1 : 1;
+	}
+	return *(const unsigned int *) a < *(const unsigned int *) b ? -1 : 1;
+}
+
+static inline int catalog_cmp_type(const void *a, const void *b)
+{
+	const struct catalog_run *ra = &catalog_sort_runs[*(const unsigned int *) a];
+	const struct catalog_run *rb = &catalog_sort_runs[*(const unsigned int *) b];
+
+	if (ra->type != rb->type) {
+		return ra->type < rb->type ? -1 : 1;
+	}
+	return catalog_cmp_date(a, b);
+}
+
+static inline int catalog_cmp_x(const void *a, const void *b)
+{
+	const struct catalog_run *ra = &catalog_sort_runs[*(const unsigned int *) a];
+	const struct catalog_run *rb = &catalog_sort_runs[*(const unsigned int *) b];
+
+	if (ra->x != rb->x) {
+		return ra->x < rb->x ? -1 : 1;
+	}
+	return catalog_cmp_date(a, b);
+}
+
+static inline int catalog_cmp_nv(const void *a, const void *b)
+{
+	const struct catalog_run *ra = &catalog_sort_runs[*(const unsigned int *) a];
+	const struct catalog_run *rb = &catalog_sort_runs[*(const unsigned int *) b];
+
+	if (ra->nv != rb->nv) {
+		return ra->nv < rb->nv ? -1 : 1;
+	}
+	return catalog_cmp_date(a, b);
+}
+
+static inline int catalog_cmp_value(const void *a, const void *b)
+{
+	const struct catalog_param *pa = a, *pb = b;
+
+	if (pa->name != pb->name) {
+		return pa->name < pb->name ? -1 : 1;
+	}
+	if (pa->value != pb->value) {
+		return pa->value < pb->value ? -1 : 1;
+	}
+	return pa->run < pb->run ? -1 : pa->run > pb->run;
+}
+
+static inline unsigned long long catalog_align(unsigned long long offset)
+{
+	return (offset + 7) / 8 * 8;
+}
+
+/*
+ * Writes the index of the catalog at log_path to index_path. Returns 0, or
+ * -1 (and prints why).
+ */
+static inline int catalog_build(const char *log_path, const char *index_path)
+{
+	struct catalog_header h;
+	struct catalog_names types, names;
+	struct catalog_build cb;
+	struct mapped_file log;
+	struct catalog_param *values;
+	unsigned int *order, *name_first, i;
+	unsigned long long pos, next, k, offset;
+	const char *text, *nl;
+	char tmp[1200];
+	int error = 0;
+	FILE *fp;
+
+	memset(&types, 0, sizeof(types));
+	memset(&names, 0, sizeof(names));
+	memset(&cb, 0, sizeof(cb));
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CATALOG_MAGIC, 8);
+
+	fp = fopen(log_path, "rb");
+	if (fp == NULL) {
+		printf("Could not open %s", log_path);
+		return -1;
+	}
+	fclose(fp);
+	log.data = NULL;
+	if (map_file(log_path, &log) == 0) {
+		text = (const char *) log.data;
+		h.log_size = log.size;
+		for(pos=0; pos<log.size; pos=next) {
+			nl = memchr(text + pos, '\n', (size_t) (log.size - pos));
+			next = nl != NULL ? (unsigned long long) (nl - text) + 1 : log.size;
+			if (text[pos] != '#') {
+				catalog_parse_line(&cb, &types, &names, text + pos,
+				                   (size_t) (next - pos - (nl != NULL)), pos);
+			}
+		}
+		unmap_file(&log);
+	}
+	h.num_runs = cb.num_runs;
+	h.num_types = types.n;
+	h.num_names = names.n;
+	h.num_params = cb.num_params;
+
+	offset = sizeof(h);
+	h.types = offset;
+	offset += (unsigned long long) types.n * CATALOG_NAME;
+	h.names = offset;
+	offset += (unsigned long long) names.n * CATALOG_NAME;
+	h.name_first = offset;
+	offset = catalog_align(offset + (names.n + 1ull) * sizeof(unsigned int));
+	h.runs = offset;
+	offset += (unsigned long long) cb.num_runs * sizeof(struct catalog_run);
+	h.params = offset;
+	offset += cb.num_params * sizeof(struct catalog_param);
+	h.values = offset;
+	offset += cb.num_params * sizeof(struct catalog_param);
+	h.by_date = offset;
+	h.by_type = h.by_date + cb.num_runs * sizeof(unsigned int);
+	h.by_x = h.by_type + cb.num_runs * sizeof(unsigned int);
+	h.by_nv = h.by_x + cb.num_runs * sizeof(unsigned int);
+
+	//the run lists and the sorted values
+	order = malloc((cb.num_runs + 1) * sizeof(unsigned int));
+	values = malloc((size_t) (cb.num_params + 1) * sizeof(*values));
+	name_first = calloc(names.n + 1, sizeof(unsigned int));
+	if (order == NULL || values == NULL || name_first == NULL) {
+		printf("Out of memory");
+		return -1;
+	}
+	memcpy(values, cb.params, (size_t) cb.num_params * sizeof(*values));
+	qsort(values, (size_t) cb.num_params, sizeof(*values), catalog_cmp_value);
+	for(k=0; k<cb.num_params; k++) {
+		name_first[values[k].name + 1]++;
+	}
+	for(i=0; i<names.n; i++) {
+		name_first[i+1] += name_first[i];
+	}
+
+	fp = atomic_open(index_path, tmp, sizeof(tmp));
+	if (fp == NULL) {
+		printf("Could not write %s", index_path);
+		return -1;
+	}
+	fwrite(&h, sizeof(h), 1, fp);
+	fwrite(types.name, CATALOG_NAME, types.n, fp);
+	fwrite(names.name, CATALOG_NAME, names.n, fp);
+	fwrite(name_first, sizeof(unsigned int), names.n + 1, fp);
+	for(pos=h.name_first + (names.n + 1ull) * sizeof(unsigned int); pos<h.runs; pos++) {
+		fputc(0, fp);
+	}
+	fwrite(cb.runs, sizeof(struct catalog_run), cb.num_runs, fp);
+	fwrite(cb.params, sizeof(struct catalog_param), (size_t) cb.num_params, fp);
+	fwrite(values, sizeof(struct catalog_param), (size_t) cb.num_params, fp);
+
+	catalog_sort_runs = cb.runs;
+	for(i=0; i<cb.num_runs; i++) {
+		order[i] = i;
+	}
+	qsort(order, cb.num_runs, sizeof(unsigned int), catalog_cmp_date);
+	fwrite(order, sizeof(unsigned int), cb.num_runs, fp);
+	qsort(order, cb.num_runs, sizeof(unsigned int), catalog_cmp_type);
+	fwrite(order, sizeof(unsigned int), cb.num_runs, fp);
+	qsort(order, cb.num_runs, sizeof(unsigned int), catalog_cmp_x);
+	fwrite(order, sizeof(unsigned int), cb.num_runs, fp);
+	qsort(order, cb.num_runs, sizeof(unsigned int), catalog_cmp_nv);
+	fwrite(order, sizeof(unsigned int), cb.num_runs, fp);
+	//an empty catalog still needs a mappable index
+	fputc(0, fp);
+
+	if (atomic_close(fp, tmp, index_path) != 0) {
+		printf("Could not write %s", index_path);
+		error = -1;
+	}
+	free(order);
+	free(values);
+	free(name_first);
+	free(cb.runs);
+	free(cb.params);
+	free(types.name);
+	free(names.name);
+	return error;
+}
+
+/* ---- querying ---- */
+
+static inline void catalog_close(struct catalog *cat)
+{
+	unmap_file(&cat->index);
+	unmap_file(&cat->log);
+}
+
+static inline int catalog_map(struct catalog *cat, const char *index_path)
+{
+	const unsigned char *base;
+
+	if (map_file(index_path, &cat->index) != 0) {
+		return -1;
+	}
+	cat->h = (const struct catalog_header *) cat->index.data;
+	if (cat->index.size < sizeof(*cat->h) || memcmp(cat->h->magic, CATALOG_MAGIC, 8) != 0
+	    || cat->h->by_nv + cat->h->num_runs * sizeof(unsigned int) > cat->index.size) {
+		unmap_file(&cat->index);
+		return -1;
+	}
+	base = cat->index.data;
+	cat->types = (const char (*)[CATALOG_NAME]) (base + cat->h->types);
+	cat->names = (const char (*)[CATALOG_NAME]) (base + cat->h->names);
+	cat->name_first = (const unsigned int *) (base + cat->h->name_first);
+	cat->runs = (const struct catalog_run *) (base + cat->h->runs);
+	cat->params = (const struct catalog_param *) (base + cat->h->params);
+	cat->values = (const struct catalog_param *) (base + cat->h->values);
+	cat->by_date = (const unsigned int *) (base + cat->h->by_date);
+	cat->by_type = (const unsigned int *) (base + cat->h->by_type);
+	cat->by_x = (const unsigned int *) (base + cat->h->by_x);
+	cat->by_nv = (const unsigned int *) (base + cat->h->by_nv);
+	return 0;
+}
+
+/*
+ * Opens the catalog at path and its index, rebuilding the index first if
+ * the catalog has changed. Returns 0, or -1 (and prints why).
+ */
+static inline int catalog_open(const char *path, struct catalog *cat)
+{
+	char index_path[1100];
+	long long size;
+	FILE *fp;
+
+	memset(cat, 0, sizeof(*cat));
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		printf("Could not open %s", path);
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fclose(fp);
+
+	snprintf(index_path, sizeof(index_path), "%s.idx", path);
+	if (catalog_map(cat, index_path) == 0 && cat->h->log_size == (unsigned long long) size) {
+		map_file(path, &cat->log);
+		return 0;
+	}
+	unmap_file(&cat->index);
+	if (catalog_build(path, index_path) != 0) {
+		return -1;
+	}
+	if (catalog_map(cat, index_path) != 0) {
+		printf("Could not read %s", index_path);
+		return -1;
+	}
+	map_file(path, &cat->log);
+	return 0;
+}
+
+//Index of a type or field name, or -1
+static inline int catalog_lookup(const char (*table)[CATALOG_NAME], unsigned int n, const char *name)
+{
+	unsigned int i;
+
+	for(i=0; i<n; i++) {
+		if (strncmp(table[i], name, CATALOG_NAME) == 0) {
+			return (int) i;
+		}
+	}
+	return -1;
+}
+
+//Value of a run's numeric field; 0 if it has none
+static inline int catalog_param(const struct catalog *cat, unsigned int run, unsigned int name,
+                                double *value)
+{
+	const struct catalog_param *p = cat->params + cat->runs[run].param_first;
+	unsigned int lo = 0, hi = cat->runs[run].param_count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (p[mid].name < name) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	if (lo < cat->runs[run].param_count && p[lo].name == name) {
+		*value = p[lo].value;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Copies the text of a run's field (any field, also file and burn) to out.
+ * Returns 0, or -1 if the run has no such field.
+ */
+static inline int catalog_text(const struct catalog *cat, unsigned int run, const char *name,
+                               char *out, size_t size)
+{
+	const char *line, *end, *field;
+	size_t n = strlen(name), length;
+
+	out[0] = 0;
+	if (cat->log.data == NULL || cat->runs[run].line + cat->runs[run].length > cat->log.size) {
+		return -1;
+	}
+	line = (const char *) cat->log.data + cat->runs[run].line;
+	end = line + cat->runs[run].length;
+	for(field=line; field<end; field++) {
+		if ((field == line || field[-1] == '\t') && end - field > (long) n
+		    && strncmp(field, name, n) == 0 && field[n] == '=') {
+			field += n + 1;
+			for(length=0; field+length<end && field[length] != '\t'
+			              && field[length] != '\r'; length++) {
+			}
+			if (length >= size) {
+				length = size - 1;
+			}
+			memcpy(out, field, length);
+			out[length] = 0;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static inline int catalog_in(const struct catalog_condition *c, double v)
+{
+	return (c->lo_open ? v > c->lo : v >= c->lo) && (c->hi_open ? v < c->hi : v <= c->hi);
+}
+
+static inline int catalog_match(const struct catalog *cat, unsigned int run,
+                                const struct catalog_condition *c)
+{
+	const struct catalog_run *r = &cat->runs[run];
+	double v;
+
+	switch (c->field) {
+	case CATALOG_TYPE:
+		return r->type == (int) c->id;
+	case CATALOG_NV:
+		return catalog_in(c, r->nv);
+	case CATALOG_DATE:
+		return catalog_in(c, r->date);
+	case CATALOG_NEAR:
+		return (r->x - c->x) * (r->x - c->x) + (r->y - c->y) * (r->y - c->y)
+		       + (r->z - c->z) * (r->z - c->z) <= c->r * c->r;
+	case CATALOG_PARAM:
+		return catalog_param(cat, run, c->id, &v) && catalog_in(c, v);
+	default:
+		return 0;
+	}
+}
+
+//The key a run list is sorted by
+static inline double catalog_key(const struct catalog *cat, enum catalog_field field, unsigned int run)
+{
+	switch (field) {
+	case CATALOG_TYPE:
+		return cat->runs[run].type;
+	case CATALOG_NV:
+		return cat->runs[run].nv;
+	case CATALOG_DATE:
+		return cat->runs[run].date;
+	default:
+		return cat->runs[run].x;
+	}
+}
+
+//First place in a sorted list whose key is >= v (or > v if after)
+static inline unsigned long long catalog_bound(const struct catalog *cat, enum catalog_field field,
+                                               const unsigned int *ids, const struct catalog_param *vals,
+                                               unsigned long long n, double v, int after)
+{
+	unsigned long long lo = 0, hi = n, mid;
+	double key;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		key = ids != NULL ? catalog_key(cat, field, ids[mid]) : vals[mid].value;
+		if (key < v || (after && key == v)) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * The runs a condition's index says can match: either ids[0..n) or the
+ * runs of vals[0..n).
+ */
+static inline unsigned long long catalog_range(const struct catalog *cat,
+                                               const struct catalog_condition *c,
+                                               const unsigned int **ids,
+                                               const struct catalog_param **vals)
+{
+	const unsigned int *list;
+	const struct catalog_param *v = NULL;
+	unsigned long long n = cat->h->num_runs, first, last;
+	double lo = c->lo, hi = c->hi;
+	int lo_open = c->lo_open, hi_open = c->hi_open;
+
+	*ids = NULL;
+	*vals = NULL;
+	switch (c->field) {
+	case CATALOG_TYPE:
+		list = cat->by_type;
+		lo = hi = c->id;
+		lo_open = hi_open = 0;
+		break;
+	case CATALOG_NV:
+		list = cat->by_nv;
+		break;
+	case CATALOG_DATE:
+		list = cat->by_date;
+		break;
+	case CATALOG_NEAR:
+		list = cat->by_x;
+		lo = c->x - c->r;
+		hi = c->x + c->r;
+		lo_open = hi_open = 0;
+		break;
+	case CATALOG_PARAM:
+		list = NULL;
+		v = cat->values + cat->name_first[c->id];
+		n = cat->name_first[c->id + 1] - cat->name_first[c->id];
+		break;
+	default:
+		return 0;
+	}
+	first = catalog_bound(cat, c->field, list, v, n, lo, lo_open);
+	last = catalog_bound(cat, c->field, list, v, n, hi, !hi_open);
+	if (last <= first) {
+		return 0;
+	}
+	if (list != NULL) {
+		*ids = list + first;
+	}
+	else {
+		*vals = v + first;
+	}
+	return last - first;
+}
+
+/*
+ * Runs that match all n conditions (all runs if n = 0), by date, into out
+ * (room for h->num_runs). Returns how many.
+ */
+static inline unsigned int catalog_find(const struct catalog *cat, const struct catalog_condition *c,
+                                        int n, unsigned int *out)
+{
+	const unsigned int *ids = cat->by_date, *best_ids = cat->by_date;
+	const struct catalog_param *vals, *best_vals = NULL;
+	unsigned long long size, best = cat->h->num_runs, k;
+	unsigned int run, found = 0;
+	int i, j;
+
+	for(i=0; i<n; i++) {
+		size = catalog_range(cat, &c[i], &ids, &vals);
+		if (size < best || (size == 0 && best == 0)) {
+			best = size;
+			best_ids = ids;
+			best_vals = vals;
+		}
+	}
+	for(k=0; k<best; k++) {
+		run = best_ids != NULL ? best_ids[k] : best_vals[k].run;
+		for(j=0; j<n && catalog_match(cat, run, &c[j]); j++) {
+		}
+		if (j == n) {
+			out[found++] = run;
+		}
+	}
+	catalog_sort_runs = cat->runs;
+	if (best_ids != cat->by_date) {
+		qsort(out, found, sizeof(unsigned int), catalog_cmp_date);
+	}
+	return found;
+}
+
+/*
+ * Seconds since 1970 from a number of seconds or a local date
+ * YYYY-MM-DD[ HH:MM[:SS]] (or with a T). A bare date ends at midnight
+ * after the day if end_of_day. Returns 0 or -1.
+ */
+static inline int catalog_date(const char *s, int end_of_day, double *t)
+{
+	struct tm tm;
+	char *end;
+	int n;
+
+	*t = strtod(s, &end);
+	if (*end == 0 && end != s) {
+		return 0;
+	}
+	memset(&tm, 0, sizeof(tm));
+	n = sscanf(s, "%d-%d-%d%*[ T]%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+	           &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+	if (n < 3) {
+		return -1;
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	tm.tm_isdst = -1;
+	if (n == 3 && end_of_day) {
+		tm.tm_mday++;
+	}
+	*t = (double) mktime(&tm);
+	return 0;
+}
+
+/*
+ * Parses a query condition:
+ *   type=T  nv=N  near=x,y,z,r (um)  from=DATE  to=DATE  days=D (the last
+ *   D days)  or  <field><op><number> with op one of = < <= > >=
+ * Returns 0, or -1 (and prints why).
+ */
+static inline int catalog_condition(const struct catalog *cat, const char *text,
+                                    struct catalog_condition *c)
+{
+	char name[CATALOG_NAME];
+	const char *op = text + strcspn(text, "<>=");
+	const char *value;
+	size_t n = op - text;
+	int id, is_eq;
+	double v;
+
+	memset(c, 0, sizeof(*c));
+	if (*op == 0 || n == 0 || n >= CATALOG_NAME) {
+		printf("Bad condition %s", text);
+		return -1;
+	}
+	memcpy(name, text, n);
+	name[n] = 0;
+	value = op + 1 + (op[1] == '=');
+	is_eq = *op == '=';
+
+	if (strcmp(name, "type") == 0 && is_eq) {
+		id = catalog_lookup(cat->types, cat->h->num_types, value);
+		c->field = id >= 0 ? CATALOG_TYPE : CATALOG_NONE;
+		c->id = (unsigned int) id;
+		return 0;
+	}
+	if (strcmp(name, "near") == 0 && is_eq) {
+		c->field = CATALOG_NEAR;
+		if (sscanf(value, "%lf,%lf,%lf,%lf", &c->x, &c->y, &c->z, &c->r) != 4) {
+			printf("Bad condition %s", text);
+			return -1;
+		}
+		return 0;
+	}
+	c->lo = -HUGE_VAL;
+	c->hi = HUGE_VAL;
+	if ((strcmp(name, "from") == 0 || strcmp(name, "to") == 0) && is_eq) {
+		c->field = CATALOG_DATE;
+		if (catalog_date(value, name[0] == 't', name[0] == 't' ? &c->hi : &c->lo) != 0) {
+			printf("Bad date %s", value);
+			return -1;
+		}
+		c->hi_open = name[0] == 't';
+		return 0;
+	}
+	if (strcmp(name, "days") == 0 && is_eq) {
+		c->field = CATALOG_DATE;
+		c->lo = (double) time(NULL) - atof(value) * 86400;
+		return 0;
+	}
+
+	if (!catalog_number(value, strlen(value), &v)) {
+		printf("Bad condition %s", text);
+		return -1;
+	}
+	if (strcmp(name, "nv") == 0) {
+		c->field = CATALOG_NV;
+	}
+	else {
+		id = catalog_lookup(cat->names, cat->h->num_names, name);
+		c->field = id >= 0 ? CATALOG_PARAM : CATALOG_NONE;
+		c->id = (unsigned int) id;
+	}
+	if (*op == '=' || op[1] == '=') {
+		//=, <= or >=
+		if (*op != '<') {
+			c->lo = v;
+		}
+		if (*op != '>') {
+			c->hi = v;
+		}
+	}
+	else if (*op == '<') {
+		c->hi = v;
+		c->hi_open = 1;
+	}
+	else {
+		c->lo = v;
+		c->lo_open = 1;
+	}
+	return 0;
+}
+
+#endif
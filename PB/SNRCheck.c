@@ -0,0 +1,258 @@
+/**
+ * \file SNRCheck.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Called from LabVIEW after every chunk of a pulsed run. Decides whether
+ *  the run has reached the target precision so we can stop averaging
+ *  instead of always running a fixed num_scans.
+ *
+ *  The uncertainty is the shot-noise limit from the accumulated counts:
+ *  either the worst contrast error over the sweep points, or the fit error
+ *  of the parameter we care about (pi time, T2, resonance frequency).
+ *
+ *  Arg Description
+ *  1   Counts file (spreadsheet, one row per chunk or scan, in sweep order,
+ *      num_points * slots per point columns)
+ *  2   What to check: points, rabi (t_pi), decay (T2) or esr (f0)
+ *  3   Contrast: diff, ratio or norm
+ *  4   Sweep min (tau, MW time or frequency, in whatever units the target
+ *      is given in)
+ *  5   Sweep max
+ *  6   Number of sweep points
+ *  7   Slots (counter gates) per point
+ *  8   Signal slot (0-indexed)
+ *  9   Reference slot (0-indexed)
+ *  10  Target 1-sigma uncertainty
+ *  11  Seconds since the run started
+ *  12+ Optional: seed=N and chunk=R when the rows are in the seeded burn
+ *      order (seed= in the burner): chunk c of R rows was burned with
+ *      seed + c, as Unshuffle.exe takes (R = 0: one seed for all rows)
+ *
+ *  Prints: done (1/0), current sigma, current value, and the estimated
+ *  number of extra rows needed, tab separated, so the VI can stop or re-burn
+ *  with a num_scans that should just reach the target. When done, the
+ *  time-to-precision and fit result are appended to <counts file>.meta,
+ *  once per check, contrast and target (later calls leave it alone).
+ *
+ *  diff contrast is given per row (signal - reference counts of one row),
+ *  so it and its error don't grow with the number of rows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "Spreadsheet.h"
+#include "Contrast.h"
+#include "Fit.h"
+#include "SweepOrder.h"
+
+/*
+ * Whether <counts file>.meta already holds a result for this check,
+ * contrast and target (name/value lines, each result starting with check)
+ */
+static int meta_has(const char *path, const char *check, const char *contrast,
+                    double target)
+{
+	char line[256], name[64], value[128], text[32];
+	int same_check = 0, same_contrast = 0, found = 0;
+	FILE *fp = fopen(path, "r");
+
+	if (fp == NULL) {
+		return 0;
+	}
+	//as written below
+	sprintf(text, "%g", target);
+	while (!found && fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%63s %127s", name, value) != 2) {
+			continue;
+		}
+		if (strcmp(name, "check") == 0) {
+			same_check = strcmp(value, check) == 0;
+			same_contrast = 0;
+		}
+		else if (strcmp(name, "contrast") == 0) {
+			same_contrast = strcmp(value, contrast) == 0;
+		}
+		else if (strcmp(name, "target") == 0) {
+			found = same_check && same_contrast && strcmp(value, text) == 0;
+		}
+	}
+	fclose(fp);
+	return found;
+}
+
+int main(int argc, char *argv[])
+{
+	int rows, cols, num_points, num_slots, sig_slot, ref_slot;
+	int i, k, row, done, use_fit;
+	double x_min, x_max, target, elapsed, sigma, value, extra_rows;
+	double *data, *x, *y, *err, *s, *r;
+	unsigned int seed = 0;
+	long chunk_rows = 0;
+	const int *burned;
+	struct sweep_unshuffle su;
+	enum contrast_type contrast;
+	enum fit_model model = FIT_RABI;
+	struct fit_result fit;
+	char meta_path[1024];
+	FILE *meta;
+
+	if (argc < 12) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	for(i=12; i<argc; i++) {
+		if (strncmp(argv[i], "seed=", 5) == 0) {
+			seed = (unsigned int) strtoul(argv[i] + 5, NULL, 0);
+		}
+		else if (strncmp(argv[i], "chunk=", 6) == 0) {
+			chunk_rows = atol(argv[i] + 6);
+		}
+		else {
+			printf("Unknown option %s", argv[i]);
+			return -1;
+		}
+	}
+
+	use_fit = 1;
+	if (strcmp(argv[2], "points") == 0) {
+		use_fit = 0;
+	}
+	else if (strcmp(argv[2], "rabi") == 0) {
+		model = FIT_RABI;
+	}
+	else if (strcmp(argv[2], "decay") == 0) {
+		model = FIT_DECAY;
+	}
+	else if (strcmp(argv[2], "esr") == 0) {
+		model = FIT_ESR;
+	}
+	else {
+		printf("Unknown check %s", argv[2]);
+		return -1;
+	}
+	if (contrast_parse(argv[3], &contrast) != 0) {
+		printf("Unknown contrast %s", argv[3]);
+		return -1;
+	}
+	x_min = atof(argv[4]);
+	x_max = atof(argv[5]);
+	num_points = atoi(argv[6]);
+	num_slots = atoi(argv[7]);
+	sig_slot = atoi(argv[8]);
+	ref_slot = atoi(argv[9]);
+	target = atof(argv[10]);
+	elapsed = atof(argv[11]);
+
+	if (num_points < 2 || sig_slot < 0 || sig_slot >= num_slots
+	    || ref_slot < 0 || ref_slot >= num_slots || target <= 0) {
+		printf("Bad sweep/slot/target arguments");
+		return -1;
+	}
+
+	data = read_spreadsheet(argv[1], &rows, &cols);
+	if (data == NULL) {
+		return -1;
+	}
+	if (rows == 0 || cols != num_points * num_slots) {
+		printf("Expected %d columns, found %d", num_points * num_slots, cols);
+		free(data);
+		return -1;
+	}
+
+	x = malloc(num_points * sizeof(double));
+	y = malloc(num_points * sizeof(double));
+	err = malloc(num_points * sizeof(double));
+	s = calloc(num_points, sizeof(double));
+	r = calloc(num_points, sizeof(double));
+	if (sweep_unshuffle_init(&su, seed, chunk_rows, num_points, num_slots) != 0) {
+		printf("Out of memory");
+		return -1;
+	}
+
+	//Total counts per point over everything acquired so far
+	for(row=0; row<rows; row++) {
+		//k-th burned point is sweep point burned[k]
+		burned = sweep_unshuffle_order(&su, row);
+		for(k=0; k<num_points; k++) {
+			s[burned[k]] += data[row*cols + k*num_slots + sig_slot];
+			r[burned[k]] += data[row*cols + k*num_slots + ref_slot];
+		}
+	}
+	sigma = 0;
+	value = 0;
+	for(i=0; i<num_points; i++) {
+		x[i] = (x_max - x_min) / (num_points - 1) * i + x_min;
+		contrast_point(contrast, s[i], r[i], &y[i], &err[i]);
+		//the difference of the sums grows with the rows, use it per row
+		if (contrast == CONTRAST_DIFF) {
+			y[i] /= rows;
+			err[i] /= rows;
+		}
+		if (err[i] > sigma) {
+			sigma = err[i];
+			value = y[i];
+		}
+	}
+
+	if (use_fit) {
+		if (fit_curve(model, x, y, err, num_points, NULL, &fit) != 0) {
+			//not enough signal yet to fit, keep averaging
+			sigma = HUGE_VAL;
+			value = 0;
+		}
+		else {
+			sigma = fit.err[fit.key];
+			value = fit.p[fit.key];
+		}
+	}
+
+	//shot noise goes as 1/sqrt(rows)
+	done = sigma <= target;
+	if (done) {
+		extra_rows = 0;
+	}
+	else if (sigma == HUGE_VAL) {
+		extra_rows = rows;
+	}
+	else {
+		extra_rows = ceil(rows * ((sigma/target) * (sigma/target) - 1));
+	}
+
+	printf("%d\t%g\t%g\t%.0f\n", done, sigma, value, extra_rows);
+
+	snprintf(meta_path, sizeof(meta_path), "%s.meta", argv[1]);
+	if (done && !meta_has(meta_path, argv[2], argv[3], target)) {
+		meta = fopen(meta_path, "a");
+		if (meta == NULL) {
+			printf("Could not open %s\n", meta_path);
+			return -1;
+		}
+		fprintf(meta, "check\t%s\n", argv[2]);
+		fprintf(meta, "contrast\t%s\n", argv[3]);
+		fprintf(meta, "target\t%g\n", target);
+		fprintf(meta, "value\t%.10g\n", value);
+		fprintf(meta, "sigma\t%g\n", sigma);
+		if (use_fit) {
+			for(i=0; i<fit.num_params; i++) {
+				fprintf(meta, "fit_p%d\t%.10g\t%g\n", i, fit.p[i], fit.err[i]);
+			}
+			fprintf(meta, "fit_chi2\t%g\n", fit.chi2);
+		}
+		fprintf(meta, "rows\t%d\n", rows);
+		fprintf(meta, "time_to_precision_s\t%g\n", elapsed);
+		fclose(meta);
+	}
+
+	free(x);
+	free(y);
+	free(err);
+	free(s);
+	free(r);
+	free(data);
+	sweep_unshuffle_free(&su);
+	return 0;
+}
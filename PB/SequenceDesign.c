@@ -0,0 +1,496 @@
+/**
+ * \file SequenceDesign.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Compares sequence variants before spending beam time on them. Takes
+ *  program images from emulated burners (Emulator/spinapi.h), e.g. the
+ *  same SpinEchoBurn/CPMGBurn/XY4Burn sweep with different pulse lengths,
+ *  and computes the expected contrast at every sweep point for a whole
+ *  batch of detunings x MW amplitude errors x bath T2 values in one pass
+ *  through each program.
+ *
+ *  Every case is one entry of an NVModel.h array (times the T2* ensemble).
+ *  Each distinct pulse or free period is made into a Bloch matrix per case
+ *  once per bath (nv_propagator; that part is scalar, it needs sin/cos)
+ *  and then applied to all cases in one vectorized loop every time it
+ *  repeats, rather than a loop of small matrix products per case.
+ *
+ *  The bath T2 values decay the coherences exponentially during every
+ *  pulse and free period, the same for every sequence, so on their own
+ *  they cannot tell a sequence that filters the real noise better. For
+ *  that give spectrum= (e.g. FilterFunction's <prefix>_spectrum.txt): the
+ *  Bloch vector at the end of each sweep point's pulse block is then also
+ *  shrunk by exp(-chi), chi being the overlap of that block's filter
+ *  function with S (FilterFunction.h), which the last pi/2 turns into the
+ *  loss of contrast.
+ *
+ *  Arg Description
+ *  1   Output prefix: writes <prefix>_<variant>.txt with one row per case:
+ *      detuning (MHz), amplitude error, T2 (us), contrast at each point
+ *  2   Laser channel mask
+ *  3   MW channel mask
+ *  4   MW Y phase channel mask
+ *  5   Counter gate channel mask
+ *  6   Gates per sweep point
+ *  7   Signal gate (0-indexed)
+ *  8   Reference gate (0-indexed)
+ *  9   Rabi frequency (MHz)
+ *  10  T2* (us, 0 = none)
+ *  11  Readout window (ns)
+ *  12  Readout contrast (0-1)
+ *  13  Detuning min (MHz)
+ *  14  Detuning max (MHz)
+ *  15  Number of detunings
+ *  16  Amplitude error min (fraction, e.g. -0.1)
+ *  17  Amplitude error max
+ *  18  Number of amplitude errors
+ *  19  Bath T2 values (us), comma separated, 0 = none
+ *  20+ Program images, one per variant
+ *
+ *  Options, name=value among the program images:
+ *  spectrum=F   noise spectrum, rows of frequency (MHz) and S, see above
+ *  step=T       time step for the filter functions (ns, default 1)
+ *
+ *  Prints the variants ranked by the RMS distance of the contrast from the
+ *  nominal case (zero detuning and amplitude error, first T2) over the
+ *  batch, in units of the readout contrast. Lower is more robust.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "PBImage.h"
+#include "NVModel.h"
+#include "Contrast.h"
+#include "FilterFunction.h"
+#include "Spreadsheet.h"
+
+#define ENSEMBLE 8
+#define MAX_BATHS 16
+#define MAX_VARIANTS 32
+#define PROPAGATORS 8      //distinct periods kept per bath
+#define SPECTRUM_PAD 4
+
+struct design {
+	int laser_mask, mw_mask, y_mask, gate_mask;
+	struct nv_params params;
+	struct nv_array nv;
+	int num_cases;        //nominal case first, then the grid
+	double *photons;      //per array entry, reset every laser segment
+
+	int gate_open;
+	double *gate_sum;     //per case, for the gate being counted
+	double *gates;        //gates[g * num_cases + c]
+	int num_gates, gates_size;
+	int failed;           //out of memory, the walk stopped
+
+	struct nv_propagator props[PROPAGATORS];
+	int prop_driven[PROPAGATORS];
+	double prop_phi[PROPAGATORS], prop_t[PROPAGATORS];
+	int num_props, next_prop;
+
+	const double *spectrum;   //NULL = no filter function decay
+	int spectrum_rows;
+	double step;
+	struct filter_collect blocks;
+	double *chi;          //per pulse block, kept for every bath of a variant
+	int num_chi, chi_size;
+};
+
+static int close_gate(struct design *d)
+{
+	double *gates;
+	int c;
+
+	if (!d->gate_open) {
+		return 0;
+	}
+	if (d->num_gates == d->gates_size) {
+		gates = realloc(d->gates, (size_t) (d->gates_size ? 2 * d->gates_size : 128)
+		                          * d->num_cases * sizeof(double));
+		if (gates == NULL) {
+			d->failed = 1;
+			return -1;
+		}
+		d->gates = gates;
+		d->gates_size = d->gates_size ? 2 * d->gates_size : 128;
+	}
+	for(c=0; c<d->num_cases; c++) {
+		d->gates[(size_t) d->num_gates * d->num_cases + c] = d->gate_sum[c];
+		d->gate_sum[c] = 0;
+	}
+	d->num_gates++;
+	d->gate_open = 0;
+	return 0;
+}
+
+//Propagator of a period, made on first use after the bath was set
+static const struct nv_propagator *propagator(struct design *d, int driven, double phi,
+                                              double t)
+{
+	int i;
+
+	for(i=0; i<d->num_props; i++) {
+		if (d->prop_driven[i] == driven && d->prop_phi[i] == phi && d->prop_t[i] == t) {
+			return &d->props[i];
+		}
+	}
+	i = d->next_prop;
+	d->next_prop = (d->next_prop + 1) % PROPAGATORS;
+	if (d->num_props < PROPAGATORS) {
+		d->num_props++;
+	}
+	nv_propagator_set(&d->props[i], &d->nv, driven, phi, t);
+	d->prop_driven[i] = driven;
+	d->prop_phi[i] = phi;
+	d->prop_t[i] = t;
+	return &d->props[i];
+}
+
+//The pulse block that just ended takes exp(-chi) off the Bloch vectors
+static int block_decay(struct design *d)
+{
+	int k = d->blocks.num_seqs - 1;
+	double *chi, keep;
+
+	if (k >= d->num_chi) {
+		if (d->num_chi == d->chi_size) {
+			chi = realloc(d->chi, (d->chi_size ? 2 * d->chi_size : 64) * sizeof(double));
+			if (chi == NULL) {
+				return -1;
+			}
+			d->chi = chi;
+			d->chi_size = d->chi_size ? 2 * d->chi_size : 64;
+		}
+		d->chi[d->num_chi] = filter_chi(&d->blocks.seqs[k], d->step, SPECTRUM_PAD,
+		                                d->spectrum, d->spectrum_rows);
+		if (d->chi[d->num_chi] < 0) {
+			return -1;
+		}
+		d->num_chi++;
+	}
+	keep = exp(-d->chi[k]);
+	for(k=0; k<d->nv.n; k++) {
+		d->nv.x[k] *= keep;
+		d->nv.y[k] *= keep;
+		d->nv.z[k] *= keep;
+	}
+	return 0;
+}
+
+static int segment(void *ctx, int outputs, double length, int addr, int outer_iter)
+{
+	struct design *d = ctx;
+	int c, e, k;
+
+	if (outer_iter > 0) {
+		return 1;   //one repetition of the sweep is all we need
+	}
+
+	if (d->spectrum != NULL) {
+		k = d->blocks.num_seqs;
+		filter_segment(&d->blocks, outputs, length, addr, outer_iter);
+		if (d->blocks.failed || (d->blocks.num_seqs > k && block_decay(d) != 0)) {
+			d->failed = 1;
+			return 1;
+		}
+	}
+
+	if (outputs & d->laser_mask) {
+		memset(d->photons, 0, d->nv.n * sizeof(double));
+		nv_laser_each(&d->nv, &d->params, length, d->photons);
+		if (outputs & d->gate_mask) {
+			for(c=0, k=0; c<d->num_cases; c++) {
+				for(e=0; e<ENSEMBLE; e++, k++) {
+					d->gate_sum[c] += d->nv.weight[k] * d->photons[k];
+				}
+			}
+		}
+	}
+	else if (outputs & d->mw_mask) {
+		nv_propagate(&d->nv, propagator(d, 1, (outputs & d->y_mask) ? M_PI / 2 : 0, length));
+	}
+	else {
+		nv_propagate(&d->nv, propagator(d, 0, 0, length));
+	}
+
+	if (outputs & d->gate_mask) {
+		d->gate_open = 1;
+	}
+	else if (close_gate(d) != 0) {
+		return 1;
+	}
+	return 0;
+}
+
+struct grid {
+	double det_min, det_max, amp_min, amp_max;
+	int num_det, num_amp;
+};
+
+//Detuning and amplitude error of case c (case 0 is the nominal case)
+static void grid_case(const struct grid *g, int c, double *det, double *amp)
+{
+	int i = (c - 1) / g->num_amp, j = (c - 1) % g->num_amp;
+
+	*det = 0;
+	*amp = 0;
+	if (c == 0) {
+		return;
+	}
+	*det = g->det_min;
+	if (g->num_det > 1) {
+		*det += (g->det_max - g->det_min) / (g->num_det - 1) * i;
+	}
+	*amp = g->amp_min;
+	if (g->num_amp > 1) {
+		*amp += (g->amp_max - g->amp_min) / (g->num_amp - 1) * j;
+	}
+}
+
+static int parse_list(const char *s, double *values, int max)
+{
+	int n = 0;
+	char *end;
+
+	while (n < max) {
+		values[n] = strtod(s, &end);
+		if (end == s) {
+			break;
+		}
+		n++;
+		s = *end == ',' ? end + 1 : end;
+	}
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct pb_image img;
+	struct design d;
+	struct pb_walk walk;
+	struct grid grid;
+	int num_baths, num_variants, slots, sig, ref;
+	int v, b, i, c, e, k, p, num_points, case_index;
+	double t2star, sigma;
+	double baths[MAX_BATHS], score[MAX_VARIANTS], worst[MAX_VARIANTS];
+	double swing[MAX_VARIANTS], det, amp, con, err, nominal_min, nominal_max;
+	double *nominal = NULL, sum_sq, *spectrum = NULL;
+	long count;
+	int rank[MAX_VARIANTS], cols;
+	const char *variants[MAX_VARIANTS];
+	char path[1024];
+	FILE *fp;
+
+	if (argc < 21) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+
+	memset(&d, 0, sizeof(d));
+	d.laser_mask = (int) strtol(argv[2], NULL, 0);
+	d.mw_mask = (int) strtol(argv[3], NULL, 0);
+	d.y_mask = (int) strtol(argv[4], NULL, 0);
+	d.gate_mask = (int) strtol(argv[5], NULL, 0);
+	slots = atoi(argv[6]);
+	sig = atoi(argv[7]);
+	ref = atoi(argv[8]);
+	d.params.rabi_mhz = atof(argv[9]);
+	t2star = atof(argv[10]);
+	d.params.readout_ns = atof(argv[11]);
+	d.params.contrast = atof(argv[12]);
+	d.params.bright_cps = 1e9;   //contrast only, any rate will do
+	grid.det_min = atof(argv[13]);
+	grid.det_max = atof(argv[14]);
+	grid.num_det = atoi(argv[15]);
+	grid.amp_min = atof(argv[16]);
+	grid.amp_max = atof(argv[17]);
+	grid.num_amp = atoi(argv[18]);
+	num_baths = parse_list(argv[19], baths, MAX_BATHS);
+	d.step = 1;
+	num_variants = 0;
+	for(i=20; i<argc; i++) {
+		if (strncmp(argv[i], "spectrum=", 9) == 0) {
+			spectrum = read_spreadsheet(argv[i] + 9, &d.spectrum_rows, &cols);
+			if (spectrum == NULL) {
+				return -1;
+			}
+			if (cols != 2) {
+				printf("%s must have two columns, frequency and S", argv[i] + 9);
+				return -1;
+			}
+			d.spectrum = spectrum;
+		}
+		else if (strncmp(argv[i], "step=", 5) == 0) {
+			d.step = atof(argv[i] + 5);
+		}
+		else if (num_variants == MAX_VARIANTS) {
+			printf("At most %d variants", MAX_VARIANTS);
+			return -1;
+		}
+		else {
+			variants[num_variants++] = argv[i];
+		}
+	}
+
+	if (slots <= 0 || sig < 0 || sig >= slots || ref < 0 || ref >= slots
+	    || grid.num_det <= 0 || grid.num_amp <= 0 || num_baths == 0
+	    || num_variants == 0 || d.step <= 0) {
+		printf("Bad gate/batch arguments");
+		return -1;
+	}
+
+	d.num_cases = 1 + grid.num_det * grid.num_amp;
+	if (nv_alloc(&d.nv, d.num_cases * ENSEMBLE) != 0) {
+		printf("Out of memory");
+		return -1;
+	}
+	d.photons = malloc(d.nv.n * sizeof(double));
+	d.gate_sum = calloc(d.num_cases, sizeof(double));
+	for(i=0; i<PROPAGATORS; i++) {
+		if (nv_propagator_alloc(&d.props[i], d.nv.n) != 0) {
+			printf("Out of memory");
+			return -1;
+		}
+	}
+	if (d.photons == NULL || d.gate_sum == NULL) {
+		printf("Out of memory");
+		return -1;
+	}
+	sigma = t2star > 0 ? sqrt(2.0) / (t2star * 1e3) : 0;
+
+	for(v=0; v<num_variants; v++) {
+		if (read_pb_image(variants[v], &img) != 0) {
+			return -1;
+		}
+		filter_collect_free(&d.blocks);
+		filter_collect_init(&d.blocks, &img, d.mw_mask);
+		d.num_chi = 0;
+		snprintf(path, sizeof(path), "%s_%d.txt", argv[1], v);
+		fp = fopen(path, "w");
+		if (fp == NULL) {
+			printf("Could not open %s", path);
+			return -1;
+		}
+
+		sum_sq = 0;
+		count = 0;
+		worst[v] = 0;
+		nominal_min = HUGE_VAL;
+		nominal_max = -HUGE_VAL;
+
+		for(b=0; b<num_baths; b++) {
+			//case 0 is nominal, then detuning x amplitude error
+			for(c=0, k=0; c<d.num_cases; c++) {
+				grid_case(&grid, c, &det, &amp);
+				for(e=0; e<ENSEMBLE; e++, k++) {
+					d.nv.delta[k] = 2 * M_PI * det * 1e-3;
+					if (sigma > 0) {
+						d.nv.delta[k] += sigma * nv_inverse_normal((e + 0.5) / ENSEMBLE);
+					}
+					d.nv.omega[k] = 2 * M_PI * d.params.rabi_mhz * 1e-3 * (1 + amp);
+					d.nv.weight[k] = 1.0 / ENSEMBLE;
+				}
+			}
+			nv_reset(&d.nv);
+			d.nv.decay_rate = baths[b] > 0 ? 1 / (baths[b] * 1e3) : 0;
+			d.num_props = 0;
+			d.next_prop = 0;
+			d.num_gates = 0;
+			d.gate_open = 0;
+			memset(d.gate_sum, 0, d.num_cases * sizeof(double));
+			filter_collect_clear(&d.blocks);
+
+			memset(&walk, 0, sizeof(walk));
+			walk.max_outer = 1;
+			if (pb_image_walk(&img, &walk, segment, &d) != 0) {
+				return -1;
+			}
+			if (d.failed || close_gate(&d) != 0) {
+				printf("Out of memory");
+				return -1;
+			}
+
+			num_points = d.num_gates / slots;
+			if (num_points == 0) {
+				printf("%s: no counter gates (gate mask 0x%X)", variants[v], d.gate_mask);
+				return -1;
+			}
+			if (d.spectrum != NULL && d.blocks.num_seqs != num_points) {
+				printf("%s: spectrum= needs one block of MW pulses per point (%d for %d points)",
+				       variants[v], d.blocks.num_seqs, num_points);
+				return -1;
+			}
+			if (nominal == NULL) {
+				nominal = malloc(num_points * sizeof(double));
+			}
+
+			for(c=0; c<d.num_cases; c++) {
+				if (b > 0 && c == 0) {
+					continue;   //nominal is defined with the first bath only
+				}
+				grid_case(&grid, c, &det, &amp);
+				fprintf(fp, "%g\t%g\t%g", det, amp, baths[b]);
+				for(p=0; p<num_points; p++) {
+					contrast_point(CONTRAST_RATIO,
+					               d.gates[(size_t) (p*slots + sig) * d.num_cases + c],
+					               d.gates[(size_t) (p*slots + ref) * d.num_cases + c],
+					               &con, &err);
+					fprintf(fp, "\t%.6f", con);
+					if (c == 0) {
+						nominal[p] = con;
+						if (con < nominal_min) nominal_min = con;
+						if (con > nominal_max) nominal_max = con;
+					}
+					else {
+						sum_sq += (con - nominal[p]) * (con - nominal[p]);
+						count++;
+						if (fabs(con - nominal[p]) > worst[v]) {
+							worst[v] = fabs(con - nominal[p]);
+						}
+					}
+				}
+				fprintf(fp, "\n");
+			}
+		}
+		fclose(fp);
+
+		free(nominal);
+		nominal = NULL;
+		swing[v] = nominal_max - nominal_min;
+		score[v] = count > 0 ? sqrt(sum_sq / count) : 0;
+		if (d.params.contrast > 0) {
+			score[v] /= d.params.contrast;
+		}
+	}
+
+	//rank by score, insertion sort, there are only a few variants
+	for(v=0; v<num_variants; v++) {
+		rank[v] = v;
+		for(i=v; i>0 && score[rank[i]] < score[rank[i-1]]; i--) {
+			case_index = rank[i];
+			rank[i] = rank[i-1];
+			rank[i-1] = case_index;
+		}
+	}
+	printf("rank\tvariant\tscore\tworst deviation\tnominal swing\n");
+	for(v=0; v<num_variants; v++) {
+		printf("%d\t%s\t%g\t%g\t%g\n", v + 1, variants[rank[v]], score[rank[v]],
+		       worst[rank[v]], swing[rank[v]]);
+	}
+
+	free(d.photons);
+	free(d.gate_sum);
+	free(d.gates);
+	free(d.chi);
+	free(spectrum);
+	filter_collect_free(&d.blocks);
+	for(i=0; i<PROPAGATORS; i++) {
+		nv_propagator_release(&d.props[i]);
+	}
+	nv_release(&d.nv);
+	return 0;
+}
@@ -0,0 +1,361 @@
+/**
+ * \file SharedResults.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Live results in named shared memory, so any number of viewers (a VI
+ *  through a call library node, SharedView.exe, a second monitor) can look
+ *  at the latest sums, contrast and fit without the engine copying arrays
+ *  to each of them or waiting on any of them.
+ *
+ *  The region holds a header and a fixed set of named blocks of doubles
+ *  (rows x cols, row major), laid out once when the writer creates it.
+ *  Consistency is a seqlock: the writer makes the sequence number odd,
+ *  updates the blocks in place and makes it even again. It never blocks.
+ *  A reader notes the sequence number, reads, and retries if it was odd or
+ *  has changed since, so it never sees half of a publish. A reader that
+ *  takes longer than the time between publishes keeps retrying, so read
+ *  only the blocks you show.
+ *
+ *  One writer per region. The writer sets closed when it is done; the
+ *  region stays readable until the name is reused, so a viewer can keep
+ *  showing the final result, and should re-open when it sees closed (a
+ *  new run makes a new region under the same name).
+ *
+ *  POSIX shared memory (shm_open, link with -lrt on old glibc) or a paging
+ *  file mapping in the Local\ namespace on Windows, which lasts while any
+ *  process has it open. A Windows mapping can't be made anew while it
+ *  exists, so there shared_create fails until every viewer of the last
+ *  run has closed it (SharedView does when it sees closed).
+ *
+ *  A reader checks the layout against the size of what it mapped before
+ *  trusting any offset in it.
+ */
+
+#ifndef SHARED_RESULTS_H
+#define SHARED_RESULTS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Clock.h"
+
+#define SHARED_MAGIC "PBSHARE1"
+#define SHARED_MAX_BLOCKS 16
+#define SHARED_ALIGN 64
+
+struct shared_block {
+	char name[16];
+	unsigned int rows, cols;
+	unsigned long long offset;      //bytes from the start of the region
+};
+
+struct shared_header {
+	char magic[8];
+	unsigned long long size;        //whole region, bytes
+	unsigned int num_blocks;
+	atomic_int closed;
+	atomic_uint seq;                //odd while a publish is in progress
+	unsigned int reserved;
+	unsigned long long publishes;   //these two are covered by seq
+	double t_publish;               //writer's clock_seconds()
+	struct shared_block block[SHARED_MAX_BLOCKS];
+};
+
+struct shared_results {
+	unsigned char *base;
+	unsigned long long mapped;      //bytes
+	struct shared_header *h;
+	int writer;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+};
+
+static inline int shared_name(char *out, const char *name)
+{
+	if (strlen(name) == 0 || strlen(name) > 63 || strchr(name, '/') || strchr(name, '\\')) {
+		return -1;
+	}
+#ifdef _WIN32
+	sprintf(out, "Local\\%s", name);
+#else
+	sprintf(out, "/%s", name);
+#endif
+	return 0;
+}
+
+static inline int shared_map(struct shared_results *sr, const char *name, unsigned long long size,
+                             int writer)
+{
+	char full[72];
+
+	sr->base = NULL;
+	sr->writer = writer;
+	if (shared_name(full, name) != 0) {
+		return -1;
+	}
+#ifdef _WIN32
+	MEMORY_BASIC_INFORMATION info;
+
+	if (writer) {
+		sr->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+		                                 (DWORD) (size >> 32), (DWORD) size, full);
+		//an existing mapping keeps its old size, too small for this layout
+		if (sr->mapping != NULL && GetLastError() == ERROR_ALREADY_EXISTS) {
+			CloseHandle(sr->mapping);
+			return -1;
+		}
+	}
+	else {
+		sr->mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, full);
+	}
+	if (sr->mapping == NULL) {
+		return -1;
+	}
+	sr->base = MapViewOfFile(sr->mapping, writer ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+	if (sr->base == NULL) {
+		CloseHandle(sr->mapping);
+		return -1;
+	}
+	if (!writer) {
+		size = VirtualQuery(sr->base, &info, sizeof(info)) == sizeof(info)
+		     ? (unsigned long long) info.RegionSize : 0;
+	}
+	if (size < sizeof(struct shared_header)) {
+		UnmapViewOfFile(sr->base);
+		CloseHandle(sr->mapping);
+		sr->base = NULL;
+		return -1;
+	}
+#else
+	struct stat st;
+	void *p;
+	int fd;
+
+	if (writer) {
+		//a fresh object, so readers of the last run keep their own
+		shm_unlink(full);
+		fd = shm_open(full, O_RDWR | O_CREAT | O_EXCL, 0644);
+		if (fd >= 0 && ftruncate(fd, (off_t) size) != 0) {
+			close(fd);
+			shm_unlink(full);
+			return -1;
+		}
+	}
+	else {
+		fd = shm_open(full, O_RDONLY, 0);
+		if (fd >= 0 && fstat(fd, &st) == 0) {
+			size = (unsigned long long) st.st_size;
+		}
+	}
+	if (fd < 0) {
+		return -1;
+	}
+	if (size < sizeof(struct shared_header)) {
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, (size_t) size, writer ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+	         fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return -1;
+	}
+	sr->base = p;
+#endif
+	sr->mapped = size;
+	sr->h = (struct shared_header *) sr->base;
+	return 0;
+}
+
+/*
+ * Writer: creates the region with the given blocks (names up to 15
+ * characters), all zero. Returns 0 or -1.
+ */
+static inline int shared_create(struct shared_results *sr, const char *name, int num_blocks,
+                                const char *const *names, const unsigned int *rows,
+                                const unsigned int *cols)
+{
+	struct shared_header layout;
+	unsigned long long offset = sizeof(struct shared_header);
+	int i;
+
+	if (num_blocks < 1 || num_blocks > SHARED_MAX_BLOCKS) {
+		return -1;
+	}
+	memset(&layout, 0, sizeof(layout));
+	memcpy(layout.magic, SHARED_MAGIC, 8);
+	layout.num_blocks = num_blocks;
+	for(i=0; i<num_blocks; i++) {
+		offset = (offset + SHARED_ALIGN - 1) / SHARED_ALIGN * SHARED_ALIGN;
+		strncpy(layout.block[i].name, names[i], sizeof(layout.block[i].name) - 1);
+		layout.block[i].rows = rows[i];
+		layout.block[i].cols = cols[i];
+		layout.block[i].offset = offset;
+		offset += (unsigned long long) rows[i] * cols[i] * sizeof(double);
+	}
+	layout.size = offset;
+
+	if (shared_map(sr, name, layout.size, 1) != 0) {
+		return -1;
+	}
+	memset(sr->base, 0, (size_t) layout.size);
+	memcpy(sr->h, &layout, sizeof(layout));
+	atomic_init(&sr->h->seq, 0);
+	atomic_init(&sr->h->closed, 0);
+	return 0;
+}
+
+//Whether the header and every block lie inside what was mapped
+static inline int shared_valid(const struct shared_results *sr)
+{
+	const struct shared_header *h = sr->h;
+	unsigned long long doubles;
+	unsigned int i;
+
+	if (memcmp(h->magic, SHARED_MAGIC, 8) != 0 || h->size > sr->mapped
+	    || h->size < sizeof(struct shared_header) || h->num_blocks > SHARED_MAX_BLOCKS) {
+		return 0;
+	}
+	for(i=0; i<h->num_blocks; i++) {
+		doubles = (unsigned long long) h->block[i].rows * h->block[i].cols;
+		if (h->block[i].offset < sizeof(struct shared_header) || h->block[i].offset > h->size
+		    || h->block[i].offset % sizeof(double) != 0
+		    || doubles > (h->size - h->block[i].offset) / sizeof(double)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Reader: opens an existing region. Returns 0, or -1 if there is none or
+ * its layout doesn't fit in it.
+ */
+static inline int shared_open(struct shared_results *sr, const char *name)
+{
+	if (shared_map(sr, name, 0, 0) != 0) {
+		return -1;
+	}
+	if (!shared_valid(sr)) {
+#ifdef _WIN32
+		UnmapViewOfFile(sr->base);
+		CloseHandle(sr->mapping);
+#else
+		munmap(sr->base, (size_t) sr->mapped);
+#endif
+		sr->base = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static inline void shared_close(struct shared_results *sr)
+{
+	if (sr->base == NULL) {
+		return;
+	}
+	if (sr->writer) {
+		atomic_store_explicit(&sr->h->closed, 1, memory_order_release);
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(sr->base);
+	CloseHandle(sr->mapping);
+#else
+	munmap(sr->base, (size_t) sr->mapped);
+#endif
+	sr->base = NULL;
+}
+
+//Index of the block called name, or -1
+static inline int shared_find(const struct shared_results *sr, const char *name)
+{
+	unsigned int i;
+
+	for(i=0; i<sr->h->num_blocks && i<SHARED_MAX_BLOCKS; i++) {
+		if (strncmp(sr->h->block[i].name, name, sizeof(sr->h->block[i].name)) == 0) {
+			return (int) i;
+		}
+	}
+	return -1;
+}
+
+static inline double *shared_data(const struct shared_results *sr, int block)
+{
+	return (double *) (sr->base + sr->h->block[block].offset);
+}
+
+//Writer: start of a publish; write the blocks through shared_data()
+static inline void shared_publish_begin(struct shared_results *sr)
+{
+	unsigned int seq = atomic_load_explicit(&sr->h->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&sr->h->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static inline void shared_publish_end(struct shared_results *sr)
+{
+	unsigned int seq = atomic_load_explicit(&sr->h->seq, memory_order_relaxed);
+
+	sr->h->publishes++;
+	sr->h->t_publish = clock_seconds();
+	atomic_store_explicit(&sr->h->seq, seq + 1, memory_order_release);
+}
+
+/*
+ * Reader, in place: take a sequence number, read what you need, and keep
+ * it only if shared_read_valid() says nothing was published meanwhile:
+ *
+ *     do {
+ *         seq = shared_read_begin(&sr);
+ *         ...read from shared_data()...
+ *     } while (!shared_read_valid(&sr, seq));
+ */
+static inline unsigned int shared_read_begin(const struct shared_results *sr)
+{
+	unsigned int seq;
+
+	while ((seq = atomic_load_explicit(&sr->h->seq, memory_order_acquire)) & 1) {
+		//a publish takes microseconds
+	}
+	return seq;
+}
+
+static inline int shared_read_valid(const struct shared_results *sr, unsigned int seq)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&sr->h->seq, memory_order_relaxed) == seq;
+}
+
+/*
+ * Reader: consistent copy of one block into out (rows * cols doubles).
+ * Returns the number of publishes it belongs to.
+ */
+static inline unsigned long long shared_read_block(const struct shared_results *sr, int block,
+                                                   double *out)
+{
+	const struct shared_block *b = &sr->h->block[block];
+	unsigned long long publishes;
+	unsigned int seq;
+
+	do {
+		seq = shared_read_begin(sr);
+		memcpy(out, shared_data(sr, block), (size_t) b->rows * b->cols * sizeof(double));
+		publishes = sr->h->publishes;
+	} while (!shared_read_valid(sr, seq));
+	return publishes;
+}
+
+#endif
@@ -0,0 +1,118 @@
+/**
+ * \file SharedView.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Reads live results that PulsedPipeline (share=) publishes to shared
+ *  memory (SharedResults.h), e.g. from a script or a second monitor while
+ *  the run goes on. Reading never holds up the pipeline.
+ *
+ *  Usage:
+ *  SharedView <name>
+ *      Lists the blocks (name, rows, columns), then the number of
+ *      publishes, seconds since the last one and whether the writer is done.
+ *  SharedView <name> <block> [wait=N] [follow=S]
+ *      Prints the block, one row per line, from one consistent publish.
+ *      wait=N    first wait until there have been N publishes (or the
+ *                writer is done)
+ *      follow=S  keep printing it every S seconds, when there is a new
+ *                publish, until the writer is done
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SharedResults.h"
+
+#ifdef _WIN32
+#define view_sleep(s) Sleep((DWORD) ((s) * 1e3))
+#else
+#define view_sleep(s) usleep((useconds_t) ((s) * 1e6))
+#endif
+
+static void print_block(const struct shared_results *sr, int block, const double *data)
+{
+	unsigned int r, c, cols = sr->h->block[block].cols;
+
+	for(r=0; r<sr->h->block[block].rows; r++) {
+		for(c=0; c<cols; c++) {
+			printf(c ? "\t%.10g" : "%.10g", data[(size_t) r * cols + c]);
+		}
+		printf("\n");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct shared_results sr;
+	unsigned long long wait = 0, last = 0, publishes;
+	double follow = 0, *data;
+	unsigned int i;
+	int block, closed;
+
+	if (argc < 2) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	for(i=3; i<(unsigned int) argc; i++) {
+		if (strncmp(argv[i], "wait=", 5) == 0) {
+			wait = strtoull(argv[i] + 5, NULL, 10);
+		}
+		else if (strncmp(argv[i], "follow=", 7) == 0) {
+			follow = atof(argv[i] + 7);
+		}
+		else {
+			printf("Unknown option %s", argv[i]);
+			return -1;
+		}
+	}
+	if (shared_open(&sr, argv[1]) != 0) {
+		printf("No shared results called %s", argv[1]);
+		return -1;
+	}
+
+	if (argc == 2) {
+		for(i=0; i<sr.h->num_blocks; i++) {
+			printf("%s\t%u\t%u\n", sr.h->block[i].name, sr.h->block[i].rows,
+			       sr.h->block[i].cols);
+		}
+		do {
+			i = shared_read_begin(&sr);
+			publishes = sr.h->publishes;
+			follow = publishes ? clock_seconds() - sr.h->t_publish : 0;
+		} while (!shared_read_valid(&sr, i));
+		printf("%llu\t%g\t%d\n", publishes, follow, atomic_load(&sr.h->closed));
+		shared_close(&sr);
+		return 0;
+	}
+
+	block = shared_find(&sr, argv[2]);
+	if (block < 0) {
+		printf("No block %s in %s", argv[2], argv[1]);
+		shared_close(&sr);
+		return -1;
+	}
+	data = malloc((size_t) sr.h->block[block].rows * sr.h->block[block].cols * sizeof(double));
+
+	while (!atomic_load(&sr.h->closed) && sr.h->publishes < wait) {
+		view_sleep(0.01);
+	}
+	do {
+		//read closed first, so the last publish is printed once it's set
+		closed = atomic_load(&sr.h->closed);
+		publishes = shared_read_block(&sr, block, data);
+		if (publishes != last) {
+			print_block(&sr, block, data);
+			fflush(stdout);
+			last = publishes;
+		}
+		if (follow > 0 && !closed) {
+			view_sleep(follow);
+		}
+	} while (follow > 0 && !closed);
+
+	free(data);
+	shared_close(&sr);
+	return 0;
+}
@@ -7,6 +7,11 @@
         argv[1-6]:  window times 1-6
         argv[7-12]: window channels 1-6
         argv[13]: number of repetitions
+        argv[14+]: optional name=value args, see BurnOptions.h
+                   aoclock= steps the laser voltage table once per
+                   repetition, at the start of window 1
+                   charge= probes the charge state after window 1,
+                   reprobe= again before one of windows 2-6
  */
 
 #include <stdio.h>
@@ -15,26 +20,32 @@
 #define PBESRPRO
 #define CLOCK 500.0
 #include "spinapi.h"
+#include "BurnOptions.h"
 
 int detect_boards();
 int select_board(int numBoards);
 
 int main(int argc, char *argv[])
 {
-	int start, scan_loop, status;
+	int scan_loop;
 	int num_scans;
 	int numBoards;
 	double window_time[6];
 	int window_channel[6];
+	struct burn_options options;
 
 	//Uncommenting the line below will generate a debug log in your current
 	//directory that can help debug any problems that you may be experiencing   
 	//pb_set_debug(1); 
 	
-	if (argc != 14) {
+	if (argc < 14) {
        printf("Wrong number of arguments");
        return -1;
     }
+    if (parse_burn_options(argc, argv, 14, &options) != 0
+        || check_reprobe(&options, 2, 6) != 0) {
+       return -1;
+    }
 
 	/*If there is more than one board in the system, have the user specify. */
 	if ((numBoards = detect_boards()) > 1) {
@@ -57,21 +68,46 @@ int main(int argc, char *argv[])
         }
     }
     num_scans = atoi(argv[13]);
+    //AO clock edge at the start of each repetition (full ON so the edge
+    //is there even if window 1 would otherwise be a short pulse)
+    if (options.ao_clock != 0) {
+        window_channel[0] |= ON | options.ao_clock;
+    }
 	
 	// Tell the driver what clock frequency the board has (in MHz)
 	pb_core_clock(CLOCK);
 
 	pb_start_programming(PULSE_PROGRAM);
+	if (burn_head(&options) != 0) {
+		printf("Error burning the program: %s\n", pb_get_error());
+		return -1;
+	}
 	
 	// Repetition loop, window 1
 	scan_loop = pb_inst(window_channel[0], LOOP, num_scans, window_time[0] * ns);
+	//charge check after the window 1 repump
+	if (burn_charge_check(&options) != 0) {
+		printf("Error burning the program: %s\n", pb_get_error());
+		return -1;
+	}
 	//Window 2-5
 	for(i=1; i<5; i++) {
+        if (burn_reprobe(&options, i + 1) != 0) {
+            printf("Error burning the program: %s\n", pb_get_error());
+            return -1;
+        }
         pb_inst(window_channel[i], CONTINUE, 0, window_time[i] * ns);
     }
 	//End loop, window 6
+	if (burn_reprobe(&options, 6) != 0) {
+		printf("Error burning the program: %s\n", pb_get_error());
+		return -1;
+	}
 	pb_inst(window_channel[5], END_LOOP, scan_loop, window_time[5] * ns);
-	pb_inst(0x0, STOP, 0, 10*ns);
+	if (burn_end(&options) != 0) {
+		printf("Error burning the program: %s\n", pb_get_error());
+		return -1;
+	}
 
 	pb_stop_programming();
 
@@ -12,6 +12,7 @@
  *  window channels 1-5,7-12
  *  number of scans (samples before track)
  *  number of times (samples) per scan (time axis points)
+ *  optional name=value args, see BurnOptions.h
  */
 
 #include <stdio.h>
@@ -20,13 +21,15 @@
 #define PBESRPRO
 #define CLOCK 500.0
 #include "spinapi.h"
+#include "BurnOptions.h"
+#include "SweepOrder.h"
 
 int detect_boards();
 int select_board(int numBoards);
 
 int main(int argc, char *argv[])
 {
-	int start, scan_loop, status;
+	int scan_loop;
 	int num_scans, num_times; //num_times - the number of times to pulse the MW
 	                           //num_scans - number of runs for min->max
 	int numBoards;
@@ -35,15 +38,21 @@ int main(int argc, char *argv[])
 	int tau;
 	int window_channel[12];
 	int window_channel3;
+	int *order;
+	struct burn_options options;
 
 	//Uncommenting the line below will generate a debug log in your current
 	//directory that can help debug any problems that you may be experiencing   
 	//pb_set_debug(1); 
 	
-	if (argc != 26) {
+	if (argc < 26) {
        printf("Wrong number of arguments");
        return -1;
     }
+    if (parse_burn_options(argc, argv, 26, &options) != 0
+        || check_reprobe(&options, 7, 12) != 0) {
+       return -1;
+    }
 
 	/*If there is more than one board in the system, have the user specify. */
 	if ((numBoards = detect_boards()) > 1) {
@@ -56,7 +65,7 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 	
-	int i,j;
+	int i,j,k;
 	//Window times 1-3, in ns
     for(i=0; i<3; i++) {
         window_time[i] = atof(argv[i+1]) * 1e9;
@@ -90,17 +99,30 @@ int main(int argc, char *argv[])
     window_channel[5] = window_channel[3];
     num_scans = atoi(argv[24]);
     num_times = atoi(argv[25]);
+    
+    order = malloc(num_times * sizeof(int));
+    sweep_order(order, num_times, options.seed);
 	
 	// Tell the driver what clock frequency the board has (in MHz)
 	pb_core_clock(CLOCK);
 
 	pb_start_programming(PULSE_PROGRAM);
+	if (burn_head(&options) != 0) {
+		printf("Error burning the program: %s\n", pb_get_error());
+		return -1;
+	}
 	
 	// Loop through all the time axis points
 	scan_loop = pb_inst(0x0, LOOP, num_scans, 10 * ns);
 	// For each time axis point
-    for(i=0; i<num_times; i++) {
+    for(k=0; k<num_times; k++) {
+        i = order[k];
         pb_inst(window_channel[0], CONTINUE, 0, window_time[0] * ns);
+        //charge check after the window 1 repump, before the MW
+        if (burn_charge_check(&options) != 0) {
+            printf("Error burning the program: %s\n", pb_get_error());
+            return -1;
+        }
         pb_inst(window_channel[1], CONTINUE, 0, window_time[1] * ns);
         pb_inst(window_channel[2], CONTINUE, 0, window_time[2] * ns);
         
@@ -121,13 +143,21 @@ int main(int argc, char *argv[])
         
         //Windows 7-12
         for(j=6;j<12;j++) {
+            if (burn_reprobe(&options, j + 1) != 0) {
+                printf("Error burning the program: %s\n", pb_get_error());
+                return -1;
+            }
             pb_inst(window_channel[j], CONTINUE, 0, window_time[j] * ns);
         }
     }
     pb_inst(0x0, END_LOOP, scan_loop, 10*ns);
-    pb_inst(0x0, STOP, 0, 10*ns);
+    if (burn_end(&options) != 0) {
+        printf("Error burning the program: %s\n", pb_get_error());
+        return -1;
+    }
 	
 	pb_stop_programming();
+	free(order);
 
 	return 0;
 }
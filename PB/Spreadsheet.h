@@ -0,0 +1,146 @@
+/**
+ * \file Spreadsheet.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Reads/writes the tab-delimited files made by LabVIEW's
+ *  Write To Spreadsheet File.vi, so the processing programs can work on
+ *  the same files the VIs save.
+ */
+
+#ifndef SPREADSHEET_H
+#define SPREADSHEET_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline int spreadsheet_push(double **data, int *size, int *capacity,
+                                   double value)
+{
+	double *grown;
+
+	if (*size == *capacity) {
+		grown = realloc(*data, 2 * (*capacity) * sizeof(double));
+		if (grown == NULL) {
+			return -1;
+		}
+		*data = grown;
+		*capacity *= 2;
+	}
+	(*data)[(*size)++] = value;
+	return 0;
+}
+
+/*
+ * Reads a whole spreadsheet into a row-major array of doubles.
+ * The number of columns is taken from the first row; short rows are padded
+ * with 0 and extra values are dropped. Returns NULL (and prints why) on
+ * failure. Caller frees.
+ */
+static inline double *read_spreadsheet(const char *path, int *rows, int *cols)
+{
+	FILE *fp;
+	char *line, *tok, *end, *grown;
+	int line_size = 1 << 16;
+	int size = 0, capacity = 1024;
+	int col, num_cols = 0, num_rows = 0, error = 0;
+	double value, *data;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		printf("Could not open %s\n", path);
+		return NULL;
+	}
+
+	line = malloc(line_size);
+	data = malloc(capacity * sizeof(double));
+	if (line == NULL || data == NULL) {
+		error = -1;
+	}
+
+	while (error == 0 && fgets(line, line_size, fp) != NULL) {
+		//long rows (big sweeps) can be longer than the buffer
+		while (strchr(line, '\n') == NULL && !feof(fp)) {
+			grown = realloc(line, 2 * line_size);
+			if (grown == NULL) {
+				error = -1;
+				break;
+			}
+			line = grown;
+			if (fgets(line + line_size - 1, line_size + 1, fp) == NULL) {
+				break;
+			}
+			line_size *= 2;
+		}
+
+		col = 0;
+		tok = line;
+		while (error == 0) {
+			value = strtod(tok, &end);
+			if (end == tok || (num_rows > 0 && col >= num_cols)) {
+				break;
+			}
+			error = spreadsheet_push(&data, &size, &capacity, value);
+			col++;
+			tok = end;
+		}
+
+		if (col == 0) {
+			continue;   //blank line
+		}
+		if (num_rows == 0) {
+			num_cols = col;
+		}
+		while (error == 0 && col < num_cols) {
+			error = spreadsheet_push(&data, &size, &capacity, 0);
+			col++;
+		}
+		num_rows++;
+	}
+
+	free(line);
+	fclose(fp);
+
+	if (error != 0) {
+		printf("Out of memory reading %s\n", path);
+		free(data);
+		return NULL;
+	}
+
+	*rows = num_rows;
+	*cols = num_cols;
+	return data;
+}
+
+/*
+ * Writes a row-major array as a tab-delimited spreadsheet.
+ * Returns 0 on success, -1 on failure.
+ */
+static inline int write_spreadsheet(const char *path, const double *data,
+                                    int rows, int cols)
+{
+	FILE *fp;
+	int i, j;
+
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		printf("Could not open %s for writing\n", path);
+		return -1;
+	}
+
+	for(i=0; i<rows; i++) {
+		for(j=0; j<cols; j++) {
+			fprintf(fp, j == 0 ? "%.10g" : "\t%.10g", data[i*cols + j]);
+		}
+		fprintf(fp, "\n");
+	}
+
+	if (fclose(fp) != 0) {
+		printf("Error writing %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,364 @@
+/**
+ * \file StabilityAnalyzer.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Started from low-T/Stability.vi (without waiting) next to a
+ *  StabilityBurn run. Watches the per-shot counts of the resonant probe as
+ *  they come in and keeps a running picture of the emitter, so bad ones can
+ *  be abandoned within seconds instead of after the run:
+ *
+ *  - counts binned to <shots per bin>
+ *  - line-center trajectory: distance of the line from the laser, from the
+ *    Lorentzian |d| = G/2 sqrt(I_max/I - 1), I_max = 95th percentile bin
+ *  - count autocorrelation g(t) = <I(0)I(t)>/<I>^2 - 1, recomputed with
+ *    an FFT every time the number of bins doubles
+ *  - jump rate = 1/(time for g to fall to 1/e)
+ *  - blinking: on/off with a threshold 3 sigma above the background,
+ *    on fraction, mean on and off times
+ *  - linewidth: sqrt(G^2 + (2.355 * rms |d| while on)^2)
+ *
+ *  The VI appends each shot's count (U32, little endian) to the spool
+ *  file. The run ends when <spool>.done exists and everything is read.
+ *
+ *  Arg Description
+ *  1   Count spool file
+ *  2   Report file (name/value lines, rewritten atomically about once a
+ *      second). Also writes <report>.trajectory (time s, counts, |d| MHz,
+ *      on) and <report>.acf (lag s, g)
+ *  3   Shots per bin
+ *  4   Shot period (us, one inner loop of StabilityBurn)
+ *  5   Homogeneous linewidth G (MHz)
+ *  6   Background counts per bin
+ *  7   Abandon if the linewidth goes above this (MHz, 0 = never)
+ *  8   Abandon if the on fraction goes below this (0 = never)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "FFT.h"
+#include "Clock.h"
+#include "AtomicWrite.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#define analyzer_sleep() Sleep(20)
+#else
+#include <unistd.h>
+#define analyzer_sleep() usleep(20000)
+#endif
+
+#define MIN_ACF_BINS 64
+#define READ_BLOCK 4096
+#define MIN_BINS_TO_JUDGE 256
+
+struct analyzer {
+	int shots_per_bin;
+	double bin_s, linewidth, background, max_linewidth, min_on_fraction;
+
+	unsigned int *bins;
+	int num_bins, bins_size;
+	unsigned int partial;
+	int partial_shots;
+
+	int *hist;                  //bins with each count, for the percentile
+	int hist_size;
+
+	double threshold;           //on/off
+	int on, num_on_bins, on_runs, off_runs;
+	double on_time, off_time;
+	double sum_d2;              //sum of |d|^2 over on bins (MHz^2)
+	int num_d;
+
+	int acf_bins;               //bins used for the last autocorrelation
+	double jump_rate;
+	double *acf;
+	int acf_size;
+};
+
+static double percentile(const struct analyzer *a, double p)
+{
+	int i, need = (int) (p * a->num_bins), seen = 0;
+
+	for(i=0; i<a->hist_size; i++) {
+		seen += a->hist[i];
+		if (seen > need) {
+			return i;
+		}
+	}
+	return a->hist_size - 1;
+}
+
+static double detuning(const struct analyzer *a, double counts, double i_max)
+{
+	double signal = counts - a->background;
+	double peak = i_max - a->background;
+
+	if (signal <= 0 || peak <= 0) {
+		return HUGE_VAL;
+	}
+	if (signal >= peak) {
+		return 0;
+	}
+	return a->linewidth / 2 * sqrt(peak / signal - 1);
+}
+
+static void update_acf(struct analyzer *a, const char *report)
+{
+	int n = 1, m, i;
+	double *re, *im, mean = 0, norm;
+	char path[1024], tmp[1100];
+	FILE *fp;
+
+	while (2 * n <= a->num_bins) {
+		n *= 2;
+	}
+	//most recent n bins, padded 2x so the correlation isn't circular
+	m = 2 * n;
+	re = calloc(m, sizeof(double));
+	im = calloc(m, sizeof(double));
+	for(i=0; i<n; i++) {
+		mean += a->bins[a->num_bins - n + i];
+	}
+	mean /= n;
+	if (mean <= 0) {
+		free(re);
+		free(im);
+		return;
+	}
+	for(i=0; i<n; i++) {
+		re[i] = a->bins[a->num_bins - n + i] - mean;
+	}
+
+	fft(re, im, m, -1);
+	for(i=0; i<m; i++) {
+		re[i] = re[i]*re[i] + im[i]*im[i];
+		im[i] = 0;
+	}
+	fft(re, im, m, 1);
+
+	if (a->acf_size < n / 2) {
+		a->acf = realloc(a->acf, n / 2 * sizeof(double));
+	}
+	a->acf_size = n / 2;
+	a->jump_rate = 0;
+	for(i=0; i<n/2; i++) {
+		//unbiased: divide by the number of overlapping pairs
+		norm = (double) m * (n - i) * mean * mean;
+		a->acf[i] = re[i] / norm;
+		if (a->jump_rate == 0 && i > 0 && a->acf[i] < a->acf[0] / M_E) {
+			a->jump_rate = 1 / (i * a->bin_s);
+		}
+	}
+	a->acf_bins = n;
+
+	snprintf(path, sizeof(path), "%s.acf", report);
+	fp = atomic_open(path, tmp, sizeof(tmp));
+	if (fp != NULL) {
+		for(i=0; i<a->acf_size; i++) {
+			fprintf(fp, "%g\t%.6g\n", i * a->bin_s, a->acf[i]);
+		}
+		atomic_close(fp, tmp, path);
+	}
+
+	free(re);
+	free(im);
+}
+
+static void add_bin(struct analyzer *a, unsigned int counts, FILE *trajectory)
+{
+	double i_max, d;
+	int on;
+
+	if (a->num_bins == a->bins_size) {
+		a->bins_size = a->bins_size ? 2 * a->bins_size : 4096;
+		a->bins = realloc(a->bins, a->bins_size * sizeof(unsigned int));
+	}
+	a->bins[a->num_bins++] = counts;
+
+	if ((int) counts >= a->hist_size) {
+		int size = a->hist_size ? a->hist_size : 256;
+		while (size <= (int) counts) size *= 2;
+		a->hist = realloc(a->hist, size * sizeof(int));
+		memset(a->hist + a->hist_size, 0, (size - a->hist_size) * sizeof(int));
+		a->hist_size = size;
+	}
+	a->hist[counts]++;
+
+	on = counts > a->threshold;
+	if (a->num_bins > 1 && on != a->on) {
+		if (a->on) a->on_runs++;
+		else a->off_runs++;
+	}
+	a->on = on;
+	if (on) {
+		a->num_on_bins++;
+		a->on_time += a->bin_s;
+	}
+	else {
+		a->off_time += a->bin_s;
+	}
+
+	i_max = percentile(a, 0.95);
+	d = detuning(a, counts, i_max);
+	if (on && d != HUGE_VAL) {
+		a->sum_d2 += d * d;
+		a->num_d++;
+	}
+	if (trajectory != NULL) {
+		fprintf(trajectory, "%.6f\t%u\t%.4g\t%d\n", a->num_bins * a->bin_s,
+		        counts, d == HUGE_VAL ? -1 : d, on);
+	}
+}
+
+static void write_report(struct analyzer *a, const char *report, int finished)
+{
+	double on_fraction, linewidth, rms_d;
+	char tmp[1100];
+	const char *verdict = "ok";
+	int runs_on, runs_off;
+	FILE *fp;
+
+	on_fraction = a->num_bins > 0 ? (double) a->num_on_bins / a->num_bins : 0;
+	rms_d = a->num_d > 0 ? sqrt(a->sum_d2 / a->num_d) : 0;
+	linewidth = sqrt(a->linewidth * a->linewidth + 2.355 * rms_d * 2.355 * rms_d);
+	//count the run in progress too
+	runs_on = a->on_runs + (a->on ? 1 : 0);
+	runs_off = a->off_runs + (a->on ? 0 : 1);
+
+	if (a->num_bins >= MIN_BINS_TO_JUDGE) {
+		if (a->max_linewidth > 0 && linewidth > a->max_linewidth) {
+			verdict = "abandon (linewidth)";
+		}
+		else if (a->min_on_fraction > 0 && on_fraction < a->min_on_fraction) {
+			verdict = "abandon (blinking)";
+		}
+	}
+
+	fp = atomic_open(report, tmp, sizeof(tmp));
+	if (fp == NULL) {
+		return;
+	}
+	fprintf(fp, "verdict\t%s\n", verdict);
+	fprintf(fp, "finished\t%d\n", finished);
+	fprintf(fp, "bins\t%d\n", a->num_bins);
+	fprintf(fp, "time_s\t%g\n", a->num_bins * a->bin_s);
+	fprintf(fp, "peak_counts\t%g\n", a->num_bins > 0 ? percentile(a, 0.95) : 0);
+	fprintf(fp, "linewidth_mhz\t%g\n", linewidth);
+	fprintf(fp, "rms_detuning_mhz\t%g\n", rms_d);
+	fprintf(fp, "jump_rate_hz\t%g\n", a->jump_rate);
+	fprintf(fp, "acf_bins\t%d\n", a->acf_bins);
+	fprintf(fp, "on_fraction\t%g\n", on_fraction);
+	fprintf(fp, "mean_on_s\t%g\n", runs_on > 0 ? a->on_time / runs_on : 0);
+	fprintf(fp, "mean_off_s\t%g\n", runs_off > 0 && a->off_time > 0 ? a->off_time / runs_off : 0);
+	atomic_close(fp, tmp, report);
+}
+
+int main(int argc, char *argv[])
+{
+	struct analyzer a;
+	unsigned int block[READ_BLOCK];
+	char done_path[1024], path[1024];
+	FILE *spool = NULL, *trajectory, *done;
+	size_t got = 0, whole, i;
+	int finishing = 0, next_acf = MIN_ACF_BINS;
+	double last_report = 0;
+
+	if (argc != 9) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+
+	memset(&a, 0, sizeof(a));
+	a.shots_per_bin = atoi(argv[3]);
+	a.bin_s = a.shots_per_bin * atof(argv[4]) * 1e-6;
+	a.linewidth = atof(argv[5]);
+	a.background = atof(argv[6]);
+	a.max_linewidth = atof(argv[7]);
+	a.min_on_fraction = atof(argv[8]);
+	a.threshold = a.background + 3 * sqrt(a.background + 1);
+	if (a.shots_per_bin <= 0 || a.bin_s <= 0) {
+		printf("Shots per bin and shot period must be positive");
+		return -1;
+	}
+
+	snprintf(done_path, sizeof(done_path), "%s.done", argv[1]);
+	snprintf(path, sizeof(path), "%s.trajectory", argv[2]);
+	trajectory = fopen(path, "w");
+	if (trajectory == NULL) {
+		printf("Could not open %s", path);
+		return -1;
+	}
+
+	while (1) {
+		if (spool == NULL) {
+			spool = fopen(argv[1], "rb");
+			if (spool == NULL) {
+				done = fopen(done_path, "rb");
+				if (done != NULL) {
+					fclose(done);
+					break;
+				}
+				analyzer_sleep();
+				continue;
+			}
+		}
+
+		//read bytes, the VI may be in the middle of writing a count
+		got += fread((char *) block + got, 1, sizeof(block) - got, spool);
+		whole = got / sizeof(unsigned int);
+		for(i=0; i<whole; i++) {
+			a.partial += block[i];
+			if (++a.partial_shots == a.shots_per_bin) {
+				add_bin(&a, a.partial, trajectory);
+				a.partial = 0;
+				a.partial_shots = 0;
+			}
+		}
+		//keep a partly read count for the next pass
+		memmove(block, block + whole, got - whole * sizeof(unsigned int));
+		got -= whole * sizeof(unsigned int);
+
+		if (a.num_bins >= next_acf) {
+			update_acf(&a, argv[2]);
+			next_acf = 2 * a.acf_bins;
+		}
+		if (clock_seconds() - last_report > 1) {
+			fflush(trajectory);
+			write_report(&a, argv[2], 0);
+			last_report = clock_seconds();
+		}
+
+		if (whole < READ_BLOCK) {
+			if (finishing) {
+				break;
+			}
+			clearerr(spool);
+			done = fopen(done_path, "rb");
+			if (done != NULL) {
+				//the VI writes .done after its last write, one more pass
+				fclose(done);
+				finishing = 1;
+				continue;
+			}
+			analyzer_sleep();
+		}
+	}
+
+	if (a.num_bins >= MIN_ACF_BINS) {
+		update_acf(&a, argv[2]);
+	}
+	write_report(&a, argv[2], 1);
+
+	if (spool != NULL) {
+		fclose(spool);
+	}
+	fclose(trajectory);
+	free(a.bins);
+	free(a.hist);
+	free(a.acf);
+	return 0;
+}
@@ -21,7 +21,7 @@ int select_board(int numBoards);
 
 int main(int argc, char *argv[])
 {
-	int start, outer_loop, inner_loop, status;
+	int outer_loop, inner_loop;
 	int num_outer_scans, num_inner_scans;
 	int numBoards;
 	double window_time[6];
@@ -19,7 +19,7 @@ int select_board(int numBoards);
 
 int main(int argc, char *argv[])
 {
-	int start, freq_loop, status;
+	int freq_loop;
 	int num_freqs;
 	int numBoards;
 	double window_time;
@@ -0,0 +1,553 @@
+/**
+ * \file SurveyPlan.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Schedules a survey over many NVs (e.g. the FindNV.exe list): in which
+ *  order to visit them and run the steps of the experiment plan on each,
+ *  instead of one NV at a time in the order found.
+ *
+ *  - The visiting order is a short stage path: nearest neighbour from the
+ *    start position, then 2-opt until no swap of two legs shortens it.
+ *  - NVs are taken in batches of K consecutive NVs along that path. Each
+ *    step is run on the whole batch before the next step (one burn per
+ *    step per batch instead of per NV, via Board.exe's skip of identical
+ *    burns), going back and forth along the batch so the NV at the end of
+ *    one step is the first of the next (no move and no re-track there).
+ *    K = 1 is the old way, all steps on one NV. The K with the shortest
+ *    estimated survey time is used: moving, tracking after each move, a
+ *    burn whenever the program changes, and the steps themselves, with
+ *    <pass> of the NVs surviving each screening step.
+ *  - Screening steps have a range for their result (ESR contrast, count
+ *    rate, ...). An NV whose result is outside it gets no further steps.
+ *
+ *  Plan file, one step per line, tab separated (# starts a comment):
+ *      name  seconds  min  max  burner command line
+ *  seconds is the step's measurement time, min/max its screening range
+ *  (- for none). A command of - needs no burn (e.g. a count rate).
+ *
+ *  Usage:
+ *  SurveyPlan plan <candidates> <plan file> <state file> <stage speed um/s>
+ *                  <track s> <burn s> [options]
+ *      candidates - spreadsheet with x, y, z (um) in the first columns,
+ *      best first (FindNV output). Prints the estimated hours for each
+ *      batch size tried, then the one used.
+ *      Options: start=x,y,z (stage position now, default the first NV),
+ *      pass=F (expected fraction passing each screen, default 0.5),
+ *      batch=K (force the batch size), max=N (only the first N NVs)
+ *  SurveyPlan next <state file>
+ *      Prints the next step: NV number, x, y, z, step name, track (1 if
+ *      the stage moved), burn (1 if the program changed), command; or
+ *      "done". Tab separated.
+ *  SurveyPlan result <state file> <value>
+ *      Result of the step just done. Prints 0 if the NV failed its screen
+ *      (and is dropped), 1 otherwise.
+ *  SurveyPlan status <state file>
+ *      Prints NVs finished, dropped, still to do, and steps left.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "AtomicWrite.h"
+#include "Spreadsheet.h"
+
+#define NAME_LENGTH 64
+#define COMMAND_LENGTH 4096
+#define MAX_STEPS 32
+
+struct step {
+	char name[NAME_LENGTH];
+	double seconds;
+	int screen;
+	double min, max;
+	char command[COMMAND_LENGTH];
+};
+
+struct nv {
+	double x, y, z;
+	int dropped;
+};
+
+struct survey {
+	int num_steps, num_nvs, num_actions;
+	struct step steps[MAX_STEPS];
+	struct nv *nvs;
+	int *action_nv, *action_step;
+	int cursor;         //next action
+	int current;        //action issued last, -1 = none
+	int loaded;         //step whose program is on the board, -1 = none
+	int at_nv;          //NV the stage is at, -1 = none
+};
+
+static double distance(const struct nv *a, const struct nv *b)
+{
+	return sqrt((a->x - b->x) * (a->x - b->x) + (a->y - b->y) * (a->y - b->y)
+	            + (a->z - b->z) * (a->z - b->z));
+}
+
+static int read_plan(const char *path, struct survey *sv)
+{
+	char line[COMMAND_LENGTH + 256], *field[5], *p;
+	struct step *st;
+	int i;
+	FILE *fp = fopen(path, "r");
+
+	if (fp == NULL) {
+		printf("Could not open %s", path);
+		return -1;
+	}
+	sv->num_steps = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] == '#' || line[0] == 0) {
+			continue;
+		}
+		p = line;
+		for(i=0; i<5; i++) {
+			field[i] = p;
+			if (i < 4) {
+				p = strchr(p, '\t');
+				if (p == NULL) {
+					break;
+				}
+				*p++ = 0;
+			}
+		}
+		if (i < 5 || sv->num_steps == MAX_STEPS) {
+			printf("Bad plan line: %s", line);
+			fclose(fp);
+			return -1;
+		}
+		st = &sv->steps[sv->num_steps++];
+		strncpy(st->name, field[0], NAME_LENGTH - 1);
+		st->name[NAME_LENGTH - 1] = 0;
+		st->seconds = atof(field[1]);
+		st->screen = strcmp(field[2], "-") != 0 || strcmp(field[3], "-") != 0;
+		st->min = strcmp(field[2], "-") != 0 ? atof(field[2]) : -HUGE_VAL;
+		st->max = strcmp(field[3], "-") != 0 ? atof(field[3]) : HUGE_VAL;
+		strncpy(st->command, field[4], COMMAND_LENGTH - 1);
+		st->command[COMMAND_LENGTH - 1] = 0;
+	}
+	fclose(fp);
+	if (sv->num_steps == 0) {
+		printf("No steps in %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+//Visiting order from start: nearest neighbour, then 2-opt on the open path
+static void plan_route(struct nv *nvs, int n, const struct nv *start)
+{
+	struct nv *path = malloc((n + 1) * sizeof(struct nv)), tmp;
+	int i, j, k, best, improved;
+	double d, best_d, delta;
+
+	path[0] = *start;
+	memcpy(path + 1, nvs, n * sizeof(struct nv));
+	for(i=1; i<n; i++) {
+		best = i;
+		best_d = HUGE_VAL;
+		for(j=i; j<=n; j++) {
+			d = distance(&path[i - 1], &path[j]);
+			if (d < best_d) {
+				best_d = d;
+				best = j;
+			}
+		}
+		tmp = path[i];
+		path[i] = path[best];
+		path[best] = tmp;
+	}
+	//reverse path[i..j] if that shortens it; the start stays first
+	do {
+		improved = 0;
+		for(i=1; i<n; i++) {
+			for(j=i+1; j<=n; j++) {
+				delta = distance(&path[i - 1], &path[j]) - distance(&path[i - 1], &path[i]);
+				if (j < n) {
+					delta += distance(&path[i], &path[j + 1])
+					       - distance(&path[j], &path[j + 1]);
+				}
+				if (delta < -1e-9) {
+					for(k=0; k<(j - i + 1) / 2; k++) {
+						tmp = path[i + k];
+						path[i + k] = path[j - k];
+						path[j - k] = tmp;
+					}
+					improved = 1;
+				}
+			}
+		}
+	} while (improved);
+	memcpy(nvs, path + 1, n * sizeof(struct nv));
+	free(path);
+}
+
+//Actions for batches of k NVs along the route; returns the count
+static int make_actions(struct survey *sv, int k, int *action_nv, int *action_step)
+{
+	int b, s, i, m, n = 0, forward;
+
+	for(b=0; b<sv->num_nvs; b+=k) {
+		m = sv->num_nvs - b < k ? sv->num_nvs - b : k;
+		forward = 1;
+		for(s=0; s<sv->num_steps; s++) {
+			for(i=0; i<m; i++) {
+				action_nv[n] = b + (forward ? i : m - 1 - i);
+				action_step[n++] = s;
+			}
+			forward = !forward;
+		}
+	}
+	return n;
+}
+
+/*
+ * Expected survey time (s) for the action order: each NV survives each
+ * screening step with probability pass, and a step is only done (and
+ * moved to, tracked and burned for) while it survives.
+ */
+static double estimate(const struct survey *sv, const int *action_nv, const int *action_step,
+                       int n, const struct nv *start, double speed, double track_s,
+                       double burn_s, double pass)
+{
+	double t = 0, p, *alive = malloc(sv->num_nvs * sizeof(double));
+	const struct nv *at = start;
+	int i, loaded = -1, s, nv;
+
+	for(i=0; i<sv->num_nvs; i++) {
+		alive[i] = 1;
+	}
+	for(i=0; i<n; i++) {
+		nv = action_nv[i];
+		s = action_step[i];
+		p = alive[nv];
+		if (&sv->nvs[nv] != at) {
+			//expected: the stage only goes there if the NV is still in
+			t += p * (distance(at, &sv->nvs[nv]) / speed + track_s);
+			at = &sv->nvs[nv];
+		}
+		if (strcmp(sv->steps[s].command, "-") != 0
+		    && (loaded < 0 || strcmp(sv->steps[loaded].command, sv->steps[s].command) != 0)) {
+			t += burn_s;
+			loaded = s;
+		}
+		t += p * sv->steps[s].seconds;
+		if (sv->steps[s].screen) {
+			alive[nv] *= pass;
+		}
+	}
+	free(alive);
+	return t;
+}
+
+static int write_state(const char *path, const struct survey *sv)
+{
+	char tmp[1100];
+	int i;
+	const struct step *st;
+	FILE *fp = atomic_open(path, tmp, sizeof(tmp));
+
+	if (fp == NULL) {
+		printf("Could not write %s", path);
+		return -1;
+	}
+	fprintf(fp, "PBSURVEY 1\n");
+	fprintf(fp, "%d\t%d\t%d\t%d\n", sv->cursor, sv->current, sv->loaded, sv->at_nv);
+	fprintf(fp, "%d\n", sv->num_steps);
+	for(i=0; i<sv->num_steps; i++) {
+		st = &sv->steps[i];
+		fprintf(fp, "%s\t%.17g\t%d\t%.17g\t%.17g\t%s\n", st->name, st->seconds, st->screen,
+		        st->screen ? st->min : 0, st->screen ? st->max : 0, st->command);
+	}
+	fprintf(fp, "%d\n", sv->num_nvs);
+	for(i=0; i<sv->num_nvs; i++) {
+		fprintf(fp, "%.17g\t%.17g\t%.17g\t%d\n", sv->nvs[i].x, sv->nvs[i].y, sv->nvs[i].z,
+		        sv->nvs[i].dropped);
+	}
+	fprintf(fp, "%d\n", sv->num_actions);
+	for(i=0; i<sv->num_actions; i++) {
+		fprintf(fp, "%d\t%d\n", sv->action_nv[i], sv->action_step[i]);
+	}
+	return atomic_close(fp, tmp, path);
+}
+
+static int read_state(const char *path, struct survey *sv)
+{
+	static char line[COMMAND_LENGTH + 256];
+	char *p;
+	struct step *st;
+	int i, j, ok = 1;
+	FILE *fp = fopen(path, "r");
+
+	memset(sv, 0, sizeof(*sv));
+	if (fp == NULL) {
+		printf("No survey state %s (run plan first)", path);
+		return -1;
+	}
+	if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, "PBSURVEY 1", 10) != 0
+	    || fscanf(fp, "%d %d %d %d %d ", &sv->cursor, &sv->current, &sv->loaded,
+	              &sv->at_nv, &sv->num_steps) != 5
+	    || sv->num_steps < 1 || sv->num_steps > MAX_STEPS) {
+		fclose(fp);
+		printf("Damaged survey state %s", path);
+		return -1;
+	}
+	for(i=0; i<sv->num_steps && ok; i++) {
+		st = &sv->steps[i];
+		ok = fgets(line, sizeof(line), fp) != NULL
+		     && sscanf(line, "%63[^\t]\t%lf\t%d\t%lf\t%lf\t", st->name, &st->seconds,
+		               &st->screen, &st->min, &st->max) == 5;
+		//the command is everything after the fifth tab
+		for(p=line, j=0; ok && p != NULL && j<5; j++) {
+			p = strchr(p, '\t');
+			p = p != NULL ? p + 1 : NULL;
+		}
+		ok = ok && p != NULL;
+		if (ok) {
+			p[strcspn(p, "\r\n")] = 0;
+			strncpy(st->command, p, COMMAND_LENGTH - 1);
+		}
+		if (!st->screen) {
+			st->min = -HUGE_VAL;
+			st->max = HUGE_VAL;
+		}
+	}
+	ok = ok && fscanf(fp, "%d", &sv->num_nvs) == 1 && sv->num_nvs > 0;
+	if (ok) {
+		sv->nvs = malloc(sv->num_nvs * sizeof(struct nv));
+	}
+	for(i=0; ok && i<sv->num_nvs; i++) {
+		ok = fscanf(fp, "%lf %lf %lf %d", &sv->nvs[i].x, &sv->nvs[i].y, &sv->nvs[i].z,
+		            &sv->nvs[i].dropped) == 4;
+	}
+	ok = ok && fscanf(fp, "%d", &sv->num_actions) == 1 && sv->num_actions > 0;
+	if (ok) {
+		sv->action_nv = malloc(sv->num_actions * sizeof(int));
+		sv->action_step = malloc(sv->num_actions * sizeof(int));
+	}
+	for(i=0; ok && i<sv->num_actions; i++) {
+		ok = fscanf(fp, "%d %d", &sv->action_nv[i], &sv->action_step[i]) == 2
+		     && sv->action_nv[i] >= 0 && sv->action_nv[i] < sv->num_nvs
+		     && sv->action_step[i] >= 0 && sv->action_step[i] < sv->num_steps;
+	}
+	fclose(fp);
+	if (!ok) {
+		printf("Damaged survey state %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+static void free_survey(struct survey *sv)
+{
+	free(sv->nvs);
+	free(sv->action_nv);
+	free(sv->action_step);
+}
+
+static int plan(int argc, char *argv[])
+{
+	struct survey sv;
+	struct nv start;
+	double *data, speed, track_s, burn_s, pass = 0.5, t, best_t = HUGE_VAL, screened;
+	int rows, cols, i, k, n, best_k = 1, batch = 0, max_nvs = 0, has_start = 0;
+	int *action_nv, *action_step;
+
+	if (argc < 8) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	memset(&sv, 0, sizeof(sv));
+	speed = atof(argv[5]);
+	track_s = atof(argv[6]);
+	burn_s = atof(argv[7]);
+	for(i=8; i<argc; i++) {
+		if (strncmp(argv[i], "start=", 6) == 0) {
+			if (sscanf(argv[i] + 6, "%lf,%lf,%lf", &start.x, &start.y, &start.z) != 3) {
+				printf("Bad option %s", argv[i]);
+				return -1;
+			}
+			has_start = 1;
+		}
+		else if (strncmp(argv[i], "pass=", 5) == 0) {
+			pass = atof(argv[i] + 5);
+		}
+		else if (strncmp(argv[i], "batch=", 6) == 0) {
+			batch = atoi(argv[i] + 6);
+		}
+		else if (strncmp(argv[i], "max=", 4) == 0) {
+			max_nvs = atoi(argv[i] + 4);
+		}
+		else {
+			printf("Unknown option %s", argv[i]);
+			return -1;
+		}
+	}
+	if (speed <= 0 || track_s < 0 || burn_s < 0 || pass < 0 || pass > 1) {
+		printf("Bad arguments");
+		return -1;
+	}
+	if (read_plan(argv[3], &sv) != 0) {
+		return -1;
+	}
+	data = read_spreadsheet(argv[2], &rows, &cols);
+	if (data == NULL) {
+		return -1;
+	}
+	if (rows < 1 || cols < 3) {
+		printf("Need x, y, z columns in %s", argv[2]);
+		free(data);
+		return -1;
+	}
+	sv.num_nvs = max_nvs > 0 && max_nvs < rows ? max_nvs : rows;
+	sv.nvs = calloc(sv.num_nvs, sizeof(struct nv));
+	for(i=0; i<sv.num_nvs; i++) {
+		sv.nvs[i].x = data[i * cols];
+		sv.nvs[i].y = data[i * cols + 1];
+		sv.nvs[i].z = data[i * cols + 2];
+	}
+	free(data);
+	if (!has_start) {
+		start = sv.nvs[0];
+	}
+	plan_route(sv.nvs, sv.num_nvs, &start);
+
+	action_nv = malloc((size_t) sv.num_nvs * sv.num_steps * sizeof(int));
+	action_step = malloc((size_t) sv.num_nvs * sv.num_steps * sizeof(int));
+	for(k=1; ; k*=2) {
+		if (k > sv.num_nvs) {
+			k = sv.num_nvs;
+		}
+		if (batch <= 0 || k == batch) {
+			n = make_actions(&sv, k, action_nv, action_step);
+			t = estimate(&sv, action_nv, action_step, n, &start, speed, track_s,
+			             burn_s, pass);
+			printf("%d\t%.3f\n", k, t / 3600);
+			if (t < best_t) {
+				best_t = t;
+				best_k = k;
+			}
+		}
+		if (k == sv.num_nvs) {
+			break;
+		}
+	}
+	if (batch > 0 && batch != best_k) {
+		best_k = batch > sv.num_nvs ? sv.num_nvs : batch;
+		n = make_actions(&sv, best_k, action_nv, action_step);
+		best_t = estimate(&sv, action_nv, action_step, n, &start, speed, track_s,
+		                  burn_s, pass);
+		printf("%d\t%.3f\n", best_k, best_t / 3600);
+	}
+
+	sv.action_nv = malloc((size_t) sv.num_nvs * sv.num_steps * sizeof(int));
+	sv.action_step = malloc((size_t) sv.num_nvs * sv.num_steps * sizeof(int));
+	sv.num_actions = make_actions(&sv, best_k, sv.action_nv, sv.action_step);
+	sv.current = sv.loaded = sv.at_nv = -1;
+	for(screened=1, i=0; i<sv.num_steps; i++) {
+		screened *= sv.steps[i].screen ? pass : 1;
+	}
+	printf("batch %d\t%.3f h\t%.1f NVs/h\n", best_k, best_t / 3600,
+	       sv.num_nvs * screened / (best_t / 3600));
+
+	free(action_nv);
+	free(action_step);
+	i = write_state(argv[4], &sv);
+	free_survey(&sv);
+	return i;
+}
+
+int main(int argc, char *argv[])
+{
+	struct survey sv;
+	const struct step *st;
+	const struct nv *nv;
+	int i, finished = 0, dropped = 0, left = 0, *last;
+	double value;
+
+	if (argc < 3) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	if (strcmp(argv[1], "plan") == 0) {
+		return plan(argc, argv);
+	}
+	if (read_state(argv[2], &sv) != 0) {
+		return -1;
+	}
+
+	if (strcmp(argv[1], "next") == 0 && argc == 3) {
+		while (sv.cursor < sv.num_actions && sv.nvs[sv.action_nv[sv.cursor]].dropped) {
+			sv.cursor++;
+		}
+		if (sv.cursor == sv.num_actions) {
+			printf("done\n");
+			sv.current = -1;
+		}
+		else {
+			i = sv.action_nv[sv.cursor];
+			nv = &sv.nvs[i];
+			st = &sv.steps[sv.action_step[sv.cursor]];
+			printf("%d\t%.6f\t%.6f\t%.6f\t%s\t%d\t%d\t%s\n", i, nv->x, nv->y, nv->z,
+			       st->name, i != sv.at_nv,
+			       strcmp(st->command, "-") != 0
+			       && (sv.loaded < 0 || strcmp(sv.steps[sv.loaded].command, st->command) != 0),
+			       st->command);
+			if (strcmp(st->command, "-") != 0) {
+				sv.loaded = sv.action_step[sv.cursor];
+			}
+			sv.at_nv = i;
+			sv.current = sv.cursor++;
+		}
+	}
+	else if (strcmp(argv[1], "result") == 0 && argc == 4) {
+		if (sv.current < 0) {
+			printf("No step in progress");
+			free_survey(&sv);
+			return -1;
+		}
+		value = atof(argv[3]);
+		st = &sv.steps[sv.action_step[sv.current]];
+		i = !(value < st->min || value > st->max);
+		if (!i) {
+			sv.nvs[sv.action_nv[sv.current]].dropped = 1;
+		}
+		printf("%d\n", i);
+	}
+	else if (strcmp(argv[1], "status") == 0 && argc == 3) {
+		//an NV is finished once its last action is behind the cursor
+		last = malloc(sv.num_nvs * sizeof(int));
+		for(i=0; i<sv.num_actions; i++) {
+			last[sv.action_nv[i]] = i;
+		}
+		for(i=0; i<sv.num_nvs; i++) {
+			if (sv.nvs[i].dropped) {
+				dropped++;
+			}
+			else if (last[i] < sv.cursor) {
+				finished++;
+			}
+		}
+		for(i=sv.cursor; i<sv.num_actions; i++) {
+			left += !sv.nvs[sv.action_nv[i]].dropped;
+		}
+		printf("%d\t%d\t%d\t%d\n", finished, dropped, sv.num_nvs - finished - dropped, left);
+		free(last);
+		free_survey(&sv);
+		return 0;
+	}
+	else {
+		printf("Unknown command or wrong number of arguments");
+		free_survey(&sv);
+		return -1;
+	}
+
+	i = write_state(argv[2], &sv);
+	free_survey(&sv);
+	return i;
+}
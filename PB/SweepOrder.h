@@ -0,0 +1,143 @@
+/**
+ * \file SweepOrder.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Seeded point order for the sweeps (tau, MW duration, frequency).
+ *
+ *  Walking the sweep monotonically turns slow drifts (focus, laser power)
+ *  into a slope across the sweep. Burning the points in a shuffled order
+ *  turns that drift into noise that averages down instead.
+ *
+ *  The generator is a plain xorshift32 so the burners and the processing
+ *  side get exactly the same permutation from the same seed on any
+ *  compiler. The processing side (struct sweep_unshuffle below) undoes
+ *  it with the same code, so there is nothing else to keep in step.
+ */
+
+#ifndef SWEEP_ORDER_H
+#define SWEEP_ORDER_H
+
+#include <stdlib.h>
+#include <string.h>
+
+static inline unsigned int sweep_rand(unsigned int *state)
+{
+	unsigned int x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+
+	return x;
+}
+
+/*
+ * Fills order[0..n-1] with the order the points are burned in:
+ * order[k] is the index of the sweep point burned k-th.
+ * seed 0 gives 0,1,...,n-1 (the old monotonic sweep).
+ */
+static inline void sweep_order(int *order, int n, unsigned int seed)
+{
+	int i, j, tmp;
+	unsigned int state;
+
+	for(i=0; i<n; i++) {
+		order[i] = i;
+	}
+	if (seed == 0) {
+		return;
+	}
+
+	//xorshift gets stuck at 0, so mix the seed into a nonzero state
+	state = seed * 2654435761u;
+	if (state == 0) {
+		state = 1;
+	}
+
+	//Fisher-Yates
+	for(i=n-1; i>0; i--) {
+		j = sweep_rand(&state) % (i+1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+}
+
+/*
+ * Processing side of a run burned with seed=: puts each scan (one record
+ * of num_points * num_slots counts, in burn order) back in sweep order.
+ * Chunk c of chunk_scans scans is taken to have been burned with seed + c,
+ * as in Unshuffle.c; chunk_scans 0 = one seed for the whole run.
+ */
+struct sweep_unshuffle {
+	unsigned int seed;      //0 = the run is in sweep order already
+	long chunk_scans;
+	int num_points, num_slots;
+	long chunk;             //chunk order is for, -1 = none yet
+	int *order;
+};
+
+static inline int sweep_unshuffle_init(struct sweep_unshuffle *su, unsigned int seed,
+                                       long chunk_scans, int num_points, int num_slots)
+{
+	su->seed = seed;
+	su->chunk_scans = chunk_scans;
+	su->num_points = num_points;
+	su->num_slots = num_slots;
+	su->chunk = -1;
+	su->order = malloc(num_points * sizeof(int));
+	return su->order == NULL ? -1 : 0;
+}
+
+static inline void sweep_unshuffle_free(struct sweep_unshuffle *su)
+{
+	free(su->order);
+	su->order = NULL;
+}
+
+//Burn order of scan number scan of the run: order[k] = point burned k-th
+static inline const int *sweep_unshuffle_order(struct sweep_unshuffle *su, long scan)
+{
+	long chunk = su->chunk_scans > 0 ? scan / su->chunk_scans : 0;
+
+	if (chunk != su->chunk) {
+		//seed 0 means the chunk was not shuffled at all
+		sweep_order(su->order, su->num_points,
+		            su->seed == 0 ? 0 : su->seed + (unsigned int) chunk);
+		su->chunk = chunk;
+	}
+	return su->order;
+}
+
+//Scan number scan of the run, from burn order (in) to sweep order (out)
+static inline void sweep_unshuffle_scan(struct sweep_unshuffle *su, long scan,
+                                        const unsigned int *in, unsigned int *out)
+{
+	const int *order = sweep_unshuffle_order(su, scan);
+	size_t slots = su->num_slots;
+	int k;
+
+	for(k=0; k<su->num_points; k++) {
+		memcpy(out + order[k] * slots, in + k * slots, slots * sizeof(unsigned int));
+	}
+}
+
+/*
+ * seed= on a burner command line (as PulsedPipeline's burn= and the run
+ * catalog keep it), 0 if there is none
+ */
+static inline unsigned int sweep_burn_seed(const char *burn)
+{
+	const char *p;
+
+	for(p=strstr(burn, "seed="); p!=NULL; p=strstr(p + 1, "seed=")) {
+		if (p == burn || p[-1] == ' ' || p[-1] == '"') {
+			return (unsigned int) strtoul(p + 5, NULL, 0);
+		}
+	}
+	return 0;
+}
+
+#endif
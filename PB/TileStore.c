@@ -0,0 +1,542 @@
+/**
+ * \file TileStore.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Writes and reads the tiled image store (TileStore.h) for confocal scans.
+ *
+ *  The raster VI appends each finished line of counts to a spool file (U32,
+ *  little endian, width counts per line, the lines of z slice 0 first) and
+ *  "TileStore write" turns them into tiles and the downsampled levels as
+ *  they come in, with <spool>.done marking the end of the scan like for
+ *  PulsedPipeline. Browsing then only reads the level and tiles in view.
+ *
+ *  Usage:
+ *  TileStore write <spool> <store> <width> <height> <depth> <tile>
+ *                  <x min> <x max> <y min> <y max> <z min> <z max>
+ *                  [serpentine=1]
+ *      Stage coordinates (um) are those of the first and last pixel on each
+ *      axis. serpentine=1 if every other line is scanned backwards (it is
+ *      stored the right way round). tile = 256 is a good size.
+ *  TileStore import <spreadsheet> <store> <tile> <x min> <x max> <y min> <y max>
+ *      Converts an image saved by ScannerMain.vi (one row per line).
+ *  TileStore info <store>
+ *      Prints the size, levels and progress, then min, max and mean of
+ *      each z slice (from the tile stats, without touching the counts).
+ *  TileStore view <store> <z> <x0> <y0> <x1> <y1> <max pixels> <output>
+ *      Writes pixels x0..x1, y0..y1 (level 0 pixels) of slice z as a
+ *      spreadsheet, from the finest level that has at most <max pixels>
+ *      across, and prints the level used.
+ *  TileStore stats <store> <level> <z> <output>
+ *      Writes one row per tile: tile column, tile row, min, max, mean.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "TileStore.h"
+#include "Spreadsheet.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#define tile_sleep() Sleep(20)
+#define tile_seek(fp, offset) _fseeki64(fp, (__int64) (offset), SEEK_SET)
+#else
+#include <unistd.h>
+#define tile_sleep() usleep(20000)
+#define tile_seek(fp, offset) fseeko(fp, (off_t) (offset), SEEK_SET)
+#endif
+
+//Lines of one level waiting to fill a row of tiles
+struct level_writer {
+	unsigned int *band;         //tile lines of tiles_x * tile counts
+	unsigned int band_rows;
+	unsigned int y;             //next line in the slice
+	unsigned int *pending;      //line waiting for its pair, for the level above
+	int has_pending;
+};
+
+struct tile_writer {
+	FILE *fp;
+	struct tile_header h;
+	struct level_writer lv[TILE_MAX_LEVELS];
+	unsigned int *tile_buf;
+};
+
+static int file_exists(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+
+	if (fp == NULL) {
+		return 0;
+	}
+	fclose(fp);
+	return 1;
+}
+
+static int write_header(struct tile_writer *tw)
+{
+	if (tile_seek(tw->fp, 0) != 0
+	    || fwrite(&tw->h, sizeof(tw->h), 1, tw->fp) != 1) {
+		return -1;
+	}
+	return fflush(tw->fp);
+}
+
+//Creates the store at its full size, so it can be mapped while it is written
+static int tile_writer_open(struct tile_writer *tw, const char *path)
+{
+	unsigned long long size;
+	unsigned int l, padded;
+	char zero = 0;
+
+	size = tile_layout(&tw->h);
+	for(l=0; l<tw->h.levels; l++) {
+		padded = tw->h.level[l].tiles_x * tw->h.tile;
+		tw->lv[l].band = calloc((size_t) padded * tw->h.tile, sizeof(unsigned int));
+		tw->lv[l].pending = calloc(tw->h.level[l].width, sizeof(unsigned int));
+		if (tw->lv[l].band == NULL || tw->lv[l].pending == NULL) {
+			printf("Out of memory");
+			return -1;
+		}
+	}
+	tw->tile_buf = malloc((size_t) tw->h.tile * tw->h.tile * sizeof(unsigned int));
+
+	tw->fp = fopen(path, "w+b");
+	if (tw->fp == NULL || tw->tile_buf == NULL) {
+		printf("Could not create %s", path);
+		return -1;
+	}
+	if (tile_seek(tw->fp, size - 1) != 0 || fwrite(&zero, 1, 1, tw->fp) != 1
+	    || write_header(tw) != 0) {
+		printf("Could not write %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+static void tile_writer_free(struct tile_writer *tw)
+{
+	unsigned int l;
+
+	for(l=0; l<tw->h.levels; l++) {
+		free(tw->lv[l].band);
+		free(tw->lv[l].pending);
+	}
+	free(tw->tile_buf);
+	if (tw->fp != NULL) {
+		fclose(tw->fp);
+	}
+}
+
+//Writes the tiles of a full (or the slice's last) band and their stats
+static int flush_band(struct tile_writer *tw, unsigned int l, unsigned int z)
+{
+	struct level_writer *lv = &tw->lv[l];
+	struct tile_level *info = &tw->h.level[l];
+	unsigned int t = tw->h.tile, padded = info->tiles_x * t;
+	unsigned int ty = (lv->y - 1) / t, tx, x, y, cols, v;
+	unsigned long long index;
+	struct tile_stats st;
+
+	for(tx=0; tx<info->tiles_x; tx++) {
+		cols = info->width - tx * t < t ? info->width - tx * t : t;
+		st.min = 0xFFFFFFFFu;
+		st.max = 0;
+		st.sum = 0;
+		memset(tw->tile_buf, 0, (size_t) t * t * sizeof(unsigned int));
+		for(y=0; y<lv->band_rows; y++) {
+			memcpy(tw->tile_buf + y * t, lv->band + (size_t) y * padded + tx * t,
+			       cols * sizeof(unsigned int));
+			for(x=0; x<cols; x++) {
+				v = tw->tile_buf[y * t + x];
+				if (v < st.min) st.min = v;
+				if (v > st.max) st.max = v;
+				st.sum += v;
+			}
+		}
+		index = tile_index(&tw->h, l, z, tx, ty);
+		if (tile_seek(tw->fp, info->data_offset
+		                      + index * t * t * sizeof(unsigned int)) != 0
+		    || fwrite(tw->tile_buf, sizeof(unsigned int), (size_t) t * t, tw->fp)
+		       != (size_t) t * t
+		    || tile_seek(tw->fp, info->stats_offset + index * sizeof(st)) != 0
+		    || fwrite(&st, sizeof(st), 1, tw->fp) != 1) {
+			return -1;
+		}
+	}
+	memset(lv->band, 0, (size_t) padded * t * sizeof(unsigned int));
+	lv->band_rows = 0;
+	info->rows_done = z * info->height + lv->y;
+	return write_header(tw);
+}
+
+//Adds the next line of slice z to level l, and what it adds to the levels above
+static int push_line(struct tile_writer *tw, unsigned int l, unsigned int z,
+                     const unsigned int *line)
+{
+	struct level_writer *lv = &tw->lv[l];
+	const struct tile_level *info = &tw->h.level[l];
+	unsigned int padded = info->tiles_x * tw->h.tile;
+	unsigned int x, n, half = tw->h.level[l + 1 < tw->h.levels ? l + 1 : l].width;
+	unsigned int *up;
+	unsigned long long sum;
+	int status;
+
+	memcpy(lv->band + (size_t) lv->band_rows * padded, line,
+	       info->width * sizeof(unsigned int));
+	lv->band_rows++;
+	lv->y++;
+	if ((lv->band_rows == tw->h.tile || lv->y == info->height)
+	    && flush_band(tw, l, z) != 0) {
+		return -1;
+	}
+
+	if (l + 1 < tw->h.levels) {
+		if (!lv->has_pending && lv->y < info->height) {
+			memcpy(lv->pending, line, info->width * sizeof(unsigned int));
+			lv->has_pending = 1;
+		}
+		else {
+			//mean of up to 2 x 2, rounded
+			up = malloc(half * sizeof(unsigned int));
+			for(x=0; x<half; x++) {
+				sum = line[2*x];
+				n = 1;
+				if (2*x + 1 < info->width) {
+					sum += line[2*x + 1];
+					n++;
+				}
+				if (lv->has_pending) {
+					sum += lv->pending[2*x];
+					n++;
+					if (2*x + 1 < info->width) {
+						sum += lv->pending[2*x + 1];
+						n++;
+					}
+				}
+				up[x] = (unsigned int) ((sum + n / 2) / n);
+			}
+			lv->has_pending = 0;
+			status = push_line(tw, l + 1, z, up);
+			free(up);
+			if (status != 0) {
+				return -1;
+			}
+		}
+	}
+
+	if (lv->y == info->height) {
+		lv->y = 0;
+	}
+	return 0;
+}
+
+static int tile_writer_finish(struct tile_writer *tw)
+{
+	tw->h.complete = 1;
+	return write_header(tw);
+}
+
+//Header for the given size; argv is tile, x min, x max, y min, y max[, z min, z max]
+static int make_header(struct tile_header *h, int width, int height, int depth,
+                       char *argv[], int has_z)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, TILE_MAGIC, 8);
+	h->width = width > 0 ? (unsigned int) width : 0;
+	h->height = height > 0 ? (unsigned int) height : 0;
+	h->depth = depth > 0 ? (unsigned int) depth : 0;
+	h->tile = (unsigned int) atoi(argv[0]);
+	h->x_min = atof(argv[1]);
+	h->x_max = atof(argv[2]);
+	h->y_min = atof(argv[3]);
+	h->y_max = atof(argv[4]);
+	if (has_z) {
+		h->z_min = atof(argv[5]);
+		h->z_max = atof(argv[6]);
+	}
+	if (h->width == 0 || h->height == 0 || h->depth == 0 || h->tile < 2) {
+		printf("Bad image size");
+		return -1;
+	}
+	return 0;
+}
+
+static void reverse_line(unsigned int *line, unsigned int n)
+{
+	unsigned int i, v;
+
+	for(i=0; i<n/2; i++) {
+		v = line[i];
+		line[i] = line[n - 1 - i];
+		line[n - 1 - i] = v;
+	}
+}
+
+//Follows the spool until <spool>.done, like PulsedPipeline's acquire stage
+static int write_from_spool(const char *spool, struct tile_writer *tw, int serpentine)
+{
+	size_t bytes = tw->h.width * sizeof(unsigned int), got = 0;
+	unsigned int *line = malloc(bytes), lines = 0, total = tw->h.height * tw->h.depth;
+	char done_path[1024];
+	int finishing = 0;
+	FILE *fp = NULL;
+
+	snprintf(done_path, sizeof(done_path), "%s.done", spool);
+	while (lines < total) {
+		if (fp == NULL) {
+			fp = fopen(spool, "rb");
+			if (fp == NULL) {
+				if (file_exists(done_path)) {
+					break;
+				}
+				tile_sleep();
+				continue;
+			}
+		}
+		got += fread((char *) line + got, 1, bytes - got, fp);
+		if (got < bytes) {
+			if (finishing) {
+				break;
+			}
+			finishing = file_exists(done_path);
+			clearerr(fp);
+			if (!finishing) {
+				tile_sleep();
+			}
+			continue;
+		}
+		if (serpentine && (lines % tw->h.height) % 2 == 1) {
+			reverse_line(line, tw->h.width);
+		}
+		if (push_line(tw, 0, lines / tw->h.height, line) != 0) {
+			printf("Error writing the store");
+			break;
+		}
+		lines++;
+		got = 0;
+		finishing = 0;
+	}
+	if (fp != NULL) {
+		fclose(fp);
+	}
+	free(line);
+	if (lines < total) {
+		printf("Scan ended after %u of %u lines\n", lines, total);
+		return lines > 0 ? 0 : -1;
+	}
+	return tile_writer_finish(tw);
+}
+
+static int import_spreadsheet(const char *path, struct tile_writer *tw, double *data)
+{
+	unsigned int *line = malloc(tw->h.width * sizeof(unsigned int)), x, y;
+	double v;
+
+	for(y=0; y<tw->h.height; y++) {
+		for(x=0; x<tw->h.width; x++) {
+			v = data[(size_t) y * tw->h.width + x];
+			line[x] = v > 0 ? (unsigned int) (v + 0.5) : 0;
+		}
+		if (push_line(tw, 0, 0, line) != 0) {
+			printf("Error writing %s", path);
+			free(line);
+			return -1;
+		}
+	}
+	free(line);
+	return tile_writer_finish(tw);
+}
+
+static void print_info(const struct tile_store *ts)
+{
+	const struct tile_header *h = ts->h;
+	const struct tile_level *lv;
+	const struct tile_stats *st;
+	unsigned long long sum, pixels;
+	unsigned int l, z, tx, ty, min, max;
+
+	printf("size\t%u\t%u\t%u\n", h->width, h->height, h->depth);
+	printf("tile\t%u\n", h->tile);
+	printf("x\t%g\t%g\n", h->x_min, h->x_max);
+	printf("y\t%g\t%g\n", h->y_min, h->y_max);
+	printf("z\t%g\t%g\n", h->z_min, h->z_max);
+	printf("complete\t%u\n", h->complete);
+	for(l=0; l<h->levels; l++) {
+		lv = &h->level[l];
+		printf("level %u\t%u\t%u\t%u tiles\t%u rows done\n", l, lv->width, lv->height,
+		       lv->tiles_x * lv->tiles_y, lv->rows_done);
+	}
+	lv = &h->level[0];
+	for(z=0; z<h->depth; z++) {
+		if (lv->rows_done < (z + 1) * lv->height) {
+			break;
+		}
+		min = 0xFFFFFFFFu;
+		max = 0;
+		sum = 0;
+		for(ty=0; ty<lv->tiles_y; ty++) {
+			for(tx=0; tx<lv->tiles_x; tx++) {
+				st = tile_store_stats(ts, 0, z, tx, ty);
+				if (st->min < min) min = st->min;
+				if (st->max > max) max = st->max;
+				sum += st->sum;
+			}
+		}
+		pixels = (unsigned long long) lv->width * lv->height;
+		printf("slice %u\t%u\t%u\t%g\n", z, min, max, (double) sum / pixels);
+	}
+}
+
+static int view(const struct tile_store *ts, char *argv[])
+{
+	const struct tile_header *h = ts->h;
+	unsigned int z = (unsigned int) atoi(argv[0]);
+	unsigned int x0 = (unsigned int) atoi(argv[1]), y0 = (unsigned int) atoi(argv[2]);
+	unsigned int x1 = (unsigned int) atoi(argv[3]), y1 = (unsigned int) atoi(argv[4]);
+	unsigned int max_pixels = (unsigned int) atoi(argv[5]), l, w, ht, i, *counts;
+	double *data;
+	int status;
+
+	if (z >= h->depth || x1 < x0 || y1 < y0 || x1 >= h->width || y1 >= h->height
+	    || max_pixels == 0) {
+		printf("Region outside the image");
+		return -1;
+	}
+	for(l=0; l+1<h->levels; l++) {
+		if ((x1 >> l) - (x0 >> l) + 1 <= max_pixels
+		    && (y1 >> l) - (y0 >> l) + 1 <= max_pixels) {
+			break;
+		}
+	}
+	x0 >>= l;
+	y0 >>= l;
+	w = (x1 >> l) - x0 + 1;
+	ht = (y1 >> l) - y0 + 1;
+
+	counts = malloc((size_t) w * ht * sizeof(unsigned int));
+	data = malloc((size_t) w * ht * sizeof(double));
+	if (counts == NULL || data == NULL) {
+		printf("Out of memory");
+		return -1;
+	}
+	tile_store_region(ts, l, z, x0, y0, w, ht, counts);
+	for(i=0; i<w*ht; i++) {
+		data[i] = counts[i];
+	}
+	status = write_spreadsheet(argv[6], data, ht, w);
+	if (status == 0) {
+		printf("%u\t%u\t%u\n", l, w, ht);
+	}
+	free(counts);
+	free(data);
+	return status;
+}
+
+static int tile_stats_table(const struct tile_store *ts, char *argv[])
+{
+	const struct tile_header *h = ts->h;
+	unsigned int l = (unsigned int) atoi(argv[0]), z = (unsigned int) atoi(argv[1]);
+	unsigned int tx, ty, cols, rows, row = 0;
+	const struct tile_stats *st;
+	double *data;
+	int status;
+
+	if (l >= h->levels || z >= h->depth) {
+		printf("No level %u / slice %u", l, z);
+		return -1;
+	}
+	data = malloc((size_t) h->level[l].tiles_x * h->level[l].tiles_y * 5 * sizeof(double));
+	for(ty=0; ty<h->level[l].tiles_y; ty++) {
+		for(tx=0; tx<h->level[l].tiles_x; tx++, row++) {
+			st = tile_store_stats(ts, l, z, tx, ty);
+			cols = h->level[l].width - tx * h->tile < h->tile
+			     ? h->level[l].width - tx * h->tile : h->tile;
+			rows = h->level[l].height - ty * h->tile < h->tile
+			     ? h->level[l].height - ty * h->tile : h->tile;
+			data[row*5] = tx;
+			data[row*5 + 1] = ty;
+			data[row*5 + 2] = st->min;
+			data[row*5 + 3] = st->max;
+			data[row*5 + 4] = (double) st->sum / ((double) cols * rows);
+		}
+	}
+	status = write_spreadsheet(argv[2], data, row, 5);
+	free(data);
+	return status;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tile_writer tw;
+	struct tile_store ts;
+	double *data;
+	int rows, cols, status, serpentine = 0;
+
+	if (argc < 3) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	memset(&tw, 0, sizeof(tw));
+
+	if (strcmp(argv[1], "write") == 0) {
+		if (argc == 15 && strcmp(argv[14], "serpentine=1") == 0) {
+			serpentine = 1;
+		}
+		else if (argc != 14) {
+			printf("Wrong number of arguments");
+			return -1;
+		}
+		if (make_header(&tw.h, atoi(argv[4]), atoi(argv[5]), atoi(argv[6]), argv + 7, 1) != 0
+		    || tile_writer_open(&tw, argv[3]) != 0) {
+			tile_writer_free(&tw);
+			return -1;
+		}
+		status = write_from_spool(argv[2], &tw, serpentine);
+		tile_writer_free(&tw);
+		return status;
+	}
+
+	if (strcmp(argv[1], "import") == 0) {
+		if (argc != 9) {
+			printf("Wrong number of arguments");
+			return -1;
+		}
+		data = read_spreadsheet(argv[2], &rows, &cols);
+		if (data == NULL) {
+			return -1;
+		}
+		if (make_header(&tw.h, cols, rows, 1, argv + 4, 0) != 0) {
+			free(data);
+			return -1;
+		}
+		status = tile_writer_open(&tw, argv[3]) == 0 ? import_spreadsheet(argv[3], &tw, data) : -1;
+		tile_writer_free(&tw);
+		free(data);
+		return status;
+	}
+
+	if (tile_store_open(argv[2], &ts) != 0) {
+		return -1;
+	}
+	status = -1;
+	if (strcmp(argv[1], "info") == 0 && argc == 3) {
+		print_info(&ts);
+		status = 0;
+	}
+	else if (strcmp(argv[1], "view") == 0 && argc == 10) {
+		status = view(&ts, argv + 3);
+	}
+	else if (strcmp(argv[1], "stats") == 0 && argc == 6) {
+		status = tile_stats_table(&ts, argv + 3);
+	}
+	else {
+		printf("Unknown command or wrong number of arguments");
+	}
+	tile_store_close(&ts);
+	return status;
+}
@@ -0,0 +1,213 @@
+/**
+ * \file TileStore.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Tiled, multi-resolution store for confocal count images and z-stacks,
+ *  instead of whole 2D arrays in ScannerMain.vi saved as spreadsheets.
+ *  Written by TileStore.exe while the scan runs, read here through a memory
+ *  mapping, so opening a 4k x 4k x 20 scan costs nothing and any view only
+ *  touches the tiles it shows.
+ *
+ *  One file, little endian:
+ *
+ *  header      struct tile_header (dimensions, stage coordinates, and per
+ *              level the size, offsets and rows written so far)
+ *  per level   tile data: tiles of tile x tile U32 counts, row major, in
+ *              order z, tile row, tile column. Edge tiles are padded with 0
+ *  per level   tile stats: struct tile_stats per tile, same order
+ *
+ *  Level 0 is the scan; every level above halves x and y (each pixel the
+ *  mean of up to 2 x 2 below it, rounded), until one tile holds a slice.
+ *  z is never downsampled. The file is created at its full size, so a
+ *  reader can map it while it is still being written and show the rows
+ *  done so far (rows_done, counted over all z slices).
+ */
+
+#ifndef TILE_STORE_H
+#define TILE_STORE_H
+
+#include <string.h>
+
+#include "MapFile.h"
+
+#define TILE_MAGIC "PBTILES1"
+#define TILE_MAX_LEVELS 16
+
+struct tile_level {
+	unsigned int width, height;
+	unsigned int tiles_x, tiles_y;
+	unsigned long long data_offset;
+	unsigned long long stats_offset;
+	unsigned int rows_done;     //rows written, z * height + y
+	unsigned int reserved;
+};
+
+struct tile_header {
+	char magic[8];
+	unsigned int width, height, depth;
+	unsigned int tile;          //tile edge in pixels
+	unsigned int levels;
+	unsigned int complete;      //1 once the whole scan is written
+	double x_min, x_max;        //stage position (um) of the first and last column
+	double y_min, y_max;
+	double z_min, z_max;
+	struct tile_level level[TILE_MAX_LEVELS];
+};
+
+struct tile_stats {
+	unsigned int min, max;      //over the real pixels of the tile
+	unsigned long long sum;
+};
+
+struct tile_store {
+	struct mapped_file map;
+	const struct tile_header *h;
+};
+
+/*
+ * Fills in the levels and offsets for a store of the given size. Returns
+ * the file size.
+ */
+static inline unsigned long long tile_layout(struct tile_header *h)
+{
+	unsigned long long offset = sizeof(struct tile_header), tiles;
+	unsigned int w = h->width, ht = h->height, l;
+
+	for(l=0; l<TILE_MAX_LEVELS; l++) {
+		h->level[l].width = w;
+		h->level[l].height = ht;
+		h->level[l].tiles_x = (w + h->tile - 1) / h->tile;
+		h->level[l].tiles_y = (ht + h->tile - 1) / h->tile;
+		h->level[l].rows_done = 0;
+		if (w <= h->tile && ht <= h->tile) {
+			break;
+		}
+		w = (w + 1) / 2;
+		ht = (ht + 1) / 2;
+	}
+	h->levels = l < TILE_MAX_LEVELS ? l + 1 : TILE_MAX_LEVELS;
+
+	for(l=0; l<h->levels; l++) {
+		tiles = (unsigned long long) h->level[l].tiles_x * h->level[l].tiles_y * h->depth;
+		h->level[l].data_offset = offset;
+		offset += tiles * h->tile * h->tile * sizeof(unsigned int);
+	}
+	for(l=0; l<h->levels; l++) {
+		tiles = (unsigned long long) h->level[l].tiles_x * h->level[l].tiles_y * h->depth;
+		h->level[l].stats_offset = offset;
+		offset += tiles * sizeof(struct tile_stats);
+	}
+	return offset;
+}
+
+static inline unsigned long long tile_index(const struct tile_header *h, unsigned int level,
+                                            unsigned int z, unsigned int tx, unsigned int ty)
+{
+	const struct tile_level *lv = &h->level[level];
+
+	return ((unsigned long long) z * lv->tiles_y + ty) * lv->tiles_x + tx;
+}
+
+//Returns 0, or -1 (and prints why) if path is not a complete tile store file
+static inline int tile_store_open(const char *path, struct tile_store *ts)
+{
+	struct tile_header layout;
+	const struct tile_level *lv;
+	unsigned int l;
+
+	if (map_file(path, &ts->map) != 0) {
+		printf("Could not open %s", path);
+		return -1;
+	}
+	ts->h = (const struct tile_header *) ts->map.data;
+	if (ts->map.size < sizeof(struct tile_header)
+	    || memcmp(ts->h->magic, TILE_MAGIC, 8) != 0) {
+		printf("%s is not a tile store", path);
+		unmap_file(&ts->map);
+		return -1;
+	}
+	memcpy(&layout, ts->h, sizeof(layout));
+	if (layout.tile == 0 || tile_layout(&layout) > ts->map.size) {
+		printf("%s is truncated", path);
+		unmap_file(&ts->map);
+		return -1;
+	}
+	//the level sizes and offsets read later must be the ones just checked
+	if (ts->h->levels != layout.levels) {
+		printf("%s has a damaged header", path);
+		unmap_file(&ts->map);
+		return -1;
+	}
+	for(l=0; l<layout.levels; l++) {
+		lv = &ts->h->level[l];
+		if (lv->width != layout.level[l].width || lv->height != layout.level[l].height
+		    || lv->tiles_x != layout.level[l].tiles_x
+		    || lv->tiles_y != layout.level[l].tiles_y
+		    || lv->data_offset != layout.level[l].data_offset
+		    || lv->stats_offset != layout.level[l].stats_offset) {
+			printf("%s has a damaged header", path);
+			unmap_file(&ts->map);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static inline void tile_store_close(struct tile_store *ts)
+{
+	unmap_file(&ts->map);
+}
+
+//tile x tile counts, row major
+static inline const unsigned int *tile_store_tile(const struct tile_store *ts, unsigned int level,
+                                                  unsigned int z, unsigned int tx, unsigned int ty)
+{
+	unsigned long long t = tile_index(ts->h, level, z, tx, ty);
+
+	return (const unsigned int *) (ts->map.data + ts->h->level[level].data_offset
+	                               + t * ts->h->tile * ts->h->tile * sizeof(unsigned int));
+}
+
+static inline const struct tile_stats *tile_store_stats(const struct tile_store *ts,
+                                                        unsigned int level, unsigned int z,
+                                                        unsigned int tx, unsigned int ty)
+{
+	return (const struct tile_stats *) (ts->map.data + ts->h->level[level].stats_offset)
+	       + tile_index(ts->h, level, z, tx, ty);
+}
+
+static inline unsigned int tile_store_pixel(const struct tile_store *ts, unsigned int level,
+                                            unsigned int z, unsigned int x, unsigned int y)
+{
+	unsigned int t = ts->h->tile;
+
+	return tile_store_tile(ts, level, z, x / t, y / t)[(y % t) * t + x % t];
+}
+
+/*
+ * Copies a w x h region at (x0, y0) of a level into out (row major). The
+ * region must lie inside the level.
+ */
+static inline void tile_store_region(const struct tile_store *ts, unsigned int level,
+                                     unsigned int z, unsigned int x0, unsigned int y0,
+                                     unsigned int w, unsigned int h, unsigned int *out)
+{
+	unsigned int t = ts->h->tile, x, y, n;
+	const unsigned int *tile;
+
+	for(y=y0; y<y0+h; y++) {
+		for(x=x0; x<x0+w; x+=n) {
+			//the rest of this row within one tile
+			n = t - x % t;
+			if (n > x0 + w - x) {
+				n = x0 + w - x;
+			}
+			tile = tile_store_tile(ts, level, z, x / t, y / t);
+			memcpy(out + (size_t) (y - y0) * w + (x - x0), tile + (y % t) * t + x % t,
+			       n * sizeof(unsigned int));
+		}
+	}
+}
+
+#endif
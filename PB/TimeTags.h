@@ -0,0 +1,145 @@
+/**
+ * \file TimeTags.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Photon time tags, for measurements that need more than edge counts
+ *  (g2, see G2.c). A tag is one U64: arrival time in ps in the low 60
+ *  bits, detector channel in the top 4. Files are plain arrays of tags in
+ *  time order, so whatever time tagger we end up with only needs a small
+ *  converter to write them.
+ *
+ *  Also a synthetic source for testing without a tagger: N independent
+ *  two-level emitters (excitation then spontaneous decay, so a single one
+ *  never gives two photons at once), with optional shelving into a dark
+ *  state, detection efficiency, a 50/50 beam splitter onto two detectors
+ *  and Poisson background on each.
+ */
+
+#ifndef TIME_TAGS_H
+#define TIME_TAGS_H
+
+#include <math.h>
+
+#include "Random.h"
+
+#define TAG_TIME_BITS 60
+#define TAG_TIME_MASK ((1ull << TAG_TIME_BITS) - 1)
+#define TAG_MAX_EMITTERS 16
+
+typedef unsigned long long time_tag;
+
+static inline unsigned long long tag_time(time_tag tag)
+{
+	return tag & TAG_TIME_MASK;
+}
+
+static inline int tag_channel(time_tag tag)
+{
+	return (int) (tag >> TAG_TIME_BITS);
+}
+
+static inline time_tag tag_make(unsigned long long time_ps, int channel)
+{
+	return (time_tag) (time_ps & TAG_TIME_MASK)
+	       | ((time_tag) channel << TAG_TIME_BITS);
+}
+
+struct tag_synth_params {
+	int channels;           //1 or 2 detectors
+	int emitters;
+	double excitation_mhz;  //excitation rate per emitter
+	double lifetime_ns;     //excited state lifetime
+	double efficiency;      //collection and detection, per photon
+	double background_cps;  //per detector
+	double shelving;        //probability per emission of going dark
+	double dark_us;         //mean time in the dark state
+};
+
+struct tag_synth {
+	struct tag_synth_params p;
+	rand_state rng;
+	double emit[TAG_MAX_EMITTERS];   //next emission time (ps)
+	double background[2];            //next background count (ps)
+};
+
+static inline double tag_exponential(rand_state *rng, double mean)
+{
+	return -mean * log(rand_uniform(rng));
+}
+
+static inline double tag_emission_gap(struct tag_synth *s)
+{
+	double gap;
+
+	gap = tag_exponential(&s->rng, 1e6 / s->p.excitation_mhz)
+	    + tag_exponential(&s->rng, s->p.lifetime_ns * 1e3);
+	if (s->p.shelving > 0 && rand_uniform(&s->rng) < s->p.shelving) {
+		gap += tag_exponential(&s->rng, s->p.dark_us * 1e6);
+	}
+	return gap;
+}
+
+//Returns -1 if the parameters make no sense.
+static inline int tag_synth_init(struct tag_synth *s, const struct tag_synth_params *p,
+                                 unsigned long long seed)
+{
+	int i;
+
+	if (p->channels < 1 || p->channels > 2 || p->emitters < 0
+	    || p->emitters > TAG_MAX_EMITTERS || p->excitation_mhz <= 0
+	    || p->lifetime_ns < 0 || p->efficiency < 0 || p->background_cps < 0
+	    || (p->emitters == 0 && p->background_cps == 0)) {
+		return -1;
+	}
+	s->p = *p;
+	rand_seed(&s->rng, seed);
+	for(i=0; i<p->emitters; i++) {
+		s->emit[i] = tag_emission_gap(s);
+	}
+	for(i=0; i<2; i++) {
+		s->background[i] = i < p->channels && p->background_cps > 0
+		                 ? tag_exponential(&s->rng, 1e12 / p->background_cps)
+		                 : HUGE_VAL;
+	}
+	return 0;
+}
+
+//Next detected photon, in time order.
+static inline time_tag tag_synth_next(struct tag_synth *s)
+{
+	int i, next, channel;
+	double t;
+
+	while (1) {
+		next = -1;
+		t = HUGE_VAL;
+		for(i=0; i<s->p.emitters; i++) {
+			if (s->emit[i] < t) {
+				t = s->emit[i];
+				next = i;
+			}
+		}
+		for(i=0; i<2; i++) {
+			if (s->background[i] < t) {
+				t = s->background[i];
+				next = TAG_MAX_EMITTERS + i;
+			}
+		}
+
+		if (next >= TAG_MAX_EMITTERS) {
+			channel = next - TAG_MAX_EMITTERS;
+			s->background[channel] += tag_exponential(&s->rng,
+			                                          1e12 / s->p.background_cps);
+			return tag_make((unsigned long long) t, channel);
+		}
+
+		s->emit[next] += tag_emission_gap(s);
+		if (rand_uniform(&s->rng) < s->p.efficiency) {
+			channel = s->p.channels == 2 && rand_uniform(&s->rng) < 0.5;
+			return tag_make((unsigned long long) t, channel);
+		}
+	}
+}
+
+#endif
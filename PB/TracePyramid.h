@@ -0,0 +1,277 @@
+/**
+ * \file TracePyramid.h
+ *
+ *  Author: Sam Kim
+ *
+ *  Min/max pyramid over a long count trace (Stability shots, Counter.vi
+ *  bins), so a chart can show any time range of millions of samples by
+ *  touching only about as many buckets as it has pixels. Written by
+ *  "TraceView follow" as the counts come in and read here through a memory
+ *  mapping, also while it is being written.
+ *
+ *  One file, little endian:
+ *
+ *  header      struct trace_header
+ *  level 0     the samples, U32
+ *  level l     struct trace_bucket per TRACE_FANOUT^l samples: min and max
+ *              and the sample index of each
+ *
+ *  The file is created at its full size for <capacity> samples. count is
+ *  rewritten after the samples and the buckets they complete, so a reader
+ *  can trust everything below it; a bucket is only written once it is
+ *  complete, the part of a range that ends in an unfinished bucket comes
+ *  from the levels below.
+ */
+
+#ifndef TRACE_PYRAMID_H
+#define TRACE_PYRAMID_H
+
+#include <string.h>
+#include <math.h>
+
+#include "MapFile.h"
+
+#define TRACE_MAGIC "PBTRACE1"
+#define TRACE_MAX_LEVELS 16
+#define TRACE_FANOUT 16
+
+struct trace_header {
+	char magic[8];
+	unsigned int fanout, levels;
+	unsigned long long capacity;    //samples the file has room for
+	unsigned long long count;       //samples written so far
+	double period;                  //seconds per sample
+	unsigned int complete;          //1 once the trace has ended
+	unsigned int reserved;
+	unsigned long long offset[TRACE_MAX_LEVELS];
+};
+
+struct trace_bucket {
+	unsigned long long i_min, i_max;
+	unsigned int min, max;
+};
+
+struct trace_pyramid {
+	struct mapped_file map;
+	const struct trace_header *h;
+};
+
+//Samples per bucket of a level
+static inline unsigned long long trace_span(const struct trace_header *h, unsigned int level)
+{
+	unsigned long long span = 1;
+
+	while (level-- > 0) {
+		span *= h->fanout;
+	}
+	return span;
+}
+
+/*
+ * Fills in the levels and offsets for h->capacity samples: levels up to
+ * the first one with at most fanout buckets. Returns the file size.
+ */
+static inline unsigned long long trace_layout(struct trace_header *h)
+{
+	unsigned long long offset = sizeof(struct trace_header), buckets = h->capacity;
+	unsigned int l;
+
+	h->offset[0] = offset;
+	offset += h->capacity * sizeof(unsigned int);
+	for(l=1; l<TRACE_MAX_LEVELS && buckets > h->fanout; l++) {
+		buckets = h->capacity / trace_span(h, l);
+		h->offset[l] = offset;
+		offset += buckets * sizeof(struct trace_bucket);
+	}
+	h->levels = l;
+	return offset;
+}
+
+//Returns 0, or -1 (and prints why) if path is not a complete trace pyramid
+static inline int trace_open(const char *path, struct trace_pyramid *tp)
+{
+	struct trace_header layout;
+
+	if (map_file(path, &tp->map) != 0) {
+		printf("Could not open %s", path);
+		return -1;
+	}
+	tp->h = (const struct trace_header *) tp->map.data;
+	if (tp->map.size < sizeof(struct trace_header)
+	    || memcmp(tp->h->magic, TRACE_MAGIC, 8) != 0) {
+		printf("%s is not a trace pyramid", path);
+		unmap_file(&tp->map);
+		return -1;
+	}
+	memcpy(&layout, tp->h, sizeof(layout));
+	if (layout.fanout < 2 || trace_layout(&layout) > tp->map.size) {
+		printf("%s is truncated", path);
+		unmap_file(&tp->map);
+		return -1;
+	}
+	//the levels and offsets read later must be the ones just checked
+	if (tp->h->levels != layout.levels || tp->h->count > tp->h->capacity
+	    || memcmp(tp->h->offset, layout.offset,
+	              layout.levels * sizeof(layout.offset[0])) != 0) {
+		printf("%s has a damaged header", path);
+		unmap_file(&tp->map);
+		return -1;
+	}
+	return 0;
+}
+
+static inline void trace_close(struct trace_pyramid *tp)
+{
+	unmap_file(&tp->map);
+}
+
+static inline const unsigned int *trace_samples(const struct trace_pyramid *tp)
+{
+	return (const unsigned int *) (tp->map.data + tp->h->offset[0]);
+}
+
+static inline const struct trace_bucket *trace_buckets(const struct trace_pyramid *tp,
+                                                       unsigned int level)
+{
+	return (const struct trace_bucket *) (tp->map.data + tp->h->offset[level]);
+}
+
+//A sample picked to represent part of the trace
+struct trace_point {
+	unsigned long long i;
+	unsigned int v;
+};
+
+static inline void trace_emit(struct trace_point *out, unsigned long long *n,
+                              unsigned long long i, unsigned int v)
+{
+	//the previous bucket's last point may be this one
+	if (*n > 0 && out[*n - 1].i == i) {
+		return;
+	}
+	out[*n].i = i;
+	out[*n].v = v;
+	(*n)++;
+}
+
+/*
+ * Appends the min and max of every bucket of level (or the samples, level
+ * 0) that lies inside samples [i0, i1), in time order; the ragged ends are
+ * covered from the levels below. Appends at most
+ * 2 (i1 - i0) / span + 4 fanout level points; i1 must be <= count.
+ */
+static inline void trace_collect(const struct trace_pyramid *tp, unsigned int level,
+                                 unsigned long long i0, unsigned long long i1,
+                                 struct trace_point *out, unsigned long long *n)
+{
+	unsigned long long span, b0, b1, b;
+	const struct trace_bucket *bk;
+	const unsigned int *s;
+
+	if (i0 >= i1) {
+		return;
+	}
+	if (level == 0) {
+		s = trace_samples(tp);
+		for(b=i0; b<i1; b++) {
+			trace_emit(out, n, b, s[b]);
+		}
+		return;
+	}
+	span = trace_span(tp->h, level);
+	b0 = (i0 + span - 1) / span;
+	b1 = i1 / span;
+	if (b0 >= b1) {
+		trace_collect(tp, level - 1, i0, i1, out, n);
+		return;
+	}
+	trace_collect(tp, level - 1, i0, b0 * span, out, n);
+	bk = trace_buckets(tp, level);
+	for(b=b0; b<b1; b++) {
+		if (bk[b].i_min <= bk[b].i_max) {
+			trace_emit(out, n, bk[b].i_min, bk[b].min);
+			trace_emit(out, n, bk[b].i_max, bk[b].max);
+		}
+		else {
+			trace_emit(out, n, bk[b].i_max, bk[b].max);
+			trace_emit(out, n, bk[b].i_min, bk[b].min);
+		}
+	}
+	trace_collect(tp, level - 1, b1 * span, i1, out, n);
+}
+
+/*
+ * Coarsest level that still has at least min_buckets buckets in a range
+ * of n samples, so collecting it costs O(min_buckets * fanout).
+ */
+static inline unsigned int trace_level_for(const struct trace_header *h, unsigned long long n,
+                                           unsigned long long min_buckets)
+{
+	unsigned int l = 0;
+
+	while (l + 1 < h->levels && n / trace_span(h, l + 1) >= min_buckets) {
+		l++;
+	}
+	return l;
+}
+
+/*
+ * Largest-Triangle-Three-Buckets: keeps the first and last point and, from
+ * each of the threshold - 2 buckets in between, the point that makes the
+ * largest triangle with the point kept before it and the mean of the next
+ * bucket. Writes threshold points to out (or all n if n <= threshold) and
+ * returns how many.
+ */
+static inline unsigned long long trace_lttb(const struct trace_point *in, unsigned long long n,
+                                            unsigned long long threshold, struct trace_point *out)
+{
+	unsigned long long k, j, start, end, next_end, best, a = 0, kept = 0;
+	double every, ax, ay, cx, cy, area, best_area;
+
+	if (n <= threshold || threshold < 3) {
+		memcpy(out, in, (size_t) n * sizeof(*in));
+		return n;
+	}
+	every = (double) (n - 2) / (threshold - 2);
+	out[kept++] = in[0];
+	for(k=0; k<threshold-2; k++) {
+		start = (unsigned long long) (k * every) + 1;
+		end = (unsigned long long) ((k + 1) * every) + 1;
+		next_end = (unsigned long long) ((k + 2) * every) + 1;
+		if (next_end > n) {
+			next_end = n;
+		}
+		//mean of the next bucket (the last point for the last bucket)
+		cx = cy = 0;
+		for(j=end; j<next_end; j++) {
+			cx += (double) in[j].i;
+			cy += in[j].v;
+		}
+		if (next_end > end) {
+			cx /= next_end - end;
+			cy /= next_end - end;
+		}
+		else {
+			cx = (double) in[n-1].i;
+			cy = in[n-1].v;
+		}
+		ax = (double) in[a].i;
+		ay = in[a].v;
+		best = start;
+		best_area = -1;
+		for(j=start; j<end; j++) {
+			area = fabs((ax - cx) * ((double) in[j].v - ay)
+			            - (ax - (double) in[j].i) * (cy - ay));
+			if (area > best_area) {
+				best_area = area;
+				best = j;
+			}
+		}
+		out[kept++] = in[best];
+		a = best;
+	}
+	out[kept++] = in[n-1];
+	return kept;
+}
+
+#endif
@@ -0,0 +1,435 @@
+/**
+ * \file TraceView.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Decimated views of long count traces for the live charts of
+ *  low-T/Stability.vi and Counter.vi, instead of handing millions of
+ *  points to a chart on every update. "follow" keeps a min/max pyramid
+ *  (TracePyramid.h) up to date as the counts come in; "view" then draws
+ *  any time range at any width from the pyramid, at a cost that depends on
+ *  the number of pixels and not on the length of the trace.
+ *
+ *  The VI appends each sample (U32, little endian, e.g. each shot of a
+ *  StabilityBurn run or each counter bin) to a spool file, with
+ *  <spool>.done marking the end, like for StabilityAnalyzer.
+ *
+ *  Usage:
+ *  TraceView follow <spool> <pyramid> <sample period s> <max samples>
+ *      Started without waiting next to the run. The pyramid file is
+ *      created at its full size for <max samples> (about 5.6 bytes per
+ *      sample) and can be viewed as soon as it exists.
+ *  TraceView view <pyramid> <output> <t0 s> <t1 s> <pixels> [mode=lttb|minmax]
+ *      Writes time (s) and counts of the points to draw as a spreadsheet.
+ *      t0 < 0 means the last -t0 seconds; t1 <= t0 or past the end means
+ *      up to the newest sample.
+ *      lttb    (default) <pixels> points picked by Largest-Triangle-Three-
+ *              Buckets from the min and max of the buckets of the coarsest
+ *              level that still has <pixels> buckets in the range
+ *      minmax  the min and max of every pixel column, 2 x <pixels> points,
+ *              exact (for spikes that must not be missed)
+ *      Prints the number of points, the level used and the time taken (ms).
+ *  TraceView info <pyramid>
+ *      Prints samples, capacity, duration (s), levels, complete, and the
+ *      min and max of the whole trace.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "TracePyramid.h"
+#include "Spreadsheet.h"
+#include "Clock.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#define trace_sleep() Sleep(20)
+#define trace_seek(fp, offset) _fseeki64(fp, (__int64) (offset), SEEK_SET)
+#else
+#include <unistd.h>
+#define trace_sleep() usleep(20000)
+#define trace_seek(fp, offset) fseeko(fp, (off_t) (offset), SEEK_SET)
+#endif
+
+#define READ_BLOCK 65536
+
+struct trace_writer {
+	FILE *fp;
+	struct trace_header h;
+	struct trace_bucket open[TRACE_MAX_LEVELS];     //bucket being filled
+	unsigned int filled[TRACE_MAX_LEVELS];          //children in it so far
+	struct trace_bucket *done[TRACE_MAX_LEVELS];    //completed, not written yet
+	unsigned long long num_done[TRACE_MAX_LEVELS];
+	unsigned long long first_done[TRACE_MAX_LEVELS];    //index of done[l][0]
+};
+
+static int file_exists(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+
+	if (fp == NULL) {
+		return 0;
+	}
+	fclose(fp);
+	return 1;
+}
+
+static int write_header(struct trace_writer *tw)
+{
+	if (trace_seek(tw->fp, 0) != 0
+	    || fwrite(&tw->h, sizeof(tw->h), 1, tw->fp) != 1) {
+		return -1;
+	}
+	return fflush(tw->fp);
+}
+
+//Creates the pyramid at its full size, so it can be mapped while it is written
+static int trace_writer_open(struct trace_writer *tw, const char *path)
+{
+	unsigned long long size;
+	unsigned int l;
+	char zero = 0;
+
+	size = trace_layout(&tw->h);
+	for(l=1; l<tw->h.levels; l++) {
+		//at most one block's worth completes between flushes
+		tw->done[l] = malloc((READ_BLOCK / trace_span(&tw->h, l) + 1)
+		                     * sizeof(struct trace_bucket));
+		if (tw->done[l] == NULL) {
+			printf("Out of memory");
+			return -1;
+		}
+	}
+	tw->fp = fopen(path, "w+b");
+	if (tw->fp == NULL) {
+		printf("Could not create %s", path);
+		return -1;
+	}
+	if (trace_seek(tw->fp, size - 1) != 0 || fwrite(&zero, 1, 1, tw->fp) != 1
+	    || write_header(tw) != 0) {
+		printf("Could not write %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+static void trace_writer_free(struct trace_writer *tw)
+{
+	unsigned int l;
+
+	for(l=1; l<tw->h.levels; l++) {
+		free(tw->done[l]);
+	}
+	if (tw->fp != NULL) {
+		fclose(tw->fp);
+	}
+}
+
+//Adds a child (a sample, or a completed bucket below) to level l's open bucket
+static void add_to_level(struct trace_writer *tw, unsigned int l, const struct trace_bucket *c)
+{
+	struct trace_bucket *b = &tw->open[l];
+
+	if (tw->filled[l] == 0) {
+		*b = *c;
+	}
+	else {
+		if (c->min < b->min) {
+			b->min = c->min;
+			b->i_min = c->i_min;
+		}
+		if (c->max > b->max) {
+			b->max = c->max;
+			b->i_max = c->i_max;
+		}
+	}
+	if (++tw->filled[l] < tw->h.fanout) {
+		return;
+	}
+	tw->filled[l] = 0;
+	tw->done[l][tw->num_done[l]++] = *b;
+	if (l + 1 < tw->h.levels) {
+		add_to_level(tw, l + 1, b);
+	}
+}
+
+/*
+ * Appends n samples: the samples, then the buckets they complete, then the
+ * count, so readers never see a count ahead of the data.
+ */
+static int append_samples(struct trace_writer *tw, const unsigned int *s, size_t n)
+{
+	struct trace_bucket c;
+	unsigned int l;
+	size_t k;
+
+	if (trace_seek(tw->fp, tw->h.offset[0] + tw->h.count * sizeof(unsigned int)) != 0
+	    || fwrite(s, sizeof(unsigned int), n, tw->fp) != n) {
+		return -1;
+	}
+	for(l=1; l<tw->h.levels; l++) {
+		tw->first_done[l] = tw->h.count / trace_span(&tw->h, l);
+		tw->num_done[l] = 0;
+	}
+	for(k=0; k<n && tw->h.levels > 1; k++) {
+		c.i_min = c.i_max = tw->h.count + k;
+		c.min = c.max = s[k];
+		add_to_level(tw, 1, &c);
+	}
+	for(l=1; l<tw->h.levels; l++) {
+		if (tw->num_done[l] == 0) {
+			continue;
+		}
+		if (trace_seek(tw->fp, tw->h.offset[l]
+		                       + tw->first_done[l] * sizeof(struct trace_bucket)) != 0
+		    || fwrite(tw->done[l], sizeof(struct trace_bucket), (size_t) tw->num_done[l],
+		              tw->fp) != tw->num_done[l]) {
+			return -1;
+		}
+	}
+	if (fflush(tw->fp) != 0) {
+		return -1;
+	}
+	tw->h.count += n;
+	return write_header(tw);
+}
+
+static int follow_spool(const char *spool, struct trace_writer *tw)
+{
+	unsigned int *block = malloc(READ_BLOCK * sizeof(unsigned int));
+	size_t got = 0, n, whole;
+	char done_path[1024];
+	int finishing = 0, status = 0;
+	FILE *fp = NULL;
+
+	snprintf(done_path, sizeof(done_path), "%s.done", spool);
+	while (1) {
+		if (fp == NULL) {
+			fp = fopen(spool, "rb");
+			if (fp == NULL) {
+				if (file_exists(done_path)) {
+					break;
+				}
+				trace_sleep();
+				continue;
+			}
+		}
+		n = READ_BLOCK * sizeof(unsigned int) - got;
+		if (n > (tw->h.capacity - tw->h.count) * sizeof(unsigned int) - got) {
+			n = (size_t) ((tw->h.capacity - tw->h.count) * sizeof(unsigned int) - got);
+		}
+		got += fread((char *) block + got, 1, n, fp);
+		whole = got / sizeof(unsigned int);
+		if (whole > 0) {
+			if (append_samples(tw, block, whole) != 0) {
+				printf("Error writing the pyramid");
+				status = -1;
+				break;
+			}
+			//keep a partly read sample for the next pass
+			memmove(block, (char *) block + whole * sizeof(unsigned int),
+			        got - whole * sizeof(unsigned int));
+			got -= whole * sizeof(unsigned int);
+			finishing = 0;
+		}
+		if (tw->h.count == tw->h.capacity) {
+			if (!file_exists(done_path) || fgetc(fp) != EOF) {
+				printf("Trace is full after %llu samples\n", tw->h.count);
+			}
+			break;
+		}
+		if (whole == 0) {
+			if (finishing) {
+				break;
+			}
+			finishing = file_exists(done_path);
+			clearerr(fp);
+			if (!finishing) {
+				trace_sleep();
+			}
+		}
+	}
+	if (fp != NULL) {
+		fclose(fp);
+	}
+	free(block);
+	tw->h.complete = 1;
+	if (write_header(tw) != 0) {
+		status = -1;
+	}
+	return status;
+}
+
+//Range [i0, i1) of samples for times t0..t1 (see view in the usage)
+static void time_range(const struct trace_header *h, double t0, double t1,
+                       unsigned long long count, unsigned long long *i0,
+                       unsigned long long *i1)
+{
+	double end = count * h->period;
+
+	if (t0 < 0) {
+		t0 = end + t0 > 0 ? end + t0 : 0;
+	}
+	if (t1 <= t0 || t1 > end) {
+		t1 = end;
+	}
+	*i0 = (unsigned long long) (t0 / h->period);
+	*i1 = (unsigned long long) (t1 / h->period + 0.5);
+	if (*i1 > count) {
+		*i1 = count;
+	}
+	if (*i0 > *i1) {
+		*i0 = *i1;
+	}
+}
+
+static int view(const struct trace_pyramid *tp, int argc, char *argv[])
+{
+	unsigned long long count = tp->h->count, i0, i1, n, num, cap, pixels, p, a, b, k, num_out;
+	unsigned int level, lo, hi;
+	struct trace_point *cand, *out;
+	double t = clock_seconds(), *table;
+	int minmax = 0, status;
+
+	if (argc < 7) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+	if (argc > 7) {
+		if (strcmp(argv[7], "mode=minmax") == 0) {
+			minmax = 1;
+		}
+		else if (strcmp(argv[7], "mode=lttb") != 0) {
+			printf("Unknown option %s", argv[7]);
+			return -1;
+		}
+	}
+	pixels = strtoull(argv[6], NULL, 10);
+	if (pixels < 3) {
+		printf("Need at least 3 pixels");
+		return -1;
+	}
+	time_range(tp->h, atof(argv[4]), atof(argv[5]), count, &i0, &i1);
+	n = i1 - i0;
+
+	if (minmax) {
+		//each pixel column on its own, from its coarsest full buckets
+		cap = 2 * tp->h->fanout + 4 * tp->h->fanout * tp->h->levels + 2;
+		cand = malloc((size_t) cap * sizeof(*cand));
+		out = malloc((size_t) 2 * pixels * sizeof(*out));
+		num_out = 0;
+		level = trace_level_for(tp->h, n / pixels, 1);
+		for(p=0; p<pixels && n>0; p++) {
+			a = i0 + n * p / pixels;
+			b = i0 + n * (p + 1) / pixels;
+			num = 0;
+			trace_collect(tp, level, a, b, cand, &num);
+			if (num == 0) {
+				continue;
+			}
+			lo = hi = 0;
+			for(k=1; k<num; k++) {
+				lo = cand[k].v < cand[lo].v ? (unsigned int) k : lo;
+				hi = cand[k].v > cand[hi].v ? (unsigned int) k : hi;
+			}
+			out[num_out++] = cand[lo < hi ? lo : hi];
+			if (lo != hi) {
+				out[num_out++] = cand[lo < hi ? hi : lo];
+			}
+		}
+	}
+	else {
+		level = trace_level_for(tp->h, n, pixels);
+		cap = 2 * (n / trace_span(tp->h, level) + 1) + 4 * tp->h->fanout * tp->h->levels + 2;
+		cand = malloc((size_t) cap * sizeof(*cand));
+		out = malloc((size_t) (pixels < cap ? cap : pixels) * sizeof(*out));
+		num = 0;
+		trace_collect(tp, level, i0, i1, cand, &num);
+		num_out = trace_lttb(cand, num, pixels, out);
+	}
+
+	table = malloc((size_t) (num_out + 1) * 2 * sizeof(double));
+	for(k=0; k<num_out; k++) {
+		table[2*k] = out[k].i * tp->h->period;
+		table[2*k + 1] = out[k].v;
+	}
+	status = write_spreadsheet(argv[3], table, (int) num_out, 2);
+	printf("%llu\t%u\t%g\n", num_out, level, (clock_seconds() - t) * 1e3);
+
+	free(cand);
+	free(out);
+	free(table);
+	return status;
+}
+
+static void info(const struct trace_pyramid *tp)
+{
+	unsigned long long count = tp->h->count, num = 0, k, cap;
+	unsigned int lo = 0, hi = 0, level = tp->h->levels - 1;
+	struct trace_point *cand;
+
+	cap = 2 * (count / trace_span(tp->h, level) + 1) + 4 * tp->h->fanout * tp->h->levels + 2;
+	cand = malloc((size_t) cap * sizeof(*cand));
+	trace_collect(tp, level, 0, count, cand, &num);
+	for(k=0; k<num; k++) {
+		lo = k == 0 || cand[k].v < lo ? cand[k].v : lo;
+		hi = k == 0 || cand[k].v > hi ? cand[k].v : hi;
+	}
+	printf("%llu\t%llu\t%g\t%u\t%u\t%u\t%u\n", count, tp->h->capacity,
+	       count * tp->h->period, tp->h->levels, tp->h->complete, lo, hi);
+	free(cand);
+}
+
+int main(int argc, char *argv[])
+{
+	struct trace_writer tw;
+	struct trace_pyramid tp;
+	int status;
+
+	if (argc < 3) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+
+	if (strcmp(argv[1], "follow") == 0) {
+		if (argc != 6) {
+			printf("Wrong number of arguments");
+			return -1;
+		}
+		memset(&tw, 0, sizeof(tw));
+		memcpy(tw.h.magic, TRACE_MAGIC, 8);
+		tw.h.fanout = TRACE_FANOUT;
+		tw.h.period = atof(argv[4]);
+		tw.h.capacity = strtoull(argv[5], NULL, 10);
+		if (tw.h.period <= 0 || tw.h.capacity < 1) {
+			printf("Bad sample period or size");
+			return -1;
+		}
+		status = trace_writer_open(&tw, argv[3]) == 0 ? follow_spool(argv[2], &tw) : -1;
+		if (status == 0) {
+			printf("%llu\n", tw.h.count);
+		}
+		trace_writer_free(&tw);
+		return status;
+	}
+
+	if (trace_open(argv[2], &tp) != 0) {
+		return -1;
+	}
+	status = 0;
+	if (strcmp(argv[1], "view") == 0) {
+		status = view(&tp, argc, argv);
+	}
+	else if (strcmp(argv[1], "info") == 0) {
+		info(&tp);
+	}
+	else {
+		printf("Unknown command %s", argv[1]);
+		status = -1;
+	}
+	trace_close(&tp);
+	return status;
+}
@@ -0,0 +1,112 @@
+/**
+ * \file Unshuffle.c
+ *
+ *  Author: Sam Kim
+ *
+ *  Called from LabVIEW, puts counts from a scan burned with seed=N back in
+ *  sweep order (see SweepOrder.h). Uses the same generator as the burners,
+ *  so nothing but the seed has to be saved with the data.
+ *
+ *  Usage:
+ *  Unshuffle order <num_points> <seed>
+ *      prints the burn order (tab separated), e.g. to permute the MW
+ *      frequency list for an ESR scan the same way
+ *
+ *  Unshuffle <input file> <output file> <num_points> <slots per point>
+ *            <seed> <rows per chunk>
+ *      input file  - spreadsheet, one row per scan, each row holds
+ *                    num_points * slots per point counts in burn order
+ *                    (slots = counter gates per point, e.g. 2 for
+ *                    signal/reference)
+ *      seed        - seed passed to the burner for the first chunk. Chunk c
+ *                    is assumed to have been burned with seed + c
+ *      rows per chunk - rows burned with the same seed (num_scans), or 0 if
+ *                    the whole file used the same seed
+ *      output file - same layout, in sweep order
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Spreadsheet.h"
+#include "SweepOrder.h"
+
+int main(int argc, char *argv[])
+{
+	int num_points, num_slots, rows_per_chunk;
+	int rows, cols, row, k, s;
+	unsigned int seed;
+	int *order;
+	const int *burned;
+	struct sweep_unshuffle su;
+	double *data, *out;
+
+	if (argc == 4 && strcmp(argv[1], "order") == 0) {
+		num_points = atoi(argv[2]);
+		seed = (unsigned int) strtoul(argv[3], NULL, 0);
+		if (num_points <= 0) {
+			printf("Number of points must be positive");
+			return -1;
+		}
+		order = malloc(num_points * sizeof(int));
+		sweep_order(order, num_points, seed);
+		for(k=0; k<num_points; k++) {
+			printf(k == 0 ? "%d" : "\t%d", order[k]);
+		}
+		printf("\n");
+		free(order);
+		return 0;
+	}
+
+	if (argc != 7) {
+		printf("Wrong number of arguments");
+		return -1;
+	}
+
+	num_points = atoi(argv[3]);
+	num_slots = atoi(argv[4]);
+	seed = (unsigned int) strtoul(argv[5], NULL, 0);
+	rows_per_chunk = atoi(argv[6]);
+	if (num_points <= 0 || num_slots <= 0) {
+		printf("Number of points and slots must be positive");
+		return -1;
+	}
+
+	data = read_spreadsheet(argv[1], &rows, &cols);
+	if (data == NULL) {
+		return -1;
+	}
+	if (cols != num_points * num_slots) {
+		printf("Expected %d columns, found %d", num_points * num_slots, cols);
+		free(data);
+		return -1;
+	}
+
+	out = malloc(rows * cols * sizeof(double));
+	if (sweep_unshuffle_init(&su, seed, rows_per_chunk, num_points, num_slots) != 0
+	    || out == NULL) {
+		printf("Out of memory");
+		return -1;
+	}
+
+	for(row=0; row<rows; row++) {
+		burned = sweep_unshuffle_order(&su, row);
+		//k-th burned point is sweep point burned[k]
+		for(k=0; k<num_points; k++) {
+			for(s=0; s<num_slots; s++) {
+				out[row*cols + burned[k]*num_slots + s] =
+					data[row*cols + k*num_slots + s];
+			}
+		}
+	}
+
+	if (write_spreadsheet(argv[2], out, rows, cols) != 0) {
+		return -1;
+	}
+
+	sweep_unshuffle_free(&su);
+	free(out);
+	free(data);
+	return 0;
+}
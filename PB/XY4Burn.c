@@ -31,6 +31,7 @@
  *  23  Number of scans
  *  24  Number of pulse sequence reptitions
  *  25  Number of delay times per scan
+ *  26+ Optional name=value args, see BurnOptions.h
  */
 
 #include <stdio.h>
@@ -39,13 +40,15 @@
 #define PBESRPRO
 #define CLOCK 500.0
 #include "spinapi.h"
+#include "BurnOptions.h"
+#include "SweepOrder.h"
 
 int detect_boards();
 int select_board(int numBoards);
 
 int main(int argc, char *argv[])
 {
-	int start, scan_loop, pulse_loop, status;
+	int scan_loop, pulse_loop;
 	int num_scans, num_sequences, num_delay_times;
        //num_delay_times - the number of times to pulse the MW
 	   //num_reps - number of repetitions of pulse sequence
@@ -54,16 +57,22 @@ int main(int argc, char *argv[])
 	double window_time[13];    //12+1 to make it 1-indexed
 	double min_tau, max_tau, tau;
 	int window_channel[13];    //12+1 to make it 1-indexed
+	int *order;
+	struct burn_options options;
 	int window_channel4, window_channelX, window_channelY;
 
 	//Uncommenting the line below will generate a debug log in your current
 	//directory that can help debug any problems that you may be experiencing   
 	//pb_set_debug(1); 
 	
-	if (argc != 26) {
+	if (argc < 26) {
        printf("Wrong number of arguments");
        return -1;
     }
+    if (parse_burn_options(argc, argv, 26, &options) != 0
+        || check_reprobe(&options, 7, 12) != 0) {
+       return -1;
+    }
 
 	/*If there is more than one board in the system, have the user specify. */
 	if ((numBoards = detect_boards()) > 1) {
@@ -76,7 +85,7 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 	
-	int i,j;
+	int i,j,k;
 	//Window times 1-3
     for(i=1; i<4; i++) {
         window_time[i] = atof(argv[i]) * 1e9;
@@ -112,6 +121,9 @@ int main(int argc, char *argv[])
     num_sequences = atoi(argv[24]);
     num_delay_times = atoi(argv[25]);
 	
+	order = malloc(num_delay_times * sizeof(int));
+	sweep_order(order, num_delay_times, options.seed);
+	
 	window_time[7] = window_time[3];
 	window_channel[7] = window_channel[3];
 	window_channel[6] = window_channel[4];
@@ -120,10 +132,20 @@ int main(int argc, char *argv[])
 	pb_core_clock(CLOCK);
 
 	pb_start_programming(PULSE_PROGRAM);
+	if (burn_head(&options) != 0) {
+		printf("Error burning the program: %s\n", pb_get_error());
+		return -1;
+	}
 	
 	scan_loop = pb_inst(0x0, LOOP, num_scans, 10*ns);
-	for(i=0; i<num_delay_times; i++) {
+	for(k=0; k<num_delay_times; k++) {
+        i = order[k];
         pb_inst(window_channel[1], CONTINUE, 0, window_time[1] * ns);
+        //charge check after the window 1 repump, before the MW
+        if (burn_charge_check(&options) != 0) {
+            printf("Error burning the program: %s\n", pb_get_error());
+            return -1;
+        }
         pb_inst(window_channel[2], CONTINUE, 0, window_time[2] * ns);
         pb_inst(window_channel[3], CONTINUE, 0, window_time[3] * ns);
             
@@ -149,13 +171,21 @@ int main(int argc, char *argv[])
 		
 		//Windows 7-12 - counting photons
 		for(j=7; j<13; j++) {
+			if (burn_reprobe(&options, j) != 0) {
+				printf("Error burning the program: %s\n", pb_get_error());
+				return -1;
+			}
 			pb_inst(window_channel[j], CONTINUE, 0, window_time[j]*ns);
 		}
     }
 	pb_inst(0x0, END_LOOP, scan_loop, 10*ns);
-    pb_inst(0x0, STOP, 0, 10*ns);
+    if (burn_end(&options) != 0) {
+        printf("Error burning the program: %s\n", pb_get_error());
+        return -1;
+    }
 	
 	pb_stop_programming();
+	free(order);
 
 	return 0;
 }